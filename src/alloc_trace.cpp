@@ -0,0 +1,127 @@
+#include "alloc_trace.h"
+#include "hugepages.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace alloc_trace {
+
+    namespace {
+
+        // Size header in front of every block; keeps the returned pointer
+        // aligned like malloc's. capacity is non-zero for blocks that came
+        // from the huge-page pool (and then covers the header too).
+        struct Header {
+            size_t size;
+            size_t capacity;
+        };
+        constexpr size_t kHeader = alignof(std::max_align_t);
+        static_assert(sizeof(Header) <= kHeader, "header must fit in the alignment slot");
+
+        thread_local Stats tStats;
+
+        void onAlloc(size_t size) {
+            tStats.allocations++;
+            tStats.bytes += size;
+            tStats.current += static_cast<int64_t>(size);
+            tStats.peak = std::max(tStats.peak, tStats.current);
+            tStats.largest = std::max<uint64_t>(tStats.largest, size);
+        }
+
+        Header* headerOf(void* p) {
+            return reinterpret_cast<Header*>(static_cast<char*>(p) - kHeader);
+        }
+
+        void* userOf(void* base) {
+            return static_cast<char*>(base) + kHeader;
+        }
+
+        // Allocates without touching the statistics.
+        void* rawAlloc(size_t size) {
+            if (hugepages::enabled() && size >= hugepages::kMinBlock) {
+                size_t capacity = 0;
+                if (void* base = hugepages::acquire(size + kHeader, &capacity)) {
+                    *static_cast<Header*>(base) = Header{size, capacity};
+                    return userOf(base);
+                }
+            }
+            void* base = std::malloc(size + kHeader);
+            if (base == nullptr) return nullptr;
+            *static_cast<Header*>(base) = Header{size, 0};
+            return userOf(base);
+        }
+
+        void rawFree(void* p) {
+            Header* h = headerOf(p);
+            if (h->capacity != 0) {
+                hugepages::release(h, h->capacity);
+            } else {
+                std::free(h);
+            }
+        }
+
+    }
+
+    void* stbMalloc(size_t size) {
+        void* p = rawAlloc(size);
+        if (p != nullptr) onAlloc(size);
+        return p;
+    }
+
+    void* stbRealloc(void* p, size_t size) {
+        if (p == nullptr) return stbMalloc(size);
+        Header* h = headerOf(p);
+        const size_t old = h->size;
+        const bool pooled = h->capacity != 0;
+        const bool wantPool = hugepages::enabled() && size >= hugepages::kMinBlock;
+
+        void* result = nullptr;
+        if (pooled && size + kHeader <= h->capacity) {
+            h->size = size;
+            result = p;
+        } else if (pooled || wantPool) {
+            result = rawAlloc(size);
+            if (result == nullptr) return nullptr;
+            std::memcpy(result, p, std::min(old, size));
+            rawFree(p);
+        } else {
+            void* grown = std::realloc(h, size + kHeader);
+            if (grown == nullptr) return nullptr;
+            static_cast<Header*>(grown)->size = size;
+            result = userOf(grown);
+        }
+        tStats.current -= static_cast<int64_t>(old);
+        onAlloc(size);
+        return result;
+    }
+
+    void stbFree(void* p) {
+        if (p == nullptr) return;
+        tStats.current -= static_cast<int64_t>(headerOf(p)->size);
+        rawFree(p);
+    }
+
+    void reset() {
+        tStats = Stats{};
+    }
+
+    Stats snapshot() {
+        return tStats;
+    }
+
+    void report(const std::string& label, uint64_t imageBytes) {
+        const Stats s = tStats;
+        const int64_t scratchPeak = std::max<int64_t>(0, s.peak - static_cast<int64_t>(imageBytes));
+        std::cerr << "alloc: " << label
+                  << ": " << s.allocations << " allocations"
+                  << ", " << s.bytes << " bytes requested"
+                  << ", peak " << s.peak
+                  << ", largest " << s.largest
+                  << ", image " << imageBytes
+                  << ", scratch at peak " << scratchPeak
+                  << ", still live " << s.current << "\n";
+    }
+
+}
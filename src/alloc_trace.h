@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Counting allocator behind stb_image's STBI_MALLOC / STBI_REALLOC /
+// STBI_FREE hooks. Every block carries a small size header so frees and
+// reallocs can be accounted for; statistics are kept per thread, so
+// concurrent decodes (server workers) don't mix their numbers. Large blocks
+// come from the huge-page pool when it is enabled.
+namespace alloc_trace {
+
+    struct Stats {
+        uint64_t allocations = 0;   // malloc + realloc calls
+        uint64_t bytes = 0;         // total bytes requested
+        int64_t current = 0;        // live bytes
+        int64_t peak = 0;           // high-water mark of live bytes
+        uint64_t largest = 0;       // largest single block
+    };
+
+    void* stbMalloc(size_t size);
+    void* stbRealloc(void* p, size_t size);
+    void stbFree(void* p);
+
+    // Clears this thread's statistics; call before a decode.
+    void reset();
+    Stats snapshot();
+
+    // One-line summary on stderr. imageBytes is the size of the decoded
+    // image, so internal scratch can be told apart from the result.
+    void report(const std::string& label, uint64_t imageBytes);
+
+}
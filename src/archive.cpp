@@ -0,0 +1,559 @@
+#include "archive.h"
+#include "decode.h"
+#include "inflate.h"
+#include "orientation.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace archive {
+
+    namespace {
+
+        constexpr size_t kBlock = 512;
+
+        uint16_t le16(const unsigned char* p) { return static_cast<uint16_t>(p[0] | (p[1] << 8)); }
+
+        uint32_t le32(const unsigned char* p) {
+            return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+                   (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+        }
+
+        uint64_t le64(const unsigned char* p) { return le32(p) | (static_cast<uint64_t>(le32(p + 4)) << 32); }
+
+        bool endsWith(const std::string& s, const char* suffix) {
+            const size_t n = std::strlen(suffix);
+            if (s.size() <= n) return false;
+            for (size_t i = 0; i < n; ++i) {
+                if (std::tolower(static_cast<unsigned char>(s[s.size() - n + i])) != suffix[i]) return false;
+            }
+            return true;
+        }
+
+        bool isArchiveName(const std::string& name) { return endsWith(name, ".tar") || endsWith(name, ".zip"); }
+
+        // A NUL-terminated (or field-filling) header string.
+        std::string field(const unsigned char* p, size_t n) {
+            size_t len = 0;
+            while (len < n && p[len] != 0) ++len;
+            return std::string(reinterpret_cast<const char*>(p), len);
+        }
+
+        // A tar numeric field: octal text, or big-endian binary when the
+        // top bit of the first byte is set (GNU base-256, for sizes past
+        // 8 GiB).
+        bool tarNumber(const unsigned char* p, size_t n, uint64_t* value) {
+            uint64_t v = 0;
+            if (p[0] & 0x80) {
+                if (p[0] != 0x80) return false;  // negative, or too large
+                for (size_t i = 1; i < n; ++i) {
+                    if (v >> 56) return false;
+                    v = (v << 8) | p[i];
+                }
+                *value = v;
+                return true;
+            }
+            size_t i = 0;
+            while (i < n && p[i] == ' ') ++i;
+            for (; i < n && p[i] >= '0' && p[i] <= '7'; ++i) {
+                if (v >> 61) return false;
+                v = (v << 3) | (p[i] - '0');
+            }
+            while (i < n && (p[i] == ' ' || p[i] == 0)) ++i;
+            if (i != n) return false;
+            *value = v;
+            return true;
+        }
+
+        // Whether a 512-byte block is a tar header: its checksum counts the
+        // checksum field as eight spaces, summed unsigned (or signed, as
+        // some old tars did).
+        bool tarHeader(const unsigned char* h) {
+            uint64_t recorded = 0;
+            if (!tarNumber(h + 148, 8, &recorded)) return false;
+            uint64_t sumU = 0;
+            int64_t sumS = 0;
+            for (size_t i = 0; i < kBlock; ++i) {
+                const unsigned char c = (i >= 148 && i < 156) ? ' ' : h[i];
+                sumU += c;
+                sumS += static_cast<signed char>(c);
+            }
+            return recorded == sumU || static_cast<int64_t>(recorded) == sumS;
+        }
+
+        bool zeroBlock(const unsigned char* h) {
+            for (size_t i = 0; i < kBlock; ++i) {
+                if (h[i] != 0) return false;
+            }
+            return true;
+        }
+
+        // The path= record of a pax extended header, or "" without one.
+        std::string paxPath(const unsigned char* p, size_t n) {
+            std::string path;
+            size_t at = 0;
+            while (at < n) {
+                // "<length> <key>=<value>\n", length counting the whole record.
+                size_t len = 0, i = at;
+                while (i < n && p[i] >= '0' && p[i] <= '9') len = len * 10 + (p[i++] - '0');
+                if (i >= n || p[i] != ' ' || len == 0 || len > n - at) break;
+                const std::string record(reinterpret_cast<const char*>(p + i + 1), at + len - (i + 1));
+                if (record.compare(0, 5, "path=") == 0 && !record.empty() && record.back() == '\n') {
+                    path = record.substr(5, record.size() - 6);
+                }
+                at += len;
+            }
+            return path;
+        }
+
+        // Offset of a zip's end of central directory record, searched for
+        // from the end: it is 22 bytes plus a comment of up to 64 KiB.
+        long findEocd(const unsigned char* data, size_t size) {
+            if (size < 22) return -1;
+            const size_t lowest = size > 22 + 0xffff ? size - 22 - 0xffff : 0;
+            for (size_t at = size - 22 + 1; at-- > lowest;) {
+                if (le32(data + at) == 0x06054b50 && at + 22 + le16(data + at + 20) <= size) {
+                    return static_cast<long>(at);
+                }
+            }
+            return -1;
+        }
+
+    }
+
+    Reader::~Reader() {
+#if defined(__linux__)
+        if (mapped_) munmap(const_cast<unsigned char*>(data_), size_);
+#endif
+    }
+
+    bool Reader::open(const std::string& path, std::string* error) {
+        path_ = path;
+#if defined(__linux__)
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            *error = "cannot open";
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(fd);
+            *error = "not a regular file";
+            return false;
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0) {
+            void* p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                *error = "cannot map";
+                return false;
+            }
+            data_ = static_cast<const unsigned char*>(p);
+            mapped_ = true;
+        }
+        ::close(fd);
+#else
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            *error = "cannot open";
+            return false;
+        }
+        copy_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data_ = copy_.data();
+        size_ = copy_.size();
+#endif
+        if (size_ >= kBlock && tarHeader(data_)) {
+            if (!indexTar(error)) return false;
+        } else if (!indexZip(error)) {
+            return false;
+        }
+        byName_.reserve(members_.size());
+        for (size_t i = 0; i < members_.size(); ++i) byName_.emplace(members_[i].name, i);
+        return true;
+    }
+
+    bool Reader::indexTar(std::string* error) {
+        std::string longName;
+        for (size_t at = 0; at + kBlock <= size_;) {
+            const unsigned char* h = data_ + at;
+            if (zeroBlock(h)) break;
+            uint64_t size = 0;
+            if (!tarHeader(h) || !tarNumber(h + 124, 12, &size)) {
+                *error = "bad tar header at offset " + std::to_string(at);
+                return false;
+            }
+            const size_t data = at + kBlock;
+            if (size > size_ - data) {
+                *error = "tar member runs past the end";
+                return false;
+            }
+            const char type = static_cast<char>(h[156]);
+            if (type == 'L' || type == 'x') {
+                // GNU long name, or pax extended header: names the next member.
+                const std::string name = type == 'L' ? field(data_ + data, size) : paxPath(data_ + data, size);
+                if (!name.empty()) longName = name;
+            } else if (type != 'g') {
+                if (type == '0' || type == '\0' || type == '7') {
+                    Member m;
+                    if (!longName.empty()) {
+                        m.name = longName;
+                    } else {
+                        m.name = field(h, 100);
+                        const std::string prefix = std::memcmp(h + 257, "ustar", 5) == 0 ? field(h + 345, 155) : "";
+                        if (!prefix.empty()) m.name = prefix + "/" + m.name;
+                    }
+                    m.offset = data;
+                    m.size = m.packedSize = size;
+                    members_.push_back(std::move(m));
+                }
+                longName.clear();
+            }
+            at = data + (size + kBlock - 1) / kBlock * kBlock;
+        }
+        return true;
+    }
+
+    bool Reader::indexZip(std::string* error) {
+        zip_ = true;
+        const long eocd = findEocd(data_, size_);
+        if (eocd < 0) {
+            *error = "not a tar or zip archive";
+            return false;
+        }
+        const unsigned char* e = data_ + eocd;
+        uint64_t entries = le16(e + 10);
+        uint64_t dirSize = le32(e + 12);
+        uint64_t dirOffset = le32(e + 16);
+        if (eocd >= 20 && le32(e - 20) == 0x07064b50) {
+            // ZIP64: the locator points at a record with 64-bit fields.
+            const uint64_t at = le64(e - 20 + 8);
+            if (at > size_ || size_ - at < 56 || le32(data_ + at) != 0x06064b50) {
+                *error = "bad zip64 end of central directory";
+                return false;
+            }
+            entries = le64(data_ + at + 32);
+            dirSize = le64(data_ + at + 40);
+            dirOffset = le64(data_ + at + 48);
+        }
+        if (dirOffset > size_ || dirSize > size_ - dirOffset) {
+            *error = "central directory runs past the end";
+            return false;
+        }
+        members_.reserve(static_cast<size_t>(std::min<uint64_t>(entries, dirSize / 46)));
+        const unsigned char* p = data_ + dirOffset;
+        const unsigned char* end = p + dirSize;
+        for (uint64_t i = 0; i < entries; ++i) {
+            if (end - p < 46 || le32(p) != 0x02014b50) {
+                *error = "bad central directory entry";
+                return false;
+            }
+            const uint16_t flags = le16(p + 8);
+            const size_t nameLen = le16(p + 28), extraLen = le16(p + 30), commentLen = le16(p + 32);
+            if (static_cast<size_t>(end - p) < 46 + nameLen + extraLen + commentLen) {
+                *error = "bad central directory entry";
+                return false;
+            }
+            Member m;
+            m.name.assign(reinterpret_cast<const char*>(p + 46), nameLen);
+            m.method = le16(p + 10);
+            m.packedSize = le32(p + 20);
+            m.size = le32(p + 24);
+            m.offset = le32(p + 42);
+
+            // ZIP64 extended information: the 64-bit values of whichever
+            // fields above are saturated, in this order.
+            const unsigned char* x = p + 46 + nameLen;
+            const unsigned char* xEnd = x + extraLen;
+            while (xEnd - x >= 4) {
+                const uint16_t id = le16(x), len = le16(x + 2);
+                if (static_cast<size_t>(xEnd - x - 4) < len) break;
+                if (id == 0x0001) {
+                    const unsigned char* v = x + 4;
+                    const unsigned char* vEnd = v + len;
+                    for (uint64_t* f : {&m.size, &m.packedSize, &m.offset}) {
+                        if (*f != 0xffffffffu) continue;
+                        if (vEnd - v < 8) break;
+                        *f = le64(v);
+                        v += 8;
+                    }
+                }
+                x += 4 + len;
+            }
+            p += 46 + nameLen + extraLen + commentLen;
+            if ((flags & 1) != 0 || m.name.empty() || m.name.back() == '/') continue;
+            members_.push_back(std::move(m));
+        }
+        return true;
+    }
+
+    long Reader::find(const std::string& name) const {
+        const auto it = byName_.find(name);
+        return it == byName_.end() ? -1 : static_cast<long>(it->second);
+    }
+
+    bool Reader::read(size_t i, std::vector<unsigned char>* scratch, const unsigned char** data,
+                      size_t* size) const {
+        if (i >= members_.size()) {
+            decode::setFailureReason("no such archive member");
+            return false;
+        }
+        const Member& m = members_[i];
+        // Decoders take an int size, so nothing larger is worth reading.
+        if (m.size > static_cast<uint64_t>(std::numeric_limits<int>::max())) {
+            decode::setFailureReason("archive member too large");
+            return false;
+        }
+        if (!zip_) {
+            *data = data_ + m.offset;
+            *size = static_cast<size_t>(m.size);
+            return true;
+        }
+
+        // The local header repeats the name and has its own extra field;
+        // only its lengths are needed to find the data.
+        if (m.offset > size_ || size_ - m.offset < 30 || le32(data_ + m.offset) != 0x04034b50) {
+            decode::setFailureReason("bad zip local header");
+            return false;
+        }
+        const uint64_t start = m.offset + 30 + le16(data_ + m.offset + 26) + le16(data_ + m.offset + 28);
+        if (start > size_ || m.packedSize > size_ - start) {
+            decode::setFailureReason("archive member cut short");
+            return false;
+        }
+        const unsigned char* packed = data_ + start;
+        if (m.method == 0) {
+            if (m.packedSize != m.size) {
+                decode::setFailureReason("stored zip member sizes differ");
+                return false;
+            }
+            *data = packed;
+            *size = static_cast<size_t>(m.size);
+            return true;
+        }
+        if (m.method != 8) {
+            decode::setFailureReason("unsupported zip compression method");
+            return false;
+        }
+        // Deflate expands at most 1032:1, so a larger size is a lie that
+        // would only cost a huge zero-filled buffer.
+        if (m.size > m.packedSize * 1032 + 1024) {
+            decode::setFailureReason("zip member larger than its data can inflate to");
+            return false;
+        }
+        scratch->resize(static_cast<size_t>(m.size));
+        const long long n = inflate::decode(packed, static_cast<size_t>(m.packedSize), scratch->data(),
+                                            scratch->size(), false);
+        if (n < 0 || static_cast<uint64_t>(n) != m.size) {
+            decode::setFailureReason("corrupt deflate data in zip member");
+            return false;
+        }
+        *data = scratch->data();
+        *size = scratch->size();
+        return true;
+    }
+
+    TarWriter::TarWriter(size_t bufferBytes) : buffer_(std::max<size_t>(bufferBytes, kBlock)) {}
+
+    TarWriter::~TarWriter() {
+        if (file_ != nullptr) std::fclose(file_);
+    }
+
+    bool TarWriter::open(const std::string& path, std::string* error) {
+        file_ = std::fopen(path.c_str(), "wb");
+        if (file_ == nullptr) {
+            *error = std::strerror(errno);
+            return false;
+        }
+        // The buffer is ours; each fwrite of it should be one write(2).
+        std::setvbuf(file_, nullptr, _IONBF, 0);
+        mtime_ = static_cast<long long>(std::time(nullptr));
+        return true;
+    }
+
+    bool TarWriter::flush() {
+        if (used_ > 0 && std::fwrite(buffer_.data(), 1, used_, file_) != used_) ok_ = false;
+        used_ = 0;
+        return ok_;
+    }
+
+    bool TarWriter::append(const void* data, size_t size) {
+        offset_ += size;
+        if (size > buffer_.size() - used_) {
+            if (!flush()) return false;
+            if (size >= buffer_.size()) {
+                // Too big to be worth copying: written straight through.
+                if (std::fwrite(data, 1, size, file_) != size) ok_ = false;
+                return ok_;
+            }
+        }
+        std::memcpy(buffer_.data() + used_, data, size);
+        used_ += size;
+        return ok_;
+    }
+
+    bool TarWriter::pad() {
+        static const char zeros[kBlock] = {};
+        return append(zeros, (kBlock - offset_ % kBlock) % kBlock);
+    }
+
+    bool TarWriter::header(const std::string& name, const std::string& prefix, char type, uint64_t size) {
+        char h[kBlock] = {};
+        std::memcpy(h, name.data(), std::min<size_t>(name.size(), 100));
+        std::snprintf(h + 100, 8, "%07o", 0644);
+        std::snprintf(h + 108, 8, "%07o", 0);
+        std::snprintf(h + 116, 8, "%07o", 0);
+        if (size < (uint64_t(1) << 33)) {
+            std::snprintf(h + 124, 12, "%011llo", static_cast<unsigned long long>(size));
+        } else {
+            h[124] = static_cast<char>(0x80);
+            for (int i = 0; i < 8; ++i) h[135 - i] = static_cast<char>(size >> (8 * i));
+        }
+        std::snprintf(h + 136, 12, "%011llo", static_cast<unsigned long long>(mtime_));
+        h[156] = type;
+        std::memcpy(h + 257, "ustar", 6);
+        h[263] = h[264] = '0';
+        std::memcpy(h + 345, prefix.data(), std::min<size_t>(prefix.size(), 155));
+        unsigned sum = 8 * ' ';
+        for (size_t i = 0; i < kBlock; ++i) sum += static_cast<unsigned char>(h[i]);
+        std::snprintf(h + 148, 8, "%06o", sum);
+        h[155] = ' ';
+        return append(h, kBlock);
+    }
+
+    bool TarWriter::add(const std::string& name, const char* data, size_t size, uint64_t* dataOffset) {
+        std::string base = name, prefix;
+        if (name.size() > 100) {
+            // Split at the first '/' that leaves at most 100 bytes of name
+            // and 155 of prefix; failing that, a long-name entry.
+            size_t slash = name.find('/', name.size() - 101);
+            if (slash != std::string::npos && slash > 0 && slash <= 155 && slash + 1 < name.size()) {
+                prefix = name.substr(0, slash);
+                base = name.substr(slash + 1);
+            } else if (!header("././@LongLink", "", 'L', name.size() + 1) || !append(name.c_str(), name.size() + 1) ||
+                       !pad()) {
+                return false;
+            }
+        }
+        if (!header(base, prefix, '0', size)) return false;
+        *dataOffset = offset_;
+        return append(data, size) && pad();
+    }
+
+    bool TarWriter::close() {
+        if (file_ == nullptr) return false;
+        static const char zeros[2 * kBlock] = {};
+        append(zeros, sizeof(zeros));
+        flush();
+        if (std::fclose(file_) != 0) ok_ = false;
+        file_ = nullptr;
+        return ok_;
+    }
+
+    bool isImageName(const std::string& name) {
+        static const char* const kExtensions[] = {".png", ".jpg", ".jpeg", ".bmp", ".gif", ".tga",
+                                                  ".psd", ".pnm", ".ppm", ".pgm", ".hdr", ".pic"};
+        for (const char* ext : kExtensions) {
+            if (endsWith(name, ext)) return true;
+        }
+        return false;
+    }
+
+    std::vector<Input> expandInputs(const std::vector<std::string>& inputs) {
+        namespace fs = std::filesystem;
+        std::map<std::string, std::shared_ptr<const Reader>> opened;
+        auto openArchive = [&](const std::string& path) -> std::shared_ptr<const Reader> {
+            const auto it = opened.find(path);
+            if (it != opened.end()) return it->second;
+            auto reader = std::make_shared<Reader>();
+            std::string error;
+            std::shared_ptr<const Reader> result;
+            if (reader->open(path, &error)) {
+                result = std::move(reader);
+            } else {
+                std::cerr << path << ": " << error << "\n";
+            }
+            opened.emplace(path, result);
+            return result;
+        };
+
+        std::vector<Input> out;
+        for (const std::string& input : inputs) {
+            std::error_code ec;
+            if (fs::is_directory(input, ec)) {
+                std::vector<std::string> found;
+                for (const fs::directory_entry& e : fs::directory_iterator(input, ec)) {
+                    if (e.is_regular_file(ec) && isImageName(e.path().filename().string())) {
+                        found.push_back(e.path().string());
+                    }
+                }
+                std::sort(found.begin(), found.end());
+                for (std::string& f : found) out.push_back(Input{std::move(f), nullptr, 0});
+                continue;
+            }
+            if (isArchiveName(input) && fs::is_regular_file(input, ec)) {
+                const std::shared_ptr<const Reader> reader = openArchive(input);
+                if (!reader) continue;
+                for (size_t i = 0; i < reader->members().size(); ++i) {
+                    const std::string& name = reader->members()[i].name;
+                    if (isImageName(name)) out.push_back(Input{input + ":" + name, reader, i});
+                }
+                continue;
+            }
+
+            // ARCHIVE:MEMBER, split at the first ':' that ends an archive
+            // name, so either part may contain colons.
+            bool member = false;
+            for (size_t colon = input.find(':'); colon != std::string::npos; colon = input.find(':', colon + 1)) {
+                const std::string path = input.substr(0, colon);
+                if (!isArchiveName(path) || !fs::is_regular_file(path, ec)) continue;
+                member = true;
+                const std::shared_ptr<const Reader> reader = openArchive(path);
+                if (!reader) break;
+                const long i = reader->find(input.substr(colon + 1));
+                if (i < 0) {
+                    std::cerr << input << ": no such member\n";
+                    break;
+                }
+                out.push_back(Input{input, reader, static_cast<size_t>(i)});
+                break;
+            }
+            if (!member) out.push_back(Input{input, nullptr, 0});
+        }
+        return out;
+    }
+
+    unsigned char* load(const Input& in, int* width, int* height, int* channels, int desired, int* orientation) {
+        if (!in.archive) {
+            unsigned char* img = decode::load(in.label.c_str(), width, height, channels, desired);
+            if (img != nullptr && orientation != nullptr) *orientation = orient::exifOrientationOfFile(in.label);
+            return img;
+        }
+        // Inflated members are decoded straight from this buffer, which
+        // keeps its capacity for the next member the thread decodes.
+        thread_local std::vector<unsigned char> scratch;
+        const unsigned char* data = nullptr;
+        size_t size = 0;
+        if (!in.archive->read(in.member, &scratch, &data, &size)) return nullptr;   // read set the reason
+        unsigned char* img = decode::loadFromMemory(data, size, width, height, channels, desired);
+        if (img != nullptr && orientation != nullptr) *orientation = orient::exifOrientation(data, size);
+        return img;
+    }
+
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Images read straight out of tar and zip archives, without extracting
+// them. An archive is mapped read-only and indexed once when it is opened:
+// a tar by walking its 512-byte headers, a zip from its central directory.
+// Stored members are views into the mapping; deflated ones are inflated
+// (inflate.h) into a buffer of exactly the size the directory records.
+// TarWriter goes the other way, packing many small outputs into one tar.
+namespace archive {
+
+    struct Member {
+        std::string name;
+        uint64_t offset = 0;        // tar: data; zip: local file header
+        uint64_t size = 0;          // uncompressed bytes
+        uint64_t packedSize = 0;    // bytes as stored
+        int method = 0;             // zip compression method; 0 stored, 8 deflate
+    };
+
+    class Reader {
+    public:
+        Reader() = default;
+        ~Reader();
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        // Maps path and indexes its regular-file members (encrypted zip
+        // members are left out). Returns false, with *error set, when it
+        // cannot be read or is neither a tar nor a zip archive.
+        bool open(const std::string& path, std::string* error);
+
+        const std::string& path() const { return path_; }
+        const std::vector<Member>& members() const { return members_; }
+
+        // Index of the member called name, or -1.
+        long find(const std::string& name) const;
+
+        // The bytes of member i: a view into the mapping when stored, or
+        // inflated into *scratch. False, with stbi_failure_reason() set,
+        // when the member is cut short, corrupt, larger than an int can
+        // count, compressed with anything but deflate, or claims more bytes
+        // than its compressed data could inflate to.
+        bool read(size_t i, std::vector<unsigned char>* scratch, const unsigned char** data, size_t* size) const;
+
+    private:
+        bool indexTar(std::string* error);
+        bool indexZip(std::string* error);
+
+        std::string path_;
+        const unsigned char* data_ = nullptr;
+        size_t size_ = 0;
+        bool mapped_ = false;
+        std::vector<unsigned char> copy_;    // the file, where it cannot be mapped
+        bool zip_ = false;
+        std::vector<Member> members_;
+        std::unordered_map<std::string, size_t> byName_;
+    };
+
+    // Appends regular files to a tar through one large buffer, so a batch
+    // of small entries reaches the disk as a few big sequential writes
+    // instead of a file (and a metadata update) each. Names past 100 bytes
+    // are split into the ustar prefix, or carried by a GNU long-name entry.
+    class TarWriter {
+    public:
+        explicit TarWriter(size_t bufferBytes = size_t(1) << 20);
+        ~TarWriter();
+        TarWriter(const TarWriter&) = delete;
+        TarWriter& operator=(const TarWriter&) = delete;
+
+        bool open(const std::string& path, std::string* error);
+
+        // Appends an entry holding data[0, size); *dataOffset receives the
+        // archive offset its bytes start at.
+        bool add(const std::string& name, const char* data, size_t size, uint64_t* dataOffset);
+
+        // Writes the end-of-archive blocks, flushes and closes.
+        bool close();
+
+        // Bytes appended so far, headers and padding included.
+        uint64_t size() const { return offset_; }
+
+    private:
+        bool header(const std::string& name, const std::string& prefix, char type, uint64_t size);
+        bool append(const void* data, size_t size);
+        bool pad();
+        bool flush();
+
+        std::FILE* file_ = nullptr;
+        std::vector<char> buffer_;
+        size_t used_ = 0;
+        uint64_t offset_ = 0;
+        long long mtime_ = 0;
+        bool ok_ = true;
+    };
+
+    // One image to decode: a file, or a member of an archive.
+    struct Input {
+        std::string label;                      // path, or archive path ':' member name
+        std::shared_ptr<const Reader> archive;  // null for a plain file
+        size_t member = 0;
+    };
+
+    // Plain files are kept as given; directories contribute their image
+    // files in name order and .tar / .zip archives their image members in
+    // archive order. ARCHIVE:MEMBER names a single member. Each archive is
+    // opened once however often it is named. Unreadable archives are
+    // reported on stderr and skipped.
+    std::vector<Input> expandInputs(const std::vector<std::string>& inputs);
+
+    // decode::load of an input, from memory for archive members. Returns
+    // nullptr with stbi_failure_reason() set, by Reader::read or the
+    // decoder, on failure. When orientation is not null it receives the
+    // input's EXIF orientation tag (orient::exifOrientation), 1 if none.
+    unsigned char* load(const Input& in, int* width, int* height, int* channels, int desired, int* orientation);
+
+    // True for the file extensions stb_image decodes.
+    bool isImageName(const std::string& name);
+
+}
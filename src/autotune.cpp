@@ -0,0 +1,204 @@
+#include "autotune.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#endif
+
+namespace autotune {
+
+    namespace {
+
+        constexpr int kCacheVersion = 1;
+        constexpr double kMinChunkNs = 20000.0;
+        constexpr int kChunksPerThread = 4;
+
+        template <typename F>
+        double bestOfNs(int runs, F&& f) {
+            double best = 1e300;
+            for (int i = 0; i < runs; ++i) {
+                auto t0 = std::chrono::steady_clock::now();
+                f();
+                auto t1 = std::chrono::steady_clock::now();
+                best = std::min(best, std::chrono::duration<double, std::nano>(t1 - t0).count());
+            }
+            return best;
+        }
+
+        double dispatchNs(const CostModel& m, int threads) {
+            if (threads <= 1) return 0.0;
+            if (m.hwThreads <= 2) return m.dispatch2Ns;
+            const double f = static_cast<double>(threads - 2) / (m.hwThreads - 2);
+            return m.dispatch2Ns + f * (m.dispatchMaxNs - m.dispatch2Ns);
+        }
+
+        double estimateNs(const CostModel& m, double cells, int threads) {
+            return cells * m.cellNs / (1.0 + (threads - 1) * m.efficiency) + dispatchNs(m, threads);
+        }
+
+        int chunkRowsFor(const CostModel& m, GridSize grid, int threads) {
+            if (threads <= 1) return grid.rows;
+            const double rowNs = std::max(1e-3, grid.cols * m.cellNs);
+            const double total = rowNs * grid.rows;
+            const double target = std::max(kMinChunkNs, total / (threads * kChunksPerThread));
+            return std::max(1, std::min(grid.rows, static_cast<int>(std::lround(target / rowNs))));
+        }
+
+        bool makeDirs(const std::string& dir) {
+#if defined(__unix__) || defined(__APPLE__)
+            for (size_t pos = 1; pos <= dir.size(); ++pos) {
+                if (pos == dir.size() || dir[pos] == '/') {
+                    const std::string part = dir.substr(0, pos);
+                    if (mkdir(part.c_str(), 0755) != 0 && errno != EEXIST) return false;
+                }
+            }
+            return true;
+#else
+            (void)dir;
+            return false;
+#endif
+        }
+
+        bool load(const std::string& path, CostModel* m) {
+            std::ifstream in(path);
+            if (!in) return false;
+            int version = 0;
+            std::string line;
+            while (std::getline(in, line)) {
+                std::istringstream kv(line);
+                std::string key;
+                if (!std::getline(kv, key, '=')) continue;
+                if (key == "version") kv >> version;
+                else if (key == "hw_threads") kv >> m->hwThreads;
+                else if (key == "cell_ns") kv >> m->cellNs;
+                else if (key == "efficiency") kv >> m->efficiency;
+                else if (key == "dispatch2_ns") kv >> m->dispatch2Ns;
+                else if (key == "dispatch_max_ns") kv >> m->dispatchMaxNs;
+            }
+            return version == kCacheVersion && m->cellNs > 0.0;
+        }
+
+        void save(const std::string& path, const CostModel& m) {
+            const size_t slash = path.rfind('/');
+            if (slash != std::string::npos && !makeDirs(path.substr(0, slash))) return;
+            std::ofstream out(path, std::ios::trunc);
+            out << "version=" << kCacheVersion << "\n"
+                << "hw_threads=" << m.hwThreads << "\n"
+                << "cell_ns=" << m.cellNs << "\n"
+                << "efficiency=" << m.efficiency << "\n"
+                << "dispatch2_ns=" << m.dispatch2Ns << "\n"
+                << "dispatch_max_ns=" << m.dispatchMaxNs << "\n";
+        }
+
+    }
+
+    std::string cachePath() {
+        if (const char* xdg = std::getenv("XDG_CACHE_HOME")) {
+            if (*xdg) return std::string(xdg) + "/ascii_art/tune";
+        }
+        if (const char* home = std::getenv("HOME")) {
+            if (*home) return std::string(home) + "/.cache/ascii_art/tune";
+        }
+        return std::string();
+    }
+
+    CostModel calibrate() {
+        ThreadPool& pool = ThreadPool::shared();
+        CostModel m;
+        m.hwThreads = pool.size();
+
+        // A synthetic RGB image large enough that one render is well above
+        // timer resolution but small enough to calibrate in milliseconds.
+        const int w = 640, h = 480, c = 3;
+        std::vector<unsigned char> pixels(static_cast<size_t>(w) * h * c);
+        uint32_t state = 12345;
+        for (unsigned char& p : pixels) {
+            state = state * 1664525u + 1013904223u;
+            p = static_cast<unsigned char>(state >> 24);
+        }
+        const ImageView img{pixels.data(), w, h, c};
+        const GridSize grid{320, 240};
+        const double cells = static_cast<double>(grid.cols) * grid.rows;
+        std::string text(renderedSize(grid), '\n');
+
+        const double serial = bestOfNs(5, [&] { renderAsciiInto(img, grid, &text[0]); });
+        m.cellNs = serial / cells;
+
+        if (m.hwThreads > 1) {
+            auto noop = [](int, int) {};
+            m.dispatch2Ns = bestOfNs(50, [&] { pool.parallelFor(2, 1, 2, noop); });
+            m.dispatchMaxNs = bestOfNs(50, [&] { pool.parallelFor(m.hwThreads, 1, m.hwThreads, noop); });
+
+            Plan p;
+            p.threads = m.hwThreads;
+            p.chunkRows = std::max(1, grid.rows / (m.hwThreads * kChunksPerThread));
+            const double parallel = bestOfNs(5, [&] { renderAsciiParallel(img, grid, p.threads, p.chunkRows, &text[0]); });
+            const double speedup = serial / std::max(1.0, parallel - m.dispatchMaxNs);
+            m.efficiency = std::min(1.0, std::max(0.0, (speedup - 1.0) / (m.hwThreads - 1)));
+        }
+        return m;
+    }
+
+    CostModel loadOrCalibrate(bool recalibrate, bool* fromCache) {
+        const std::string path = cachePath();
+        const int hw = ThreadPool::shared().size();
+        CostModel m;
+        if (!recalibrate && !path.empty() && load(path, &m) && m.hwThreads == hw) {
+            *fromCache = true;
+            return m;
+        }
+        *fromCache = false;
+        m = calibrate();
+        if (!path.empty()) save(path, m);
+        return m;
+    }
+
+    Plan choose(const CostModel& model, GridSize grid) {
+        const double cells = static_cast<double>(grid.cols) * grid.rows;
+        Plan best;
+        best.serialNs = estimateNs(model, cells, 1);
+        best.estimatedNs = best.serialNs;
+        for (int t = 2; t <= model.hwThreads && t <= grid.rows; ++t) {
+            const double est = estimateNs(model, cells, t);
+            if (est < best.estimatedNs) {
+                best.threads = t;
+                best.estimatedNs = est;
+            }
+        }
+        best.chunkRows = chunkRowsFor(model, grid, best.threads);
+        return best;
+    }
+
+    Plan withThreads(const CostModel& model, GridSize grid, int threads) {
+        const double cells = static_cast<double>(grid.cols) * grid.rows;
+        Plan p;
+        p.threads = std::max(1, std::min(threads, model.hwThreads));
+        p.chunkRows = chunkRowsFor(model, grid, p.threads);
+        p.serialNs = estimateNs(model, cells, 1);
+        p.estimatedNs = estimateNs(model, cells, p.threads);
+        return p;
+    }
+
+    std::string describe(const Plan& plan, const CostModel& model, GridSize grid) {
+        char buf[256];
+        std::snprintf(buf, sizeof(buf),
+                      "render: %dx%d cells, %d thread%s%s, %d rows/chunk, est %.1f us (serial %.1f us); "
+                      "model: %.2f ns/cell, efficiency %.2f, dispatch %.1f-%.1f us",
+                      grid.cols, grid.rows, plan.threads, plan.threads == 1 ? "" : "s",
+                      plan.threads == 1 ? " (serial)" : "", plan.chunkRows,
+                      plan.estimatedNs / 1e3, plan.serialNs / 1e3,
+                      model.cellNs, model.efficiency, model.dispatch2Ns / 1e3, model.dispatchMaxNs / 1e3);
+        return buf;
+    }
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "render.h"
+
+#include <string>
+
+// Chooses how many threads and how many rows per chunk to render with.
+//
+// The cost model is calibrated once per machine by a short microbenchmark
+// and cached on disk:
+//
+//   t(T) = cells * cellNs / (1 + (T - 1) * efficiency) + dispatch(T)
+//
+// where dispatch(T) is the measured fork/join latency of the shared pool,
+// interpolated linearly between 2 threads and all of them.
+namespace autotune {
+
+    struct CostModel {
+        int hwThreads = 1;
+        double cellNs = 0.0;        // serial render cost per output cell
+        double efficiency = 1.0;    // speedup per extra thread, 0..1
+        double dispatch2Ns = 0.0;   // fork/join latency with 2 threads
+        double dispatchMaxNs = 0.0; // ... and with hwThreads threads
+    };
+
+    struct Plan {
+        int threads = 1;
+        int chunkRows = 1;
+        double estimatedNs = 0.0;
+        double serialNs = 0.0;
+    };
+
+    // $XDG_CACHE_HOME/ascii_art/tune, falling back to ~/.cache.
+    std::string cachePath();
+
+    // Loads the cached model, recalibrating when it is missing, stale (other
+    // thread count) or `recalibrate` is set. *fromCache tells which happened.
+    CostModel loadOrCalibrate(bool recalibrate, bool* fromCache);
+
+    CostModel calibrate();
+
+    Plan choose(const CostModel& model, GridSize grid);
+
+    // Fixed thread count (threads > 0) with a chunk size from the model.
+    Plan withThreads(const CostModel& model, GridSize grid, int threads);
+
+    std::string describe(const Plan& plan, const CostModel& model, GridSize grid);
+
+}
@@ -0,0 +1,169 @@
+#include "batch.h"
+#include "archive.h"
+#include "metrics.h"
+#include "thread_pool.h"
+#include "stb_image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace batch {
+
+    namespace {
+
+        struct Rendered {
+            bool ok = false;
+            std::string text;   // the rendering, or why the input failed
+        };
+
+        // Decodes and renders one input as the one-shot mode would, EXIF
+        // orientation included. On failure *text receives the decoder's
+        // reason, which is only readable on the thread that decoded.
+        bool renderInput(const archive::Input& in, const Options& opts, std::string* text) {
+            int w = 0, h = 0, c = 0;
+            int exif = 1;
+            stbi_uc* img = nullptr;
+            {
+                metrics::ScopedTimer timer(metrics::Stage::Decode);
+                img = archive::load(in, &w, &h, &c, 0, &exif);
+            }
+            if (img == nullptr) {
+                *text = stbi_failure_reason();
+                return false;
+            }
+            if (img == nullptr) return false;
+            {
+                metrics::ScopedTimer timer(metrics::Stage::Render);
+                const ImageView view{img, w, h, c};
+                const orient::Transform t = orient::compose(orient::fromExif(exif), opts.transform);
+                int displayWidth = 0, displayHeight = 0;
+                orient::displaySize(view, t, &displayWidth, &displayHeight);
+                const GridSize grid = computeGrid(displayWidth, displayHeight, opts.termCols);
+                text->assign(renderedSize(grid), '\n');
+                if (t.identity()) {
+                    renderWithOptions(view, grid, opts.render, &(*text)[0]);
+                } else {
+                    orient::renderWithOptions(view, t, grid, opts.render, &(*text)[0]);
+                }
+            }
+            stbi_image_free(img);
+            return true;
+        }
+
+    }
+
+    std::string entryName(const std::string& path) {
+        std::string name;
+        size_t at = 0;
+        while (at <= path.size()) {
+            size_t end = path.find('/', at);
+            if (end == std::string::npos) end = path.size();
+            const std::string part = path.substr(at, end - at);
+            if (!part.empty() && part != "." && part != "..") {
+                if (!name.empty()) name += '/';
+                name += part;
+            }
+            at = end + 1;
+        }
+        return name + ".txt";
+    }
+
+    int run(const std::vector<std::string>& inputs, const Options& opts) {
+        const std::vector<archive::Input> files = archive::expandInputs(inputs);
+        if (files.empty()) {
+            std::cerr << "--output-archive: no images\n";
+            return 1;
+        }
+        const auto start = std::chrono::steady_clock::now();
+
+        archive::TarWriter tar;
+        std::string error;
+        if (!tar.open(opts.output, &error)) {
+            std::cerr << opts.output << ": " << error << "\n";
+            return 1;
+        }
+        std::FILE* index = nullptr;
+        if (!opts.index.empty() && (index = std::fopen(opts.index.c_str(), "w")) == nullptr) {
+            std::cerr << opts.index << ": cannot open\n";
+            return 1;
+        }
+
+        ThreadPool& pool = ThreadPool::shared();
+        const int threads = opts.threads > 0 ? opts.threads : pool.size();
+        // Renders finished ahead of the writer wait here, keyed by input.
+        const size_t window = static_cast<size_t>(std::max(8, 4 * threads));
+        std::mutex mu;
+        std::condition_variable cv;
+        std::map<size_t, Rendered> ready;
+        size_t next = 0;    // input the writer needs next
+
+        int failed = 0;
+        bool writeOk = true;
+        std::thread writer([&] {
+            for (size_t i = 0; i < files.size(); ++i) {
+                Rendered r;
+                {
+                    std::unique_lock<std::mutex> lock(mu);
+                    cv.wait(lock, [&] { return ready.count(i) != 0; });
+                    r = std::move(ready[i]);
+                    ready.erase(i);
+                    next = i + 1;
+                }
+                cv.notify_all();
+                if (!r.ok) {
+                    std::cerr << "Error loading image: " << files[i].label << ": " << r.text << "\n";
+                    ++failed;
+                    metrics::add(metrics::Counter::Errors);
+                    continue;
+                }
+                if (!writeOk) continue;
+                metrics::ScopedTimer timer(metrics::Stage::Write);
+                const std::string path = files[i].archive ? files[i].archive->path() + "/" +
+                                                                files[i].archive->members()[files[i].member].name
+                                                          : files[i].label;
+                const std::string name = entryName(path);
+                uint64_t offset = 0;
+                writeOk = tar.add(name, r.text.data(), r.text.size(), &offset);
+                if (writeOk && index != nullptr) {
+                    std::fprintf(index, "%llu %zu %s\n", static_cast<unsigned long long>(offset), r.text.size(),
+                                 name.c_str());
+                }
+                metrics::add(metrics::Counter::Images);
+                metrics::add(metrics::Counter::BytesOut, r.text.size());
+            }
+        });
+
+        pool.parallelFor(static_cast<int>(files.size()), 1, threads, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                {
+                    metrics::ScopedTimer timer(metrics::Stage::QueueWait);
+                    std::unique_lock<std::mutex> lock(mu);
+                    cv.wait(lock, [&] { return static_cast<size_t>(i) < next + window; });
+                }
+                Rendered r;
+                r.ok = renderInput(files[static_cast<size_t>(i)], opts, &r.text);
+                {
+                    std::lock_guard<std::mutex> lock(mu);
+                    ready.emplace(static_cast<size_t>(i), std::move(r));
+                }
+                cv.notify_all();
+            }
+        });
+        writer.join();
+
+        writeOk = tar.close() && writeOk;
+        if (index != nullptr && std::fclose(index) != 0) writeOk = false;
+        if (!writeOk) std::cerr << opts.output << ": write failed\n";
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "output-archive: " << files.size() - failed << " of " << files.size() << " images, "
+                  << tar.size() << " bytes, " << threads << " threads, " << ms << " ms\n";
+        return failed == 0 && writeOk ? 0 : 1;
+    }
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "orientation.h"
+#include "render.h"
+
+#include <string>
+#include <vector>
+
+// Batch conversion into one tar archive (--output-archive). Pool workers
+// decode and render the inputs; a single writer thread appends each render
+// to the tar, in input order, through archive::TarWriter's large buffer,
+// so millions of outputs cost a few big sequential writes rather than a
+// file each. Workers stay at most a small window ahead of the writer.
+namespace batch {
+
+    struct Options {
+        std::string output;         // tar archive to write
+        std::string index;          // offset index to write alongside, or ""
+        int termCols = 80;
+        int threads = 0;            // 0 uses the whole shared pool
+        RenderOptions render;
+        orient::Transform transform;
+    };
+
+    // Name of the entry an input's render is stored under: its path (the
+    // archive path, '/', then the member name for archive members) plus
+    // ".txt", without a leading '/' or any "." or ".." components so it
+    // extracts inside the current directory.
+    std::string entryName(const std::string& path);
+
+    // Renders archive::expandInputs(inputs) into opts.output. The index, if
+    // asked for, has one "offset size name" line per entry, offset being
+    // where the entry's text starts in the tar. Inputs that fail to decode
+    // are reported on stderr and left out. Returns the process exit status.
+    int run(const std::vector<std::string>& inputs, const Options& opts);
+
+}
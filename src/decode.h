@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+// stbi_load / stbi_load_from_memory with PNG image data inflated in tree
+// (inflate.h) into a buffer sized from the header. Streams the in-tree
+// decoder rejects, and every other format, go through stb_image, so
+// results and stbi_failure_reason() match stbi_load. Free the result with
+// stbi_image_free. Implemented in stb_image_impl.cpp.
+namespace decode {
+
+    unsigned char* load(const char* path, int* width, int* height, int* channels, int desired);
+    unsigned char* loadFromMemory(const unsigned char* data, size_t size, int* width, int* height, int* channels,
+                                  int desired);
+
+    // Makes stbi_failure_reason() on this thread report reason, a string
+    // literal, for failures found before any decoder runs.
+    void setFailureReason(const char* reason);
+
+    // Takes an image a row at a time as it is decoded: begin() once with its
+    // size and channel count, then row() once for every y in [0, height),
+    // width * channels bytes that are only valid during the call. Rows come
+    // top to bottom, except that a bottom-up BMP hands them over in file
+    // order. begin() returning false abandons the decode.
+    struct RowSink {
+        std::function<bool(int width, int height, int channels)> begin;
+        std::function<void(int y, const unsigned char* pixels)> row;
+    };
+
+    // Decodes to sink, with the channels load(..., 0) would return. These
+    // formats go to the sink as each row is produced, so the image is never
+    // held whole:
+    // - 8-bit non-interlaced PNGs without a palette, tRNS or CgBI, as each
+    //   row is unfiltered;
+    // - JPEGs, as each row is colour-converted (the component planes are
+    //   still decoded first);
+    // - 8-bit PNMs, as each row is read;
+    // - BMPs without alpha, as each row is unpacked.
+    // Anything else is decoded by load() and then handed over row by row.
+    // Returns false with stbi_failure_reason() set on failure.
+    bool decodeRows(const char* path, const RowSink& sink);
+    bool decodeRowsFromMemory(const unsigned char* data, size_t size, const RowSink& sink);
+
+    // luminancePlane() of what load(..., 0) returns: width * height bytes,
+    // built from decodeRows() one row at a time.
+    unsigned char* loadLuminance(const char* path, int* width, int* height);
+    unsigned char* loadLuminanceFromMemory(const unsigned char* data, size_t size, int* width, int* height);
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+
+// 8x8 bitmaps for the ramp characters, from the public domain font8x8_basic
+// set. Row 0 is the top; bit 0 of each row is the leftmost pixel.
+struct GlyphBitmap {
+    char ch;
+    uint8_t rows[8];
+};
+
+constexpr GlyphBitmap kFont8x8[] = {
+    {' ', {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}},
+    {'.', {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00}},
+    {':', {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00}},
+    {'-', {0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00}},
+    {'=', {0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00}},
+    {'+', {0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00}},
+    {'*', {0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00}},
+    {'#', {0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00}},
+    {'%', {0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00}},
+    {'@', {0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00}},
+};
+
+constexpr int kFontGlyphs = static_cast<int>(sizeof(kFont8x8) / sizeof(kFont8x8[0]));
+
+// Bitmap for c, or the blank glyph for characters the table doesn't carry.
+static inline const uint8_t* glyphBitmap(char c) {
+    for (const GlyphBitmap& g : kFont8x8) {
+        if (g.ch == c) return g.rows;
+    }
+    return kFont8x8[0].rows;
+}
+
+static inline int glyphCoverage(const uint8_t* rows) {
+    int bits = 0;
+    for (int r = 0; r < 8; ++r) bits += __builtin_popcount(rows[r]);
+    return bits;
+}
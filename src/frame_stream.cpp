@@ -0,0 +1,304 @@
+#include "frame_stream.h"
+#include "metrics.h"
+#include "stream_output.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+namespace frame_stream {
+
+    namespace {
+
+        // Tile size in cells; one hash per tile.
+        constexpr int kTileCols = 8;
+        constexpr int kTileRows = 4;
+
+        constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+        constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+        constexpr uint64_t kKeys[8] = {
+            0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull,
+            0x78e5c0cc4ee679cbull, 0x2172ffcc7dd05a82ull, 0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull,
+        };
+
+        uint64_t fmix64(uint64_t h) {
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ull;
+            h ^= h >> 33;
+            return h;
+        }
+
+        uint64_t rotl64(uint64_t v, int r) {
+            return (v << r) | (v >> (64 - r));
+        }
+
+        void cursorTo(std::string* out, int row, int col) {
+            char buf[32];
+            const int n = std::snprintf(buf, sizeof(buf), "\x1b[%d;%dH", row + 1, col + 1);
+            out->append(buf, static_cast<size_t>(n));
+        }
+
+        bool readFull(int fd, unsigned char* data, size_t size, size_t* got) {
+            *got = 0;
+#if defined(__unix__) || defined(__APPLE__)
+            while (*got < size) {
+                const ssize_t n = ::read(fd, data + *got, size - *got);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                if (n == 0) break;
+                *got += static_cast<size_t>(n);
+            }
+#else
+            *got = std::fread(data, 1, size, stdin);
+#endif
+            return true;
+        }
+
+    }
+
+    uint64_t hash64(const unsigned char* data, size_t size, uint64_t seed) {
+        // Two 64-bit lanes; each 16-byte block is keyed, its 32-bit halves
+        // multiplied, and the block itself added lane-swapped.
+        const size_t blocks = size / 16;
+#if defined(__SSE2__)
+        __m128i acc = _mm_set_epi64x(static_cast<long long>(seed ^ kPrime2), static_cast<long long>(seed ^ kPrime1));
+        auto step = [&](const unsigned char* p, size_t i) {
+            const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            const __m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i*>(kKeys + 2 * (i & 3)));
+            const __m128i dk = _mm_xor_si128(d, k);
+            const __m128i product = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+            acc = _mm_add_epi64(acc, _mm_add_epi64(product, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2))));
+        };
+        for (size_t i = 0; i < blocks; ++i) step(data + i * 16, i);
+        if (size % 16 != 0) {
+            alignas(16) unsigned char tail[16] = {};
+            std::memcpy(tail, data + blocks * 16, size % 16);
+            step(tail, blocks);
+        }
+        alignas(16) uint64_t lanes[2];
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanes), acc);
+#else
+        uint64_t lanes[2] = {seed ^ kPrime1, seed ^ kPrime2};
+        auto step = [&](const unsigned char* p, size_t i) {
+            uint64_t d[2];
+            std::memcpy(d, p, 16);
+            for (int l = 0; l < 2; ++l) {
+                const uint64_t dk = d[l] ^ kKeys[2 * (i & 3) + l];
+                lanes[l] += (dk & 0xffffffffull) * (dk >> 32) + d[l ^ 1];
+            }
+        };
+        for (size_t i = 0; i < blocks; ++i) step(data + i * 16, i);
+        if (size % 16 != 0) {
+            unsigned char tail[16] = {};
+            std::memcpy(tail, data + blocks * 16, size % 16);
+            step(tail, blocks);
+        }
+#endif
+        return fmix64(lanes[0] ^ rotl64(lanes[1], 31) ^ (size * kPrime2));
+    }
+
+    Renderer::Renderer(int width, int height, int channels, GridSize grid, const RenderOptions& opts)
+        : width_(width), height_(height), channels_(channels), grid_(grid), opts_(opts),
+          tilesX_((grid.cols + kTileCols - 1) / kTileCols), tilesY_((grid.rows + kTileRows - 1) / kTileRows),
+          hashes_(static_cast<size_t>(tilesX_) * tilesY_, 0), changed_(hashes_.size(), 0),
+          lum_(static_cast<size_t>(grid.cols) * grid.rows, 0), text_(renderedSize(grid), '\n') {
+        const ImageView img{nullptr, width, height, channels};
+        if (opts.sampling == Sampling::Area) {
+            boxSpans(width, cellWidth(img, grid) * grid.cols, grid.cols, colLo_, colHi_);
+            boxSpans(height, cellHeight(img, grid) * grid.rows, grid.rows, rowLo_, rowHi_);
+            return;
+        }
+        // Nearest: the one pixel renderRow would pick.
+        colLo_.resize(static_cast<size_t>(grid.cols));
+        rowLo_.resize(static_cast<size_t>(grid.rows));
+        for (int x = 0; x < grid.cols; ++x) {
+            colLo_[x] = nearestColumn(width, grid.cols, x);
+        }
+        for (int y = 0; y < grid.rows; ++y) {
+            rowLo_[y] = nearestRow(height, grid.rows, y);
+        }
+        colHi_ = colLo_;
+        rowHi_ = rowLo_;
+        for (int& v : colHi_) ++v;
+        for (int& v : rowHi_) ++v;
+    }
+
+    void Renderer::columns(int cx0, int cx1, int* lo, int* hi) const {
+        *lo = *std::min_element(colLo_.begin() + cx0, colLo_.begin() + cx1);
+        *hi = *std::max_element(colHi_.begin() + cx0, colHi_.begin() + cx1);
+    }
+
+    void Renderer::renderTile(const unsigned char* frame, int tx, int ty) {
+        const int cx0 = tx * kTileCols, cx1 = std::min(grid_.cols, cx0 + kTileCols);
+        const int cy0 = ty * kTileRows, cy1 = std::min(grid_.rows, cy0 + kTileRows);
+        const size_t rowBytes = static_cast<size_t>(width_) * channels_;
+        if (opts_.sampling != Sampling::Area) {
+            for (int y = cy0; y < cy1; ++y) {
+                const unsigned char* row = frame + static_cast<size_t>(rowLo_[y]) * rowBytes;
+                for (int x = cx0; x < cx1; ++x) {
+                    lum_[static_cast<size_t>(y) * grid_.cols + x] =
+                        luminance(row + static_cast<size_t>(colLo_[x]) * channels_, channels_);
+                }
+            }
+            return;
+        }
+        // Same sums and rounding as boxResample, restricted to the tile.
+        int a = 0, b = 0;
+        columns(cx0, cx1, &a, &b);
+        thread_local std::vector<uint32_t> colSums;
+        thread_local std::vector<uint8_t> lumRow;
+        colSums.resize(static_cast<size_t>(b - a));
+        lumRow.resize(static_cast<size_t>(b - a));
+        for (int y = cy0; y < cy1; ++y) {
+            std::fill(colSums.begin(), colSums.end(), 0u);
+            for (int sy = rowLo_[y]; sy < rowHi_[y]; ++sy) {
+                luminanceGrid(frame + sy * rowBytes + static_cast<size_t>(a) * channels_, channels_,
+                              static_cast<size_t>(b - a), lumRow.data());
+                for (int i = 0; i < b - a; ++i) colSums[i] += lumRow[i];
+            }
+            for (int x = cx0; x < cx1; ++x) {
+                uint64_t sum = 0;
+                for (int sx = colLo_[x]; sx < colHi_[x]; ++sx) sum += colSums[sx - a];
+                const uint64_t count = static_cast<uint64_t>(colHi_[x] - colLo_[x]) * (rowHi_[y] - rowLo_[y]);
+                lum_[static_cast<size_t>(y) * grid_.cols + x] = static_cast<uint8_t>((sum + count / 2) / count);
+            }
+        }
+    }
+
+    size_t Renderer::update(const unsigned char* frame, std::string* escapes) {
+        const size_t rowBytes = static_cast<size_t>(width_) * channels_;
+        ThreadPool& pool = ThreadPool::shared();
+        pool.parallelFor(tilesY_, 1, pool.size(), [&](int begin, int end) {
+            for (int ty = begin; ty < end; ++ty) {
+                const int cy0 = ty * kTileRows, cy1 = std::min(grid_.rows, cy0 + kTileRows);
+                for (int tx = 0; tx < tilesX_; ++tx) {
+                    const int cx0 = tx * kTileCols, cx1 = std::min(grid_.cols, cx0 + kTileCols);
+                    int a = 0, b = 0;
+                    columns(cx0, cx1, &a, &b);
+                    // Hash each source row the tile reads once, in order.
+                    uint64_t h = static_cast<uint64_t>(tx) * kPrime1 + ty;
+                    int last = -1;
+                    for (int y = cy0; y < cy1; ++y) {
+                        for (int sy = std::max(rowLo_[y], last + 1); sy < rowHi_[y]; ++sy) {
+                            h = hash64(frame + sy * rowBytes + static_cast<size_t>(a) * channels_,
+                                       static_cast<size_t>(b - a) * channels_, h);
+                            last = sy;
+                        }
+                    }
+                    const size_t t = static_cast<size_t>(ty) * tilesX_ + tx;
+                    changed_[t] = first_ || h != hashes_[t];
+                    hashes_[t] = h;
+                    if (changed_[t]) renderTile(frame, tx, ty);
+                }
+            }
+        });
+        mapGlyphs(lum_.data(), grid_, Dither::None, opts_.glyphs, &text_[0]);
+
+        const size_t stride = static_cast<size_t>(grid_.cols) + 1;
+        size_t cells = 0;
+        if (first_) {
+            escapes->append("\x1b[H\x1b[2J");
+            for (int y = 0; y < grid_.rows; ++y) {
+                cursorTo(escapes, y, 0);
+                escapes->append(text_, y * stride, static_cast<size_t>(grid_.cols));
+            }
+            first_ = false;
+            return static_cast<size_t>(grid_.cols) * grid_.rows;
+        }
+        for (int ty = 0; ty < tilesY_; ++ty) {
+            const int cy0 = ty * kTileRows, cy1 = std::min(grid_.rows, cy0 + kTileRows);
+            int tx = 0;
+            while (tx < tilesX_) {
+                if (!changed_[static_cast<size_t>(ty) * tilesX_ + tx]) {
+                    ++tx;
+                    continue;
+                }
+                // Runs of changed tiles go out as one span per cell row.
+                int end = tx + 1;
+                while (end < tilesX_ && changed_[static_cast<size_t>(ty) * tilesX_ + end]) ++end;
+                const int cx0 = tx * kTileCols, cx1 = std::min(grid_.cols, end * kTileCols);
+                for (int y = cy0; y < cy1; ++y) {
+                    cursorTo(escapes, y, cx0);
+                    escapes->append(text_, y * stride + cx0, static_cast<size_t>(cx1 - cx0));
+                }
+                cells += static_cast<size_t>(cx1 - cx0) * (cy1 - cy0);
+                tx = end;
+            }
+        }
+        return cells;
+    }
+
+    int run(const Options& opts) {
+        if (opts.render.dither != Dither::None) {
+            std::cerr << "--raw-stream does not support dithering\n";
+            return 2;
+        }
+        const GridSize grid = computeGrid(opts.width, opts.height, opts.termCols);
+        Renderer renderer(opts.width, opts.height, opts.channels, grid, opts.render);
+        const size_t frameBytes = static_cast<size_t>(opts.width) * opts.height * opts.channels;
+        std::vector<unsigned char> frame(frameBytes);
+        const stream_output::Sink sink = stream_output::fdSink(1);
+        const size_t cells = static_cast<size_t>(grid.cols) * grid.rows;
+        std::string escapes;
+        size_t totalCells = 0;
+        int frames = 0;
+        std::cout.flush();
+
+        for (;;) {
+            size_t got = 0;
+            if (!readFull(0, frame.data(), frameBytes, &got)) {
+                std::cerr << "raw-stream: read error\n";
+                return 1;
+            }
+            if (got == 0) break;
+            if (got < frameBytes) {
+                std::cerr << "raw-stream: truncated frame (" << got << " of " << frameBytes << " bytes)\n";
+                return 1;
+            }
+            metrics::add(metrics::Counter::BytesIn, frameBytes);
+            const auto start = std::chrono::steady_clock::now();
+            escapes.clear();
+            size_t redrawn = 0;
+            {
+                metrics::ScopedTimer timer(metrics::Stage::Render);
+                redrawn = renderer.update(frame.data(), &escapes);
+            }
+            const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            {
+                metrics::ScopedTimer timer(metrics::Stage::Write);
+                if (!sink(escapes.data(), escapes.size())) return 1;
+            }
+            metrics::add(metrics::Counter::Images);
+            metrics::add(metrics::Counter::BytesOut, escapes.size());
+            totalCells += redrawn;
+            std::fprintf(stderr, "frame %d: %.1f%% of cells re-rendered, %.3f ms\n", frames,
+                         100.0 * redrawn / cells, ms);
+            ++frames;
+        }
+
+        escapes.clear();
+        cursorTo(&escapes, grid.rows, 0);
+        sink(escapes.data(), escapes.size());
+        std::fprintf(stderr, "raw-stream: %d frames, %.1f%% of cells re-rendered on average\n", frames,
+                     frames ? 100.0 * totalCells / (static_cast<double>(cells) * frames) : 0.0);
+        return 0;
+    }
+
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "render.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Raw video input (--raw-stream): fixed-size frames of packed pixels read
+// back to back. Cells are grouped into tiles; each tile's source footprint
+// is hashed every frame and only tiles whose hash changed are re-sampled
+// and re-drawn, which is most of the saving for screen-capture content.
+namespace frame_stream {
+
+    // Fast 64-bit hash for change detection (not for adversarial input);
+    // SSE2 multiply-accumulate over 16-byte blocks.
+    uint64_t hash64(const unsigned char* data, size_t size, uint64_t seed);
+
+    class Renderer {
+    public:
+        // opts.dither must be Dither::None: error diffusion couples every
+        // cell to all the ones before it.
+        Renderer(int width, int height, int channels, GridSize grid, const RenderOptions& opts);
+
+        // Brings text() up to date with frame; appends cursor-addressed
+        // updates for the changed tiles to escapes (a full redraw on the first
+        // frame) and returns the number of cells re-rendered.
+        size_t update(const unsigned char* frame, std::string* escapes);
+
+        const std::string& text() const { return text_; }
+        GridSize grid() const { return grid_; }
+
+    private:
+        // Source columns read by cells [cx0, cx1) of a row.
+        void columns(int cx0, int cx1, int* lo, int* hi) const;
+        void renderTile(const unsigned char* frame, int tx, int ty);
+
+        int width_, height_, channels_;
+        GridSize grid_;
+        RenderOptions opts_;
+        int tilesX_, tilesY_;
+        std::vector<int> colLo_, colHi_;            // source columns per cell
+        std::vector<int> rowLo_, rowHi_;            // source rows per cell
+        std::vector<uint64_t> hashes_;
+        std::vector<uint8_t> changed_;
+        std::vector<uint8_t> lum_;
+        std::string text_;
+        bool first_ = true;
+    };
+
+    struct Options {
+        int width = 0;
+        int height = 0;
+        int channels = 0;
+        int termCols = 80;
+        RenderOptions render;
+    };
+
+    // Reads frames from stdin until EOF, drawing each to stdout and one
+    // line of statistics per frame to stderr. Returns the exit status.
+    int run(const Options& opts);
+
+}
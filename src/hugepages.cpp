@@ -0,0 +1,201 @@
+#include "hugepages.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+namespace hugepages {
+
+    namespace {
+
+        // Idle blocks beyond this are unmapped instead of cached.
+        constexpr uint64_t kMaxCachedBytes = 2ull << 30;
+
+        std::atomic<bool> gEnabled{false};
+
+        struct Block {
+            void* base;
+            size_t capacity;
+        };
+
+        struct Pool {
+            std::mutex mu;
+            std::vector<Block> idle;
+            Stats stats;
+        };
+
+        Pool& pool() {
+            static Pool* p = new Pool();
+            return *p;
+        }
+
+        size_t roundUp(size_t n) {
+            return (n + kHugePage - 1) & ~(kHugePage - 1);
+        }
+
+#if defined(__linux__)
+        void* mapBlock(size_t capacity, bool* hugetlb) {
+            *hugetlb = false;
+#if defined(MAP_HUGETLB)
+            void* p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) {
+                *hugetlb = true;
+                return p;
+            }
+#endif
+            // Over-map by one huge page so the block can start on a 2 MiB
+            // boundary, which transparent huge pages need.
+            const size_t span = capacity + kHugePage;
+            void* raw = mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw == MAP_FAILED) return nullptr;
+            const uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+            const uintptr_t aligned = (start + kHugePage - 1) & ~(static_cast<uintptr_t>(kHugePage) - 1);
+            if (aligned > start) munmap(raw, aligned - start);
+            const uintptr_t end = start + span;
+            if (end > aligned + capacity) munmap(reinterpret_cast<void*>(aligned + capacity), end - (aligned + capacity));
+#if defined(MADV_HUGEPAGE)
+            madvise(reinterpret_cast<void*>(aligned), capacity, MADV_HUGEPAGE);
+#endif
+            return reinterpret_cast<void*>(aligned);
+        }
+
+        void unmapBlock(void* base, size_t capacity) {
+            munmap(base, capacity);
+        }
+#else
+        void* mapBlock(size_t capacity, bool* hugetlb) {
+            *hugetlb = false;
+            return std::malloc(capacity);
+        }
+
+        void unmapBlock(void* base, size_t) {
+            std::free(base);
+        }
+#endif
+
+    }
+
+    void setEnabled(bool on) {
+        gEnabled.store(on, std::memory_order_relaxed);
+    }
+
+    bool enabled() {
+        return gEnabled.load(std::memory_order_relaxed);
+    }
+
+    void* acquire(size_t size, size_t* capacity) {
+        const size_t need = roundUp(std::max<size_t>(size, 1));
+        Pool& p = pool();
+        {
+            std::lock_guard<std::mutex> lock(p.mu);
+            // Smallest idle block that fits without wasting more than half.
+            auto best = p.idle.end();
+            for (auto it = p.idle.begin(); it != p.idle.end(); ++it) {
+                if (it->capacity >= need && it->capacity <= need * 2 &&
+                    (best == p.idle.end() || it->capacity < best->capacity)) {
+                    best = it;
+                }
+            }
+            if (best != p.idle.end()) {
+                Block b = *best;
+                *best = p.idle.back();
+                p.idle.pop_back();
+                p.stats.reused++;
+                p.stats.cachedBytes -= b.capacity;
+                *capacity = b.capacity;
+                return b.base;
+            }
+        }
+
+        bool hugetlb = false;
+        void* base = mapBlock(need, &hugetlb);
+        if (base == nullptr) return nullptr;
+        {
+            std::lock_guard<std::mutex> lock(p.mu);
+            p.stats.mapped++;
+            if (hugetlb) p.stats.hugetlb++;
+        }
+        *capacity = need;
+        return base;
+    }
+
+    void release(void* block, size_t capacity) {
+        if (block == nullptr) return;
+        Pool& p = pool();
+        {
+            std::lock_guard<std::mutex> lock(p.mu);
+            if (p.stats.cachedBytes + capacity <= kMaxCachedBytes) {
+                p.idle.push_back(Block{block, capacity});
+                p.stats.cachedBytes += capacity;
+                return;
+            }
+        }
+        unmapBlock(block, capacity);
+    }
+
+    Stats stats() {
+        Pool& p = pool();
+        std::lock_guard<std::mutex> lock(p.mu);
+        return p.stats;
+    }
+
+    Faults faults() {
+        Faults f;
+#if defined(__unix__) || defined(__APPLE__)
+        rusage ru{};
+        if (getrusage(RUSAGE_SELF, &ru) == 0) {
+            f.minor = ru.ru_minflt;
+            f.major = ru.ru_majflt;
+        }
+#endif
+        return f;
+    }
+
+    Buffer::Buffer(size_t size) : size_(size) {
+        if (enabled() && size >= kMinBlock) {
+            data_ = static_cast<unsigned char*>(acquire(size, &capacity_));
+            if (data_ != nullptr) return;
+            capacity_ = 0;
+        }
+        data_ = static_cast<unsigned char*>(std::malloc(std::max<size_t>(size, 1)));
+        if (data_ == nullptr) throw std::bad_alloc();
+    }
+
+    Buffer::~Buffer() {
+        reset();
+    }
+
+    Buffer::Buffer(Buffer&& o) noexcept
+        : data_(std::exchange(o.data_, nullptr)), size_(std::exchange(o.size_, 0)), capacity_(std::exchange(o.capacity_, 0)) {}
+
+    Buffer& Buffer::operator=(Buffer&& o) noexcept {
+        if (this != &o) {
+            reset();
+            data_ = std::exchange(o.data_, nullptr);
+            size_ = std::exchange(o.size_, 0);
+            capacity_ = std::exchange(o.capacity_, 0);
+        }
+        return *this;
+    }
+
+    void Buffer::reset() {
+        if (capacity_ != 0) {
+            release(data_, capacity_);
+        } else {
+            std::free(data_);
+        }
+        data_ = nullptr;
+        size_ = 0;
+        capacity_ = 0;
+    }
+
+}
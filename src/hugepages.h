@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Pool of large, huge-page backed buffers for decoded images and other
+// whole-image planes. Blocks are mapped with MAP_HUGETLB when the system
+// has huge pages reserved, otherwise as ordinary anonymous memory advised
+// with MADV_HUGEPAGE so transparent huge pages back them. Released blocks
+// are kept for reuse, so long-running modes stop paying page faults for
+// every image.
+namespace hugepages {
+
+    constexpr size_t kHugePage = 2u << 20;
+
+    // Requests smaller than this are left to malloc.
+    constexpr size_t kMinBlock = kHugePage;
+
+    void setEnabled(bool on);
+    bool enabled();
+
+    // Returns a block of at least size bytes and its real capacity, or
+    // nullptr if the mapping fails. Not zeroed when reused.
+    void* acquire(size_t size, size_t* capacity);
+    void release(void* block, size_t capacity);
+
+    struct Stats {
+        uint64_t mapped = 0;        // blocks mapped from the kernel
+        uint64_t hugetlb = 0;       // ... of which explicitly MAP_HUGETLB
+        uint64_t reused = 0;        // acquires served from the pool
+        uint64_t cachedBytes = 0;   // bytes currently idle in the pool
+    };
+    Stats stats();
+
+    struct Faults {
+        long minor = 0;
+        long major = 0;
+    };
+    Faults faults();
+
+    // Owning buffer that comes from the pool when enabled and large enough,
+    // and from malloc otherwise. Throws std::bad_alloc, as a std::vector
+    // would, when neither can supply it.
+    class Buffer {
+    public:
+        Buffer() = default;
+        explicit Buffer(size_t size);
+        ~Buffer();
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+        Buffer(Buffer&& o) noexcept;
+        Buffer& operator=(Buffer&& o) noexcept;
+
+        unsigned char* data() { return data_; }
+        const unsigned char* data() const { return data_; }
+        size_t size() const { return size_; }
+
+    private:
+        void reset();
+
+        unsigned char* data_ = nullptr;
+        size_t size_ = 0;
+        size_t capacity_ = 0;   // non-zero when the block belongs to the pool
+    };
+
+}
@@ -0,0 +1,77 @@
+#include "indexed.h"
+#include "hugepages.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace indexed {
+
+    namespace {
+
+        // Source column of every cell and source row of every grid row,
+        // picked exactly as renderRow picks them.
+        void samplePositions(const Image& img, GridSize grid, std::vector<int>& sx, std::vector<int>& sy) {
+            sx.resize(static_cast<size_t>(grid.cols));
+            sy.resize(static_cast<size_t>(grid.rows));
+            for (int x = 0; x < grid.cols; ++x) {
+                sx[static_cast<size_t>(x)] = nearestColumn(img.width, grid.cols, x);
+            }
+            for (int y = 0; y < grid.rows; ++y) {
+                sy[static_cast<size_t>(y)] = nearestRow(img.height, grid.rows, y);
+            }
+        }
+
+    }
+
+    void lumaTable(const Image& img, uint8_t lut[256]) {
+        for (int i = 0; i < 256; ++i) lut[i] = luminance(img.palette[i], img.channels);
+    }
+
+    void renderInto(const Image& img, GridSize grid, int threads, char* out) {
+        uint8_t lut[256];
+        lumaTable(img, lut);
+        char glyph[256];
+        for (int i = 0; i < 256; ++i) glyph[i] = glyphFor(lut[i]);
+        std::vector<int> sx, sy;
+        samplePositions(img, grid, sx, sy);
+
+        const size_t stride = static_cast<size_t>(grid.cols) + 1;
+        const int chunk = std::max(1, grid.rows / (std::max(1, threads) * 4));
+        ThreadPool::shared().parallelFor(grid.rows, chunk, threads, [&](int begin, int end) {
+            for (int y = begin; y < end; ++y) {
+                const unsigned char* row = img.indices + static_cast<size_t>(sy[static_cast<size_t>(y)]) * img.width;
+                char* line = out + static_cast<size_t>(y) * stride;
+                for (int x = 0; x < grid.cols; ++x) line[x] = glyph[row[sx[static_cast<size_t>(x)]]];
+                line[grid.cols] = '\n';
+            }
+        });
+    }
+
+    void renderWithOptions(const Image& img, GridSize grid, const RenderOptions& opts, char* out) {
+        uint8_t lut[256];
+        lumaTable(img, lut);
+        std::vector<uint8_t> lum(static_cast<size_t>(grid.cols) * grid.rows);
+        if (opts.sampling == Sampling::Nearest) {
+            std::vector<int> sx, sy;
+            samplePositions(img, grid, sx, sy);
+            for (int y = 0; y < grid.rows; ++y) {
+                const unsigned char* row = img.indices + static_cast<size_t>(sy[static_cast<size_t>(y)]) * img.width;
+                for (int x = 0; x < grid.cols; ++x) {
+                    lum[static_cast<size_t>(y) * grid.cols + x] = lut[row[sx[static_cast<size_t>(x)]]];
+                }
+            }
+        } else {
+            const size_t pixels = static_cast<size_t>(img.width) * img.height;
+            hugepages::Buffer plane(pixels);
+            uint8_t* p = plane.data();
+            for (size_t i = 0; i < pixels; ++i) p[i] = lut[img.indices[i]];
+            const ImageView view{nullptr, img.width, img.height, 1};
+            boxResample(p, img.width, img.height, cellWidth(view, grid) * grid.cols, cellHeight(view, grid) * grid.rows,
+                        grid.cols, grid.rows, lum.data());
+        }
+        mapGlyphs(lum.data(), grid, opts.dither, opts.glyphs, out);
+    }
+
+}
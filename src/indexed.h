@@ -0,0 +1,39 @@
+#pragma once
+
+#include "render.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// Palette images (indexed PNG, GIF) kept at one byte per pixel. Luminance
+// and the ramp glyph are worked out once per palette entry, so rendering
+// is a table lookup per cell instead of expanding every pixel to RGB(A)
+// first. Output matches rendering what stbi_load returns for the file.
+namespace indexed {
+
+    struct Image {
+        int width = 0;
+        int height = 0;
+        int channels = 0;                   // channels stbi_load would return (3 or 4)
+        uint8_t palette[256][4] = {};       // what each index expands to, as RGBA
+        unsigned char* indices = nullptr;   // width * height; free with stbi_image_free
+    };
+
+    // Decodes a palette PNG, or the first frame of a GIF, without expanding
+    // it. Returns 1 on success, 0 on a decode error (stbi_failure_reason()
+    // says why) and -1 when the file is anything else, which the caller
+    // should hand to stbi_load. Implemented in stb_image_impl.cpp.
+    int load(const char* path, Image* img);
+    int loadFromMemory(const unsigned char* data, size_t size, Image* img);
+
+    // luminance() of every palette entry.
+    void lumaTable(const Image& img, uint8_t lut[256]);
+
+    // renderAsciiInto of the expanded image, rows spread over up to
+    // `threads` pool threads.
+    void renderInto(const Image& img, GridSize grid, int threads, char* out);
+
+    // renderWithOptions of the expanded image.
+    void renderWithOptions(const Image& img, GridSize grid, const RenderOptions& opts, char* out);
+
+}
@@ -0,0 +1,383 @@
+#include "inflate.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace inflate {
+
+    namespace {
+
+        constexpr int kLitBits = 11;
+        constexpr int kDistBits = 8;
+        // Primary table plus room for the subtables of codes longer than
+        // the primary index (at most 912 and 512 entries for DEFLATE's
+        // 288 and 32 symbol alphabets).
+        constexpr size_t kLitTableSize = (size_t{1} << kLitBits) + 1024;
+        constexpr size_t kDistTableSize = (size_t{1} << kDistBits) + 512;
+
+        // Decode table entry: bits 0-4 hold the code bits to consume, 5-7
+        // the kind, 8-11 the extra bits that follow the code (or a
+        // subtable's index bits) and 12-31 the payload: literal byte(s),
+        // base length or distance, or subtable offset.
+        enum Kind : uint32_t { kInvalid = 0, kLiteral, kLiteralPair, kBase, kEnd, kSubtable };
+
+        constexpr uint32_t entry(uint32_t bits, uint32_t kind, uint32_t extra, uint32_t payload) {
+            return bits | kind << 5 | extra << 8 | payload << 12;
+        }
+        inline uint32_t bitsOf(uint32_t e) { return e & 31; }
+        inline uint32_t kindOf(uint32_t e) { return (e >> 5) & 7; }
+        inline uint32_t extraOf(uint32_t e) { return (e >> 8) & 15; }
+        inline uint32_t payloadOf(uint32_t e) { return e >> 12; }
+
+        const uint16_t kLengthBase[29] = {3,  4,  5,  6,  7,  8,  9,  10,  11,  13,  15,  17,  19,  23, 27,
+                                          31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        const uint8_t kLengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                          2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        const uint16_t kDistBase[30] = {1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+                                        193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+        const uint8_t kDistExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                        6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+        uint32_t litLenSymbol(int s) {
+            if (s < 256) return entry(0, kLiteral, 0, static_cast<uint32_t>(s));
+            if (s == 256) return entry(0, kEnd, 0, 0);
+            if (s < 286) return entry(0, kBase, kLengthExtra[s - 257], kLengthBase[s - 257]);
+            return entry(0, kInvalid, 0, 0);
+        }
+
+        uint32_t distSymbol(int s) {
+            return s < 30 ? entry(0, kBase, kDistExtra[s], kDistBase[s]) : entry(0, kInvalid, 0, 0);
+        }
+
+        uint32_t codeLengthSymbol(int s) { return entry(0, kLiteral, 0, static_cast<uint32_t>(s)); }
+
+        uint32_t reverse(uint32_t code, int length) {
+            uint32_t r = 0;
+            for (int i = 0; i < length; ++i, code >>= 1) r = r << 1 | (code & 1);
+            return r;
+        }
+
+        // Decode table for the canonical code with lengths[0, n): a primary
+        // table indexed by the next primaryBits input bits, then one
+        // subtable per primary slot whose codes are longer. Slots no code
+        // reaches stay kInvalid. False for an over-subscribed code.
+        bool build(const uint8_t* lengths, int n, int primaryBits, uint32_t (*meaning)(int), uint32_t* table,
+                   size_t capacity) {
+            int count[16] = {};
+            for (int s = 0; s < n; ++s) ++count[lengths[s]];
+            count[0] = 0;
+            int left = 1;
+            for (int len = 1; len <= 15; ++len) {
+                left = (left << 1) - count[len];
+                if (left < 0) return false;
+            }
+            uint32_t next[16] = {};
+            uint32_t code = 0;
+            for (int len = 1; len <= 15; ++len) {
+                code = (code + static_cast<uint32_t>(count[len - 1])) << 1;
+                next[len] = code;
+            }
+
+            const uint32_t primarySize = 1u << primaryBits;
+            std::fill(table, table + capacity, 0u);
+            uint32_t rev[288];
+            uint8_t subBits[1u << kLitBits] = {};
+            for (int s = 0; s < n; ++s) {
+                const int len = lengths[s];
+                if (len == 0) continue;
+                rev[s] = reverse(next[len]++, len);
+                if (len > primaryBits) {
+                    uint8_t& b = subBits[rev[s] & (primarySize - 1)];
+                    b = std::max(b, static_cast<uint8_t>(len - primaryBits));
+                }
+            }
+            size_t used = primarySize;
+            for (uint32_t p = 0; p < primarySize; ++p) {
+                if (subBits[p] == 0) continue;
+                if (used + (size_t{1} << subBits[p]) > capacity) return false;
+                table[p] = entry(static_cast<uint32_t>(primaryBits), kSubtable, subBits[p], static_cast<uint32_t>(used));
+                used += size_t{1} << subBits[p];
+            }
+            for (int s = 0; s < n; ++s) {
+                const int len = lengths[s];
+                if (len == 0) continue;
+                const uint32_t m = meaning(s);
+                if (len <= primaryBits) {
+                    for (uint32_t i = rev[s]; i < primarySize; i += 1u << len) table[i] = m | static_cast<uint32_t>(len);
+                } else {
+                    const uint32_t sub = table[rev[s] & (primarySize - 1)];
+                    const int step = len - primaryBits;
+                    for (uint32_t i = rev[s] >> primaryBits; i < (1u << extraOf(sub)); i += 1u << step) {
+                        table[payloadOf(sub) + i] = m | static_cast<uint32_t>(step);
+                    }
+                }
+            }
+            return true;
+        }
+
+        // Primary slots whose literal code leaves room for a whole second
+        // literal code within the same lookup decode both at once.
+        void pairLiterals(uint32_t* table) {
+            uint32_t single[1u << kLitBits];
+            std::memcpy(single, table, sizeof(single));
+            for (uint32_t i = 0; i < (1u << kLitBits); ++i) {
+                const uint32_t e = single[i];
+                if (kindOf(e) != kLiteral || bitsOf(e) >= kLitBits) continue;
+                const uint32_t second = single[i >> bitsOf(e)];
+                if (kindOf(second) == kLiteral && bitsOf(e) + bitsOf(second) <= kLitBits) {
+                    table[i] = entry(bitsOf(e) + bitsOf(second), kLiteralPair, 0,
+                                     payloadOf(e) | payloadOf(second) << 8);
+                }
+            }
+        }
+
+        struct Tables {
+            uint32_t lit[kLitTableSize];
+            uint32_t dist[kDistTableSize];
+        };
+
+        struct FixedTables : Tables {
+            FixedTables() {
+                uint8_t lengths[288];
+                std::fill(lengths, lengths + 144, 8);
+                std::fill(lengths + 144, lengths + 256, 9);
+                std::fill(lengths + 256, lengths + 280, 7);
+                std::fill(lengths + 280, lengths + 288, 8);
+                build(lengths, 288, kLitBits, litLenSymbol, lit, kLitTableSize);
+                pairLiterals(lit);
+                std::fill(lengths, lengths + 32, 5);
+                build(lengths, 32, kDistBits, distSymbol, dist, kDistTableSize);
+            }
+        };
+
+        // LSB-first bit reader. Bits above `count` may already hold the
+        // following input; refilling ORs the same bytes into the same
+        // places, so they never need clearing.
+        struct Bits {
+            const uint8_t* in;
+            const uint8_t* end;
+            uint64_t buf = 0;
+            unsigned count = 0;
+            unsigned padding = 0;   // zero bytes shifted in past the end of the input
+
+            Bits(const uint8_t* begin, const uint8_t* stop) : in(begin), end(stop) {}
+
+            // Leaves at least 56 bits in buf.
+            void refill() {
+                if (end - in >= 8) {
+                    uint64_t word;
+                    std::memcpy(&word, in, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                    word = __builtin_bswap64(word);
+#endif
+                    buf |= word << count;
+                    in += (63 - count) >> 3;
+                    count |= 56;
+                    return;
+                }
+                while (count <= 56) {
+                    if (in < end) buf |= static_cast<uint64_t>(*in++) << count;
+                    else ++padding;
+                    count += 8;
+                }
+            }
+
+            uint32_t peek(unsigned n) const { return static_cast<uint32_t>(buf & ((uint64_t{1} << n) - 1)); }
+
+            void consume(unsigned n) {
+                buf >>= n;
+                count -= n;
+            }
+
+            uint32_t take(unsigned n) {
+                const uint32_t v = peek(n);
+                consume(n);
+                return v;
+            }
+
+            // True once decoding has used bits that were never in the input.
+            bool overrun() const { return padding * 8 > count; }
+
+            // Drops the partial byte and hands whole buffered bytes back to
+            // the input, for stored blocks.
+            bool align() {
+                consume(count & 7);
+                const unsigned bytes = count >> 3;
+                if (padding > bytes) return false;
+                in -= bytes - padding;
+                buf = 0;
+                count = padding = 0;
+                return true;
+            }
+        };
+
+        bool readDynamicTables(Bits& b, Tables& t) {
+            static const uint8_t kOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+            b.refill();
+            const int nlit = static_cast<int>(b.take(5)) + 257;
+            const int ndist = static_cast<int>(b.take(5)) + 1;
+            const int nclen = static_cast<int>(b.take(4)) + 4;
+            uint8_t clen[19] = {};
+            for (int i = 0; i < nclen; ++i) {
+                b.refill();
+                clen[kOrder[i]] = static_cast<uint8_t>(b.take(3));
+            }
+            uint32_t clTable[128];
+            if (!build(clen, 19, 7, codeLengthSymbol, clTable, 128)) return false;
+
+            uint8_t lengths[288 + 32] = {};
+            const int total = nlit + ndist;
+            for (int n = 0; n < total;) {
+                b.refill();
+                const uint32_t e = clTable[b.peek(7)];
+                if (kindOf(e) != kLiteral) return false;
+                b.consume(bitsOf(e));
+                const uint32_t sym = payloadOf(e);
+                if (sym < 16) {
+                    lengths[n++] = static_cast<uint8_t>(sym);
+                    continue;
+                }
+                uint8_t value = 0;
+                int repeat = 0;
+                if (sym == 16) {
+                    if (n == 0) return false;
+                    value = lengths[n - 1];
+                    repeat = 3 + static_cast<int>(b.take(2));
+                } else if (sym == 17) {
+                    repeat = 3 + static_cast<int>(b.take(3));
+                } else {
+                    repeat = 11 + static_cast<int>(b.take(7));
+                }
+                if (n + repeat > total) return false;
+                std::memset(lengths + n, value, static_cast<size_t>(repeat));
+                n += repeat;
+            }
+            if (lengths[256] == 0 || b.overrun()) return false;
+            if (!build(lengths, nlit, kLitBits, litLenSymbol, t.lit, kLitTableSize)) return false;
+            pairLiterals(t.lit);
+            return build(lengths + nlit, ndist, kDistBits, distSymbol, t.dist, kDistTableSize);
+        }
+
+        // Copies a match that may overlap its own output. With 16 bytes of
+        // slack after it the copy runs in 8- or 16-byte steps, each reading
+        // only bytes that are already final.
+        inline void copyMatch(uint8_t* dst, size_t distance, size_t length, const uint8_t* end) {
+            const uint8_t* src = dst - distance;
+            uint8_t* const stop = dst + length;
+            if (end - stop >= 16) {
+                if (distance >= 16) {
+                    do {
+                        std::memcpy(dst, src, 16);
+                        dst += 16;
+                        src += 16;
+                    } while (dst < stop);
+                    return;
+                }
+                if (distance >= 8) {
+                    do {
+                        std::memcpy(dst, src, 8);
+                        dst += 8;
+                        src += 8;
+                    } while (dst < stop);
+                    return;
+                }
+                if (distance == 1) {
+                    std::memset(dst, *src, length);
+                    return;
+                }
+            }
+            do {
+                *dst++ = *src++;
+            } while (dst < stop);
+        }
+
+        // One Huffman-coded block. A refill leaves at least 56 bits, enough
+        // for the longest length code, its extra bits, distance code and
+        // distance extra bits (48).
+        bool decodeBlock(Bits& b, const Tables& t, uint8_t* begin, uint8_t*& dst, uint8_t* end) {
+            constexpr uint32_t litMask = (1u << kLitBits) - 1;
+            constexpr uint32_t distMask = (1u << kDistBits) - 1;
+            for (;;) {
+                b.refill();
+                uint32_t e = t.lit[b.buf & litMask];
+                if (kindOf(e) == kSubtable) {
+                    b.consume(kLitBits);
+                    e = t.lit[payloadOf(e) + b.peek(extraOf(e))];
+                }
+                b.consume(bitsOf(e));
+                const uint32_t kind = kindOf(e);
+                if (kind == kLiteral) {
+                    if (dst == end) return false;
+                    *dst++ = static_cast<uint8_t>(payloadOf(e));
+                    continue;
+                }
+                if (kind == kLiteralPair) {
+                    if (end - dst < 2) return false;
+                    dst[0] = static_cast<uint8_t>(payloadOf(e));
+                    dst[1] = static_cast<uint8_t>(payloadOf(e) >> 8);
+                    dst += 2;
+                    continue;
+                }
+                if (kind == kEnd) return !b.overrun();
+                if (kind != kBase || b.overrun()) return false;
+
+                const size_t length = payloadOf(e) + b.take(extraOf(e));
+                uint32_t d = t.dist[b.buf & distMask];
+                if (kindOf(d) == kSubtable) {
+                    b.consume(kDistBits);
+                    d = t.dist[payloadOf(d) + b.peek(extraOf(d))];
+                }
+                b.consume(bitsOf(d));
+                if (kindOf(d) != kBase) return false;
+                const size_t distance = payloadOf(d) + b.take(extraOf(d));
+                if (distance > static_cast<size_t>(dst - begin) || length > static_cast<size_t>(end - dst)) return false;
+                copyMatch(dst, distance, length, end);
+                dst += length;
+            }
+        }
+
+    }
+
+    long long decode(const uint8_t* in, size_t size, uint8_t* out, size_t capacity, bool zlibHeader) {
+        if (zlibHeader) {
+            if (size < 2) return -1;
+            const unsigned cmf = in[0], flg = in[1];
+            if ((cmf * 256 + flg) % 31 != 0 || (flg & 32) != 0 || (cmf & 15) != 8) return -1;
+            in += 2;
+            size -= 2;
+        }
+        static const FixedTables fixed;
+        Tables dynamic;
+        Bits b(in, in + size);
+        uint8_t* dst = out;
+        uint8_t* const end = out + capacity;
+        bool last = false;
+        do {
+            b.refill();
+            if (b.overrun()) return -1;
+            last = b.take(1) != 0;
+            const uint32_t type = b.take(2);
+            if (type == 0) {
+                if (!b.align() || b.end - b.in < 4) return -1;
+                const size_t length = static_cast<size_t>(b.in[0] | b.in[1] << 8);
+                const size_t inverse = static_cast<size_t>(b.in[2] | b.in[3] << 8);
+                b.in += 4;
+                if (length != (~inverse & 0xFFFF) || static_cast<size_t>(b.end - b.in) < length ||
+                    static_cast<size_t>(end - dst) < length) {
+                    return -1;
+                }
+                std::memcpy(dst, b.in, length);
+                b.in += length;
+                dst += length;
+            } else if (type == 1) {
+                if (!decodeBlock(b, fixed, out, dst, end)) return -1;
+            } else if (type == 2) {
+                if (!readDynamicTables(b, dynamic) || !decodeBlock(b, dynamic, out, dst, end)) return -1;
+            } else {
+                return -1;
+            }
+        } while (!last);
+        return dst - out;
+    }
+
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// DEFLATE / zlib decoder used for PNG image data. The caller supplies an
+// output buffer of known size (for PNG, exactly what the header implies),
+// so nothing is grown or copied while decoding. Input bits are refilled
+// 56 at a time from unaligned 64-bit loads, the literal/length table
+// resolves two short literals per lookup, and matches are copied 8 or 16
+// bytes at a time, overlapping their own output.
+namespace inflate {
+
+    // Decodes a zlib stream (raw DEFLATE when zlibHeader is false) into
+    // out[0, capacity). Returns the number of bytes written, or -1 when the
+    // stream is corrupt or would not fit. The Adler-32 trailer is not
+    // checked, matching stb_image.
+    long long decode(const uint8_t* in, size_t size, uint8_t* out, size_t capacity, bool zlibHeader);
+
+}
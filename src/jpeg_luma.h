@@ -0,0 +1,16 @@
+#pragma once
+
+// Greyscale decode for monochrome output. For YCbCr JPEGs whose luma plane
+// is stored at full resolution, the chroma components are still
+// entropy-decoded (the bitstream interleaves them) but never
+// inverse-transformed, upsampled or colour-converted; the Y plane is
+// returned as it comes out of the IDCT. Anything else is decoded by
+// stbi_load as usual, keeping its channels.
+//
+// Implemented in stb_image_impl.cpp, the translation unit that owns the
+// stb_image internals. The result is freed with stbi_image_free.
+namespace jpeg_luma {
+
+    unsigned char* load(const char* path, int* width, int* height, int* channels);
+
+}
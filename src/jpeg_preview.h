@@ -0,0 +1,21 @@
+#pragma once
+
+// Reduced-size decode of progressive JPEGs. Their first scans carry the
+// DC coefficient of every block, which is the block's mean: that alone is
+// the image at 1/8 scale. Only those scans are entropy-decoded, and the
+// AC refinement scans after them are never read. Grey, YCbCr and RGB
+// images are supported, colour converted as stb_image does; chroma
+// subsampled blocks are repeated.
+//
+// Implemented in stb_image_impl.cpp, the translation unit that owns the
+// stb_image internals. The result is freed with stbi_image_free.
+namespace jpeg_preview {
+
+    // The 1/8-scale image, ceil(w / 8) x ceil(h / 8) with one or three
+    // channels; the full size goes to fullWidth/fullHeight. Returns
+    // nullptr for baseline JPEGs, other formats and unsupported
+    // component layouts, as well as on errors.
+    unsigned char* load(const char* path, int* width, int* height, int* channels, int* fullWidth,
+                        int* fullHeight);
+
+}
@@ -0,0 +1,290 @@
+#include "jpeg_simd.h"
+
+#include <atomic>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define JPEG_SIMD_AVX2 1
+#include <immintrin.h>
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace jpeg_simd {
+
+    namespace {
+
+        std::atomic<bool> gEnabled{true};
+
+#if defined(JPEG_SIMD_AVX2)
+        // stbi__f2f, with the same float/double arithmetic.
+        constexpr short f2f(float x) { return static_cast<short>(static_cast<int>(x * 4096 + 0.5)); }
+
+        // 32-bit halves of eight 16-bit lanes per 128-bit lane, as the
+        // _l/_h pairs of stbi__idct_simd.
+        struct Wide {
+            __m256i l, h;
+        };
+
+        AVX2 inline __m256i dctConst(short x, short y) {
+            return _mm256_setr_epi16(x, y, x, y, x, y, x, y, x, y, x, y, x, y, x, y);
+        }
+
+        AVX2 inline void rot(Wide& out0, Wide& out1, __m256i x, __m256i y, __m256i c0, __m256i c1) {
+            const __m256i lo = _mm256_unpacklo_epi16(x, y), hi = _mm256_unpackhi_epi16(x, y);
+            out0 = {_mm256_madd_epi16(lo, c0), _mm256_madd_epi16(hi, c0)};
+            out1 = {_mm256_madd_epi16(lo, c1), _mm256_madd_epi16(hi, c1)};
+        }
+
+        AVX2 inline Wide widen(__m256i in) {
+            const __m256i zero = _mm256_setzero_si256();
+            return {_mm256_srai_epi32(_mm256_unpacklo_epi16(zero, in), 4),
+                    _mm256_srai_epi32(_mm256_unpackhi_epi16(zero, in), 4)};
+        }
+
+        AVX2 inline Wide add(const Wide& a, const Wide& b) {
+            return {_mm256_add_epi32(a.l, b.l), _mm256_add_epi32(a.h, b.h)};
+        }
+
+        AVX2 inline Wide sub(const Wide& a, const Wide& b) {
+            return {_mm256_sub_epi32(a.l, b.l), _mm256_sub_epi32(a.h, b.h)};
+        }
+
+        template <int Shift>
+        AVX2 inline void butterfly(__m256i& out0, __m256i& out1, const Wide& a, const Wide& b, __m256i bias) {
+            const Wide biased{_mm256_add_epi32(a.l, bias), _mm256_add_epi32(a.h, bias)};
+            const Wide sum = add(biased, b), dif = sub(biased, b);
+            out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum.l, Shift), _mm256_srai_epi32(sum.h, Shift));
+            out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif.l, Shift), _mm256_srai_epi32(dif.h, Shift));
+        }
+
+        AVX2 inline void interleave16(__m256i& a, __m256i& b) {
+            const __m256i t = a;
+            a = _mm256_unpacklo_epi16(a, b);
+            b = _mm256_unpackhi_epi16(t, b);
+        }
+
+        AVX2 inline void interleave8(__m256i& a, __m256i& b) {
+            const __m256i t = a;
+            a = _mm256_unpacklo_epi8(a, b);
+            b = _mm256_unpackhi_epi8(t, b);
+        }
+
+        // One 1-D pass of stbi__idct_simd over eight rows.
+        template <int Shift>
+        AVX2 inline void idctPass(__m256i* row, __m256i bias) {
+            const __m256i rot0_0 = dctConst(f2f(0.5411961f), f2f(0.5411961f) + f2f(-1.847759065f));
+            const __m256i rot0_1 = dctConst(f2f(0.5411961f) + f2f(0.765366865f), f2f(0.5411961f));
+            const __m256i rot1_0 = dctConst(f2f(1.175875602f) + f2f(-0.899976223f), f2f(1.175875602f));
+            const __m256i rot1_1 = dctConst(f2f(1.175875602f), f2f(1.175875602f) + f2f(-2.562915447f));
+            const __m256i rot2_0 = dctConst(f2f(-1.961570560f) + f2f(0.298631336f), f2f(-1.961570560f));
+            const __m256i rot2_1 = dctConst(f2f(-1.961570560f), f2f(-1.961570560f) + f2f(3.072711026f));
+            const __m256i rot3_0 = dctConst(f2f(-0.390180644f) + f2f(2.053119869f), f2f(-0.390180644f));
+            const __m256i rot3_1 = dctConst(f2f(-0.390180644f), f2f(-0.390180644f) + f2f(1.501321110f));
+
+            // even part
+            Wide t2e, t3e;
+            rot(t2e, t3e, row[2], row[6], rot0_0, rot0_1);
+            const Wide t0e = widen(_mm256_add_epi16(row[0], row[4]));
+            const Wide t1e = widen(_mm256_sub_epi16(row[0], row[4]));
+            const Wide x0 = add(t0e, t3e), x3 = sub(t0e, t3e);
+            const Wide x1 = add(t1e, t2e), x2 = sub(t1e, t2e);
+            // odd part
+            Wide y0o, y2o, y1o, y3o, y4o, y5o;
+            rot(y0o, y2o, row[7], row[3], rot2_0, rot2_1);
+            rot(y1o, y3o, row[5], row[1], rot3_0, rot3_1);
+            rot(y4o, y5o, _mm256_add_epi16(row[1], row[7]), _mm256_add_epi16(row[3], row[5]), rot1_0, rot1_1);
+            const Wide x4 = add(y0o, y4o), x5 = add(y1o, y5o), x6 = add(y2o, y5o), x7 = add(y3o, y4o);
+            butterfly<Shift>(row[0], row[7], x0, x7, bias);
+            butterfly<Shift>(row[1], row[6], x1, x6, bias);
+            butterfly<Shift>(row[2], row[5], x2, x5, bias);
+            butterfly<Shift>(row[3], row[4], x3, x4, bias);
+        }
+
+        AVX2 inline void storeBlock(uint8_t* out, int stride, __m128i p0, __m128i p1, __m128i p2, __m128i p3) {
+            const __m128i rows[] = {p0, p2, p1, p3};
+            for (const __m128i& r : rows) {
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out), r);
+                out += stride;
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi32(r, 0x4e));
+                out += stride;
+            }
+        }
+
+        AVX2 void idct2(uint8_t* outA, int strideA, const short* a, uint8_t* outB, int strideB, const short* b) {
+            __m256i row[8];
+            for (int r = 0; r < 8; ++r) {
+                row[r] = _mm256_inserti128_si256(
+                    _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + r * 8))),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + r * 8)), 1);
+            }
+
+            // column pass, 16-bit transpose, row pass
+            idctPass<10>(row, _mm256_set1_epi32(512));
+            interleave16(row[0], row[4]);
+            interleave16(row[1], row[5]);
+            interleave16(row[2], row[6]);
+            interleave16(row[3], row[7]);
+            interleave16(row[0], row[2]);
+            interleave16(row[1], row[3]);
+            interleave16(row[4], row[6]);
+            interleave16(row[5], row[7]);
+            interleave16(row[0], row[1]);
+            interleave16(row[2], row[3]);
+            interleave16(row[4], row[5]);
+            interleave16(row[6], row[7]);
+            idctPass<17>(row, _mm256_set1_epi32(65536 + (128 << 17)));
+
+            // pack and 8-bit transpose
+            __m256i p0 = _mm256_packus_epi16(row[0], row[1]);
+            __m256i p1 = _mm256_packus_epi16(row[2], row[3]);
+            __m256i p2 = _mm256_packus_epi16(row[4], row[5]);
+            __m256i p3 = _mm256_packus_epi16(row[6], row[7]);
+            interleave8(p0, p2);
+            interleave8(p1, p3);
+            interleave8(p0, p1);
+            interleave8(p2, p3);
+            interleave8(p0, p2);
+            interleave8(p1, p3);
+
+            storeBlock(outA, strideA, _mm256_castsi256_si128(p0), _mm256_castsi256_si128(p1),
+                       _mm256_castsi256_si128(p2), _mm256_castsi256_si128(p3));
+            storeBlock(outB, strideB, _mm256_extracti128_si256(p0, 1), _mm256_extracti128_si256(p1, 1),
+                       _mm256_extracti128_si256(p2, 1), _mm256_extracti128_si256(p3, 1));
+        }
+
+        AVX2 inline __m256i load(const uint8_t* p) {
+            return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+        }
+
+        // 3 * near + far for 16 pixels from i.
+        AVX2 inline __m256i vertical(const uint8_t* near, const uint8_t* far, int i) {
+            const __m256i n = load(near + i), f = load(far + i);
+            return _mm256_add_epi16(_mm256_add_epi16(n, _mm256_slli_epi16(n, 1)), f);
+        }
+
+        // Every output pixel is (3 * t[i] + t[neighbour] + 8) >> 4 with
+        // t = 3 * near + far; the two ends, with no outer neighbour,
+        // reduce to (t + 2) >> 2 as in stb.
+        AVX2 uint8_t* upsampleHv2(uint8_t* out, uint8_t* near, uint8_t* far, int w, int) {
+            auto t = [&](int i) { return 3 * near[i] + far[i]; };
+            if (w == 1) {
+                out[0] = out[1] = static_cast<uint8_t>((t(0) + 2) >> 2);
+                return out;
+            }
+            auto pixel = [&](int i) {
+                const int c = 3 * t(i) + 8;
+                out[i * 2] = static_cast<uint8_t>(i == 0 ? (t(0) + 2) >> 2 : (c + t(i - 1)) >> 4);
+                out[i * 2 + 1] = static_cast<uint8_t>(i == w - 1 ? (t(i) + 2) >> 2 : (c + t(i + 1)) >> 4);
+            };
+            pixel(0);
+            int i = 1;
+            const __m256i bias = _mm256_set1_epi16(8);
+            for (; i + 17 <= w; i += 16) {
+                const __m256i curr = vertical(near, far, i);
+                const __m256i c = _mm256_add_epi16(_mm256_add_epi16(curr, _mm256_slli_epi16(curr, 1)), bias);
+                const __m256i even = _mm256_srli_epi16(_mm256_add_epi16(c, vertical(near, far, i - 1)), 4);
+                const __m256i odd = _mm256_srli_epi16(_mm256_add_epi16(c, vertical(near, far, i + 1)), 4);
+                // Within each 128-bit lane, pixels 0-3 then 4-7 of that lane.
+                const __m256i packed =
+                    _mm256_packus_epi16(_mm256_unpacklo_epi16(even, odd), _mm256_unpackhi_epi16(even, odd));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i * 2), packed);
+            }
+            for (; i < w; ++i) pixel(i);
+            return out;
+        }
+
+        // stbi__float2fixed
+        constexpr int float2fixed(float x) { return static_cast<int>(x * 4096.0f + 0.5f) << 8; }
+
+        AVX2 void ycbcrToRgb(uint8_t* out, const uint8_t* y, const uint8_t* pcb, const uint8_t* pcr, int count,
+                             int step) {
+            int i = 0;
+            if (step == 3 || step == 4) {
+                const __m256i signflip = _mm256_set1_epi16(0x80);
+                const __m256i crConst0 = _mm256_set1_epi16(static_cast<short>(1.40200f * 4096.0f + 0.5f));
+                const __m256i crConst1 = _mm256_set1_epi16(-static_cast<short>(0.71414f * 4096.0f + 0.5f));
+                const __m256i cbConst0 = _mm256_set1_epi16(-static_cast<short>(0.34414f * 4096.0f + 0.5f));
+                const __m256i cbConst1 = _mm256_set1_epi16(static_cast<short>(1.77200f * 4096.0f + 0.5f));
+                const __m256i yBias = _mm256_set1_epi16(128);
+                const __m256i xw = _mm256_set1_epi16(255);
+                const __m256i rgbOnly = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                                         0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+                for (; i + 16 <= count; i += 16) {
+                    // The words of stb's unpacks: y << 8 | 128, and the
+                    // re-centred chroma << 8.
+                    const __m256i yw = _mm256_or_si256(_mm256_slli_epi16(load(y + i), 8), yBias);
+                    const __m256i crw = _mm256_slli_epi16(_mm256_xor_si256(load(pcr + i), signflip), 8);
+                    const __m256i cbw = _mm256_slli_epi16(_mm256_xor_si256(load(pcb + i), signflip), 8);
+
+                    const __m256i yws = _mm256_srli_epi16(yw, 4);
+                    const __m256i rws = _mm256_add_epi16(_mm256_mulhi_epi16(crConst0, crw), yws);
+                    const __m256i gwt = _mm256_add_epi16(_mm256_mulhi_epi16(cbConst0, cbw), yws);
+                    const __m256i bws = _mm256_add_epi16(yws, _mm256_mulhi_epi16(cbw, cbConst1));
+                    const __m256i gws = _mm256_add_epi16(gwt, _mm256_mulhi_epi16(crw, crConst1));
+                    const __m256i rw = _mm256_srai_epi16(rws, 4);
+                    const __m256i bw = _mm256_srai_epi16(bws, 4);
+                    const __m256i gw = _mm256_srai_epi16(gws, 4);
+
+                    // Per 128-bit lane: pixels 0-3 in o0, 4-7 in o1, as RGBX.
+                    const __m256i brb = _mm256_packus_epi16(rw, bw);
+                    const __m256i gxb = _mm256_packus_epi16(gw, xw);
+                    const __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+                    const __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+                    const __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+                    const __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+                    if (step == 4) {
+                        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_permute2x128_si256(o0, o1, 0x20));
+                        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 32),
+                                            _mm256_permute2x128_si256(o0, o1, 0x31));
+                        out += 64;
+                        continue;
+                    }
+                    // Squeeze each four pixels to 12 bytes and butt them
+                    // together into three stores.
+                    const __m256i s0 = _mm256_shuffle_epi8(o0, rgbOnly), s1 = _mm256_shuffle_epi8(o1, rgbOnly);
+                    const __m128i c0 = _mm256_castsi256_si128(s0), c1 = _mm256_castsi256_si128(s1);
+                    const __m128i c2 = _mm256_extracti128_si256(s0, 1), c3 = _mm256_extracti128_si256(s1, 1);
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_or_si128(c0, _mm_slli_si128(c1, 12)));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16),
+                                     _mm_or_si128(_mm_srli_si128(c1, 4), _mm_slli_si128(c2, 8)));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 32),
+                                     _mm_or_si128(_mm_srli_si128(c2, 8), _mm_slli_si128(c3, 4)));
+                    out += 48;
+                }
+            }
+            for (; i < count; ++i) {
+                const int yFixed = (y[i] << 20) + (1 << 19);
+                const int cr = pcr[i] - 128, cb = pcb[i] - 128;
+                int r = yFixed + cr * float2fixed(1.40200f);
+                int g = yFixed + cr * -float2fixed(0.71414f) +
+                        (static_cast<int>(cb * -float2fixed(0.34414f)) & 0xffff0000);
+                int b = yFixed + cb * float2fixed(1.77200f);
+                r >>= 20;
+                g >>= 20;
+                b >>= 20;
+                if (static_cast<unsigned>(r) > 255) r = r < 0 ? 0 : 255;
+                if (static_cast<unsigned>(g) > 255) g = g < 0 ? 0 : 255;
+                if (static_cast<unsigned>(b) > 255) b = b < 0 ? 0 : 255;
+                out[0] = static_cast<uint8_t>(r);
+                out[1] = static_cast<uint8_t>(g);
+                out[2] = static_cast<uint8_t>(b);
+                if (step == 4) out[3] = 255;
+                out += step;
+            }
+        }
+
+        const Kernels kAvx2{idct2, upsampleHv2, ycbcrToRgb};
+#endif
+
+    }
+
+    const Kernels* avx2() {
+#if defined(JPEG_SIMD_AVX2)
+        static const bool supported = __builtin_cpu_supports("avx2");
+        if (supported && gEnabled.load(std::memory_order_relaxed)) return &kAvx2;
+#endif
+        return nullptr;
+    }
+
+    void setEnabled(bool on) { gEnabled.store(on, std::memory_order_relaxed); }
+
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+
+// AVX2 kernels for the JPEG decoder, picked at run time from the CPU's
+// feature flags. Each is a lane-for-lane widening of stb_image's SSE2
+// kernel (or its scalar edges), so the pixels are identical to stbi_load:
+// the IDCT transforms two blocks per call, one per 128-bit lane, and the
+// upsampler and colour converter handle 16 pixels per step.
+namespace jpeg_simd {
+
+    struct Kernels {
+        // stbi__idct_simd on blocks a and b.
+        void (*idct2)(uint8_t* outA, int strideA, const short* a, uint8_t* outB, int strideB, const short* b);
+        // stbi__resample_row_hv_2 (2x2 chroma upsampling); returns out.
+        uint8_t* (*upsampleHv2)(uint8_t* out, uint8_t* near, uint8_t* far, int w, int hs);
+        // stbi__YCbCr_to_RGB_row for step 3 and 4.
+        void (*ycbcrToRgb)(uint8_t* out, const uint8_t* y, const uint8_t* cb, const uint8_t* cr, int count,
+                           int step);
+    };
+
+    // The AVX2 kernels, or nullptr when the CPU (or the compiler) lacks
+    // AVX2 or they have been switched off.
+    const Kernels* avx2();
+
+    // On by default; off makes avx2() return nullptr (for benchmarking).
+    void setEnabled(bool on);
+
+}
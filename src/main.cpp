@@ -1,10 +1,37 @@
-#define STB_IMAGE_IMPLEMENTATION
+#include "alloc_trace.h"
+#include "autotune.h"
+#include "batch.h"
+#include "decode.h"
+#include "frame_stream.h"
+#include "hugepages.h"
+#include "indexed.h"
+#include "jpeg_luma.h"
+#include "jpeg_preview.h"
+#include "jpeg_simd.h"
+#include "metrics.h"
+#include "montage.h"
+#include "orientation.h"
+#include "palette.h"
+#include "perf_counters.h"
+#include "playback.h"
+#include "pyramid.h"
+#include "quadrant.h"
+#include "quality.h"
+#include "render.h"
+#include "server.h"
+#include "stream_output.h"
+#include "thread_pool.h"
 #include "stb_image.h"
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <vector>
 #include <string>
-#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <cstdint>
 
 #if defined(__unix__) || defined(__APPLE__)
@@ -29,83 +56,779 @@ static TermSize getTerminalSize() {
     return ts;
 }
 
-static inline uint8_t clampU8(int v) {
-    if (v < 0) return 0;
-    if (v > 255) return 255;
-    return static_cast<uint8_t>(v);
+// Runs the staged pipeline with hardware counters around each stage and
+// reports them on stderr; the rendered image still goes to stdout.
+static int runPerfCounters(const std::string& path, int termCols) {
+    perf::StageCounters counters;
+
+    int width = 0, height = 0, channels = 0;
+    counters.begin("decode");
+    stbi_uc* img = decode::load(path.c_str(), &width, &height, &channels, 0);
+    counters.end();
+    if (img == nullptr) {
+        std::cerr << "Error loading image: " << stbi_failure_reason() << "\n";
+        std::cerr << "Tried: " << path << "\n";
+        return 1;
+    }
+
+    GridSize grid = computeGrid(width, height, termCols);
+    ImageView view{img, width, height, channels};
+    const size_t cells = static_cast<size_t>(grid.cols) * grid.rows;
+    std::vector<unsigned char> samples(cells * static_cast<size_t>(channels));
+    std::vector<uint8_t> lum(cells);
+    std::string text(renderedSize(grid), '\n');
+
+    counters.begin("resample");
+    resampleGrid(view, grid, samples.data());
+    counters.end();
+    counters.begin("luminance");
+    luminanceGrid(samples.data(), channels, cells, lum.data());
+    counters.end();
+    counters.begin("glyph");
+    glyphGrid(lum.data(), grid, &text[0]);
+    counters.end();
+    counters.begin("output");
+    std::cout.write(text.data(), static_cast<std::streamsize>(text.size()));
+    std::cout.flush();
+    counters.end();
+
+    stbi_image_free(img);
+    counters.report(cells);
+    return 0;
 }
 
+// Times every decode variant over each file, read into memory first, and
+// reports MB/s of decoded pixels (width * height * components) at the
+// median of `iterations` runs.
+static int runDecodeBench(const std::vector<std::string>& paths, int iterations) {
+    iterations = std::max(1, iterations);
+    for (const std::string& path : paths) {
+        std::vector<unsigned char> file;
+        if (std::FILE* f = std::fopen(path.c_str(), "rb")) {
+            unsigned char buf[65536];
+            for (size_t n; (n = std::fread(buf, 1, sizeof(buf), f)) > 0;) file.insert(file.end(), buf, buf + n);
+            std::fclose(f);
+        }
+        int width = 0, height = 0, channels = 0;
+        if (stbi_info_from_memory(file.data(), static_cast<int>(file.size()), &width, &height, &channels) == 0) {
+            std::cerr << "Error loading image: " << stbi_failure_reason() << "\n";
+            std::cerr << "Tried: " << path << "\n";
+            return 1;
+        }
+        const double bytes = static_cast<double>(width) * height * channels;
+        std::cerr << path << ": " << width << "x" << height << "x" << channels << ", " << iterations
+                  << " iterations\n";
 
-static inline uint8_t luminance(const unsigned char* p, int channels) {
+        std::vector<uint8_t> plane;
+        struct Variant {
+            const char* name;
+            bool simd;
+            std::function<unsigned char*(int*, int*, int*)> run;
+        };
+        const Variant variants[] = {
+            {"stbi_load", false,
+             [&](int* w, int* h, int* c) {
+                 return stbi_load_from_memory(file.data(), static_cast<int>(file.size()), w, h, c, 0);
+             }},
+            {"decode", false,
+             [&](int* w, int* h, int* c) { return decode::loadFromMemory(file.data(), file.size(), w, h, c, 0); }},
+            {"decode avx2", true,
+             [&](int* w, int* h, int* c) { return decode::loadFromMemory(file.data(), file.size(), w, h, c, 0); }},
+            {"decode + luminance", true,
+             [&](int* w, int* h, int* c) {
+                 unsigned char* pixels = decode::loadFromMemory(file.data(), file.size(), w, h, c, 0);
+                 if (pixels != nullptr) {
+                     plane.resize(static_cast<size_t>(*w) * *h);
+                     luminancePlane(ImageView{pixels, *w, *h, *c}, plane.data());
+                 }
+                 return pixels;
+             }},
+            {"fused luminance", true,
+             [&](int* w, int* h, int*) { return decode::loadLuminanceFromMemory(file.data(), file.size(), w, h); }},
+        };
+        for (const Variant& v : variants) {
+            jpeg_simd::setEnabled(v.simd);
+            std::vector<double> ms;
+            for (int i = 0; i < iterations; ++i) {
+                int w = 0, h = 0, c = 0;
+                const auto t0 = std::chrono::steady_clock::now();
+                unsigned char* out = v.run(&w, &h, &c);
+                const auto t1 = std::chrono::steady_clock::now();
+                if (out == nullptr) {
+                    std::cerr << v.name << ": " << stbi_failure_reason() << "\n";
+                    return 1;
+                }
+                stbi_image_free(out);
+                ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+            }
+            std::sort(ms.begin(), ms.end());
+            const double median = ms[ms.size() / 2];
+            std::fprintf(stderr, "  %-20s min %8.2f ms  median %8.2f ms  %8.1f MB/s\n", v.name, ms.front(), median,
+                         bytes / (median * 1000.0));
+        }
+        jpeg_simd::setEnabled(true);
+    }
+    return 0;
+}
+
+struct OneShotSettings {
+    RenderOptions renderOpts;
+    int threads;
+    bool retune;
+    bool traceAlloc;
+    bool hugePages;
+    bool jpegLuma;
+    bool jpegPreview;
+    bool stream;
+    int streamChunkRows;
+    bool quadrants;
+    int paletteColours;
+    orient::Transform transform;
+    int termCols;
+    pyramid::Region region;
+};
+
+static void reportFaults(const char* stage, const hugepages::Faults& before) {
+    const hugepages::Faults now = hugepages::faults();
+    std::cerr << "hugepages: " << stage << " +" << (now.minor - before.minor) << " minor, +"
+              << (now.major - before.major) << " major faults\n";
+}
 
-    float r = 0.f, g = 0.f, b = 0.f, a = 1.f;
-    if (channels == 1) {
+static bool isDefault(const RenderOptions& opts) {
+    return opts.sampling == Sampling::Nearest && opts.dither == Dither::None && opts.glyphs == GlyphMatch::Ramp;
+}
 
-        r = g = b = p[0] / 255.0f;
-    } else if (channels == 2) {
+static void writeText(const std::string& text) {
+    {
+        metrics::ScopedTimer timer(metrics::Stage::Write);
+        std::cout.write(text.data(), static_cast<std::streamsize>(text.size()));
+        std::cout.flush();
+    }
+    metrics::add(metrics::Counter::Images);
+    metrics::add(metrics::Counter::BytesOut, text.size());
+}
 
-        float gray = p[0] / 255.0f;
-        a = p[1] / 255.0f;
-        r = g = b = gray * a;
-    } else if (channels >= 3) {
-        r = p[0] / 255.0f;
-        g = p[1] / 255.0f;
-        b = p[2] / 255.0f;
-        if (channels >= 4) {
-            a = p[3] / 255.0f;
-            r *= a; g *= a; b *= a;
+// renderImageFile for palette PNGs and GIFs, rendered from their indices.
+// Returns -1, having written nothing, for any other kind of file.
+static int renderIndexedFile(const std::string& path, const OneShotSettings& s) {
+    indexed::Image img;
+    int status = -1;
+    {
+        metrics::ScopedTimer timer(metrics::Stage::Decode);
+        alloc_trace::reset();
+        status = indexed::load(path.c_str(), &img);
+    }
+    if (status < 0) return -1;
+    if (s.traceAlloc) {
+        alloc_trace::report(path, static_cast<uint64_t>(img.width) * img.height);
+    }
+    if (status == 0) {
+        std::cerr << "Error loading image: " << stbi_failure_reason() << "\n";
+        std::cerr << "Tried: " << path << "\n";
+        metrics::add(metrics::Counter::Errors);
+        return 1;
+    }
+
+    const GridSize grid = computeGrid(img.width, img.height, s.termCols);
+    std::string text(renderedSize(grid), '\n');
+    {
+        metrics::ScopedTimer timer(metrics::Stage::Render);
+        if (isDefault(s.renderOpts)) {
+            indexed::renderInto(img, grid, s.threads > 0 ? s.threads : ThreadPool::shared().size(), &text[0]);
+        } else {
+            indexed::renderWithOptions(img, grid, s.renderOpts, &text[0]);
         }
     }
-    float Y = 0.2126f * r + 0.7152f * g + 0.0722f * b;
-    int yi = static_cast<int>(std::round(Y * 255.0f));
-    return clampU8(yi);
+    writeText(text);
+    stbi_image_free(img.indices);
+    return 0;
 }
 
-int main(int argc, char** argv) {
-    std::string path = "PUT_YOUR_IMAGE_PATH_HERE.png";
-    if (argc > 1) path = argv[1];
+// renderImageFile for area sampling of an upright image. Each row is
+// reduced to luminance and added into the cell sums as the decoder hands it
+// over (decode::decodeRows), so neither the image nor its luminance plane
+// is ever stored. Returns -1, having written nothing, when the image has an
+// EXIF rotation.
+static int renderLuminanceFile(const std::string& path, const OneShotSettings& s) {
+    if (!orient::fromExif(orient::exifOrientationOfFile(path)).identity()) return -1;
+    GridSize grid{0, 0};
+    std::unique_ptr<BoxAccumulator> cells;
+    std::vector<uint8_t> lumRow;
+    int channels = 0;
+    bool ok = false;
+    {
+        metrics::ScopedTimer timer(metrics::Stage::Decode);
+        alloc_trace::reset();
+        const decode::RowSink sink{
+            [&](int width, int height, int n) {
+                grid = computeGrid(width, height, s.termCols);
+                const ImageView view{nullptr, width, height, n};
+                cells = std::make_unique<BoxAccumulator>(width, height, cellWidth(view, grid) * grid.cols,
+                                                         cellHeight(view, grid) * grid.rows, grid.cols, grid.rows);
+                lumRow.resize(static_cast<size_t>(width));
+                channels = n;
+                return true;
+            },
+            [&](int y, const unsigned char* pixels) {
+                luminanceGrid(pixels, channels, lumRow.size(), lumRow.data());
+                cells->addRow(y, lumRow.data());
+            }};
+        ok = decode::decodeRows(path.c_str(), sink);
+    }
+    if (s.traceAlloc) {
+        alloc_trace::report(path, ok ? static_cast<uint64_t>(grid.cols) * grid.rows : 0);
+    }
+    if (!ok) {
+        std::cerr << "Error loading image: " << stbi_failure_reason() << "\n";
+        std::cerr << "Tried: " << path << "\n";
+        metrics::add(metrics::Counter::Errors);
+        return 1;
+    }
+
+    std::string text(renderedSize(grid), '\n');
+    {
+        metrics::ScopedTimer timer(metrics::Stage::Render);
+        std::vector<uint8_t> lum(static_cast<size_t>(grid.cols) * grid.rows);
+        cells->finish(lum.data());
+        mapGlyphs(lum.data(), grid, s.renderOpts.dither, s.renderOpts.glyphs, &text[0]);
+    }
+    writeText(text);
+    return 0;
+}
+
+// renderImageFile for a pyramid file (--build-pyramid). The level closest
+// to the cell size is sampled in place, through the stored EXIF orientation
+// and --rotate / --flip, so only the tiles under the cells are paged in,
+// however large the image.
+static int renderPyramidFile(const std::string& path, const OneShotSettings& s) {
+    const auto start = std::chrono::steady_clock::now();
+    pyramid::File file;
+    std::string error;
+    bool ok = false;
+    {
+        metrics::ScopedTimer timer(metrics::Stage::Decode);
+        ok = file.open(path, &error);
+    }
+    if (!ok) {
+        std::cerr << "Error loading pyramid: " << error << "\n";
+        std::cerr << "Tried: " << path << "\n";
+        metrics::add(metrics::Counter::Errors);
+        return 1;
+    }
+
+    const orient::Transform orientation = orient::compose(orient::fromExif(file.orientation()), s.transform);
+    const pyramid::Region region = pyramid::clampRegion(file, orientation, s.region);
+    const GridSize grid = computeGrid(region.width, region.height, s.termCols);
+    const int level = pyramid::levelFor(file, region, grid);
+    std::string text(renderedSize(grid), '\n');
+    size_t tiles = 0;
+    {
+        metrics::ScopedTimer timer(metrics::Stage::Render);
+        std::vector<uint8_t> lum(static_cast<size_t>(grid.cols) * grid.rows);
+        tiles = pyramid::sampleLuminance(file, orientation, region, grid, level, lum.data());
+        mapGlyphs(lum.data(), grid, s.renderOpts.dither, s.renderOpts.glyphs, &text[0]);
+    }
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "pyramid: level " << level << " of " << file.levelCount() << " (" << file.level(level).width << "x"
+              << file.level(level).height << "), " << tiles << " tiles read, " << ms << " ms\n";
+    writeText(text);
+    return 0;
+}
+
+// The option a pyramid input cannot honour, or nullptr. Pyramids are
+// sampled nearest into luminance, so only --dither and --glyphs apply.
+static const char* unsupportedByPyramid(const OneShotSettings& s) {
+    if (s.renderOpts.sampling != Sampling::Nearest) return "--sampling area";
+    if (s.quadrants) return "--quadrants";
+    if (s.paletteColours > 0) return "--palette";
+    if (s.stream) return "--stream";
+    if (s.jpegLuma) return "--jpeg-luma";
+    if (s.jpegPreview) return "--jpeg-preview";
+    return nullptr;
+}
+
+// The option --stream cannot honour, or nullptr. Streaming renders the
+// default ASCII ramp chunk by chunk; the other modes need the whole image.
+static const char* unsupportedByStream(const OneShotSettings& s) {
+    if (s.renderOpts.sampling != Sampling::Nearest) return "--sampling area";
+    if (s.renderOpts.dither != Dither::None) return "--dither";
+    if (s.renderOpts.glyphs != GlyphMatch::Ramp) return "--glyphs";
+    if (s.quadrants) return "--quadrants";
+    if (s.paletteColours > 0) return "--palette";
+    return nullptr;
+}
+
+// The option --output-archive, --montage and --play cannot honour, or
+// nullptr. They take --sampling, --dither, --glyphs, --rotate and --flip;
+// the rest only mean something for one picture written to the terminal.
+static const char* unsupportedByMultiImage(const OneShotSettings& s) {
+    if (s.quadrants) return "--quadrants";
+    if (s.paletteColours > 0) return "--palette";
+    if (s.stream) return "--stream";
+    if (s.jpegLuma) return "--jpeg-luma";
+    if (s.jpegPreview) return "--jpeg-preview";
+    if (s.region.width > 0) return "--region";
+    return nullptr;
+}
+
+// The DC image of a progressive JPEG, when the grid it would be rendered
+// at has at most one cell per 8 source pixels along each axis; *grid is
+// set to that grid. nullptr otherwise.
+static stbi_uc* loadPreview(const std::string& path, const OneShotSettings& s, int* width, int* height,
+                            int* channels, GridSize* grid) {
+    int fullWidth = 0, fullHeight = 0, fullChannels = 0;
+    if (!stbi_info(path.c_str(), &fullWidth, &fullHeight, &fullChannels)) return nullptr;
+    const orient::Transform orientation =
+        orient::compose(orient::fromExif(orient::exifOrientationOfFile(path)), s.transform);
+    int displayWidth = 0, displayHeight = 0;
+    orient::displaySize(ImageView{nullptr, fullWidth, fullHeight, fullChannels}, orientation, &displayWidth,
+                        &displayHeight);
+    const GridSize full = computeGrid(displayWidth, displayHeight, s.termCols);
+    if (full.cols * 8 > displayWidth || full.rows * 8 > displayHeight) return nullptr;
+    stbi_uc* img = jpeg_preview::load(path.c_str(), width, height, channels, &fullWidth, &fullHeight);
+    if (img != nullptr) *grid = full;
+    return img;
+}
 
+// Decodes, renders and writes one image to stdout.
+static int renderImageFile(const std::string& path, const OneShotSettings& s) {
+    GridSize previewGrid{0, 0};
     int width = 0, height = 0, channels = 0;
-    stbi_uc* img = stbi_load(path.c_str(), &width, &height, &channels, 0);
+    stbi_uc* img = nullptr;
+    if (s.jpegPreview) {
+        metrics::ScopedTimer timer(metrics::Stage::Decode);
+        img = loadPreview(path, s, &width, &height, &channels, &previewGrid);
+    }
+
+    // Palette images stay at one byte per pixel when the output is ASCII.
+    if (img == nullptr && !s.jpegLuma && !s.stream && !s.quadrants && s.paletteColours == 0 &&
+        s.transform.identity()) {
+        const int status = renderIndexedFile(path, s);
+        if (status >= 0) return status;
+        if (s.renderOpts.sampling == Sampling::Area) {
+            const int lumaStatus = renderLuminanceFile(path, s);
+            if (lumaStatus >= 0) return lumaStatus;
+        }
+    }
+
+    const hugepages::Faults beforeDecode = hugepages::faults();
+    if (img == nullptr) {
+        metrics::ScopedTimer timer(metrics::Stage::Decode);
+        alloc_trace::reset();
+        img = s.jpegLuma ? jpeg_luma::load(path.c_str(), &width, &height, &channels)
+                         : decode::load(path.c_str(), &width, &height, &channels, 0);
+    }
+    if (s.traceAlloc) {
+        alloc_trace::report(path, img ? static_cast<uint64_t>(width) * height * channels : 0);
+    }
     if (img == nullptr) {
         std::cerr << "Error loading image: " << stbi_failure_reason() << "\n";
         std::cerr << "Tried: " << path << "\n";
+        metrics::add(metrics::Counter::Errors);
         return 1;
     }
+    if (s.hugePages) reportFaults("decode", beforeDecode);
+
+    ImageView view{img, width, height, channels};
+    orient::Transform orientation =
+        orient::compose(orient::fromExif(orient::exifOrientationOfFile(path)), s.transform);
+    int displayWidth = 0, displayHeight = 0;
+    orient::displaySize(view, orientation, &displayWidth, &displayHeight);
+    GridSize grid = previewGrid.cols > 0 ? previewGrid : computeGrid(displayWidth, displayHeight, s.termCols);
 
+    const bool defaultOptions = isDefault(s.renderOpts);
+    // The ASCII paths sample through the transform; the others get an
+    // upright copy.
+    hugepages::Buffer upright;
+    if (!orientation.identity() && (s.stream || s.quadrants || s.paletteColours > 0)) {
+        upright = hugepages::Buffer(static_cast<size_t>(width) * height * channels);
+        orient::apply(img, width, height, channels, orientation, upright.data());
+        view = ImageView{upright.data(), displayWidth, displayHeight, channels};
+        orientation = orient::Transform{};
+    }
+    if (s.stream) {
+        // Render and write overlap here, so the whole pipeline is one stage.
+        std::cout.flush();
+        const int chunkRows = s.streamChunkRows > 0 ? s.streamChunkRows : stream_output::defaultChunkRows(grid);
+        const int threads = s.threads > 0 ? s.threads : ThreadPool::shared().size();
+        stream_output::Stats st;
+        bool ok = false;
+        {
+            metrics::ScopedTimer timer(metrics::Stage::Render);
+            ok = stream_output::render(view, grid, chunkRows, threads, stream_output::fdSink(1), &st);
+        }
+        std::cerr << "stream: " << st.chunks << " chunks of " << chunkRows << " rows, first byte after "
+                  << st.firstByteMs << " ms, done after " << st.totalMs << " ms\n";
+        stbi_image_free(img);
+        if (!ok) {
+            metrics::add(metrics::Counter::Errors);
+            return 1;
+        }
+        metrics::add(metrics::Counter::Images);
+        metrics::add(metrics::Counter::BytesOut, renderedSize(grid));
+        return 0;
+    }
+
+    const hugepages::Faults beforeRender = hugepages::faults();
+    std::string text;
+    {
+        metrics::ScopedTimer timer(metrics::Stage::Render);
+        if (s.paletteColours > 0) {
+            text = palette::render(view, grid, s.paletteColours, s.threads > 0 ? s.threads : ThreadPool::shared().size());
+        } else if (s.quadrants) {
+            text = quadrant::render(view, grid, s.threads > 0 ? s.threads : ThreadPool::shared().size());
+        } else if (defaultOptions) {
+            bool cached = false;
+            const autotune::CostModel model = autotune::loadOrCalibrate(s.retune, &cached);
+            const autotune::Plan plan = s.threads > 0 ? autotune::withThreads(model, grid, s.threads)
+                                                      : autotune::choose(model, grid);
+            std::cerr << autotune::describe(plan, model, grid)
+                      << (cached ? "" : " [calibrated]") << "\n";
+            text.assign(renderedSize(grid), '\n');
+            if (orientation.identity()) {
+                renderAsciiParallel(view, grid, plan.threads, plan.chunkRows, &text[0]);
+            } else {
+                orient::renderInto(view, orientation, grid, plan.threads, &text[0]);
+            }
+        } else {
+            text.assign(renderedSize(grid), '\n');
+            if (orientation.identity()) {
+                renderWithOptions(view, grid, s.renderOpts, &text[0]);
+            } else {
+                orient::renderWithOptions(view, orientation, grid, s.renderOpts, &text[0]);
+            }
+        }
+    }
+    if (s.hugePages) reportFaults("render", beforeRender);
+    writeText(text);
+
+    stbi_image_free(img);
+    if (s.hugePages) {
+        const hugepages::Stats st = hugepages::stats();
+        std::cerr << "hugepages: pool mapped " << st.mapped << " (" << st.hugetlb << " MAP_HUGETLB), reused "
+                  << st.reused << ", idle " << (st.cachedBytes >> 20) << " MiB\n";
+    }
+    return 0;
+}
+
+static void writeMetricsFile(const std::string& path) {
+    if (!path.empty() && !metrics::writeFile(path)) {
+        std::cerr << "Cannot write metrics to " << path << "\n";
+    }
+}
+
+static int badValue(const std::string& option, const std::string& value) {
+    std::cerr << "Invalid value for " << option << ": " << value << "\n";
+    return 2;
+}
+
+static void printUsage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " [options] IMAGE...\n"
+              << "  --sampling MODE        nearest (default) or area\n"
+              << "  --dither MODE          none (default) or fs (Floyd-Steinberg)\n"
+              << "  --glyphs MODE          ramp (default) or coverage (font ink coverage)\n"
+              << "  --quality-bench        time and SSIM-score every render mode over IMAGE...\n"
+              << "  --decode-bench         time each decoder variant over IMAGE... (MB/s)\n"
+              << "  --threads N            render threads (default: chosen by the cost model)\n"
+              << "  --retune               recalibrate the cached threading cost model\n"
+              << "  --hugepages            decode into a reusable huge-page backed buffer pool\n"
+              << "  --quadrants            true-colour 2x2 quadrant block glyphs\n"
+              << "  --palette K            K-colour (2-16) per-image palette for 16-colour terminals\n"
+              << "  --rotate DEG           rotate clockwise by 90, 180 or 270 (after EXIF)\n"
+              << "  --flip                 mirror left-right (after rotating)\n"
+              << "  --jpeg-luma            decode only the Y plane of colour JPEGs (greyscale modes)\n"
+              << "  --jpeg-preview         render progressive JPEGs at 1/8 size or less from their DC scans\n"
+              << "  --stream               write rows as soon as each chunk is rendered (default mode only)\n"
+              << "  --stream-chunk ROWS    rows per streamed chunk (default: about 32 KiB)\n"
+              << "  --montage              contact sheet of IMAGE... (files, directories, .tar / .zip\n"
+              << "                         archives or ARCHIVE:MEMBER, read without extracting)\n"
+              << "  --tile COLSxROWS       montage tile size (default 24x12)\n"
+              << "  --output-archive TAR   render IMAGE... (as for --montage) into one tar, one .txt each\n"
+              << "  --output-index FILE    with --output-archive: write \"offset size name\" per entry\n"
+              << "  --build-pyramid OUT    write IMAGE as a tiled, mip-mapped pyramid file for fast reopening\n"
+              << "  --region X,Y,W,H       pyramid inputs: render only this part (full-size pixels, as displayed)\n"
+              << "  --raw-stream WxHxC     render raw frames from stdin, redrawing changed tiles\n"
+              << "  --play PATTERN         play a numbered image sequence, e.g. frames/%04d.png\n"
+              << "  --fps N                playback frame rate (default 24)\n"
+              << "  --serve SOCKET         run a local conversion server\n"
+              << "  --client SOCKET        render IMAGE through a running server\n"
+              << "  --bench-transport SOCKET\n"
+              << "                         time inline vs memfd requests for IMAGE\n"
+              << "  --memfd                client: pass input and output through memfds\n"
+              << "  --raw                  client: decode locally and send raw pixels\n"
+              << "  --iterations N         benchmark iterations (default 10)\n"
+              << "  --workers N            server or playback decode threads\n"
+              << "  --metrics-file PATH    write Prometheus metrics to PATH\n"
+              << "  --metrics-socket PATH  serve Prometheus metrics on a Unix socket\n"
+              << "  --perf-counters        report hardware counters per pipeline stage\n"
+              << "  --trace-alloc          report stb_image allocations per image\n";
+}
+
+int main(int argc, char** argv) {
+    std::string path = "PUT_YOUR_IMAGE_PATH_HERE.png";
+    std::string serveSocket;
+    std::string clientSocket;
+    bool benchTransport = false;
+    int workers = 0;
+    std::string metricsFile;
+    std::string metricsSocket;
+    bool perfCounters = false;
+    bool traceAlloc = false;
+    bool qualityBench = false;
+    bool decodeBench = false;
+    int threads = 0;
+    bool retune = false;
+    bool hugePages = false;
+    bool stream = false;
+    bool jpegLuma = false;
+    bool jpegPreview = false;
+    int streamChunkRows = 0;
+    playback::Options play;
+    bool quadrants = false;
+    int paletteColours = 0;
+    orient::Transform transform;
+    frame_stream::Options rawStream;
+    bool montageMode = false;
+    montage::Options sheet;
+    batch::Options batchOpts;
+    std::string pyramidOut;
+    pyramid::Region region;
+    RenderOptions renderOpts;
+    std::vector<std::string> inputs;
+    ClientOptions client;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for " << arg << "\n";
+                std::exit(2);
+            }
+            return argv[++i];
+        };
+        if (arg == "--serve") {
+            serveSocket = value();
+        } else if (arg == "--client") {
+            clientSocket = value();
+        } else if (arg == "--bench-transport") {
+            clientSocket = value();
+            benchTransport = true;
+        } else if (arg == "--memfd") {
+            client.memfd = true;
+        } else if (arg == "--raw") {
+            client.raw = true;
+        } else if (arg == "--iterations") {
+            client.iterations = std::atoi(value().c_str());
+        } else if (arg == "--workers") {
+            workers = std::atoi(value().c_str());
+        } else if (arg == "--metrics-file") {
+            metricsFile = value();
+        } else if (arg == "--metrics-socket") {
+            metricsSocket = value();
+        } else if (arg == "--perf-counters") {
+            perfCounters = true;
+        } else if (arg == "--trace-alloc") {
+            traceAlloc = true;
+        } else if (arg == "--sampling") {
+            std::string v = value();
+            if (v == "nearest") renderOpts.sampling = Sampling::Nearest;
+            else if (v == "area") renderOpts.sampling = Sampling::Area;
+            else return badValue(arg, v);
+        } else if (arg == "--dither") {
+            std::string v = value();
+            if (v == "none") renderOpts.dither = Dither::None;
+            else if (v == "fs") renderOpts.dither = Dither::FloydSteinberg;
+            else return badValue(arg, v);
+        } else if (arg == "--glyphs") {
+            std::string v = value();
+            if (v == "ramp") renderOpts.glyphs = GlyphMatch::Ramp;
+            else if (v == "coverage") renderOpts.glyphs = GlyphMatch::Coverage;
+            else return badValue(arg, v);
+        } else if (arg == "--quality-bench") {
+            qualityBench = true;
+        } else if (arg == "--decode-bench") {
+            decodeBench = true;
+        } else if (arg == "--threads") {
+            threads = std::atoi(value().c_str());
+        } else if (arg == "--retune") {
+            retune = true;
+        } else if (arg == "--hugepages") {
+            hugePages = true;
+        } else if (arg == "--jpeg-luma") {
+            jpegLuma = true;
+        } else if (arg == "--jpeg-preview") {
+            jpegPreview = true;
+        } else if (arg == "--stream") {
+            stream = true;
+        } else if (arg == "--stream-chunk") {
+            streamChunkRows = std::atoi(value().c_str());
+        } else if (arg == "--quadrants") {
+            quadrants = true;
+        } else if (arg == "--palette") {
+            std::string v = value();
+            paletteColours = std::atoi(v.c_str());
+            if (paletteColours < 2 || paletteColours > palette::kMaxColours) return badValue(arg, v);
+        } else if (arg == "--rotate") {
+            std::string v = value();
+            if (v == "0" || v == "90" || v == "180" || v == "270") transform.quarterTurns = std::atoi(v.c_str()) / 90;
+            else return badValue(arg, v);
+        } else if (arg == "--flip") {
+            transform.flip = true;
+        } else if (arg == "--montage") {
+            montageMode = true;
+        } else if (arg == "--output-archive") {
+            batchOpts.output = value();
+        } else if (arg == "--output-index") {
+            batchOpts.index = value();
+        } else if (arg == "--tile") {
+            std::string v = value();
+            if (std::sscanf(v.c_str(), "%dx%d", &sheet.tileCols, &sheet.tileRows) != 2 || sheet.tileCols < 1 ||
+                sheet.tileRows < 1) {
+                return badValue(arg, v);
+            }
+        } else if (arg == "--build-pyramid") {
+            pyramidOut = value();
+        } else if (arg == "--region") {
+            std::string v = value();
+            if (std::sscanf(v.c_str(), "%d,%d,%d,%d", &region.x, &region.y, &region.width, &region.height) != 4 ||
+                region.x < 0 || region.y < 0 || region.width < 1 || region.height < 1) {
+                return badValue(arg, v);
+            }
+        } else if (arg == "--raw-stream") {
+            std::string v = value();
+            if (std::sscanf(v.c_str(), "%dx%dx%d", &rawStream.width, &rawStream.height, &rawStream.channels) != 3 ||
+                rawStream.width < 1 || rawStream.height < 1 || rawStream.channels < 1 || rawStream.channels > 4) {
+                return badValue(arg, v);
+            }
+        } else if (arg == "--play") {
+            play.pattern = value();
+        } else if (arg == "--fps") {
+            play.fps = std::atof(value().c_str());
+        } else if (arg == "-h" || arg == "--help") {
+            printUsage(argv[0]);
+            return 0;
+        } else if (!arg.empty() && arg[0] == '-') {
+            std::cerr << "Unknown option: " << arg << "\n";
+            printUsage(argv[0]);
+            return 2;
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+    if (!inputs.empty()) path = inputs.front();
+
+    if (!metricsSocket.empty() && !metrics::startSocketExporter(metricsSocket)) return 1;
+
+    if (!serveSocket.empty()) {
+        if (hugePages) hugepages::setEnabled(true);
+        if (!metricsFile.empty()) metrics::startFileExporter(metricsFile, 5000);
+        return runServer(serveSocket, workers, traceAlloc);
+    }
 
     TermSize ts = getTerminalSize();
 
-    int targetCols = std::max(20, ts.cols - 2);
+    if (qualityBench) return quality::runQualityBench(inputs, ts.cols);
+    if (decodeBench) return runDecodeBench(inputs, client.iterations);
 
+    if (!clientSocket.empty()) {
+        client.socketPath = clientSocket;
+        client.imagePath = path;
+        client.cols = ts.cols;
+        return benchTransport ? runTransportBenchmark(client) : runClient(client);
+    }
 
-    const float charAspect = 2.0f;
+    if (perfCounters) return runPerfCounters(path, ts.cols);
 
-    float scale = static_cast<float>(targetCols) / static_cast<float>(width);
-    int targetRows = std::max(1, static_cast<int>(std::round((height * scale) / charAspect)));
+    if (hugePages) hugepages::setEnabled(true);
 
+    if (!pyramidOut.empty()) {
+        const auto start = std::chrono::steady_clock::now();
+        std::string error;
+        if (!pyramid::build(path, pyramidOut, &error)) {
+            std::cerr << "--build-pyramid: " << error << "\n";
+            return 1;
+        }
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        pyramid::File file;
+        if (file.open(pyramidOut, &error)) {
+            std::cerr << "pyramid: " << file.width() << "x" << file.height() << "x" << file.channels() << ", "
+                      << file.levelCount() << " levels of " << pyramid::kTileSize << "x" << pyramid::kTileSize
+                      << " tiles, " << ms << " ms\n";
+        }
+        return 0;
+    }
 
-    const std::string ramp = " .:-=+*#%@";
-    const int rampN = static_cast<int>(ramp.size());
+    OneShotSettings settings{renderOpts, threads, retune, traceAlloc, hugePages, jpegLuma, jpegPreview, stream, streamChunkRows, quadrants, paletteColours, transform, ts.cols, region};
+    const char* mode = !batchOpts.output.empty() ? "--output-archive"
+                       : montageMode            ? "--montage"
+                       : !play.pattern.empty()  ? "--play"
+                                                : nullptr;
+    if (mode != nullptr && unsupportedByMultiImage(settings) != nullptr) {
+        std::cerr << unsupportedByMultiImage(settings) << " is not supported with " << mode << "\n";
+        return 2;
+    }
 
+    if (!batchOpts.output.empty()) {
+        batchOpts.termCols = ts.cols;
+        batchOpts.threads = threads;
+        batchOpts.render = renderOpts;
+        batchOpts.transform = transform;
+        const int status = batch::run(inputs, batchOpts);
+        writeMetricsFile(metricsFile);
+        return status;
+    }
 
-    std::vector<char> line(static_cast<size_t>(targetCols) + 1, '\0');
+    if (montageMode) {
+        sheet.termCols = ts.cols;
+        sheet.threads = threads;
+        sheet.render = renderOpts;
+        sheet.transform = transform;
+        const int status = montage::run(inputs, sheet);
+        writeMetricsFile(metricsFile);
+        return status;
+    }
 
-    for (int y = 0; y < targetRows; ++y) {
+    if (rawStream.width > 0) {
+        rawStream.termCols = ts.cols;
+        rawStream.render = renderOpts;
+        const int status = frame_stream::run(rawStream);
+        writeMetricsFile(metricsFile);
+        return status;
+    }
 
-        int sy = std::min(height - 1, std::max(0, static_cast<int>(std::round((y + 0.5f) * (height / (targetRows * charAspect)) - 0.5f))));
-        for (int x = 0; x < targetCols; ++x) {
-            int sx = std::min(width - 1, std::max(0, static_cast<int>(std::round((x + 0.5f) * (static_cast<float>(width) / targetCols) - 0.5f))));
-            const unsigned char* p = img + (static_cast<size_t>(sy) * width + sx) * channels;
-            uint8_t lum = luminance(p, channels);
+    if (!play.pattern.empty()) {
+        play.termCols = ts.cols;
+        play.workers = workers;
+        play.render = renderOpts;
+        play.transform = transform;
+        const int status = playback::run(play);
+        writeMetricsFile(metricsFile);
+        return status;
+    }
 
-            int idx = (lum * (rampN - 1)) / 255;
-            line[static_cast<size_t>(x)] = ramp[idx];
+    if (inputs.empty()) inputs.push_back(path);
+    if (stream && unsupportedByStream(settings) != nullptr) {
+        std::cerr << unsupportedByStream(settings) << " is not supported with --stream\n";
+        return 2;
+    }
+    std::vector<bool> pyramids;
+    for (const std::string& input : inputs) {
+        pyramids.push_back(pyramid::isPyramid(input));
+        if (pyramids.back() && unsupportedByPyramid(settings) != nullptr) {
+            std::cerr << unsupportedByPyramid(settings) << " is not supported for pyramid input " << input << "\n";
+            return 2;
         }
-        line[static_cast<size_t>(targetCols)] = '\0';
-        std::cout << line.data() << "\n";
+        if (!pyramids.back() && region.width > 0) {
+            std::cerr << "--region needs a pyramid input (--build-pyramid); " << input << " is not one\n";
+            return 2;
+        }
+    }
+    int status = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        const int result = pyramids[i] ? renderPyramidFile(inputs[i], settings) : renderImageFile(inputs[i], settings);
+        if (result != 0) status = 1;
     }
 
-    stbi_image_free(img);
-    return 0;
-}
\ No newline at end of file
+    writeMetricsFile(metricsFile);
+    return status;
+}
@@ -0,0 +1,206 @@
+#include "metrics.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace metrics {
+
+    namespace {
+
+        struct Registry {
+            std::mutex mu;
+            std::vector<Shard*> shards;
+        };
+
+        Registry& registry() {
+            static Registry* r = new Registry();
+            return *r;
+        }
+
+        const char* stageName(int s) {
+            switch (static_cast<Stage>(s)) {
+                case Stage::Decode: return "decode";
+                case Stage::Render: return "render";
+                case Stage::Write: return "write";
+                case Stage::QueueWait: return "queue_wait";
+                default: return "unknown";
+            }
+        }
+
+        struct CounterInfo {
+            const char* name;
+            const char* help;
+        };
+
+        const CounterInfo kCounters[] = {
+            {"ascii_images_total", "Images rendered."},
+            {"ascii_errors_total", "Requests or images that failed."},
+            {"ascii_input_bytes_total", "Encoded or raw input bytes received."},
+            {"ascii_output_bytes_total", "Rendered bytes produced."},
+        };
+        static_assert(sizeof(kCounters) / sizeof(kCounters[0]) == static_cast<size_t>(Counter::Count),
+                      "counter table out of sync");
+
+        // Exclusive upper bound of a bucket, in seconds.
+        double bucketUpperSeconds(int idx) {
+            const int e = kMinExp + (idx >> kSubBits);
+            const uint64_t sub = static_cast<uint64_t>(idx & ((1 << kSubBits) - 1));
+            const uint64_t upper = ((1ull << kSubBits) + sub + 1) << (e - kSubBits);
+            return static_cast<double>(upper) * 1e-9;
+        }
+
+    }
+
+    Shard* registerShard() {
+        auto* shard = new Shard();
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mu);
+        r.shards.push_back(shard);
+        return shard;
+    }
+
+    std::string exportText() {
+        constexpr int kStages = static_cast<int>(Stage::Count);
+        constexpr int kCounterCount = static_cast<int>(Counter::Count);
+        uint64_t counters[kCounterCount] = {};
+        std::vector<uint64_t> buckets(static_cast<size_t>(kStages) * kBuckets, 0);
+        uint64_t sums[kStages] = {};
+
+        {
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock(r.mu);
+            for (const Shard* s : r.shards) {
+                for (int c = 0; c < kCounterCount; ++c) counters[c] += s->counters[c].load(std::memory_order_relaxed);
+                for (int st = 0; st < kStages; ++st) {
+                    sums[st] += s->sumNs[st].load(std::memory_order_relaxed);
+                    for (int b = 0; b < kBuckets; ++b) {
+                        buckets[static_cast<size_t>(st) * kBuckets + b] += s->buckets[st][b].load(std::memory_order_relaxed);
+                    }
+                }
+            }
+        }
+
+        std::ostringstream out;
+        for (int c = 0; c < kCounterCount; ++c) {
+            out << "# HELP " << kCounters[c].name << " " << kCounters[c].help << "\n"
+                << "# TYPE " << kCounters[c].name << " counter\n"
+                << kCounters[c].name << " " << counters[c] << "\n";
+        }
+
+        out << "# HELP ascii_stage_duration_seconds Time spent per pipeline stage.\n"
+            << "# TYPE ascii_stage_duration_seconds histogram\n";
+        char le[32];
+        for (int st = 0; st < kStages; ++st) {
+            const uint64_t* b = &buckets[static_cast<size_t>(st) * kBuckets];
+            uint64_t cumulative = 0;
+            for (int i = 0; i < kBuckets - 1; ++i) {
+                cumulative += b[i];
+                std::snprintf(le, sizeof(le), "%.9g", bucketUpperSeconds(i));
+                out << "ascii_stage_duration_seconds_bucket{stage=\"" << stageName(st)
+                    << "\",le=\"" << le << "\"} " << cumulative << "\n";
+            }
+            cumulative += b[kBuckets - 1];
+            std::snprintf(le, sizeof(le), "%.9f", static_cast<double>(sums[st]) * 1e-9);
+            out << "ascii_stage_duration_seconds_bucket{stage=\"" << stageName(st) << "\",le=\"+Inf\"} " << cumulative << "\n"
+                << "ascii_stage_duration_seconds_sum{stage=\"" << stageName(st) << "\"} " << le << "\n"
+                << "ascii_stage_duration_seconds_count{stage=\"" << stageName(st) << "\"} " << cumulative << "\n";
+        }
+        return out.str();
+    }
+
+    bool writeFile(const std::string& path) {
+        const std::string text = exportText();
+        const std::string tmp = path + ".tmp";
+        std::FILE* f = std::fopen(tmp.c_str(), "wb");
+        if (f == nullptr) return false;
+        bool ok = std::fwrite(text.data(), 1, text.size(), f) == text.size();
+        ok = (std::fclose(f) == 0) && ok;
+        return ok && std::rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    void startFileExporter(const std::string& path, int intervalMs) {
+        std::thread([path, intervalMs]() {
+            for (;;) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+                if (!writeFile(path)) std::cerr << "Cannot write metrics to " << path << "\n";
+            }
+        }).detach();
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+#ifdef MSG_NOSIGNAL
+    constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+    constexpr int kSendFlags = 0;
+#endif
+
+    bool startSocketExporter(const std::string& socketPath) {
+        sockaddr_un addr{};
+        if (socketPath.size() >= sizeof(addr.sun_path)) {
+            std::cerr << "Socket path too long: " << socketPath << "\n";
+            return false;
+        }
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+        struct stat st{};
+        if (lstat(socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) ::unlink(socketPath.c_str());
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 4) != 0) {
+            std::cerr << "Cannot listen on " << socketPath << ": " << std::strerror(errno) << "\n";
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+
+        std::thread([fd, socketPath]() {
+            for (;;) {
+                int conn = ::accept(fd, nullptr, nullptr);
+                if (conn < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    // Out of descriptors or memory: wait for the rest of the
+                    // process to give some back rather than spin on accept.
+                    if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                        continue;
+                    }
+                    std::cerr << "Metrics exporter on " << socketPath << " stopped: " << std::strerror(errno) << "\n";
+                    ::close(fd);
+                    return;
+                }
+                const std::string text = exportText();
+                const char* p = text.data();
+                size_t n = text.size();
+                while (n > 0) {
+                    ssize_t w = ::send(conn, p, n, kSendFlags);
+                    if (w <= 0) break;
+                    p += w;
+                    n -= static_cast<size_t>(w);
+                }
+                ::close(conn);
+            }
+        }).detach();
+        return true;
+    }
+#else
+    bool startSocketExporter(const std::string&) {
+        std::cerr << "--metrics-socket is not supported on this platform\n";
+        return false;
+    }
+#endif
+
+}
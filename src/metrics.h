@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// In-process metrics registry exported in Prometheus text format.
+//
+// Every thread records into its own shard, so recording is a couple of
+// relaxed, uncontended stores (no lock prefix, no shared cache lines); the
+// exporter sums all shards when it renders the text.
+namespace metrics {
+
+    enum class Stage : int {
+        Decode,
+        Render,
+        Write,
+        QueueWait,
+        Count,
+    };
+
+    enum class Counter : int {
+        Images,
+        Errors,
+        BytesIn,
+        BytesOut,
+        Count,
+    };
+
+    // Log-linear buckets: four linear sub-buckets per power of two of
+    // nanoseconds, from 1 us (2^10 ns) up to ~69 s (2^36 ns).
+    constexpr int kSubBits = 2;
+    constexpr int kMinExp = 10;
+    constexpr int kMaxExp = 36;
+    constexpr int kBuckets = (kMaxExp - kMinExp) << kSubBits;
+
+    static inline int bucketFor(uint64_t ns) {
+        if (ns < (1ull << kMinExp)) return 0;
+        const int e = 63 - __builtin_clzll(ns);
+        if (e >= kMaxExp) return kBuckets - 1;
+        const int sub = static_cast<int>(ns >> (e - kSubBits)) & ((1 << kSubBits) - 1);
+        return ((e - kMinExp) << kSubBits) + sub;
+    }
+
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counters[static_cast<int>(Counter::Count)]{};
+        std::atomic<uint64_t> buckets[static_cast<int>(Stage::Count)][kBuckets]{};
+        std::atomic<uint64_t> sumNs[static_cast<int>(Stage::Count)]{};
+    };
+
+    Shard* registerShard();
+
+    static inline Shard& localShard() {
+        thread_local Shard* shard = registerShard();
+        return *shard;
+    }
+
+    // Only the owning thread writes a shard, so a load/store pair is enough.
+    static inline void bump(std::atomic<uint64_t>& v, uint64_t n) {
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static inline void record(Stage stage, uint64_t ns) {
+        Shard& s = localShard();
+        const int st = static_cast<int>(stage);
+        bump(s.buckets[st][bucketFor(ns)], 1);
+        bump(s.sumNs[st], ns);
+    }
+
+    static inline void add(Counter counter, uint64_t n = 1) {
+        bump(localShard().counters[static_cast<int>(counter)], n);
+    }
+
+    class ScopedTimer {
+    public:
+        explicit ScopedTimer(Stage stage) : stage_(stage), start_(std::chrono::steady_clock::now()) {}
+        ~ScopedTimer() {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_);
+            record(stage_, static_cast<uint64_t>(ns.count()));
+        }
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    private:
+        Stage stage_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    // Renders all shards in Prometheus text exposition format.
+    std::string exportText();
+
+    // Atomically replaces path with the current export.
+    bool writeFile(const std::string& path);
+
+    // Background exporters for long-running modes. The file is rewritten
+    // every intervalMs; the socket answers each connection with one export.
+    void startFileExporter(const std::string& path, int intervalMs);
+    bool startSocketExporter(const std::string& socketPath);
+
+}
@@ -0,0 +1,136 @@
+#include "montage.h"
+#include "archive.h"
+#include "metrics.h"
+#include "render.h"
+#include "thread_pool.h"
+#include "stb_image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+
+namespace montage {
+
+    namespace {
+
+        // Largest grid inside tileCols x tileRows with the image's aspect,
+        // sized the way computeGrid sizes a full-width render.
+        GridSize fitTile(int width, int height, int tileCols, int tileRows) {
+            const float perCol = static_cast<float>(height) / (static_cast<float>(width) * kCharAspect);
+            int cols = tileCols;
+            if (cols * perCol > tileRows) cols = static_cast<int>(tileRows / perCol);
+            cols = std::max(1, std::min(tileCols, cols));
+            const int rows = std::max(1, std::min(tileRows, static_cast<int>(std::round(cols * perCol))));
+            return GridSize{cols, rows};
+        }
+
+        // Renders view through t into a tile whose rows are stride bytes
+        // apart. The default mode writes straight into the frame, sampling
+        // through orient::Sampler when turned; the others render whole and
+        // are copied in.
+        void renderTile(const ImageView& view, orient::Transform t, GridSize grid, const RenderOptions& opts,
+                        char* tile, size_t stride) {
+            if (opts.sampling == Sampling::Nearest && opts.dither == Dither::None && opts.glyphs == GlyphMatch::Ramp) {
+                if (t.identity()) {
+                    for (int y = 0; y < grid.rows; ++y) renderRow(view, grid, y, tile + y * stride);
+                    return;
+                }
+                const orient::Sampler sampler(view, t, grid);
+                for (int y = 0; y < grid.rows; ++y) {
+                    char* line = tile + y * stride;
+                    for (int x = 0; x < grid.cols; ++x) line[x] = glyphFor(luminance(sampler.at(x, y), view.channels));
+                }
+                return;
+            }
+            std::string text(renderedSize(grid), '\n');
+            if (t.identity()) {
+                renderWithOptions(view, grid, opts, &text[0]);
+            } else {
+                orient::renderWithOptions(view, t, grid, opts, &text[0]);
+            }
+            for (int y = 0; y < grid.rows; ++y) {
+                std::copy_n(&text[static_cast<size_t>(y) * (grid.cols + 1)], grid.cols, tile + y * stride);
+            }
+        }
+
+    }
+
+    int run(const std::vector<std::string>& inputs, const Options& opts) {
+        const std::vector<archive::Input> files = archive::expandInputs(inputs);
+        if (files.empty()) {
+            std::cerr << "--montage: no images\n";
+            return 1;
+        }
+        const auto start = std::chrono::steady_clock::now();
+
+        // Each slot is a tile plus a one-column gap and a label row.
+        const int tileCols = std::max(1, opts.tileCols);
+        const int tileRows = std::max(1, opts.tileRows);
+        const int across = std::max(1, (opts.termCols + 1) / (tileCols + 1));
+        const int down = (static_cast<int>(files.size()) + across - 1) / across;
+        const int frameCols = across * (tileCols + 1) - 1;
+        const int frameRows = down * (tileRows + 1);
+        const size_t stride = static_cast<size_t>(frameCols) + 1;
+
+        std::string frame(stride * frameRows, ' ');
+        for (int r = 0; r < frameRows; ++r) frame[r * stride + frameCols] = '\n';
+
+        ThreadPool& pool = ThreadPool::shared();
+        const int threads = opts.threads > 0 ? opts.threads : pool.size();
+        std::atomic<int> failed{0};
+        pool.parallelFor(static_cast<int>(files.size()), 1, threads, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                char* origin = &frame[(i / across) * (tileRows + 1) * stride + (i % across) * (tileCols + 1)];
+
+                // Label: file (or member) name, truncated to the tile width.
+                const std::string name = std::filesystem::path(files[i].label).filename().string();
+                std::copy_n(name.begin(), std::min<size_t>(name.size(), tileCols), origin + tileRows * stride);
+
+                int w = 0, h = 0, c = 0;
+                int exif = 1;
+                stbi_uc* img = nullptr;
+                {
+                    metrics::ScopedTimer timer(metrics::Stage::Decode);
+                    img = archive::load(files[i], &w, &h, &c, 0, &exif);
+                }
+                if (img == nullptr) {
+                    // One string, so lines from different workers stay whole.
+                    std::cerr << files[i].label + ": " + stbi_failure_reason() + "\n";
+                    const char msg[] = "(unreadable)";
+                    std::copy_n(msg, std::min<size_t>(sizeof(msg) - 1, tileCols), origin);
+                    failed.fetch_add(1, std::memory_order_relaxed);
+                    metrics::add(metrics::Counter::Errors);
+                    continue;
+                }
+                {
+                    metrics::ScopedTimer timer(metrics::Stage::Render);
+                    const ImageView view{img, w, h, c};
+                    const orient::Transform t = orient::compose(orient::fromExif(exif), opts.transform);
+                    int displayWidth = 0, displayHeight = 0;
+                    orient::displaySize(view, t, &displayWidth, &displayHeight);
+                    const GridSize grid = fitTile(displayWidth, displayHeight, tileCols, tileRows);
+                    char* tile = origin + ((tileRows - grid.rows) / 2) * stride + (tileCols - grid.cols) / 2;
+                    renderTile(view, t, grid, opts.render, tile, stride);
+                }
+                stbi_image_free(img);
+                metrics::add(metrics::Counter::Images);
+            }
+        });
+
+        {
+            metrics::ScopedTimer timer(metrics::Stage::Write);
+            std::cout.write(frame.data(), static_cast<std::streamsize>(frame.size()));
+            std::cout.flush();
+        }
+        metrics::add(metrics::Counter::BytesOut, frame.size());
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "montage: " << files.size() << " images (" << failed.load() << " unreadable) in " << across
+                  << "x" << down << " tiles of " << tileCols << "x" << tileRows << ", " << threads << " threads, "
+                  << ms << " ms\n";
+        return failed.load() == 0 ? 0 : 1;
+    }
+
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "orientation.h"
+#include "render.h"
+
+#include <string>
+#include <vector>
+
+// Contact sheet: many images laid out as a grid of fixed-size tiles in one
+// text frame. Tiles are decoded and rendered in parallel, each straight into
+// its own sub-rectangle of the shared frame buffer.
+namespace montage {
+
+    struct Options {
+        int termCols = 80;
+        int tileCols = 24;      // glyphs per tile, excluding the gap
+        int tileRows = 12;      // rows per tile, excluding the label
+        int threads = 0;        // 0 uses the whole shared pool
+        RenderOptions render;
+        orient::Transform transform;
+    };
+
+    // Renders the sheet of archive::expandInputs(inputs) to stdout, reading
+    // archive members without extracting them; returns the process exit
+    // status.
+    int run(const std::vector<std::string>& inputs, const Options& opts);
+
+}
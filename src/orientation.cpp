@@ -0,0 +1,217 @@
+#include "orientation.h"
+#include "hugepages.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace orient {
+
+    namespace {
+
+        constexpr size_t kExifScanBytes = 64 * 1024;
+        constexpr int kTile = 32;
+
+        uint32_t readU16(const unsigned char* p, bool le) {
+            return le ? (p[0] | p[1] << 8) : (p[0] << 8 | p[1]);
+        }
+
+        uint32_t readU32(const unsigned char* p, bool le) {
+            return le ? (readU16(p, true) | readU16(p + 2, true) << 16) : (readU16(p, false) << 16 | readU16(p + 2, false));
+        }
+
+        // Orientation tag of a TIFF structure (the body of an Exif block).
+        int tiffOrientation(const unsigned char* t, size_t size) {
+            if (size < 8) return 1;
+            bool le;
+            if (t[0] == 'I' && t[1] == 'I') le = true;
+            else if (t[0] == 'M' && t[1] == 'M') le = false;
+            else return 1;
+            if (readU16(t + 2, le) != 42) return 1;
+            const size_t ifd = readU32(t + 4, le);
+            if (ifd + 2 > size) return 1;
+            const size_t entries = readU16(t + ifd, le);
+            for (size_t i = 0; i < entries; ++i) {
+                const size_t e = ifd + 2 + i * 12;
+                if (e + 12 > size) break;
+                if (readU16(t + e, le) == 0x0112 && readU16(t + e + 2, le) == 3) {
+                    const int tag = static_cast<int>(readU16(t + e + 8, le));
+                    return tag >= 1 && tag <= 8 ? tag : 1;
+                }
+            }
+            return 1;
+        }
+
+        // Source pixel index as a linear function of the displayed (dx, dy):
+        // origin + dx * ax + dy * ay.
+        struct Linear {
+            long long origin, ax, ay;
+        };
+
+        Linear linearMap(int width, int height, Transform t) {
+            int dw = 0, dh = 0;
+            displaySize(ImageView{nullptr, width, height, 1}, t, &dw, &dh);
+            auto source = [&](long long dx, long long dy) -> long long {
+                if (t.flip) dx = dw - 1 - dx;
+                long long sx = 0, sy = 0;
+                switch (t.quarterTurns & 3) {
+                    case 0: sx = dx; sy = dy; break;
+                    case 1: sx = dy; sy = height - 1 - dx; break;
+                    case 2: sx = width - 1 - dx; sy = height - 1 - dy; break;
+                    default: sx = width - 1 - dy; sy = dx; break;
+                }
+                return sy * width + sx;
+            };
+            const long long o = source(0, 0);
+            return Linear{o, source(1, 0) - o, source(0, 1) - o};
+        }
+
+    }
+
+    Transform fromExif(int tag) {
+        switch (tag) {
+            case 2: return Transform{0, true};
+            case 3: return Transform{2, false};
+            case 4: return Transform{2, true};
+            case 5: return Transform{1, true};
+            case 6: return Transform{1, false};
+            case 7: return Transform{3, true};
+            case 8: return Transform{3, false};
+            default: return Transform{};
+        }
+    }
+
+    Transform compose(Transform first, Transform second) {
+        // A mirror reverses the sense of any rotation applied after it.
+        const int turns = first.flip ? first.quarterTurns - second.quarterTurns
+                                     : first.quarterTurns + second.quarterTurns;
+        return Transform{((turns % 4) + 4) % 4, first.flip != second.flip};
+    }
+
+    int exifOrientation(const unsigned char* data, size_t size) {
+        if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return 1;
+        size_t pos = 2;
+        while (pos + 4 <= size) {
+            if (data[pos] != 0xFF) return 1;
+            const unsigned char marker = data[pos + 1];
+            if (marker == 0xFF) {
+                ++pos;
+                continue;
+            }
+            if (marker == 0xDA || marker == 0xD9) return 1;   // image data: no Exif before it
+            const size_t length = readU16(data + pos + 2, false);
+            if (length < 2) return 1;
+            const unsigned char* body = data + pos + 4;
+            const size_t bodySize = std::min(length - 2, size - (pos + 4));
+            if (marker == 0xE1 && bodySize >= 6 && std::memcmp(body, "Exif\0\0", 6) == 0) {
+                return tiffOrientation(body + 6, bodySize - 6);
+            }
+            pos += 2 + length;
+        }
+        return 1;
+    }
+
+    int exifOrientationOfFile(const std::string& path) {
+        std::FILE* f = std::fopen(path.c_str(), "rb");
+        if (f == nullptr) return 1;
+        std::vector<unsigned char> head(kExifScanBytes);
+        const size_t n = std::fread(head.data(), 1, head.size(), f);
+        std::fclose(f);
+        return exifOrientation(head.data(), n);
+    }
+
+    void displaySize(const ImageView& img, Transform t, int* width, int* height) {
+        *width = t.swapsAxes() ? img.height : img.width;
+        *height = t.swapsAxes() ? img.width : img.height;
+    }
+
+    Sampler::Sampler(const ImageView& img, Transform t, GridSize grid)
+        : data_(img.data), colOffset_(static_cast<size_t>(grid.cols)), rowOffset_(static_cast<size_t>(grid.rows)) {
+        int width = 0, height = 0;
+        displaySize(img, t, &width, &height);
+        const Linear map = linearMap(img.width, img.height, t);
+        const long long ch = img.channels;
+        // Each displayed column and row advances along one source axis, so
+        // the offset of (x, y) is the sum of a column and a row term. The
+        // origin goes into the row term to keep both non-negative.
+        for (int x = 0; x < grid.cols; ++x) {
+            const int dx = nearestColumn(width, grid.cols, x);
+            const long long lo = map.ax < 0 ? map.ax * (width - 1) : 0;
+            colOffset_[static_cast<size_t>(x)] = static_cast<size_t>((dx * map.ax - lo) * ch);
+        }
+        for (int y = 0; y < grid.rows; ++y) {
+            const int dy = nearestRow(height, grid.rows, y);
+            const long long lo = map.ax < 0 ? map.ax * (width - 1) : 0;
+            rowOffset_[static_cast<size_t>(y)] = static_cast<size_t>((map.origin + dy * map.ay + lo) * ch);
+        }
+    }
+
+    void renderInto(const ImageView& img, Transform t, GridSize grid, int threads, char* out) {
+        const Sampler sampler(img, t, grid);
+        const size_t stride = static_cast<size_t>(grid.cols) + 1;
+        const int chunk = std::max(1, grid.rows / (std::max(1, threads) * 4));
+        ThreadPool::shared().parallelFor(grid.rows, chunk, threads, [&](int begin, int end) {
+            for (int y = begin; y < end; ++y) {
+                char* line = out + static_cast<size_t>(y) * stride;
+                for (int x = 0; x < grid.cols; ++x) line[x] = glyphFor(luminance(sampler.at(x, y), img.channels));
+                line[grid.cols] = '\n';
+            }
+        });
+    }
+
+    void renderWithOptions(const ImageView& img, Transform t, GridSize grid, const RenderOptions& opts, char* out) {
+        std::vector<uint8_t> lum(static_cast<size_t>(grid.cols) * grid.rows);
+        if (opts.sampling == Sampling::Nearest) {
+            const Sampler sampler(img, t, grid);
+            for (int y = 0; y < grid.rows; ++y) {
+                for (int x = 0; x < grid.cols; ++x) {
+                    lum[static_cast<size_t>(y) * grid.cols + x] = luminance(sampler.at(x, y), img.channels);
+                }
+            }
+        } else {
+            // Area sampling box-filters a plane, so the luminance plane is
+            // transposed once rather than walking the source across rows.
+            const size_t pixels = static_cast<size_t>(img.width) * img.height;
+            hugepages::Buffer plane(pixels);
+            hugepages::Buffer turned(pixels);
+            luminancePlane(img, plane.data());
+            apply(plane.data(), img.width, img.height, 1, t, turned.data());
+            ImageView view{nullptr, 0, 0, 1};
+            displaySize(img, t, &view.width, &view.height);
+            boxResample(turned.data(), view.width, view.height,
+                        cellWidth(view, grid) * grid.cols, cellHeight(view, grid) * grid.rows,
+                        grid.cols, grid.rows, lum.data());
+        }
+        mapGlyphs(lum.data(), grid, opts.dither, opts.glyphs, out);
+    }
+
+    void apply(const unsigned char* src, int width, int height, int channels, Transform t, unsigned char* dst) {
+        int dw = 0, dh = 0;
+        displaySize(ImageView{src, width, height, channels}, t, &dw, &dh);
+        if (t.identity()) {
+            std::memcpy(dst, src, static_cast<size_t>(width) * height * channels);
+            return;
+        }
+        const Linear map = linearMap(width, height, t);
+        for (int by = 0; by < dh; by += kTile) {
+            const int yEnd = std::min(dh, by + kTile);
+            for (int bx = 0; bx < dw; bx += kTile) {
+                const int xEnd = std::min(dw, bx + kTile);
+                for (int dy = by; dy < yEnd; ++dy) {
+                    unsigned char* row = dst + (static_cast<size_t>(dy) * dw + bx) * channels;
+                    long long s = map.origin + bx * map.ax + dy * map.ay;
+                    if (channels == 1) {
+                        for (int dx = bx; dx < xEnd; ++dx, s += map.ax) *row++ = src[s];
+                    } else {
+                        for (int dx = bx; dx < xEnd; ++dx, s += map.ax, row += channels) {
+                            std::memcpy(row, src + s * channels, static_cast<size_t>(channels));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "render.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Image orientation: EXIF orientation tags plus --rotate / --flip. The
+// transform is folded into the per-column and per-row sampling tables of the
+// nearest path, so no rotated copy of the image is made. Paths that need a
+// transformed plane or image get it from a cache-blocked transpose.
+namespace orient {
+
+    // Rotate clockwise by quarterTurns, then mirror left-right if flip.
+    struct Transform {
+        int quarterTurns = 0;
+        bool flip = false;
+
+        bool identity() const { return quarterTurns == 0 && !flip; }
+        bool swapsAxes() const { return (quarterTurns & 1) != 0; }
+    };
+
+    // Transform that displays an image carrying EXIF orientation tag 1-8
+    // upright; anything else is treated as 1.
+    Transform fromExif(int tag);
+
+    // first, then second.
+    Transform compose(Transform first, Transform second);
+
+    // Orientation tag from the APP1 Exif block of a JPEG, or 1 when there
+    // is none. Only the first 64 KiB of the file are read.
+    int exifOrientation(const unsigned char* data, size_t size);
+    int exifOrientationOfFile(const std::string& path);
+
+    // Width and height of img once transformed.
+    void displaySize(const ImageView& img, Transform t, int* width, int* height);
+
+    // Source pixel under every cell of the displayed image, picked exactly as
+    // renderRow picks it, as one byte offset per column plus one per row.
+    class Sampler {
+    public:
+        Sampler(const ImageView& img, Transform t, GridSize grid);
+
+        const unsigned char* at(int x, int y) const {
+            return data_ + rowOffset_[static_cast<size_t>(y)] + colOffset_[static_cast<size_t>(x)];
+        }
+
+    private:
+        const unsigned char* data_;
+        std::vector<size_t> colOffset_;
+        std::vector<size_t> rowOffset_;
+    };
+
+    // renderAsciiInto of the transformed image (grid computed from its
+    // displaySize), rows spread over up to `threads` pool threads.
+    void renderInto(const ImageView& img, Transform t, GridSize grid, int threads, char* out);
+
+    // renderWithOptions of the transformed image.
+    void renderWithOptions(const ImageView& img, Transform t, GridSize grid, const RenderOptions& opts, char* out);
+
+    // Writes the transformed pixels (same channel count) to dst, in 32x32
+    // pixel tiles so both sides stay cache-resident during a transpose.
+    void apply(const unsigned char* src, int width, int height, int channels, Transform t, unsigned char* dst);
+
+}
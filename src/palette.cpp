@@ -0,0 +1,254 @@
+#include "palette.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace palette {
+
+    namespace {
+
+        constexpr int kIterations = 64;
+        constexpr size_t kBatch = 512;
+        constexpr int kCubeBits = 5;
+        constexpr int kCubeSide = 1 << kCubeBits;
+
+        // Palette entries as float planes, padded with far-away entries so
+        // the SIMD loop can always work on groups of four.
+        struct Centres {
+            alignas(16) float r[kMaxColours];
+            alignas(16) float g[kMaxColours];
+            alignas(16) float b[kMaxColours];
+            int size = 0;
+
+            explicit Centres(int k) : size(k) {
+                std::fill(r, r + kMaxColours, 1e9f);
+                std::fill(g, g + kMaxColours, 1e9f);
+                std::fill(b, b + kMaxColours, 1e9f);
+            }
+        };
+
+        // Nearest centre to (r, g, b); ties go to the lowest index.
+        int nearestCentreScalar(const Centres& c, float r, float g, float b) {
+            int bestIdx = 0;
+            float best = std::numeric_limits<float>::max();
+            for (int j = 0; j < c.size; ++j) {
+                const float dr = c.r[j] - r, dg = c.g[j] - g, db = c.b[j] - b;
+                const float d = dr * dr + dg * dg + db * db;
+                if (d < best) {
+                    best = d;
+                    bestIdx = j;
+                }
+            }
+            return bestIdx;
+        }
+
+        // nearestCentreScalar, four centres at a time.
+        int nearestCentre(const Centres& c, float r, float g, float b) {
+#if defined(__SSE2__)
+            const __m128 pr = _mm_set1_ps(r), pg = _mm_set1_ps(g), pb = _mm_set1_ps(b);
+            __m128 best = _mm_set1_ps(std::numeric_limits<float>::max());
+            __m128i bestIdx = _mm_setzero_si128();
+            __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+            const __m128i four = _mm_set1_epi32(4);
+            for (int j = 0; j < c.size; j += 4) {
+                const __m128 dr = _mm_sub_ps(_mm_load_ps(c.r + j), pr);
+                const __m128 dg = _mm_sub_ps(_mm_load_ps(c.g + j), pg);
+                const __m128 db = _mm_sub_ps(_mm_load_ps(c.b + j), pb);
+                const __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+                const __m128 lt = _mm_cmplt_ps(d, best);
+                best = _mm_or_ps(_mm_and_ps(lt, d), _mm_andnot_ps(lt, best));
+                const __m128i lti = _mm_castps_si128(lt);
+                bestIdx = _mm_or_si128(_mm_and_si128(lti, idx), _mm_andnot_si128(lti, bestIdx));
+                idx = _mm_add_epi32(idx, four);
+            }
+            alignas(16) float d[4];
+            alignas(16) int i[4];
+            _mm_store_ps(d, best);
+            _mm_store_si128(reinterpret_cast<__m128i*>(i), bestIdx);
+            int lane = 0;
+            for (int k = 1; k < 4; ++k) {
+                if (d[k] < d[lane] || (d[k] == d[lane] && i[k] < i[lane])) lane = k;
+            }
+            return i[lane];
+#else
+            return nearestCentreScalar(c, r, g, b);
+#endif
+        }
+
+        Centres centresOf(const Palette& pal) {
+            Centres c(pal.size);
+            for (int j = 0; j < pal.size; ++j) {
+                c.r[j] = pal.rgb[j][0];
+                c.g[j] = pal.rgb[j][1];
+                c.b[j] = pal.rgb[j][2];
+            }
+            return c;
+        }
+
+        uint32_t xorshift(uint32_t* s) {
+            uint32_t x = *s;
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            return *s = x;
+        }
+
+        void appendSgrBackground(std::string* out, int index) {
+            char buf[16];
+            const int n = std::snprintf(buf, sizeof(buf), "\x1b[%dm", index < 8 ? 40 + index : 100 + index - 8);
+            out->append(buf, static_cast<size_t>(n));
+        }
+
+    }
+
+    Palette cluster(const uint8_t* rgb, size_t n, int k, int threads) {
+        Palette pal;
+        k = std::max(1, std::min(k, kMaxColours));
+        pal.size = k;
+        if (n == 0) return pal;
+        Centres c(k);
+        uint32_t seed = 0x9e3779b9u;
+
+        // k-means++ seeding: each new centre is drawn with probability
+        // proportional to the squared distance to the nearest one so far.
+        std::vector<float> dist(n, std::numeric_limits<float>::max());
+        size_t pick = xorshift(&seed) % n;
+        for (int j = 0; j < k; ++j) {
+            c.r[j] = rgb[pick * 3];
+            c.g[j] = rgb[pick * 3 + 1];
+            c.b[j] = rgb[pick * 3 + 2];
+            double total = 0.0;
+            for (size_t i = 0; i < n; ++i) {
+                const float dr = rgb[i * 3] - c.r[j], dg = rgb[i * 3 + 1] - c.g[j], db = rgb[i * 3 + 2] - c.b[j];
+                dist[i] = std::min(dist[i], dr * dr + dg * dg + db * db);
+                total += dist[i];
+            }
+            if (total <= 0.0) {
+                pick = xorshift(&seed) % n;
+                continue;
+            }
+            double target = total * (xorshift(&seed) / 4294967296.0);
+            pick = n - 1;
+            for (size_t i = 0; i < n; ++i) {
+                target -= dist[i];
+                if (target < 0.0) {
+                    pick = i;
+                    break;
+                }
+            }
+        }
+
+        // Mini-batch k-means (Sculley): assign a random batch in parallel,
+        // then move each centre towards its points with a per-centre rate.
+        const size_t batch = std::min(n, kBatch);
+        std::vector<size_t> points(batch);
+        std::vector<int> owner(batch);
+        std::vector<int> counts(static_cast<size_t>(k), 0);
+        ThreadPool& pool = ThreadPool::shared();
+        for (int it = 0; it < kIterations; ++it) {
+            for (size_t& p : points) p = xorshift(&seed) % n;
+            pool.parallelFor(static_cast<int>(batch), 64, threads, [&](int begin, int end) {
+                for (int i = begin; i < end; ++i) {
+                    const uint8_t* p = rgb + points[static_cast<size_t>(i)] * 3;
+                    owner[static_cast<size_t>(i)] = nearestCentre(c, p[0], p[1], p[2]);
+                }
+            });
+            for (size_t i = 0; i < batch; ++i) {
+                const int j = owner[i];
+                const uint8_t* p = rgb + points[i] * 3;
+                const float eta = 1.0f / static_cast<float>(++counts[static_cast<size_t>(j)]);
+                c.r[j] += eta * (p[0] - c.r[j]);
+                c.g[j] += eta * (p[1] - c.g[j]);
+                c.b[j] += eta * (p[2] - c.b[j]);
+            }
+        }
+
+        for (int j = 0; j < k; ++j) {
+            pal.rgb[j][0] = clampU8(static_cast<int>(std::lround(c.r[j])));
+            pal.rgb[j][1] = clampU8(static_cast<int>(std::lround(c.g[j])));
+            pal.rgb[j][2] = clampU8(static_cast<int>(std::lround(c.b[j])));
+        }
+        return pal;
+    }
+
+    int nearest(const Palette& pal, const uint8_t* rgb) {
+        return nearestCentre(centresOf(pal), rgb[0], rgb[1], rgb[2]);
+    }
+
+    int nearestScalar(const Palette& pal, const uint8_t* rgb) {
+        return nearestCentreScalar(centresOf(pal), rgb[0], rgb[1], rgb[2]);
+    }
+
+    std::vector<uint8_t> buildCube(const Palette& pal, int threads) {
+        const Centres c = centresOf(pal);
+        std::vector<uint8_t> cube(static_cast<size_t>(kCubeSide) * kCubeSide * kCubeSide);
+        const float half = 1 << (7 - kCubeBits);
+        ThreadPool::shared().parallelFor(kCubeSide, 1, threads, [&](int begin, int end) {
+            for (int r = begin; r < end; ++r) {
+                for (int g = 0; g < kCubeSide; ++g) {
+                    uint8_t* row = &cube[(static_cast<size_t>(r) * kCubeSide + g) * kCubeSide];
+                    for (int b = 0; b < kCubeSide; ++b) {
+                        row[b] = static_cast<uint8_t>(nearestCentre(c, (r << (8 - kCubeBits)) + half,
+                                                                    (g << (8 - kCubeBits)) + half,
+                                                                    (b << (8 - kCubeBits)) + half));
+                    }
+                }
+            }
+        });
+        return cube;
+    }
+
+    std::string render(const ImageView& img, GridSize grid, int colours, int threads) {
+        // Cell colours, sampled where renderRow samples.
+        const size_t cells = static_cast<size_t>(grid.cols) * grid.rows;
+        std::vector<uint8_t> rgb(cells * 3);
+        std::vector<int> sx(static_cast<size_t>(grid.cols));
+        for (int x = 0; x < grid.cols; ++x) {
+            sx[x] = nearestColumn(img.width, grid.cols, x);
+        }
+        for (int y = 0; y < grid.rows; ++y) {
+            const int sy = nearestRow(img.height, grid.rows, y);
+            const unsigned char* line = img.data + static_cast<size_t>(sy) * img.width * img.channels;
+            for (int x = 0; x < grid.cols; ++x) {
+                premultipliedRgb(line + static_cast<size_t>(sx[x]) * img.channels, img.channels,
+                                 &rgb[(static_cast<size_t>(y) * grid.cols + x) * 3]);
+            }
+        }
+
+        const Palette pal = cluster(rgb.data(), cells, colours, threads);
+        const std::vector<uint8_t> cube = buildCube(pal, threads);
+
+        std::string out;
+        out.reserve(cells * 2 + static_cast<size_t>(pal.size) * 24);
+        for (int j = 0; j < pal.size; ++j) {
+            char buf[40];
+            const int n = std::snprintf(buf, sizeof(buf), "\x1b]4;%d;rgb:%02x/%02x/%02x\x1b\\", j, pal.rgb[j][0],
+                                        pal.rgb[j][1], pal.rgb[j][2]);
+            out.append(buf, static_cast<size_t>(n));
+        }
+        const int shift = 8 - kCubeBits;
+        for (int y = 0; y < grid.rows; ++y) {
+            int last = -1;
+            for (int x = 0; x < grid.cols; ++x) {
+                const uint8_t* p = &rgb[(static_cast<size_t>(y) * grid.cols + x) * 3];
+                const int index = cube[((static_cast<size_t>(p[0] >> shift) << kCubeBits | (p[1] >> shift))
+                                        << kCubeBits) | (p[2] >> shift)];
+                if (index != last) {
+                    appendSgrBackground(&out, index);
+                    last = index;
+                }
+                out.push_back(' ');
+            }
+            out.append("\x1b[0m\n");
+        }
+        return out;
+    }
+
+}
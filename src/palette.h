@@ -0,0 +1,40 @@
+#pragma once
+
+#include "render.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Per-image palettes for 16-colour terminals. The cell colours of the output
+// grid (not the source pixels, so the cost is bounded by the grid) are
+// clustered with mini-batch k-means; every colour is then mapped through a
+// 32x32x32 lookup cube to its nearest palette entry. The terminal's palette
+// slots are redefined with OSC 4, so the picture uses the image's own colours.
+namespace palette {
+
+    constexpr int kMaxColours = 16;
+
+    struct Palette {
+        int size = 0;
+        uint8_t rgb[kMaxColours][3] = {};
+    };
+
+    // Clusters n RGB triples into k <= kMaxColours colours. Deterministic
+    // for a given input.
+    Palette cluster(const uint8_t* rgb, size_t n, int k, int threads);
+
+    // Index of the nearest palette entry; SIMD over four entries at a time.
+    int nearest(const Palette& pal, const uint8_t* rgb);
+
+    // Plain loop over the entries; the reference for the SIMD path.
+    int nearestScalar(const Palette& pal, const uint8_t* rgb);
+
+    // Lookup cube indexed by the top five bits of r, g and b.
+    std::vector<uint8_t> buildCube(const Palette& pal, int threads);
+
+    // Renders the grid as background-coloured cells, preceded by the OSC 4
+    // palette definition. The terminal palette stays redefined afterwards.
+    std::string render(const ImageView& img, GridSize grid, int colours, int threads);
+
+}
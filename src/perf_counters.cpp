@@ -0,0 +1,160 @@
+#include "perf_counters.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace perf {
+
+    namespace {
+
+        const char* const kEventNames[kEventCount] = {"cycles", "instructions", "L1d-miss", "LLC-miss", "br-miss"};
+
+        int64_t nowNs() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+#if defined(__linux__)
+        int openEvent(uint32_t type, uint64_t config) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+        }
+
+        constexpr uint64_t cacheConfig(uint64_t cache, uint64_t op, uint64_t result) {
+            return cache | (op << 8) | (result << 16);
+        }
+
+        // Reads a counter, scaled up if the kernel multiplexed it.
+        uint64_t readScaled(int fd) {
+            uint64_t buf[3] = {};
+            if (::read(fd, buf, sizeof(buf)) != static_cast<ssize_t>(sizeof(buf)) || buf[2] == 0) return 0;
+            if (buf[2] >= buf[1]) return buf[0];
+            return static_cast<uint64_t>(static_cast<double>(buf[0]) * buf[1] / buf[2]);
+        }
+#endif
+
+    }
+
+    StageCounters::StageCounters() {
+        for (int& fd : fds_) fd = -1;
+#if defined(__linux__)
+        fds_[kCycles] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        if (fds_[kCycles] < 0) openError_ = std::strerror(errno);
+        fds_[kInstructions] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fds_[kL1dMisses] = openEvent(PERF_TYPE_HW_CACHE, cacheConfig(PERF_COUNT_HW_CACHE_L1D,
+                                                                     PERF_COUNT_HW_CACHE_OP_READ,
+                                                                     PERF_COUNT_HW_CACHE_RESULT_MISS));
+        fds_[kLlcMisses] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        fds_[kBranchMisses] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+#else
+        openError_ = "perf_event_open is Linux-only";
+#endif
+    }
+
+    StageCounters::~StageCounters() {
+#if defined(__linux__)
+        for (int fd : fds_) {
+            if (fd >= 0) ::close(fd);
+        }
+#endif
+    }
+
+    bool StageCounters::anyAvailable() const {
+        for (int fd : fds_) {
+            if (fd >= 0) return true;
+        }
+        return false;
+    }
+
+    void StageCounters::begin(const char* stage) {
+        samples_.push_back(StageSample{});
+        samples_.back().name = stage;
+#if defined(__linux__)
+        for (int fd : fds_) {
+            if (fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+        startNs_ = nowNs();
+    }
+
+    void StageCounters::end() {
+        const int64_t elapsed = nowNs() - startNs_;
+        StageSample& s = samples_.back();
+#if defined(__linux__)
+        for (int e = 0; e < kEventCount; ++e) {
+            if (fds_[e] < 0) continue;
+            ioctl(fds_[e], PERF_EVENT_IOC_DISABLE, 0);
+            s.values[e] = readScaled(fds_[e]);
+        }
+#endif
+        s.wallMs = static_cast<double>(elapsed) / 1e6;
+    }
+
+    void StageCounters::report(uint64_t cells) const {
+        if (!anyAvailable()) {
+            std::cerr << "perf counters unavailable (" << (openError_.empty() ? "unknown error" : openError_)
+                      << "); reporting wall time only\n";
+        }
+        if (cells == 0) cells = 1;
+
+        char line[256];
+        std::snprintf(line, sizeof(line), "%-10s %10s %14s %14s %6s %12s %12s %12s\n",
+                      "stage", "ms", kEventNames[kCycles], kEventNames[kInstructions], "IPC",
+                      "L1d/cell", "LLC/cell", "br/cell");
+        std::cerr << line;
+
+        auto perCell = [&](const StageSample& s, Event e, char* buf, size_t n) {
+            if (fds_[e] < 0) {
+                std::snprintf(buf, n, "-");
+            } else {
+                std::snprintf(buf, n, "%.3f", static_cast<double>(s.values[e]) / static_cast<double>(cells));
+            }
+        };
+        auto count = [&](const StageSample& s, Event e, char* buf, size_t n) {
+            if (fds_[e] < 0) {
+                std::snprintf(buf, n, "-");
+            } else {
+                std::snprintf(buf, n, "%llu", static_cast<unsigned long long>(s.values[e]));
+            }
+        };
+
+        for (const StageSample& s : samples_) {
+            char cyc[24], ins[24], ipc[16], l1[24], llc[24], br[24];
+            count(s, kCycles, cyc, sizeof(cyc));
+            count(s, kInstructions, ins, sizeof(ins));
+            if (fds_[kCycles] >= 0 && fds_[kInstructions] >= 0 && s.values[kCycles] > 0) {
+                std::snprintf(ipc, sizeof(ipc), "%.2f",
+                              static_cast<double>(s.values[kInstructions]) / static_cast<double>(s.values[kCycles]));
+            } else {
+                std::snprintf(ipc, sizeof(ipc), "-");
+            }
+            perCell(s, kL1dMisses, l1, sizeof(l1));
+            perCell(s, kLlcMisses, llc, sizeof(llc));
+            perCell(s, kBranchMisses, br, sizeof(br));
+            std::snprintf(line, sizeof(line), "%-10s %10.3f %14s %14s %6s %12s %12s %12s\n",
+                          s.name.c_str(), s.wallMs, cyc, ins, ipc, l1, llc, br);
+            std::cerr << line;
+        }
+        std::cerr << "cells: " << cells << "\n";
+    }
+
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Hardware performance counters around pipeline stages (Linux
+// perf_event_open). Events that cannot be opened - no PMU in a VM,
+// perf_event_paranoid, non-Linux builds - are reported as unavailable and
+// the stage still gets its wall time.
+namespace perf {
+
+    enum Event : int {
+        kCycles,
+        kInstructions,
+        kL1dMisses,
+        kLlcMisses,
+        kBranchMisses,
+        kEventCount,
+    };
+
+    struct StageSample {
+        std::string name;
+        double wallMs = 0.0;
+        uint64_t values[kEventCount] = {};
+    };
+
+    class StageCounters {
+    public:
+        StageCounters();
+        ~StageCounters();
+        StageCounters(const StageCounters&) = delete;
+        StageCounters& operator=(const StageCounters&) = delete;
+
+        bool available(Event e) const { return fds_[e] >= 0; }
+        bool anyAvailable() const;
+
+        void begin(const char* stage);
+        void end();
+
+        // Prints one line per stage with IPC and misses per output cell.
+        void report(uint64_t cells) const;
+
+    private:
+        int fds_[kEventCount];
+        std::string openError_;
+        std::vector<StageSample> samples_;
+        int64_t startNs_ = 0;
+    };
+
+}
@@ -0,0 +1,276 @@
+#include "playback.h"
+#include "decode.h"
+#include "metrics.h"
+#include "render.h"
+#include "stream_output.h"
+#include "stb_image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace playback {
+
+    namespace {
+
+        // Unchanged cells shorter than this between two changed runs are
+        // rewritten rather than skipped with a cursor move (~8 bytes).
+        constexpr int kMergeGap = 8;
+        constexpr int kMaxFrames = 1000000;
+
+        struct Slot {
+            std::string text;
+            GridSize grid{0, 0};
+            int frame = -1;     // frame held, -1 while free or being filled
+            bool ok = false;
+        };
+
+        // Accepts exactly one %d / %i / %u conversion (with optional flags
+        // and width); %% is allowed anywhere.
+        bool validPattern(const std::string& p) {
+            int conversions = 0;
+            for (size_t i = 0; i < p.size(); ++i) {
+                if (p[i] != '%') continue;
+                if (i + 1 < p.size() && p[i + 1] == '%') {
+                    ++i;
+                    continue;
+                }
+                size_t j = i + 1;
+                while (j < p.size() && (p[j] == '0' || p[j] == '-' || p[j] == '+' || p[j] == ' ')) ++j;
+                while (j < p.size() && p[j] >= '0' && p[j] <= '9') ++j;
+                if (j >= p.size() || (p[j] != 'd' && p[j] != 'i' && p[j] != 'u')) return false;
+                ++conversions;
+                i = j;
+            }
+            return conversions == 1;
+        }
+
+        std::string framePath(const std::string& pattern, int index) {
+            char buf[4096];
+            std::snprintf(buf, sizeof(buf), pattern.c_str(), index);
+            return buf;
+        }
+
+        bool exists(const std::string& path) {
+            std::FILE* f = std::fopen(path.c_str(), "rb");
+            if (f == nullptr) return false;
+            std::fclose(f);
+            return true;
+        }
+
+        void cursorTo(std::string* out, int row, int col) {
+            char buf[32];
+            int n = std::snprintf(buf, sizeof(buf), "\x1b[%d;%dH", row + 1, col + 1);
+            out->append(buf, static_cast<size_t>(n));
+        }
+
+        // Appends the escape sequences that turn prev into cur; returns the
+        // number of cells written. An empty prev redraws everything.
+        size_t diffFrame(const std::string& prev, GridSize prevGrid, const std::string& cur, GridSize grid,
+                         std::string* out) {
+            const size_t stride = static_cast<size_t>(grid.cols) + 1;
+            const bool full = prev.empty() || prevGrid.cols != grid.cols || prevGrid.rows != grid.rows;
+            size_t written = 0;
+            if (full) {
+                out->append("\x1b[H\x1b[2J");
+                for (int r = 0; r < grid.rows; ++r) {
+                    cursorTo(out, r, 0);
+                    out->append(cur, r * stride, static_cast<size_t>(grid.cols));
+                }
+                return static_cast<size_t>(grid.cols) * grid.rows;
+            }
+            for (int r = 0; r < grid.rows; ++r) {
+                const char* a = prev.data() + r * stride;
+                const char* b = cur.data() + r * stride;
+                int c = 0;
+                while (c < grid.cols) {
+                    while (c < grid.cols && a[c] == b[c]) ++c;
+                    if (c == grid.cols) break;
+                    const int start = c;
+                    int end = c + 1;
+                    for (int k = end; k < grid.cols && k - end < kMergeGap; ++k) {
+                        if (a[k] != b[k]) end = k + 1;
+                    }
+                    cursorTo(out, r, start);
+                    out->append(b + start, static_cast<size_t>(end - start));
+                    written += static_cast<size_t>(end - start);
+                    c = end;
+                }
+            }
+            return written;
+        }
+
+    }
+
+    int run(const Options& opts) {
+        if (!validPattern(opts.pattern)) {
+            std::cerr << "--play needs a pattern with one integer conversion, e.g. frames/%04d.png\n";
+            return 2;
+        }
+        int first = 0;
+        if (!exists(framePath(opts.pattern, first))) first = 1;
+        int count = 0;
+        while (count < kMaxFrames && exists(framePath(opts.pattern, first + count))) ++count;
+        if (count == 0) {
+            std::cerr << "No frames match " << opts.pattern << "\n";
+            return 1;
+        }
+
+        const int hw = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        const int workers = opts.workers > 0 ? opts.workers : std::max(1, std::min(4, hw - 1));
+        const int maxDepth = std::max(2, opts.maxDepth);
+        const double fps = opts.fps > 0.0 ? opts.fps : 24.0;
+
+        std::vector<Slot> ring(static_cast<size_t>(maxDepth));
+        std::mutex mu;
+        std::condition_variable cv;
+        int next = 0;       // next frame to hand to a worker
+        int shown = 0;      // frames already displayed
+        int depth = std::min(maxDepth, std::max(2, workers));
+        bool stop = false;
+        const bool defaultOptions = opts.render.sampling == Sampling::Nearest && opts.render.dither == Dither::None &&
+                                    opts.render.glyphs == GlyphMatch::Ramp;
+
+        auto worker = [&] {
+            for (;;) {
+                int i = 0;
+                {
+                    std::unique_lock<std::mutex> lock(mu);
+                    cv.wait(lock, [&] { return stop || next >= count || next < shown + depth; });
+                    if (stop || next >= count) return;
+                    i = next++;
+                }
+                Slot& slot = ring[static_cast<size_t>(i % maxDepth)];
+                const std::string path = framePath(opts.pattern, first + i);
+                int w = 0, h = 0, c = 0;
+                stbi_uc* img = nullptr;
+                {
+                    metrics::ScopedTimer timer(metrics::Stage::Decode);
+                    img = decode::load(path.c_str(), &w, &h, &c, 0);
+                }
+                bool ok = img != nullptr;
+                if (ok) {
+                    metrics::ScopedTimer timer(metrics::Stage::Render);
+                    const ImageView view{img, w, h, c};
+                    const orient::Transform t =
+                        orient::compose(orient::fromExif(orient::exifOrientationOfFile(path)), opts.transform);
+                    int displayWidth = 0, displayHeight = 0;
+                    orient::displaySize(view, t, &displayWidth, &displayHeight);
+                    slot.grid = computeGrid(displayWidth, displayHeight, opts.termCols);
+                    slot.text.assign(renderedSize(slot.grid), '\n');
+                    if (!t.identity()) {
+                        orient::renderWithOptions(view, t, slot.grid, opts.render, &slot.text[0]);
+                    } else if (defaultOptions) {
+                        renderAsciiInto(view, slot.grid, &slot.text[0]);
+                    } else {
+                        renderWithOptions(view, slot.grid, opts.render, &slot.text[0]);
+                    }
+                    stbi_image_free(img);
+                } else {
+                    std::cerr << "Error loading frame " << path << ": " << stbi_failure_reason() << "\n";
+                    metrics::add(metrics::Counter::Errors);
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mu);
+                    slot.ok = ok;
+                    slot.frame = i;
+                }
+                cv.notify_all();
+            }
+        };
+        std::vector<std::thread> threads;
+        for (int t = 0; t < workers; ++t) threads.emplace_back(worker);
+
+        using clock = std::chrono::steady_clock;
+        const auto period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / fps));
+        const stream_output::Sink sink = stream_output::fdSink(1);
+        std::string prev, out;
+        GridSize prevGrid{0, 0};
+        int stalls = 0, late = 0, calm = 0, peakDepth = depth;
+        size_t cellsShown = 0, cellsWritten = 0;
+        bool ok = true;
+        std::cout.flush();
+        const auto began = clock::now();
+        auto start = began;
+
+        for (int i = 0; i < count && ok; ++i) {
+            Slot& slot = ring[static_cast<size_t>(i % maxDepth)];
+            {
+                std::unique_lock<std::mutex> lock(mu);
+                if (slot.frame != i) {
+                    // Decoding fell behind the display: look further ahead.
+                    // The first frame always waits and doesn't count.
+                    if (i > 0) ++stalls;
+                    calm = 0;
+                    if (i > 0 && depth < maxDepth) {
+                        ++depth;
+                        peakDepth = std::max(peakDepth, depth);
+                        cv.notify_all();
+                    }
+                    const auto waitFrom = clock::now();
+                    cv.wait(lock, [&] { return slot.frame == i; });
+                    // Keep the schedule relative to the stall, not behind it.
+                    start += clock::now() - waitFrom;
+                }
+            }
+
+            const auto deadline = start + period * i;
+            const auto now = clock::now();
+            if (now < deadline) {
+                std::this_thread::sleep_until(deadline);
+            } else if (now > deadline + period) {
+                ++late;
+            }
+
+            if (slot.ok) {
+                out.clear();
+                cellsWritten += diffFrame(prev, prevGrid, slot.text, slot.grid, &out);
+                cellsShown += static_cast<size_t>(slot.grid.cols) * slot.grid.rows;
+                {
+                    metrics::ScopedTimer timer(metrics::Stage::Write);
+                    ok = sink(out.data(), out.size());
+                }
+                metrics::add(metrics::Counter::Images);
+                metrics::add(metrics::Counter::BytesOut, out.size());
+                // The slot keeps the old buffer so its capacity is reused.
+                prev.swap(slot.text);
+                prevGrid = slot.grid;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mu);
+                slot.frame = -1;
+                shown = i + 1;
+                // A couple of seconds without stalls: give memory back.
+                if (++calm >= static_cast<int>(2 * fps) && depth > 2) {
+                    --depth;
+                    calm = 0;
+                }
+            }
+            cv.notify_all();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            stop = true;
+        }
+        cv.notify_all();
+        for (std::thread& t : threads) t.join();
+
+        out.clear();
+        cursorTo(&out, prevGrid.rows, 0);
+        sink(out.data(), out.size());
+        const double seconds = std::chrono::duration<double>(clock::now() - began).count();
+        std::cerr << "play: " << count << " frames in " << seconds << " s (" << (count / seconds) << " fps, target "
+                  << fps << "), " << late << " late, " << stalls << " stalls, decode-ahead " << depth << " (peak "
+                  << peakDepth << "), " << workers << " workers, "
+                  << (cellsShown ? 100.0 * cellsWritten / cellsShown : 0.0) << "% of cells redrawn\n";
+        return ok ? 0 : 1;
+    }
+
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "orientation.h"
+#include "render.h"
+
+#include <string>
+
+// Plays a numbered image sequence (frames/%04d.png) as ASCII animation.
+// Frames are decoded and rendered ahead of time on worker threads into a
+// ring of reusable text buffers, shown at a fixed frame rate, and only the
+// cells that changed since the previous frame are redrawn. The decode-ahead
+// depth grows whenever the display has to wait for a frame.
+namespace playback {
+
+    struct Options {
+        std::string pattern;    // printf pattern with one integer conversion
+        double fps = 24.0;
+        int termCols = 80;
+        int workers = 0;        // decode threads; 0 picks from the core count
+        int maxDepth = 16;      // ring size, upper bound for decode-ahead
+        RenderOptions render;
+        orient::Transform transform;
+    };
+
+    // Returns the process exit status.
+    int run(const Options& opts);
+
+}
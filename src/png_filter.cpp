@@ -0,0 +1,208 @@
+#include "png_filter.h"
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace png_filter {
+
+    namespace {
+
+        // stbi__paeth: the PNG predictor, written without branches.
+        inline int paeth(int a, int b, int c) {
+            const int thresh = c * 3 - (a + b);
+            const int lo = a < b ? a : b;
+            const int hi = a < b ? b : a;
+            const int t0 = hi <= thresh ? lo : c;
+            return thresh <= lo ? hi : t0;
+        }
+
+        void subScalar(const uint8_t* raw, uint8_t* cur, size_t n, size_t k, int bpp) {
+            for (; k < n && k < static_cast<size_t>(bpp); ++k) cur[k] = raw[k];
+            for (; k < n; ++k) cur[k] = static_cast<uint8_t>(raw[k] + cur[k - bpp]);
+        }
+
+        void upScalar(const uint8_t* raw, const uint8_t* prior, uint8_t* cur, size_t n, size_t k) {
+            for (; k < n; ++k) cur[k] = static_cast<uint8_t>(raw[k] + prior[k]);
+        }
+
+        void averageScalar(const uint8_t* raw, const uint8_t* prior, uint8_t* cur, size_t n, int bpp) {
+            size_t k = 0;
+            for (; k < n && k < static_cast<size_t>(bpp); ++k) cur[k] = static_cast<uint8_t>(raw[k] + (prior[k] >> 1));
+            for (; k < n; ++k) cur[k] = static_cast<uint8_t>(raw[k] + ((prior[k] + cur[k - bpp]) >> 1));
+        }
+
+        void paethScalar(const uint8_t* raw, const uint8_t* prior, uint8_t* cur, size_t n, int bpp) {
+            size_t k = 0;
+            for (; k < n && k < static_cast<size_t>(bpp); ++k) cur[k] = static_cast<uint8_t>(raw[k] + prior[k]);
+            for (; k < n; ++k) {
+                cur[k] = static_cast<uint8_t>(raw[k] + paeth(cur[k - bpp], prior[k], prior[k - bpp]));
+            }
+        }
+
+#if defined(__SSE2__)
+        // Pixels move as 32-bit words; a 3-byte pixel carries one byte of
+        // its neighbour, which no lane of the arithmetic mixes in. Only the
+        // last pixel of a row, which may end a buffer, is moved bytewise.
+        inline __m128i loadPixel(const uint8_t* p) {
+            uint32_t v;
+            std::memcpy(&v, p, 4);
+            return _mm_cvtsi32_si128(static_cast<int>(v));
+        }
+
+        inline void storePixel(uint8_t* p, __m128i v) {
+            const uint32_t x = static_cast<uint32_t>(_mm_cvtsi128_si32(v));
+            std::memcpy(p, &x, 4);
+        }
+
+        // Runs step(raw pixel, prior pixel) -> reconstructed pixel along a
+        // row, all pixels but the last through whole words.
+        template <int Bpp, typename Step>
+        void eachPixel(const uint8_t* raw, const uint8_t* prior, uint8_t* cur, size_t n, Step step) {
+            size_t k = 0;
+            for (; k + 4 <= n; k += Bpp) {
+                storePixel(cur + k, step(loadPixel(raw + k), loadPixel(prior + k)));
+            }
+            if (k + Bpp <= n) {
+                uint8_t r[4] = {}, b[4] = {}, x[4];
+                std::memcpy(r, raw + k, Bpp);
+                std::memcpy(b, prior + k, Bpp);
+                storePixel(x, step(loadPixel(r), loadPixel(b)));
+                std::memcpy(cur + k, x, Bpp);
+            }
+        }
+
+        // Four pixels per step: a log-step prefix sum within the vector,
+        // plus the last pixel of the previous step in every pixel slot.
+        // A 3-byte step stores 16 bytes but advances 12; the spare four
+        // are rewritten by the next step.
+        template <int Bpp>
+        void subSse2(const uint8_t* raw, uint8_t* cur, size_t n) {
+            const __m128i low3 = _mm_setr_epi8(-1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+            __m128i carry = _mm_setzero_si128();
+            size_t k = 0;
+            for (; k + 16 <= n; k += 4 * Bpp) {
+                __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw + k));
+                x = _mm_add_epi8(x, _mm_slli_si128(x, Bpp));
+                x = _mm_add_epi8(x, _mm_slli_si128(x, 2 * Bpp));
+                x = _mm_add_epi8(x, carry);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(cur + k), x);
+                if (Bpp == 4) {
+                    carry = _mm_shuffle_epi32(x, 0xFF);
+                } else {
+                    carry = _mm_and_si128(_mm_srli_si128(x, 9), low3);
+                    carry = _mm_or_si128(carry, _mm_slli_si128(carry, 3));
+                    carry = _mm_or_si128(carry, _mm_slli_si128(carry, 6));
+                }
+            }
+            subScalar(raw, cur, n, k, Bpp);
+        }
+
+        void upSse2(const uint8_t* raw, const uint8_t* prior, uint8_t* cur, size_t n) {
+            size_t k = 0;
+            for (; k + 16 <= n; k += 16) {
+                const __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw + k));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + k));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(cur + k), _mm_add_epi8(r, b));
+            }
+            upScalar(raw, prior, cur, n, k);
+        }
+
+        // floor((a + b) / 2) per byte: pavgb rounds up, so take off the
+        // low bit of a ^ b.
+        template <int Bpp>
+        void averageSse2(const uint8_t* raw, const uint8_t* prior, uint8_t* cur, size_t n) {
+            const __m128i one = _mm_set1_epi8(1);
+            __m128i a = _mm_setzero_si128();
+            eachPixel<Bpp>(raw, prior, cur, n, [&](__m128i r, __m128i b) {
+                const __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+                a = _mm_add_epi8(r, avg);
+                return a;
+            });
+        }
+
+        // stbi__paeth on 16-bit lanes. Its threshold form keeps the chain
+        // from one pixel to the next short: a + b, the threshold compare,
+        // two selects and the add.
+        template <int Bpp>
+        void paethSse2(const uint8_t* raw, const uint8_t* prior, uint8_t* cur, size_t n) {
+            const __m128i zero = _mm_setzero_si128(), low = _mm_set1_epi16(0xFF);
+            auto select = [](__m128i mask, __m128i yes, __m128i no) {
+                return _mm_or_si128(_mm_and_si128(mask, yes), _mm_andnot_si128(mask, no));
+            };
+            __m128i a = zero, c = zero;
+            eachPixel<Bpp>(raw, prior, cur, n, [&](__m128i r, __m128i bytes) {
+                const __m128i b = _mm_unpacklo_epi8(bytes, zero);
+                const __m128i c3 = _mm_add_epi16(c, _mm_add_epi16(c, c));
+                const __m128i thresh = _mm_sub_epi16(c3, _mm_add_epi16(a, b));
+                const __m128i lo = _mm_min_epi16(a, b), hi = _mm_max_epi16(a, b);
+                const __m128i t0 = select(_mm_cmpgt_epi16(hi, thresh), c, lo);
+                const __m128i pred = select(_mm_cmpgt_epi16(thresh, lo), t0, hi);
+                a = _mm_and_si128(_mm_add_epi16(_mm_unpacklo_epi8(r, zero), pred), low);
+                c = b;
+                return _mm_packus_epi16(a, a);
+            });
+        }
+#endif
+
+    }
+
+    bool unfilterRow(int filter, const uint8_t* raw, const uint8_t* prior, uint8_t* cur, size_t bytes, int bpp) {
+        switch (filter) {
+            case 0:
+                std::memcpy(cur, raw, bytes);
+                return true;
+            case 1:
+#if defined(__SSE2__)
+                if (bpp == 3) {
+                    subSse2<3>(raw, cur, bytes);
+                    return true;
+                }
+                if (bpp == 4) {
+                    subSse2<4>(raw, cur, bytes);
+                    return true;
+                }
+#endif
+                subScalar(raw, cur, bytes, 0, bpp);
+                return true;
+            case 2:
+#if defined(__SSE2__)
+                upSse2(raw, prior, cur, bytes);
+#else
+                upScalar(raw, prior, cur, bytes, 0);
+#endif
+                return true;
+            case 3:
+#if defined(__SSE2__)
+                if (bpp == 3) {
+                    averageSse2<3>(raw, prior, cur, bytes);
+                    return true;
+                }
+                if (bpp == 4) {
+                    averageSse2<4>(raw, prior, cur, bytes);
+                    return true;
+                }
+#endif
+                averageScalar(raw, prior, cur, bytes, bpp);
+                return true;
+            case 4:
+#if defined(__SSE2__)
+                if (bpp == 3) {
+                    paethSse2<3>(raw, prior, cur, bytes);
+                    return true;
+                }
+                if (bpp == 4) {
+                    paethSse2<4>(raw, prior, cur, bytes);
+                    return true;
+                }
+#endif
+                paethScalar(raw, prior, cur, bytes, bpp);
+                return true;
+            default:
+                return false;
+        }
+    }
+
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// PNG scanline reconstruction (filter types 0-4). Up is added 16 bytes at a
+// time for any pixel size; for 3- and 4-byte pixels Sub is a prefix sum
+// over four pixels per vector, and Average and Paeth work a whole pixel per
+// step. Other pixel sizes, and builds without SSE2, use the scalar loops of
+// stb_image. Results are identical either way.
+namespace png_filter {
+
+    // Reconstructs `bytes` bytes of one scanline into cur from its filtered
+    // bytes in raw and the reconstructed previous line in prior (all zeros
+    // for the first line of an image or pass). bpp is the filter distance:
+    // bytes per pixel, or 1 below 8 bits per pixel, and bytes is a whole
+    // number of them. Returns false for a filter type above 4. cur must not
+    // overlap raw or prior.
+    bool unfilterRow(int filter, const uint8_t* raw, const uint8_t* prior, uint8_t* cur, size_t bytes, int bpp);
+
+}
@@ -0,0 +1,370 @@
+#include "pyramid.h"
+#include "decode.h"
+#include "stb_image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace pyramid {
+
+    namespace {
+
+        constexpr char kMagic[8] = {'A', 'S', 'C', 'I', 'P', 'Y', 'R', '\0'};
+        constexpr uint32_t kVersion = 2;
+        constexpr int kMaxLevels = 32;
+        constexpr size_t kLevelTable = 36;
+        constexpr size_t kLevelBytes = 24;
+
+        void put32(unsigned char* p, uint32_t v) {
+            for (int i = 0; i < 4; ++i) p[i] = static_cast<unsigned char>(v >> (8 * i));
+        }
+
+        void put64(unsigned char* p, uint64_t v) {
+            for (int i = 0; i < 8; ++i) p[i] = static_cast<unsigned char>(v >> (8 * i));
+        }
+
+        uint32_t get32(const unsigned char* p) {
+            return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+                   (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+        }
+
+        uint64_t get64(const unsigned char* p) { return get32(p) | (static_cast<uint64_t>(get32(p + 4)) << 32); }
+
+        size_t tileBytes(int channels) { return static_cast<size_t>(kTileSize) * kTileSize * channels; }
+
+        // Levels of a width x height image, laid out after the header page;
+        // *total is the file size.
+        std::vector<Level> plan(int width, int height, int channels, uint64_t* total) {
+            std::vector<Level> levels;
+            uint64_t offset = kPageSize;
+            for (int w = width, h = height;; w = (w + 1) / 2, h = (h + 1) / 2) {
+                Level l;
+                l.width = w;
+                l.height = h;
+                l.tilesX = (w + kTileSize - 1) / kTileSize;
+                l.tilesY = (h + kTileSize - 1) / kTileSize;
+                l.offset = offset;
+                offset += static_cast<uint64_t>(l.tilesX) * l.tilesY * tileBytes(channels);
+                levels.push_back(l);
+                if ((w <= kTileSize && h <= kTileSize) || levels.size() == kMaxLevels) break;
+            }
+            *total = offset;
+            return levels;
+        }
+
+        unsigned char* pixelIn(unsigned char* base, const Level& l, int channels, int x, int y) {
+            const size_t tile = static_cast<size_t>(y / kTileSize) * l.tilesX + x / kTileSize;
+            const size_t at = (tile * kTileSize + y % kTileSize) * kTileSize + x % kTileSize;
+            return base + l.offset + at * channels;
+        }
+
+        // Pixel of a width x height level under its displayed pixel (dx, dy)
+        // when shown through t; the mapping orient::Sampler uses.
+        void storedPixel(int width, int height, orient::Transform t, int dx, int dy, int* sx, int* sy) {
+            if (t.flip) dx = (t.swapsAxes() ? height : width) - 1 - dx;
+            switch (t.quarterTurns & 3) {
+                case 0: *sx = dx; *sy = dy; break;
+                case 1: *sx = dy; *sy = height - 1 - dx; break;
+                case 2: *sx = width - 1 - dx; *sy = height - 1 - dy; break;
+                default: *sx = width - 1 - dy; *sy = dx; break;
+            }
+        }
+
+        // Level `to` from the level before it: each pixel the rounded mean
+        // of the 2x2 block under it, repeating the last row or column of an
+        // odd-sized source. Tile by tile, so each output tile reads a 2x2
+        // block of source tiles.
+        void downsample(unsigned char* base, const Level& from, const Level& to, int channels) {
+            for (int ty = 0; ty < to.tilesY; ++ty) {
+                for (int tx = 0; tx < to.tilesX; ++tx) {
+                    const int x0 = tx * kTileSize, x1 = std::min(to.width, x0 + kTileSize);
+                    const int y0 = ty * kTileSize, y1 = std::min(to.height, y0 + kTileSize);
+                    for (int y = y0; y < y1; ++y) {
+                        const int sy0 = 2 * y, sy1 = std::min(2 * y + 1, from.height - 1);
+                        unsigned char* out = pixelIn(base, to, channels, x0, y);
+                        for (int x = x0; x < x1; ++x) {
+                            const int sx0 = 2 * x, sx1 = std::min(2 * x + 1, from.width - 1);
+                            const unsigned char* a = pixelIn(base, from, channels, sx0, sy0);
+                            const unsigned char* b = pixelIn(base, from, channels, sx1, sy0);
+                            const unsigned char* c = pixelIn(base, from, channels, sx0, sy1);
+                            const unsigned char* d = pixelIn(base, from, channels, sx1, sy1);
+                            for (int i = 0; i < channels; ++i) {
+                                *out++ = static_cast<unsigned char>((a[i] + b[i] + c[i] + d[i] + 2) >> 2);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+    }
+
+#if defined(__linux__)
+
+    bool build(const std::string& image, const std::string& path, std::string* error) {
+        error->clear();
+        // Building over the source would destroy it before it is read.
+        struct stat in{}, old{};
+        if (::stat(image.c_str(), &in) == 0 && ::stat(path.c_str(), &old) == 0 && in.st_dev == old.st_dev &&
+            in.st_ino == old.st_ino) {
+            *error = path + " is the input image";
+            return false;
+        }
+        // A temporary file next to path, renamed over it only once it is
+        // complete: a failed build leaves any old pyramid alone, and readers
+        // that have the old one mapped keep their pages.
+        struct Output {
+            std::string path;
+            int fd = -1;
+            unsigned char* data = nullptr;
+            size_t size = 0;
+            bool keep = false;
+
+            ~Output() {
+                if (data != nullptr) munmap(data, size);
+                if (fd >= 0) ::close(fd);
+                if (!path.empty() && !keep) ::unlink(path.c_str());
+            }
+        } out;
+
+        std::vector<Level> levels;
+        int channels = 0;
+        const decode::RowSink sink{
+            [&](int width, int height, int n) {
+                uint64_t total = 0;
+                levels = plan(width, height, n, &total);
+                channels = n;
+                std::string temp = path + ".XXXXXX";
+                out.fd = ::mkostemp(&temp[0], O_CLOEXEC);
+                if (out.fd < 0) {
+                    *error = "cannot create a file next to " + path;
+                    return false;
+                }
+                out.path = temp;
+                ::fchmod(out.fd, 0644);
+                if (total > SIZE_MAX || ftruncate(out.fd, static_cast<off_t>(total)) != 0) {
+                    *error = "cannot size " + path;
+                    return false;
+                }
+                out.size = static_cast<size_t>(total);
+                void* p = mmap(nullptr, out.size, PROT_READ | PROT_WRITE, MAP_SHARED, out.fd, 0);
+                if (p == MAP_FAILED) {
+                    *error = "cannot map " + path;
+                    return false;
+                }
+                out.data = static_cast<unsigned char*>(p);
+                return true;
+            },
+            [&](int y, const unsigned char* pixels) {
+                const Level& l = levels[0];
+                for (int tx = 0; tx < l.tilesX; ++tx) {
+                    const int x0 = tx * kTileSize, n = std::min(kTileSize, l.width - x0);
+                    std::memcpy(pixelIn(out.data, l, channels, x0, y), pixels + static_cast<size_t>(x0) * channels,
+                                static_cast<size_t>(n) * channels);
+                }
+            }};
+        if (!decode::decodeRows(image.c_str(), sink)) {
+            if (error->empty()) {
+                const char* reason = stbi_failure_reason();
+                *error = "cannot decode " + image + (reason != nullptr ? std::string(": ") + reason : "");
+            }
+            return false;
+        }
+        for (size_t k = 1; k < levels.size(); ++k) downsample(out.data, levels[k - 1], levels[k], channels);
+        const int orientation = orient::exifOrientationOfFile(image);
+
+        unsigned char* h = out.data;
+        put32(h + 8, kVersion);
+        put32(h + 12, static_cast<uint32_t>(levels[0].width));
+        put32(h + 16, static_cast<uint32_t>(levels[0].height));
+        put32(h + 20, static_cast<uint32_t>(channels));
+        put32(h + 24, kTileSize);
+        put32(h + 28, static_cast<uint32_t>(levels.size()));
+        put32(h + 32, static_cast<uint32_t>(orientation));
+        for (size_t k = 0; k < levels.size(); ++k) {
+            unsigned char* e = h + kLevelTable + k * kLevelBytes;
+            put32(e, static_cast<uint32_t>(levels[k].width));
+            put32(e + 4, static_cast<uint32_t>(levels[k].height));
+            put32(e + 8, static_cast<uint32_t>(levels[k].tilesX));
+            put32(e + 12, static_cast<uint32_t>(levels[k].tilesY));
+            put64(e + 16, levels[k].offset);
+        }
+        std::memcpy(h, kMagic, sizeof(kMagic));
+        if (msync(out.data, out.size, MS_SYNC) != 0) {
+            *error = "cannot write " + out.path;
+            return false;
+        }
+        if (::rename(out.path.c_str(), path.c_str()) != 0) {
+            *error = "cannot replace " + path;
+            return false;
+        }
+        out.keep = true;
+        return true;
+    }
+
+    File::~File() {
+        if (data_ != nullptr) munmap(const_cast<unsigned char*>(data_), size_);
+    }
+
+    bool File::open(const std::string& path, std::string* error) {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            *error = "cannot open";
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < kPageSize) {
+            ::close(fd);
+            *error = "not a pyramid";
+            return false;
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        void* p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            *error = "cannot map";
+            return false;
+        }
+        data_ = static_cast<const unsigned char*>(p);
+        // Renders read a few pixels from each tile they touch; readahead
+        // would only page in tiles nobody asked for.
+        madvise(p, size_, MADV_RANDOM);
+
+        const unsigned char* h = data_;
+        const uint32_t count = get32(h + 28);
+        if (std::memcmp(h, kMagic, sizeof(kMagic)) != 0) {
+            *error = "not a pyramid";
+            return false;
+        }
+        if (get32(h + 8) != kVersion) {
+            *error = "unsupported pyramid version; rebuild it with --build-pyramid";
+            return false;
+        }
+        channels_ = static_cast<int>(get32(h + 20));
+        orientation_ = static_cast<int>(get32(h + 32));
+        if (channels_ < 1 || channels_ > 4 || get32(h + 24) != kTileSize || count < 1 || count > kMaxLevels ||
+            orientation_ < 1 || orientation_ > 8 ||
+            get32(h + 12) < 1 || get32(h + 12) > (1u << 30) || get32(h + 16) < 1 || get32(h + 16) > (1u << 30)) {
+            *error = "unsupported pyramid header";
+            return false;
+        }
+        uint64_t total = 0;
+        levels_ = plan(static_cast<int>(get32(h + 12)), static_cast<int>(get32(h + 16)), channels_, &total);
+        if (levels_.size() != count || total > size_) {
+            *error = "pyramid header does not match its size";
+            return false;
+        }
+        for (size_t k = 0; k < levels_.size(); ++k) {
+            const unsigned char* e = h + kLevelTable + k * kLevelBytes;
+            const Level& l = levels_[k];
+            if (get32(e) != static_cast<uint32_t>(l.width) || get32(e + 4) != static_cast<uint32_t>(l.height) ||
+                get32(e + 8) != static_cast<uint32_t>(l.tilesX) || get32(e + 12) != static_cast<uint32_t>(l.tilesY) ||
+                get64(e + 16) != l.offset) {
+                *error = "pyramid level table is inconsistent";
+                return false;
+            }
+        }
+        return true;
+    }
+
+#else
+
+    bool build(const std::string&, const std::string&, std::string* error) {
+        *error = "pyramids are only supported on Linux";
+        return false;
+    }
+
+    File::~File() = default;
+
+    bool File::open(const std::string&, std::string* error) {
+        *error = "pyramids are only supported on Linux";
+        return false;
+    }
+
+#endif
+
+    bool isPyramid(const std::string& path) {
+        char magic[sizeof(kMagic)] = {};
+        std::FILE* f = std::fopen(path.c_str(), "rb");
+        if (f == nullptr) return false;
+        const bool read = std::fread(magic, 1, sizeof(magic), f) == sizeof(magic);
+        std::fclose(f);
+        return read && std::memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+    }
+
+    Region clampRegion(const File& f, orient::Transform t, Region r) {
+        const int width = t.swapsAxes() ? f.height() : f.width();
+        const int height = t.swapsAxes() ? f.width() : f.height();
+        r.x = std::min(std::max(r.x, 0), width - 1);
+        r.y = std::min(std::max(r.y, 0), height - 1);
+        r.width = r.width > 0 ? std::min(r.width, width - r.x) : width - r.x;
+        r.height = r.height > 0 ? std::min(r.height, height - r.y) : height - r.y;
+        return r;
+    }
+
+    int levelFor(const File& f, const Region& r, GridSize grid) {
+        const float cell = std::min(static_cast<float>(r.width) / grid.cols,
+                                    static_cast<float>(r.height) / (grid.rows * kCharAspect));
+        int k = 0;
+        while (k + 1 < f.levelCount() && static_cast<float>(1 << (k + 1)) <= cell) ++k;
+        return k;
+    }
+
+    size_t sampleLuminance(const File& f, orient::Transform t, const Region& r, GridSize grid, int k, uint8_t* lum) {
+        // The nearest-pixel rule of orient::Sampler, scaled to level k and
+        // shifted to the region: with k = 0 and the whole image every term
+        // below is the one the Sampler computes. Displayed columns and rows
+        // each advance along one stored axis, so tiles are counted per axis.
+        const Level& l = f.level(k);
+        const int width = t.swapsAxes() ? l.height : l.width;
+        const int height = t.swapsAxes() ? l.width : l.height;
+        const float scale = static_cast<float>(1 << k);
+        const float cw = static_cast<float>(r.width) / scale / grid.cols;
+        const float ch = static_cast<float>(r.height) / scale / (grid.rows * kCharAspect);
+        const float ox = r.x / scale, oy = r.y / scale;
+
+        std::vector<int> dx(static_cast<size_t>(grid.cols));
+        int tilesAcross = 0, lastTile = -1;
+        for (int x = 0; x < grid.cols; ++x) {
+            const int d = nearestIndex(x, cw, ox, width);
+            dx[static_cast<size_t>(x)] = d;
+            int sx = 0, sy = 0;
+            storedPixel(l.width, l.height, t, d, 0, &sx, &sy);
+            const int tile = (t.swapsAxes() ? sy : sx) / kTileSize;
+            if (tile != lastTile) {
+                lastTile = tile;
+                ++tilesAcross;
+            }
+        }
+        int tilesDown = 0;
+        lastTile = -1;
+        const int channels = f.channels();
+        for (int y = 0; y < grid.rows; ++y) {
+            const int dy = nearestIndex(y, ch, oy, height);
+            uint8_t* row = lum + static_cast<size_t>(y) * grid.cols;
+            for (int x = 0; x < grid.cols; ++x) {
+                int sx = 0, sy = 0;
+                storedPixel(l.width, l.height, t, dx[static_cast<size_t>(x)], dy, &sx, &sy);
+                if (x == 0) {
+                    const int tile = (t.swapsAxes() ? sx : sy) / kTileSize;
+                    if (tile != lastTile) {
+                        lastTile = tile;
+                        ++tilesDown;
+                    }
+                }
+                row[x] = luminance(f.pixel(k, sx, sy), channels);
+            }
+        }
+        return static_cast<size_t>(tilesAcross) * tilesDown;
+    }
+
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "orientation.h"
+#include "render.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Persistent image pyramid: the decoded image and its mip levels, cut into
+// fixed-size tiles in one file that is mapped and sampled in place, so a
+// huge image is decoded once (--build-pyramid) and every later render, at
+// any zoom, reads only the tiles under its cells.
+//
+// Layout, all integers little-endian:
+//   0   magic "ASCIPYR\0"
+//   8   u32 version (2)
+//   12  u32 width, u32 height, u32 channels (as decoded, 1-4)
+//   24  u32 tile size T, u32 level count
+//   32  u32 EXIF orientation tag of the source (1-8)
+//   36  per level: u32 width, u32 height, u32 tilesX, u32 tilesY, u64 offset
+// Level 0 is the image; each further level halves the one before (2x2 box,
+// rounded, the last row or column repeated at odd edges) until it fits in
+// one tile. A level is its tiles row by row, each T * T * channels bytes
+// with rows of T pixels, zero past the image edge. The header fills the
+// first page and every tile starts on a page boundary. Levels are stored as
+// decoded; the orientation is applied when sampling.
+namespace pyramid {
+
+    constexpr int kTileSize = 256;
+    constexpr size_t kPageSize = 4096;
+
+    struct Level {
+        int width = 0, height = 0;
+        int tilesX = 0, tilesY = 0;
+        uint64_t offset = 0;
+    };
+
+    // Decodes image row by row (decode::decodeRows) straight into the tiles
+    // of level 0 of a new file, then builds each level from the one before
+    // it in the mapping. The file is written next to path and renamed over
+    // it only once complete, so a failed build leaves whatever was at path
+    // untouched. Refuses to build when path is image itself.
+    bool build(const std::string& image, const std::string& path, std::string* error);
+
+    // Whether path starts with the pyramid magic.
+    bool isPyramid(const std::string& path);
+
+    class File {
+    public:
+        File() = default;
+        ~File();
+        File(const File&) = delete;
+        File& operator=(const File&) = delete;
+
+        // Maps path and checks its header against the file size.
+        bool open(const std::string& path, std::string* error);
+
+        int width() const { return levels_.empty() ? 0 : levels_[0].width; }
+        int height() const { return levels_.empty() ? 0 : levels_[0].height; }
+        int channels() const { return channels_; }
+        int orientation() const { return orientation_; }
+        int levelCount() const { return static_cast<int>(levels_.size()); }
+        const Level& level(int k) const { return levels_[static_cast<size_t>(k)]; }
+
+        // Pixel (x, y) of level k, channels() bytes; x and y in range.
+        const unsigned char* pixel(int k, int x, int y) const {
+            const Level& l = levels_[static_cast<size_t>(k)];
+            const size_t tile = static_cast<size_t>(y / kTileSize) * l.tilesX + x / kTileSize;
+            const size_t at = (tile * kTileSize + y % kTileSize) * kTileSize + x % kTileSize;
+            return data_ + l.offset + at * channels_;
+        }
+
+    private:
+        const unsigned char* data_ = nullptr;
+        size_t size_ = 0;
+        int channels_ = 0;
+        int orientation_ = 1;
+        std::vector<Level> levels_;
+    };
+
+    // Part of the displayed image (level 0 seen through a transform) in its
+    // pixels; a zero width or height means the whole image.
+    struct Region {
+        int x = 0, y = 0;
+        int width = 0, height = 0;
+    };
+
+    // Region clamped to f as displayed through t, with zero sizes filled in.
+    Region clampRegion(const File& f, orient::Transform t, Region r);
+
+    // Coarsest level whose pixels are no larger than a cell of grid over r
+    // along either axis.
+    int levelFor(const File& f, const Region& r, GridSize grid);
+
+    // Luminance of the level k pixel nearest each cell centre of grid over
+    // r of f displayed through t (grid.cols * grid.rows bytes), picked
+    // exactly as orient::Sampler picks from the decoded image when k is 0
+    // and r the whole image. Returns the number of distinct tiles read.
+    size_t sampleLuminance(const File& f, orient::Transform t, const Region& r, GridSize grid, int k, uint8_t* lum);
+
+}
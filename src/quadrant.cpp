@@ -0,0 +1,199 @@
+#include "quadrant.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace quadrant {
+
+    namespace {
+
+        constexpr int kCandidates = 8;
+
+        // UTF-8 glyph per mask, indexed as in Choice::mask.
+        constexpr const char* kGlyphs[16] = {
+            " ", "▘", "▝", "▀", "▖", "▌", "▞", "▛",
+            "▗", "▚", "▐", "▜", "▄", "▙", "▟", "█",
+        };
+
+        // 1 / popcount, with 0 for the empty side of the split.
+        constexpr float kInvCount[5] = {0.0f, 1.0f, 1.0f / 2, 1.0f / 3, 1.0f / 4};
+
+        int popcount4(int m) {
+            return (m & 1) + ((m >> 1) & 1) + ((m >> 2) & 1) + ((m >> 3) & 1);
+        }
+
+        uint8_t meanOf(int sum, int n) {
+            return static_cast<uint8_t>((sum + n / 2) / n);
+        }
+
+        // Fills in the colours of a chosen split.
+        Choice finish(const Cell& cell, int mask) {
+            int fg[3] = {0, 0, 0}, bg[3] = {0, 0, 0};
+            for (int k = 0; k < 4; ++k) {
+                int* side = (mask >> k) & 1 ? fg : bg;
+                for (int c = 0; c < 3; ++c) side[c] += cell.rgb[k][c];
+            }
+            const int n1 = popcount4(mask);
+            Choice out;
+            out.mask = mask;
+            for (int c = 0; c < 3; ++c) {
+                out.bg[c] = meanOf(bg[c], 4 - n1);
+                out.fg[c] = n1 > 0 ? meanOf(fg[c], n1) : out.bg[c];
+            }
+            return out;
+        }
+
+        // Squared error of a split is sum|p|^2 - |S1|^2/n1 - |S0|^2/n0, so
+        // the best split maximises the last two terms. Ties go to the lowest
+        // mask, in both evaluators.
+        int pickBest(const float* score) {
+            int best = 0;
+            for (int m = 1; m < kCandidates; ++m) {
+                if (score[m] > score[best]) best = m;
+            }
+            return best;
+        }
+
+        void appendByte(std::string* out, int v) {
+            char buf[3];
+            int n = 0;
+            do {
+                buf[n++] = static_cast<char>('0' + v % 10);
+                v /= 10;
+            } while (v > 0);
+            while (n > 0) out->push_back(buf[--n]);
+        }
+
+        void appendColour(std::string* out, const char* prefix, const uint8_t* rgb) {
+            out->append(prefix);
+            appendByte(out, rgb[0]);
+            out->push_back(';');
+            appendByte(out, rgb[1]);
+            out->push_back(';');
+            appendByte(out, rgb[2]);
+            out->push_back('m');
+        }
+
+        void renderRowInto(const ImageView& img, GridSize grid, const std::vector<int>& sx, int y, std::string* out) {
+            const float subRow = static_cast<float>(img.height) / (2.0f * grid.rows);
+            int sy[2];
+            for (int k = 0; k < 2; ++k) {
+                sy[k] = nearestIndex(2 * y + k, subRow, 0.0f, img.height);
+            }
+            const size_t rowBytes = static_cast<size_t>(img.width) * img.channels;
+            const unsigned char* rows[2] = {img.data + sy[0] * rowBytes, img.data + sy[1] * rowBytes};
+
+            out->clear();
+            int lastFg = -1, lastBg = -1;
+            for (int x = 0; x < grid.cols; ++x) {
+                Cell cell;
+                for (int k = 0; k < 4; ++k) {
+                    const unsigned char* p = rows[k >> 1] + static_cast<size_t>(sx[2 * x + (k & 1)]) * img.channels;
+                    premultipliedRgb(p, img.channels, cell.rgb[k]);
+                }
+                const Choice choice = bestPartition(cell);
+                const int bg = (choice.bg[0] << 16) | (choice.bg[1] << 8) | choice.bg[2];
+                const int fg = (choice.fg[0] << 16) | (choice.fg[1] << 8) | choice.fg[2];
+                if (bg != lastBg) {
+                    appendColour(out, "\x1b[48;2;", choice.bg);
+                    lastBg = bg;
+                }
+                if (choice.mask != 0 && fg != lastFg) {
+                    appendColour(out, "\x1b[38;2;", choice.fg);
+                    lastFg = fg;
+                }
+                out->append(kGlyphs[choice.mask]);
+            }
+            out->append("\x1b[0m\n");
+        }
+
+    }
+
+    Choice bestPartitionScalar(const Cell& cell) {
+        int total[3] = {0, 0, 0};
+        for (int k = 0; k < 4; ++k) {
+            for (int c = 0; c < 3; ++c) total[c] += cell.rgb[k][c];
+        }
+        float score[kCandidates];
+        for (int m = 0; m < kCandidates; ++m) {
+            float s1 = 0.0f, s0 = 0.0f;
+            for (int c = 0; c < 3; ++c) {
+                int in = 0;
+                for (int k = 0; k < 3; ++k) {
+                    if ((m >> k) & 1) in += cell.rgb[k][c];
+                }
+                const float a = static_cast<float>(in), b = static_cast<float>(total[c] - in);
+                s1 += a * a;
+                s0 += b * b;
+            }
+            const int n1 = popcount4(m);
+            score[m] = s1 * kInvCount[n1] + s0 * kInvCount[4 - n1];
+        }
+        return finish(cell, pickBest(score));
+    }
+
+    Choice bestPartition(const Cell& cell) {
+#if defined(__SSE2__)
+        // Masks 0-3 in lo, 4-7 in hi; bit k of the mask selects sample k.
+        const __m128 bit0 = _mm_castsi128_ps(_mm_setr_epi32(0, -1, 0, -1));
+        const __m128 bit1 = _mm_castsi128_ps(_mm_setr_epi32(0, 0, -1, -1));
+        const __m128 inv1Lo = _mm_setr_ps(kInvCount[0], kInvCount[1], kInvCount[1], kInvCount[2]);
+        const __m128 inv1Hi = _mm_setr_ps(kInvCount[1], kInvCount[2], kInvCount[2], kInvCount[3]);
+        const __m128 inv0Lo = _mm_setr_ps(kInvCount[4], kInvCount[3], kInvCount[3], kInvCount[2]);
+        const __m128 inv0Hi = _mm_setr_ps(kInvCount[3], kInvCount[2], kInvCount[2], kInvCount[1]);
+
+        __m128 s1Lo = _mm_setzero_ps(), s1Hi = _mm_setzero_ps();
+        __m128 s0Lo = _mm_setzero_ps(), s0Hi = _mm_setzero_ps();
+        for (int c = 0; c < 3; ++c) {
+            const __m128 p0 = _mm_set1_ps(cell.rgb[0][c]);
+            const __m128 p1 = _mm_set1_ps(cell.rgb[1][c]);
+            const __m128 p2 = _mm_set1_ps(cell.rgb[2][c]);
+            const __m128 total = _mm_set1_ps(static_cast<float>(cell.rgb[0][c] + cell.rgb[1][c] + cell.rgb[2][c] +
+                                                                cell.rgb[3][c]));
+            const __m128 lo = _mm_add_ps(_mm_and_ps(bit0, p0), _mm_and_ps(bit1, p1));
+            const __m128 hi = _mm_add_ps(lo, p2);
+            const __m128 restLo = _mm_sub_ps(total, lo);
+            const __m128 restHi = _mm_sub_ps(total, hi);
+            s1Lo = _mm_add_ps(s1Lo, _mm_mul_ps(lo, lo));
+            s1Hi = _mm_add_ps(s1Hi, _mm_mul_ps(hi, hi));
+            s0Lo = _mm_add_ps(s0Lo, _mm_mul_ps(restLo, restLo));
+            s0Hi = _mm_add_ps(s0Hi, _mm_mul_ps(restHi, restHi));
+        }
+        float score[kCandidates];
+        _mm_storeu_ps(score, _mm_add_ps(_mm_mul_ps(s1Lo, inv1Lo), _mm_mul_ps(s0Lo, inv0Lo)));
+        _mm_storeu_ps(score + 4, _mm_add_ps(_mm_mul_ps(s1Hi, inv1Hi), _mm_mul_ps(s0Hi, inv0Hi)));
+        return finish(cell, pickBest(score));
+#else
+        return bestPartitionScalar(cell);
+#endif
+    }
+
+    std::string render(const ImageView& img, GridSize grid, int threads) {
+        std::vector<int> sx(static_cast<size_t>(grid.cols) * 2);
+        const float subCol = static_cast<float>(img.width) / (2.0f * grid.cols);
+        for (size_t u = 0; u < sx.size(); ++u) {
+            sx[u] = nearestIndex(static_cast<int>(u), subCol, 0.0f, img.width);
+        }
+
+        std::vector<std::string> rows(static_cast<size_t>(grid.rows));
+        ThreadPool& pool = ThreadPool::shared();
+        const int chunk = std::max(1, grid.rows / (std::max(1, threads) * 4));
+        pool.parallelFor(grid.rows, chunk, threads, [&](int begin, int end) {
+            for (int y = begin; y < end; ++y) renderRowInto(img, grid, sx, y, &rows[static_cast<size_t>(y)]);
+        });
+
+        size_t total = 0;
+        for (const std::string& r : rows) total += r.size();
+        std::string out;
+        out.reserve(total);
+        for (const std::string& r : rows) out += r;
+        return out;
+    }
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "render.h"
+
+#include <cstdint>
+#include <string>
+
+// Colour rendering with Unicode quadrant blocks: every cell covers 2x2
+// samples and shows one of the 16 quadrant glyphs with a foreground and a
+// background 24-bit colour, chosen as the 2-colour split of the four
+// samples with the least squared error. That quadruples the spatial
+// resolution of the ramp in terminals with true colour.
+namespace quadrant {
+
+    // Four RGB samples: top-left, top-right, bottom-left, bottom-right.
+    struct Cell {
+        uint8_t rgb[4][3];
+    };
+
+    // Mask of the samples drawn in the foreground colour (bit 0 = top-left,
+    // 1 = top-right, 2 = bottom-left, 3 = bottom-right) plus both colours.
+    struct Choice {
+        int mask;
+        uint8_t fg[3];
+        uint8_t bg[3];
+    };
+
+    // Best partition. A mask and its complement are the same split, so only
+    // the eight masks without the bottom-right bit are evaluated.
+    Choice bestPartition(const Cell& cell);
+
+    // Plain loop over the same candidates; the reference for the SIMD path.
+    Choice bestPartitionScalar(const Cell& cell);
+
+    // Renders the grid as ANSI true-colour quadrant text, rows spread over up
+    // to `threads` threads of the shared pool.
+    std::string render(const ImageView& img, GridSize grid, int threads);
+
+}
@@ -0,0 +1,214 @@
+#include "quality.h"
+#include "decode.h"
+#include "font8x8.h"
+#include "stb_image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace quality {
+
+    namespace {
+
+        constexpr int kWindow = 8;
+        constexpr int kStep = 4;
+
+        struct WindowSums {
+            int32_t a, b, aa, bb, ab;
+        };
+
+#if defined(__SSE2__)
+        inline int32_t hsum(__m128i v) {
+            v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+            v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+            return _mm_cvtsi128_si32(v);
+        }
+
+        inline WindowSums windowSums(const uint8_t* a, const uint8_t* b, size_t stride) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i ones = _mm_set1_epi16(1);
+            __m128i sa = zero, sb = zero, saa = zero, sbb = zero, sab = zero;
+            for (int r = 0; r < kWindow; ++r) {
+                const __m128i va = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(a + r * stride)), zero);
+                const __m128i vb = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(b + r * stride)), zero);
+                sa = _mm_add_epi32(sa, _mm_madd_epi16(va, ones));
+                sb = _mm_add_epi32(sb, _mm_madd_epi16(vb, ones));
+                saa = _mm_add_epi32(saa, _mm_madd_epi16(va, va));
+                sbb = _mm_add_epi32(sbb, _mm_madd_epi16(vb, vb));
+                sab = _mm_add_epi32(sab, _mm_madd_epi16(va, vb));
+            }
+            return WindowSums{hsum(sa), hsum(sb), hsum(saa), hsum(sbb), hsum(sab)};
+        }
+#else
+        inline WindowSums windowSums(const uint8_t* a, const uint8_t* b, size_t stride) {
+            WindowSums s{0, 0, 0, 0, 0};
+            for (int r = 0; r < kWindow; ++r) {
+                for (int c = 0; c < kWindow; ++c) {
+                    const int32_t va = a[r * stride + c], vb = b[r * stride + c];
+                    s.a += va;
+                    s.b += vb;
+                    s.aa += va * va;
+                    s.bb += vb * vb;
+                    s.ab += va * vb;
+                }
+            }
+            return s;
+        }
+#endif
+
+        double windowSsim(const WindowSums& s) {
+            constexpr double n = kWindow * kWindow;
+            constexpr double c1 = (0.01 * 255) * (0.01 * 255);
+            constexpr double c2 = (0.03 * 255) * (0.03 * 255);
+            const double ma = s.a / n, mb = s.b / n;
+            const double va = s.aa / n - ma * ma;
+            const double vb = s.bb / n - mb * mb;
+            const double cov = s.ab / n - ma * mb;
+            return ((2 * ma * mb + c1) * (2 * cov + c2)) / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+        }
+
+        const char* samplingName(Sampling s) { return s == Sampling::Nearest ? "nearest" : "area"; }
+        const char* ditherName(Dither d) { return d == Dither::None ? "none" : "floyd-steinberg"; }
+        const char* glyphName(GlyphMatch g) { return g == GlyphMatch::Ramp ? "ramp" : "coverage"; }
+
+        struct ModeResult {
+            RenderOptions opts;
+            double totalMs = 0.0;
+            double ssimSum = 0.0;
+            int images = 0;
+        };
+
+        // Mean render time over enough repetitions to get past timer noise.
+        double timeRender(const ImageView& img, GridSize grid, const RenderOptions& opts, std::string* text) {
+            using clock = std::chrono::steady_clock;
+            int runs = 0;
+            auto start = clock::now();
+            auto elapsed = clock::duration::zero();
+            do {
+                renderWithOptions(img, grid, opts, &(*text)[0]);
+                ++runs;
+                elapsed = clock::now() - start;
+            } while (runs < 3 || (elapsed < std::chrono::milliseconds(50) && runs < 200));
+            return std::chrono::duration<double, std::milli>(elapsed).count() / runs;
+        }
+
+    }
+
+    void rasterize(const char* text, GridSize grid, uint8_t* out) {
+        const size_t outW = static_cast<size_t>(grid.cols) * kGlyphW;
+        const size_t stride = static_cast<size_t>(grid.cols) + 1;
+        for (int y = 0; y < grid.rows; ++y) {
+            for (int x = 0; x < grid.cols; ++x) {
+                const uint8_t* rows = glyphBitmap(text[static_cast<size_t>(y) * stride + x]);
+                for (int r = 0; r < kGlyphH; ++r) {
+                    const uint8_t bits = rows[r / 2];
+                    uint8_t* dst = out + (static_cast<size_t>(y) * kGlyphH + r) * outW + static_cast<size_t>(x) * kGlyphW;
+                    for (int b = 0; b < kGlyphW; ++b) dst[b] = ((bits >> b) & 1) ? 255 : 0;
+                }
+            }
+        }
+    }
+
+    double ssim(const uint8_t* a, const uint8_t* b, int width, int height, int threads) {
+        if (width < kWindow || height < kWindow) return 1.0;
+        const int winX = (width - kWindow) / kStep + 1;
+        const int winY = (height - kWindow) / kStep + 1;
+        threads = std::max(1, std::min(threads, winY));
+
+        std::vector<double> partial(static_cast<size_t>(threads), 0.0);
+        auto work = [&](int t) {
+            double sum = 0.0;
+            for (int wy = t; wy < winY; wy += threads) {
+                const size_t rowOffset = static_cast<size_t>(wy) * kStep * width;
+                for (int wx = 0; wx < winX; ++wx) {
+                    const size_t off = rowOffset + static_cast<size_t>(wx) * kStep;
+                    sum += windowSsim(windowSums(a + off, b + off, static_cast<size_t>(width)));
+                }
+            }
+            partial[static_cast<size_t>(t)] = sum;
+        };
+
+        std::vector<std::thread> pool;
+        for (int t = 1; t < threads; ++t) pool.emplace_back(work, t);
+        work(0);
+        for (std::thread& th : pool) th.join();
+
+        double total = 0.0;
+        for (double p : partial) total += p;
+        return total / (static_cast<double>(winX) * winY);
+    }
+
+    int runQualityBench(const std::vector<std::string>& paths, int termCols) {
+        std::vector<ModeResult> modes;
+        for (Sampling s : {Sampling::Nearest, Sampling::Area}) {
+            for (Dither d : {Dither::None, Dither::FloydSteinberg}) {
+                for (GlyphMatch g : {GlyphMatch::Ramp, GlyphMatch::Coverage}) {
+                    ModeResult m;
+                    m.opts = RenderOptions{s, d, g};
+                    modes.push_back(m);
+                }
+            }
+        }
+        const int threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        int maxInk = 0;
+        for (int i = 0; i < kRampN; ++i) maxInk = std::max(maxInk, glyphCoverage(glyphBitmap(kRamp[i])));
+
+        int loaded = 0;
+        for (const std::string& path : paths) {
+            int width = 0, height = 0, channels = 0;
+            stbi_uc* data = decode::load(path.c_str(), &width, &height, &channels, 0);
+            if (data == nullptr) {
+                std::cerr << "Error loading image: " << stbi_failure_reason() << "\n";
+                std::cerr << "Tried: " << path << "\n";
+                continue;
+            }
+            ++loaded;
+            const ImageView img{data, width, height, channels};
+            const GridSize grid = computeGrid(width, height, termCols);
+            const int gw = grid.cols * kGlyphW, gh = grid.rows * kGlyphH;
+            const int vw = gw / kViewScale, vh = gh / kViewScale;
+
+            std::vector<uint8_t> plane(static_cast<size_t>(width) * height);
+            luminancePlane(img, plane.data());
+            std::vector<uint8_t> reference(static_cast<size_t>(vw) * vh);
+            boxResample(plane.data(), width, height,
+                        cellWidth(img, grid) * grid.cols, cellHeight(img, grid) * grid.rows,
+                        vw, vh, reference.data());
+            for (uint8_t& v : reference) v = static_cast<uint8_t>(v * maxInk / 64);
+
+            std::string text(renderedSize(grid), '\n');
+            std::vector<uint8_t> raster(static_cast<size_t>(gw) * gh);
+            std::vector<uint8_t> viewed(reference.size());
+            for (ModeResult& m : modes) {
+                m.totalMs += timeRender(img, grid, m.opts, &text);
+                rasterize(text.data(), grid, raster.data());
+                boxResample(raster.data(), gw, gh, static_cast<float>(gw), static_cast<float>(gh), vw, vh, viewed.data());
+                m.ssimSum += ssim(reference.data(), viewed.data(), vw, vh, threads);
+                m.images++;
+            }
+            stbi_image_free(data);
+        }
+        if (loaded == 0) return 1;
+
+        std::printf("%-8s %-16s %-9s %12s %8s %s\n", "sampling", "dither", "glyphs", "ms/image", "SSIM", "pareto");
+        for (const ModeResult& m : modes) {
+            const double ms = m.totalMs / m.images, q = m.ssimSum / m.images;
+            bool dominated = false;
+            for (const ModeResult& o : modes) {
+                const double oms = o.totalMs / o.images, oq = o.ssimSum / o.images;
+                if (oms <= ms && oq >= q && (oms < ms || oq > q)) dominated = true;
+            }
+            std::printf("%-8s %-16s %-9s %12.4f %8.4f %s\n", samplingName(m.opts.sampling), ditherName(m.opts.dither),
+                        glyphName(m.opts.glyphs), ms, q, dominated ? "" : "*");
+        }
+        return 0;
+    }
+
+}
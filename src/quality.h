@@ -0,0 +1,34 @@
+#pragma once
+
+#include "render.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Speed/quality evaluation of the render modes. The text output is
+// re-rasterized with the embedded 8x8 font (each font row doubled, so a cell
+// is 8x16 like a terminal glyph), blurred to viewing distance by box
+// filtering it kViewScale times smaller, and compared with SSIM to the
+// source box-filtered to the same resolution over the grid's footprint.
+// The source is scaled into the brightness range the glyphs can reach, so
+// the score measures structure rather than the font's maximum ink.
+namespace quality {
+
+    constexpr int kGlyphW = 8;
+    constexpr int kGlyphH = 16;
+    constexpr int kViewScale = 4;
+
+    // Draws rendered text (renderedSize(grid) bytes) into a
+    // cols*kGlyphW x rows*kGlyphH luminance raster.
+    void rasterize(const char* text, GridSize grid, uint8_t* out);
+
+    // Mean SSIM over 8x8 windows with a stride of 4, split across threads.
+    double ssim(const uint8_t* a, const uint8_t* b, int width, int height, int threads);
+
+    // Renders every image with every sampling / dithering / glyph mode and
+    // prints time per image and mean SSIM per mode on stdout, marking the
+    // Pareto-optimal ones.
+    int runQualityBench(const std::vector<std::string>& paths, int termCols);
+
+}
@@ -0,0 +1,308 @@
+#include "render.h"
+#include "font8x8.h"
+#include "hugepages.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+GridSize computeGrid(int width, int height, int termCols) {
+    int targetCols = std::max(20, termCols - 2);
+
+    float scale = static_cast<float>(targetCols) / static_cast<float>(width);
+    int targetRows = std::max(1, static_cast<int>(std::round((height * scale) / kCharAspect)));
+    return GridSize{targetCols, targetRows};
+}
+
+void renderRow(const ImageView& img, GridSize grid, int y, char* out) {
+    const int width = img.width;
+    const int height = img.height;
+
+    int sy = nearestRow(height, grid.rows, y);
+    for (int x = 0; x < grid.cols; ++x) {
+        int sx = nearestColumn(width, grid.cols, x);
+        const unsigned char* p = img.data + (static_cast<size_t>(sy) * width + sx) * img.channels;
+        out[x] = glyphFor(luminance(p, img.channels));
+    }
+}
+
+void renderAsciiInto(const ImageView& img, GridSize grid, char* out) {
+    const size_t stride = static_cast<size_t>(grid.cols) + 1;
+    for (int y = 0; y < grid.rows; ++y) {
+        char* line = out + static_cast<size_t>(y) * stride;
+        renderRow(img, grid, y, line);
+        line[grid.cols] = '\n';
+    }
+}
+
+void renderAsciiParallel(const ImageView& img, GridSize grid, int threads, int chunkRows, char* out) {
+    renderAsciiParallel(img, grid, threads, chunkRows, out, ThreadPool::shared());
+}
+
+void renderAsciiParallel(const ImageView& img, GridSize grid, int threads, int chunkRows, char* out,
+                         ThreadPool& pool) {
+    if (threads <= 1) {
+        renderAsciiInto(img, grid, out);
+        return;
+    }
+    const size_t stride = static_cast<size_t>(grid.cols) + 1;
+    pool.parallelFor(grid.rows, chunkRows, threads, [&](int begin, int end) {
+        for (int y = begin; y < end; ++y) {
+            char* line = out + static_cast<size_t>(y) * stride;
+            renderRow(img, grid, y, line);
+            line[grid.cols] = '\n';
+        }
+    });
+}
+
+std::string renderAscii(const ImageView& img, GridSize grid) {
+    std::string text(renderedSize(grid), '\n');
+    renderAsciiInto(img, grid, &text[0]);
+    return text;
+}
+
+void resampleGrid(const ImageView& img, GridSize grid, unsigned char* samples) {
+    const int width = img.width;
+    const int height = img.height;
+    const size_t channels = static_cast<size_t>(img.channels);
+
+    std::vector<int> sxs(static_cast<size_t>(grid.cols));
+    for (int x = 0; x < grid.cols; ++x) {
+        sxs[static_cast<size_t>(x)] = nearestColumn(width, grid.cols, x);
+    }
+    for (int y = 0; y < grid.rows; ++y) {
+        int sy = nearestRow(height, grid.rows, y);
+        const unsigned char* row = img.data + static_cast<size_t>(sy) * width * channels;
+        unsigned char* dst = samples + static_cast<size_t>(y) * grid.cols * channels;
+        for (int x = 0; x < grid.cols; ++x) {
+            std::memcpy(dst + static_cast<size_t>(x) * channels, row + static_cast<size_t>(sxs[static_cast<size_t>(x)]) * channels, channels);
+        }
+    }
+}
+
+namespace {
+
+    // One loop per channel count, so the compiler can vectorise each.
+    template <int Channels>
+    void luminanceRun(const unsigned char* samples, size_t cells, uint8_t* lum) {
+        for (size_t i = 0; i < cells; ++i) lum[i] = luminance(samples + i * Channels, Channels);
+    }
+
+}
+
+void luminanceGrid(const unsigned char* samples, int channels, size_t cells, uint8_t* lum) {
+    switch (channels) {
+        case 1: return luminanceRun<1>(samples, cells, lum);
+        case 2: return luminanceRun<2>(samples, cells, lum);
+        case 3: return luminanceRun<3>(samples, cells, lum);
+        case 4: return luminanceRun<4>(samples, cells, lum);
+        default:
+            for (size_t i = 0; i < cells; ++i) {
+                lum[i] = luminance(samples + i * static_cast<size_t>(channels), channels);
+            }
+    }
+}
+
+void glyphGrid(const uint8_t* lum, GridSize grid, char* out) {
+    for (int y = 0; y < grid.rows; ++y) {
+        const uint8_t* src = lum + static_cast<size_t>(y) * grid.cols;
+        char* line = out + static_cast<size_t>(y) * (static_cast<size_t>(grid.cols) + 1);
+        for (int x = 0; x < grid.cols; ++x) line[x] = glyphFor(src[x]);
+        line[grid.cols] = '\n';
+    }
+}
+
+void luminancePlane(const ImageView& img, uint8_t* out) {
+    const size_t pixels = static_cast<size_t>(img.width) * img.height;
+    luminanceGrid(img.data, img.channels, pixels, out);
+}
+
+namespace {
+
+    struct GlyphLevels {
+        char glyph[kRampN];
+        float level[kRampN];
+        uint8_t nearest[256];   // index of the closest level for each byte value
+    };
+
+    GlyphLevels makeLevels(GlyphMatch match) {
+        GlyphLevels g{};
+        if (match == GlyphMatch::Ramp) {
+            for (int i = 0; i < kRampN; ++i) {
+                g.glyph[i] = kRamp[i];
+                g.level[i] = i * 255.0f / (kRampN - 1);
+            }
+        } else {
+            int coverage[kRampN];
+            int maxCoverage = 1;
+            int order[kRampN];
+            for (int i = 0; i < kRampN; ++i) {
+                coverage[i] = glyphCoverage(glyphBitmap(kRamp[i]));
+                maxCoverage = std::max(maxCoverage, coverage[i]);
+                order[i] = i;
+            }
+            std::stable_sort(order, order + kRampN, [&](int a, int b) { return coverage[a] < coverage[b]; });
+            for (int i = 0; i < kRampN; ++i) {
+                g.glyph[i] = kRamp[order[i]];
+                g.level[i] = coverage[order[i]] * 255.0f / maxCoverage;
+            }
+        }
+        for (int v = 0; v < 256; ++v) {
+            int best = 0;
+            for (int i = 1; i < kRampN; ++i) {
+                if (std::fabs(g.level[i] - v) < std::fabs(g.level[best] - v)) best = i;
+            }
+            g.nearest[v] = static_cast<uint8_t>(best);
+        }
+        return g;
+    }
+
+    const GlyphLevels& levelsFor(GlyphMatch match) {
+        static const GlyphLevels ramp = makeLevels(GlyphMatch::Ramp);
+        static const GlyphLevels coverage = makeLevels(GlyphMatch::Coverage);
+        return match == GlyphMatch::Ramp ? ramp : coverage;
+    }
+
+}
+
+void boxSpans(int srcN, float region, int outN, std::vector<int>& lo, std::vector<int>& hi) {
+    lo.resize(static_cast<size_t>(outN));
+    hi.resize(static_cast<size_t>(outN));
+    const float step = region / outN;
+    for (int i = 0; i < outN; ++i) {
+        const float a = i * step, b = (i + 1) * step;
+        int first = std::max(0, static_cast<int>(std::ceil(a - 0.5f)));
+        int last = std::min(srcN, static_cast<int>(std::ceil(b - 0.5f)));
+        if (first >= last) {
+            first = std::min(srcN - 1, std::max(0, static_cast<int>((a + b) * 0.5f)));
+            last = first + 1;
+        }
+        lo[static_cast<size_t>(i)] = first;
+        hi[static_cast<size_t>(i)] = last;
+    }
+}
+
+void boxResample(const uint8_t* plane, int width, int height, float regionW, float regionH,
+                 int outW, int outH, uint8_t* out) {
+    BoxAccumulator acc(width, height, regionW, regionH, outW, outH);
+    for (int sy = 0; sy < height; ++sy) acc.addRow(sy, plane + static_cast<size_t>(sy) * width);
+    acc.finish(out);
+}
+
+BoxAccumulator::BoxAccumulator(int width, int height, float regionW, float regionH, int outW, int outH)
+    : outW_(outW), outH_(outH),
+      firstOut_(static_cast<size_t>(height), 0), endOut_(static_cast<size_t>(height), 0),
+      colSums_(static_cast<size_t>(width), 0u), cellSums_(static_cast<size_t>(outW) * outH, 0u) {
+    boxSpans(width, regionW, outW, x0_, x1_);
+    boxSpans(height, regionH, outH, y0_, y1_);
+    // Spans only move forward, so the output rows covering a source row
+    // are a contiguous range.
+    for (int oy = outH - 1; oy >= 0; --oy) {
+        for (int sy = y0_[static_cast<size_t>(oy)]; sy < y1_[static_cast<size_t>(oy)]; ++sy) {
+            const size_t i = static_cast<size_t>(sy);
+            if (endOut_[i] == 0) endOut_[i] = oy + 1;
+            firstOut_[i] = oy;
+        }
+    }
+}
+
+void BoxAccumulator::addRow(int y, const uint8_t* row) {
+    const size_t i = static_cast<size_t>(y);
+    if (firstOut_[i] == endOut_[i]) return;
+    if (firstOut_[i] != bandFirst_ || endOut_[i] != bandEnd_) {
+        fold();
+        bandFirst_ = firstOut_[i];
+        bandEnd_ = endOut_[i];
+    }
+    const size_t width = colSums_.size();
+    for (size_t sx = 0; sx < width; ++sx) colSums_[sx] += row[sx];
+}
+
+void BoxAccumulator::fold() {
+    if (bandFirst_ == bandEnd_) return;
+    for (int ox = 0; ox < outW_; ++ox) {
+        uint64_t sum = 0;
+        for (int sx = x0_[static_cast<size_t>(ox)]; sx < x1_[static_cast<size_t>(ox)]; ++sx) {
+            sum += colSums_[static_cast<size_t>(sx)];
+        }
+        for (int oy = bandFirst_; oy < bandEnd_; ++oy) cellSums_[static_cast<size_t>(oy) * outW_ + ox] += sum;
+    }
+    std::fill(colSums_.begin(), colSums_.end(), 0u);
+    bandFirst_ = bandEnd_ = 0;
+}
+
+void BoxAccumulator::finish(uint8_t* out) {
+    fold();
+    for (int oy = 0; oy < outH_; ++oy) {
+        const uint64_t rows = static_cast<uint64_t>(y1_[static_cast<size_t>(oy)] - y0_[static_cast<size_t>(oy)]);
+        for (int ox = 0; ox < outW_; ++ox) {
+            const uint64_t cols = static_cast<uint64_t>(x1_[static_cast<size_t>(ox)] - x0_[static_cast<size_t>(ox)]);
+            const uint64_t count = cols * rows;
+            const size_t c = static_cast<size_t>(oy) * outW_ + ox;
+            out[c] = static_cast<uint8_t>((cellSums_[c] + count / 2) / count);
+        }
+    }
+}
+
+void sampleLuminance(const ImageView& img, GridSize grid, Sampling sampling, uint8_t* lum) {
+    if (sampling == Sampling::Nearest) {
+        const size_t cells = static_cast<size_t>(grid.cols) * grid.rows;
+        std::vector<unsigned char> samples(cells * static_cast<size_t>(img.channels));
+        resampleGrid(img, grid, samples.data());
+        luminanceGrid(samples.data(), img.channels, cells, lum);
+        return;
+    }
+    hugepages::Buffer plane(static_cast<size_t>(img.width) * img.height);
+    luminancePlane(img, plane.data());
+    boxResample(plane.data(), img.width, img.height,
+                cellWidth(img, grid) * grid.cols, cellHeight(img, grid) * grid.rows,
+                grid.cols, grid.rows, lum);
+}
+
+void mapGlyphs(const uint8_t* lum, GridSize grid, Dither dither, GlyphMatch glyphs, char* out) {
+    const size_t stride = static_cast<size_t>(grid.cols) + 1;
+    if (dither == Dither::None && glyphs == GlyphMatch::Ramp) {
+        glyphGrid(lum, grid, out);
+        return;
+    }
+
+    const GlyphLevels& levels = levelsFor(glyphs);
+    if (dither == Dither::None) {
+        for (int y = 0; y < grid.rows; ++y) {
+            const uint8_t* src = lum + static_cast<size_t>(y) * grid.cols;
+            char* line = out + static_cast<size_t>(y) * stride;
+            for (int x = 0; x < grid.cols; ++x) line[x] = levels.glyph[levels.nearest[src[x]]];
+            line[grid.cols] = '\n';
+        }
+        return;
+    }
+
+    // Floyd-Steinberg over the cell grid; error rows carry one cell of
+    // padding on each side so the kernel needs no edge checks.
+    std::vector<float> errCur(static_cast<size_t>(grid.cols) + 2, 0.f);
+    std::vector<float> errNext(static_cast<size_t>(grid.cols) + 2, 0.f);
+    for (int y = 0; y < grid.rows; ++y) {
+        const uint8_t* src = lum + static_cast<size_t>(y) * grid.cols;
+        char* line = out + static_cast<size_t>(y) * stride;
+        std::fill(errNext.begin(), errNext.end(), 0.f);
+        for (int x = 0; x < grid.cols; ++x) {
+            const float v = src[x] + errCur[static_cast<size_t>(x) + 1];
+            const int q = levels.nearest[clampU8(static_cast<int>(std::lround(v)))];
+            const float e = v - levels.level[q];
+            line[x] = levels.glyph[q];
+            errCur[static_cast<size_t>(x) + 2] += e * (7.0f / 16.0f);
+            errNext[static_cast<size_t>(x)] += e * (3.0f / 16.0f);
+            errNext[static_cast<size_t>(x) + 1] += e * (5.0f / 16.0f);
+            errNext[static_cast<size_t>(x) + 2] += e * (1.0f / 16.0f);
+        }
+        line[grid.cols] = '\n';
+        std::swap(errCur, errNext);
+    }
+}
+
+void renderWithOptions(const ImageView& img, GridSize grid, const RenderOptions& opts, char* out) {
+    std::vector<uint8_t> lum(static_cast<size_t>(grid.cols) * grid.rows);
+    sampleLuminance(img, grid, opts.sampling, lum.data());
+    mapGlyphs(lum.data(), grid, opts.dither, opts.glyphs, out);
+}
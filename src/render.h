@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct ImageView {
+    const unsigned char* data;
+    int width;
+    int height;
+    int channels;
+};
+
+struct GridSize {
+    int cols;
+    int rows;
+};
+
+constexpr float kCharAspect = 2.0f;
+constexpr char kRamp[] = " .:-=+*#%@";
+constexpr int kRampN = static_cast<int>(sizeof(kRamp) - 1);
+
+static inline uint8_t clampU8(int v) {
+    if (v < 0) return 0;
+    if (v > 255) return 255;
+    return static_cast<uint8_t>(v);
+}
+
+static inline uint8_t luminance(const unsigned char* p, int channels) {
+
+    float r = 0.f, g = 0.f, b = 0.f, a = 1.f;
+    if (channels == 1) {
+
+        r = g = b = p[0] / 255.0f;
+    } else if (channels == 2) {
+
+        float gray = p[0] / 255.0f;
+        a = p[1] / 255.0f;
+        r = g = b = gray * a;
+    } else if (channels >= 3) {
+        r = p[0] / 255.0f;
+        g = p[1] / 255.0f;
+        b = p[2] / 255.0f;
+        if (channels >= 4) {
+            a = p[3] / 255.0f;
+            r *= a; g *= a; b *= a;
+        }
+    }
+    float Y = 0.2126f * r + 0.7152f * g + 0.0722f * b;
+    // std::round for Y >= 0 without the libm call: the sum is exact in
+    // double, so truncating it rounds halves away from zero.
+    int yi = static_cast<int>(static_cast<double>(Y * 255.0f) + 0.5);
+    return clampU8(yi);
+}
+
+// Colour of one pixel with alpha applied, treating grey and alpha channels
+// the way luminance() does.
+static inline void premultipliedRgb(const unsigned char* p, int channels, uint8_t* rgb) {
+    int r = p[0], g = p[0], b = p[0], a = 255;
+    if (channels == 2) a = p[1];
+    if (channels >= 3) {
+        g = p[1];
+        b = p[2];
+    }
+    if (channels >= 4) a = p[3];
+    if (a != 255) {
+        r = (r * a + 127) / 255;
+        g = (g * a + 127) / 255;
+        b = (b * a + 127) / 255;
+    }
+    rgb[0] = static_cast<uint8_t>(r);
+    rgb[1] = static_cast<uint8_t>(g);
+    rgb[2] = static_cast<uint8_t>(b);
+}
+
+static inline char glyphFor(uint8_t lum) {
+    return kRamp[(lum * (kRampN - 1)) / 255];
+}
+
+// Output grid for an image rendered into a terminal that is termCols wide.
+GridSize computeGrid(int width, int height, int termCols);
+
+// Renders one output row (grid.cols glyphs, no terminator) into out.
+void renderRow(const ImageView& img, GridSize grid, int y, char* out);
+
+// Bytes produced by renderAsciiInto / renderAscii for this grid.
+static inline size_t renderedSize(GridSize grid) {
+    return (static_cast<size_t>(grid.cols) + 1) * static_cast<size_t>(grid.rows);
+}
+
+// Renders the whole grid into out (renderedSize(grid) bytes), one
+// '\n'-terminated line per row.
+void renderAsciiInto(const ImageView& img, GridSize grid, char* out);
+
+std::string renderAscii(const ImageView& img, GridSize grid);
+
+class ThreadPool;
+
+// renderAsciiInto split into chunks of chunkRows rows spread over up to
+// `threads` threads of pool (the shared pool by default). threads <= 1
+// renders serially.
+void renderAsciiParallel(const ImageView& img, GridSize grid, int threads, int chunkRows, char* out);
+void renderAsciiParallel(const ImageView& img, GridSize grid, int threads, int chunkRows, char* out,
+                         ThreadPool& pool);
+
+// The same pipeline split into whole-grid passes, so each stage can be
+// measured on its own (--perf-counters). Output matches renderAsciiInto.
+//
+// resampleGrid gathers the nearest source pixel of every cell into samples
+// (cols * rows * channels bytes), luminanceGrid reduces them to one byte per
+// cell and glyphGrid maps those onto the ramp, writing renderedSize bytes.
+void resampleGrid(const ImageView& img, GridSize grid, unsigned char* samples);
+void luminanceGrid(const unsigned char* samples, int channels, size_t cells, uint8_t* lum);
+void glyphGrid(const uint8_t* lum, GridSize grid, char* out);
+
+enum class Sampling {
+    Nearest,    // one source pixel per cell (the reference path)
+    Area,       // mean luminance of all source pixels under the cell
+};
+
+enum class Dither {
+    None,
+    FloydSteinberg,
+};
+
+enum class GlyphMatch {
+    Ramp,       // evenly spaced ramp levels
+    Coverage,   // levels from the ink coverage of each glyph in the 8x8 font
+};
+
+struct RenderOptions {
+    Sampling sampling = Sampling::Nearest;
+    Dither dither = Dither::None;
+    GlyphMatch glyphs = GlyphMatch::Ramp;
+};
+
+// Source-space size of one cell. Every sampling mode covers the same
+// footprint, cols * cellWidth by rows * cellHeight from the top-left.
+static inline float cellWidth(const ImageView& img, GridSize grid) {
+    return static_cast<float>(img.width) / grid.cols;
+}
+
+static inline float cellHeight(const ImageView& img, GridSize grid) {
+    return img.height / (grid.rows * kCharAspect);
+}
+
+// Source index in [0, size) nearest the centre of cell i, for cells step
+// source pixels apart starting at offset. Every nearest-pixel path picks
+// its pixels through this (or the two below), which is what keeps them
+// bit-exact with each other.
+static inline int nearestIndex(int i, float step, float offset, int size) {
+    return std::min(size - 1, std::max(0, static_cast<int>(std::round((i + 0.5f) * step - 0.5f + offset))));
+}
+
+// Source column of cell x and source row of grid row y, as renderRow picks
+// them.
+static inline int nearestColumn(int width, int cols, int x) {
+    return nearestIndex(x, static_cast<float>(width) / cols, 0.0f, width);
+}
+
+static inline int nearestRow(int height, int rows, int y) {
+    return nearestIndex(y, height / (rows * kCharAspect), 0.0f, height);
+}
+
+// Luminance of every source pixel (width * height bytes).
+void luminancePlane(const ImageView& img, uint8_t* out);
+
+// Half-open source index range [lo, hi) for every output index along one
+// axis of boxResample; never empty.
+void boxSpans(int srcN, float region, int outN, std::vector<int>& lo, std::vector<int>& hi);
+
+// Box-filters the region [0, regionW) x [0, regionH) of a one-byte plane
+// down (or up) to outW x outH, averaging the pixels whose centres fall in
+// each output pixel and falling back to the nearest one when none do.
+void boxResample(const uint8_t* plane, int width, int height, float regionW, float regionH,
+                 int outW, int outH, uint8_t* out);
+
+// boxResample fed one source row at a time, so a decoder can hand rows
+// over while they are still in cache and the plane is never stored. Rows
+// may come in any order (a bottom-up BMP delivers its last row first);
+// each is added to column sums that are folded into per-cell totals
+// whenever the next row belongs to different output rows. The sums are
+// integers, so the result is exactly boxResample's whatever the order.
+class BoxAccumulator {
+public:
+    BoxAccumulator(int width, int height, float regionW, float regionH, int outW, int outH);
+
+    // Adds source row y (width bytes); each row at most once.
+    void addRow(int y, const uint8_t* row);
+
+    // Writes the outW * outH averages, once every row has been added.
+    void finish(uint8_t* out);
+
+private:
+    void fold();
+
+    int outW_, outH_;
+    std::vector<int> x0_, x1_, y0_, y1_;
+    std::vector<int> firstOut_, endOut_;    // output rows covering each source row
+    std::vector<uint32_t> colSums_;
+    std::vector<uint64_t> cellSums_;
+    int bandFirst_ = 0, bandEnd_ = 0;       // output rows colSums_ belongs to
+};
+
+void sampleLuminance(const ImageView& img, GridSize grid, Sampling sampling, uint8_t* lum);
+void mapGlyphs(const uint8_t* lum, GridSize grid, Dither dither, GlyphMatch glyphs, char* out);
+
+// renderAsciiInto with a choice of sampling, dithering and glyph matching;
+// the default options produce exactly the reference output.
+void renderWithOptions(const ImageView& img, GridSize grid, const RenderOptions& opts, char* out);
@@ -0,0 +1,564 @@
+#include "server.h"
+#include "alloc_trace.h"
+#include "decode.h"
+#include "metrics.h"
+#include "render.h"
+#include "stb_image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+
+namespace {
+
+    constexpr uint64_t kMaxInlineBytes = 1ull << 30;
+    constexpr int kMaxCols = 4096;
+    constexpr size_t kMaxOutputBytes = size_t(256) << 20;
+
+    bool gTraceAlloc = false;
+
+    struct Fd {
+        int fd = -1;
+
+        Fd() = default;
+        explicit Fd(int f) : fd(f) {}
+        Fd(const Fd&) = delete;
+        Fd& operator=(const Fd&) = delete;
+        Fd(Fd&& o) noexcept : fd(o.fd) { o.fd = -1; }
+        Fd& operator=(Fd&& o) noexcept {
+            if (this != &o) {
+                reset();
+                fd = o.fd;
+                o.fd = -1;
+            }
+            return *this;
+        }
+        ~Fd() { reset(); }
+
+        void reset() {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+    };
+
+    struct Mapping {
+        void* addr = nullptr;
+        size_t size = 0;
+        int error = 0;      // errno of a failed map()
+
+        Mapping() = default;
+        Mapping(const Mapping&) = delete;
+        Mapping& operator=(const Mapping&) = delete;
+        ~Mapping() {
+            if (addr != nullptr) munmap(addr, size);
+        }
+
+        bool map(int fd, size_t n, int prot) {
+            size = n;
+            if (n == 0) return true;
+            void* p = mmap(nullptr, n, prot, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                error = errno;
+                return false;
+            }
+            addr = p;
+            return true;
+        }
+
+        const unsigned char* bytes() const { return static_cast<const unsigned char*>(addr); }
+    };
+
+    using StbiPtr = std::unique_ptr<stbi_uc, void (*)(void*)>;
+
+    bool writeAll(int fd, const void* data, size_t n) {
+        const char* p = static_cast<const char*>(data);
+        while (n > 0) {
+            ssize_t w = ::send(fd, p, n, MSG_NOSIGNAL);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            p += w;
+            n -= static_cast<size_t>(w);
+        }
+        return true;
+    }
+
+    bool readAll(int fd, void* data, size_t n) {
+        char* p = static_cast<char*>(data);
+        while (n > 0) {
+            ssize_t r = ::read(fd, p, n);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) return false;
+            p += r;
+            n -= static_cast<size_t>(r);
+        }
+        return true;
+    }
+
+    bool sendWithFds(int sock, const void* data, size_t n, const int* fds, int nfds) {
+        if (nfds == 0) return writeAll(sock, data, n);
+
+        iovec iov{const_cast<void*>(data), n};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 2)]{};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        std::memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+
+        ssize_t w;
+        do {
+            w = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while (w < 0 && errno == EINTR);
+        if (w < 0) return false;
+        const size_t sent = static_cast<size_t>(w);
+        return sent == n || writeAll(sock, static_cast<const char*>(data) + sent, n - sent);
+    }
+
+    // Reads exactly n bytes; descriptors arrive with the first chunk.
+    bool recvWithFds(int sock, void* data, size_t n, Fd* fds, int maxFds, int* nfds) {
+        *nfds = 0;
+        iovec iov{data, n};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 2)]{};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t r;
+        do {
+            r = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        } while (r < 0 && errno == EINTR);
+        if (r <= 0) return false;
+
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+            int count = static_cast<int>((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < count; ++i) {
+                int fd;
+                std::memcpy(&fd, CMSG_DATA(cm) + sizeof(int) * i, sizeof(int));
+                if (*nfds < maxFds) {
+                    fds[(*nfds)++] = Fd(fd);
+                } else {
+                    ::close(fd);
+                }
+            }
+        }
+        if (msg.msg_flags & MSG_CTRUNC) return false;
+
+        const size_t got = static_cast<size_t>(r);
+        return got == n || readAll(sock, static_cast<char*>(data) + got, n - got);
+    }
+
+    bool sendResponse(int sock, int status, uint64_t size) {
+        if (status != 0) metrics::add(metrics::Counter::Errors);
+        transport::Response resp{transport::kMagic, status, size};
+        return writeAll(sock, &resp, sizeof(resp));
+    }
+
+    // Serves one request. Returns false when the connection should be dropped.
+    bool handleRequest(int sock, const transport::Request& req, Fd* fds, int nfds) {
+        using namespace transport;
+
+        const bool inputFd = (req.flags & kInputFd) != 0;
+        const bool outputFd = (req.flags & kOutputFd) != 0;
+        const int needFds = (inputFd ? 1 : 0) + (outputFd ? 1 : 0);
+        if (nfds != needFds) return false;
+        const int inFd = inputFd ? fds[0].fd : -1;
+        const int outFd = outputFd ? fds[nfds - 1].fd : -1;
+
+        Mapping inMap;
+        std::vector<unsigned char> inBuf;
+        const unsigned char* bytes = nullptr;
+        size_t n = 0;
+        if (inputFd) {
+            // Unsealed, the client could shrink the memfd mid-decode and
+            // take the whole server down with SIGBUS.
+            const int seals = fcntl(inFd, F_GET_SEALS);
+            if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE)) {
+                return sendResponse(sock, EPERM, 0);
+            }
+            struct stat st{};
+            if (fstat(inFd, &st) != 0) return sendResponse(sock, errno, 0);
+            if (!inMap.map(inFd, static_cast<size_t>(st.st_size), PROT_READ)) return sendResponse(sock, inMap.error, 0);
+            bytes = inMap.bytes();
+            n = inMap.size;
+        } else {
+            if (req.size > kMaxInlineBytes) return false;
+            inBuf.resize(static_cast<size_t>(req.size));
+            if (!readAll(sock, inBuf.data(), inBuf.size())) return false;
+            bytes = inBuf.data();
+            n = inBuf.size();
+        }
+        metrics::add(metrics::Counter::BytesIn, n);
+
+        StbiPtr decoded(nullptr, stbi_image_free);
+        ImageView img{};
+        if (req.flags & kRawPixels) {
+            img = ImageView{bytes, req.width, req.height, req.channels};
+            if (img.width <= 0 || img.height <= 0 || img.channels < 1 || img.channels > 4 ||
+                static_cast<uint64_t>(img.width) * img.height * img.channels > n) {
+                return sendResponse(sock, EINVAL, 0);
+            }
+        } else {
+            if (n > static_cast<size_t>(INT_MAX)) return sendResponse(sock, EFBIG, 0);
+            int w = 0, h = 0, c = 0;
+            {
+                metrics::ScopedTimer timer(metrics::Stage::Decode);
+                alloc_trace::reset();
+                decoded.reset(decode::loadFromMemory(bytes, n, &w, &h, &c, 0));
+            }
+            if (gTraceAlloc) {
+                alloc_trace::report("request (" + std::to_string(n) + " bytes)",
+                                    decoded ? static_cast<uint64_t>(w) * h * c : 0);
+            }
+            if (!decoded) {
+                std::cerr << "Error decoding request: " << stbi_failure_reason() << "\n";
+                return sendResponse(sock, EINVAL, 0);
+            }
+            img = ImageView{decoded.get(), w, h, c};
+        }
+
+        // cols comes from the client: bound it, and the text it implies
+        // (estimated in double, as computeGrid's int row count could
+        // overflow), before anything is sized from it.
+        if (req.cols <= 0 || req.cols > kMaxCols) return sendResponse(sock, EINVAL, 0);
+        const double cols = std::max(20, req.cols - 2);
+        const double rows = static_cast<double>(img.height) * cols / img.width / kCharAspect;
+        if ((cols + 1) * (rows + 1) > static_cast<double>(kMaxOutputBytes)) return sendResponse(sock, EFBIG, 0);
+        GridSize grid = computeGrid(img.width, img.height, req.cols);
+        const size_t outSize = renderedSize(grid);
+        if (outSize > kMaxOutputBytes) return sendResponse(sock, EFBIG, 0);
+
+        if (outputFd) {
+            Mapping outMap;
+            if (ftruncate(outFd, static_cast<off_t>(outSize)) != 0) return sendResponse(sock, errno, 0);
+            // Fix the size before mapping it, and check nobody changed it
+            // between the ftruncate and the seal.
+            struct stat st{};
+            if (fcntl(outFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) return sendResponse(sock, EPERM, 0);
+            if (fstat(outFd, &st) != 0) return sendResponse(sock, errno, 0);
+            if (static_cast<uint64_t>(st.st_size) != outSize) return sendResponse(sock, EINVAL, 0);
+            if (!outMap.map(outFd, outSize, PROT_READ | PROT_WRITE)) return sendResponse(sock, outMap.error, 0);
+            {
+                metrics::ScopedTimer timer(metrics::Stage::Render);
+                renderAsciiInto(img, grid, static_cast<char*>(outMap.addr));
+            }
+            metrics::add(metrics::Counter::Images);
+            metrics::add(metrics::Counter::BytesOut, outSize);
+            metrics::ScopedTimer timer(metrics::Stage::Write);
+            return sendResponse(sock, 0, outSize);
+        }
+
+        std::string text(outSize, '\n');
+        {
+            metrics::ScopedTimer timer(metrics::Stage::Render);
+            renderAsciiInto(img, grid, &text[0]);
+        }
+        metrics::add(metrics::Counter::Images);
+        metrics::add(metrics::Counter::BytesOut, outSize);
+        metrics::ScopedTimer timer(metrics::Stage::Write);
+        return sendResponse(sock, 0, text.size()) && writeAll(sock, text.data(), text.size());
+    }
+
+    void serveConnection(int sock) {
+        for (;;) {
+            transport::Request req{};
+            Fd fds[2];
+            int nfds = 0;
+            if (!recvWithFds(sock, &req, sizeof(req), fds, 2, &nfds)) return;
+            if (req.magic != transport::kMagic) return;
+            if (!handleRequest(sock, req, fds, nfds)) return;
+        }
+    }
+
+    // Accepted connections waiting for a worker.
+    struct ConnectionQueue {
+        struct Item {
+            Fd conn;
+            std::chrono::steady_clock::time_point enqueued;
+        };
+
+        std::mutex mu;
+        std::condition_variable cv;
+        std::deque<Item> items;
+
+        void push(Fd conn) {
+            {
+                std::lock_guard<std::mutex> lock(mu);
+                items.push_back(Item{std::move(conn), std::chrono::steady_clock::now()});
+            }
+            cv.notify_one();
+        }
+
+        Fd pop() {
+            std::unique_lock<std::mutex> lock(mu);
+            cv.wait(lock, [this] { return !items.empty(); });
+            Item item = std::move(items.front());
+            items.pop_front();
+            lock.unlock();
+            auto waited = std::chrono::steady_clock::now() - item.enqueued;
+            metrics::record(metrics::Stage::QueueWait,
+                            static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count()));
+            return std::move(item.conn);
+        }
+    };
+
+    bool makeAddress(const std::string& path, sockaddr_un* addr) {
+        if (path.size() >= sizeof(addr->sun_path)) {
+            std::cerr << "Socket path too long: " << path << "\n";
+            return false;
+        }
+        *addr = sockaddr_un{};
+        addr->sun_family = AF_UNIX;
+        std::memcpy(addr->sun_path, path.c_str(), path.size() + 1);
+        return true;
+    }
+
+    Fd connectTo(const std::string& path) {
+        sockaddr_un addr{};
+        if (!makeAddress(path, &addr)) return Fd();
+        Fd sock(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        if (sock.fd < 0 || ::connect(sock.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            std::cerr << "Cannot connect to " << path << ": " << std::strerror(errno) << "\n";
+            return Fd();
+        }
+        return sock;
+    }
+
+    // Copies data into a sealed memfd so the server can map it without
+    // worrying about the client resizing it underneath.
+    Fd makeInputMemfd(const unsigned char* data, size_t n) {
+        Fd fd(memfd_create("ascii-request", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+        if (fd.fd < 0 || ftruncate(fd.fd, static_cast<off_t>(n)) != 0) return Fd();
+        {
+            Mapping m;
+            if (!m.map(fd.fd, n, PROT_READ | PROT_WRITE)) return Fd();
+            if (n > 0) std::memcpy(m.addr, data, n);
+        }
+        // The server refuses an input it could see change.
+        if (fcntl(fd.fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) return Fd();
+        return fd;
+    }
+
+    struct Payload {
+        const unsigned char* data = nullptr;
+        size_t size = 0;
+        int width = 0, height = 0, channels = 0;
+        bool raw = false;
+    };
+
+    // One request/response round trip. The rendered text is appended to out.
+    bool roundTrip(int sock, const Payload& payload, int cols, bool memfd, std::string* out) {
+        using namespace transport;
+
+        Request req{};
+        req.magic = kMagic;
+        req.cols = cols;
+        if (payload.raw) {
+            req.flags |= kRawPixels;
+            req.width = payload.width;
+            req.height = payload.height;
+            req.channels = payload.channels;
+        }
+
+        Fd inFd, outFd;
+        if (memfd) {
+            inFd = makeInputMemfd(payload.data, payload.size);
+            outFd = Fd(memfd_create("ascii-response", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+            if (inFd.fd < 0 || outFd.fd < 0) {
+                std::cerr << "memfd_create failed: " << std::strerror(errno) << "\n";
+                return false;
+            }
+            req.flags |= kInputFd | kOutputFd;
+            int fds[2] = {inFd.fd, outFd.fd};
+            if (!sendWithFds(sock, &req, sizeof(req), fds, 2)) return false;
+        } else {
+            req.size = payload.size;
+            if (!writeAll(sock, &req, sizeof(req)) || !writeAll(sock, payload.data, payload.size)) return false;
+        }
+
+        Response resp{};
+        if (!readAll(sock, &resp, sizeof(resp)) || resp.magic != kMagic) {
+            std::cerr << "Server closed the connection\n";
+            return false;
+        }
+        if (resp.status != 0) {
+            std::cerr << "Server error: " << std::strerror(resp.status) << "\n";
+            return false;
+        }
+
+        const size_t base = out->size();
+        if (memfd) {
+            Mapping m;
+            if (!m.map(outFd.fd, static_cast<size_t>(resp.size), PROT_READ)) return false;
+            out->append(reinterpret_cast<const char*>(m.addr), m.size);
+        } else {
+            out->resize(base + static_cast<size_t>(resp.size));
+            if (!readAll(sock, &(*out)[base], static_cast<size_t>(resp.size))) return false;
+        }
+        return true;
+    }
+
+    // Maps the image file and, for raw requests, decodes it up front so the
+    // transport is measured on its own.
+    struct ClientInput {
+        Fd fd;
+        Mapping file;
+        StbiPtr pixels{nullptr, stbi_image_free};
+        Payload payload;
+
+        bool load(const ClientOptions& opts) {
+            fd = Fd(::open(opts.imagePath.c_str(), O_RDONLY | O_CLOEXEC));
+            struct stat st{};
+            if (fd.fd < 0 || fstat(fd.fd, &st) != 0 ||
+                !file.map(fd.fd, static_cast<size_t>(st.st_size), PROT_READ)) {
+                std::cerr << "Cannot read " << opts.imagePath << ": " << std::strerror(errno) << "\n";
+                return false;
+            }
+            payload.data = file.bytes();
+            payload.size = file.size;
+            if (!opts.raw) return true;
+
+            int w = 0, h = 0, c = 0;
+            pixels.reset(decode::loadFromMemory(file.bytes(), file.size, &w, &h, &c, 0));
+            if (!pixels) {
+                std::cerr << "Error loading image: " << stbi_failure_reason() << "\n";
+                return false;
+            }
+            payload = Payload{pixels.get(), static_cast<size_t>(w) * h * c, w, h, c, true};
+            return true;
+        }
+    };
+
+}
+
+int runServer(const std::string& socketPath, int workers, bool traceAlloc) {
+    gTraceAlloc = traceAlloc;
+
+    sockaddr_un addr{};
+    if (!makeAddress(socketPath, &addr)) return 1;
+
+    struct stat st{};
+    if (lstat(socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) ::unlink(socketPath.c_str());
+
+    Fd listener(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (listener.fd < 0 ||
+        ::bind(listener.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        ::listen(listener.fd, 16) != 0) {
+        std::cerr << "Cannot listen on " << socketPath << ": " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    if (workers <= 0) workers = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    std::cerr << "Listening on " << socketPath << " with " << workers << " workers\n";
+
+    ConnectionQueue queue;
+    for (int i = 0; i < workers; ++i) {
+        std::thread([&queue]() {
+            for (;;) {
+                Fd conn = queue.pop();
+                serveConnection(conn.fd);
+            }
+        }).detach();
+    }
+
+    for (;;) {
+        Fd conn(::accept4(listener.fd, nullptr, nullptr, SOCK_CLOEXEC));
+        if (conn.fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::cerr << "accept failed: " << std::strerror(errno) << "\n";
+            return 1;
+        }
+        queue.push(std::move(conn));
+    }
+}
+
+int runClient(const ClientOptions& opts) {
+    ClientInput input;
+    if (!input.load(opts)) return 1;
+    Fd sock = connectTo(opts.socketPath);
+    if (sock.fd < 0) return 1;
+
+    std::string text;
+    if (!roundTrip(sock.fd, input.payload, opts.cols, opts.memfd, &text)) return 1;
+    std::cout.write(text.data(), static_cast<std::streamsize>(text.size()));
+    return 0;
+}
+
+int runTransportBenchmark(const ClientOptions& opts) {
+    ClientInput input;
+    if (!input.load(opts)) return 1;
+    Fd sock = connectTo(opts.socketPath);
+    if (sock.fd < 0) return 1;
+
+    const int iterations = std::max(1, opts.iterations);
+    std::cerr << "payload: " << input.payload.size << " bytes"
+              << (input.payload.raw ? " (raw pixels)" : " (encoded)")
+              << ", " << iterations << " iterations\n";
+
+    for (bool memfd : {false, true}) {
+        std::vector<double> ms;
+        std::string text;
+        for (int i = 0; i < iterations; ++i) {
+            text.clear();
+            auto t0 = std::chrono::steady_clock::now();
+            if (!roundTrip(sock.fd, input.payload, opts.cols, memfd, &text)) return 1;
+            auto t1 = std::chrono::steady_clock::now();
+            ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+        }
+        std::sort(ms.begin(), ms.end());
+        double mean = 0.0;
+        for (double v : ms) mean += v;
+        mean /= static_cast<double>(ms.size());
+        std::cerr << (memfd ? "memfd " : "inline") << "  min " << ms.front()
+                  << " ms  median " << ms[ms.size() / 2]
+                  << " ms  mean " << mean << " ms\n";
+    }
+    return 0;
+}
+
+#else
+
+int runServer(const std::string&, int, bool) {
+    std::cerr << "--serve is only supported on Linux\n";
+    return 1;
+}
+
+int runClient(const ClientOptions&) {
+    std::cerr << "--client is only supported on Linux\n";
+    return 1;
+}
+
+int runTransportBenchmark(const ClientOptions&) {
+    std::cerr << "--bench-transport is only supported on Linux\n";
+    return 1;
+}
+
+#endif
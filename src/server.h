@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Local conversion server over a Unix domain socket.
+//
+// Each request is a fixed-size header, optionally followed by an inline
+// payload. Instead of the payload, a client can attach file descriptors with
+// SCM_RIGHTS: a memfd holding the encoded image (or raw pixels), and a memfd
+// the server resizes and renders the text straight into. Passing both keeps
+// large requests zero-copy through the kernel. The input memfd must carry
+// F_SEAL_SHRINK and F_SEAL_WRITE, and the output memfd must allow sealing:
+// the server seals its size once it is set, so a client cannot pull pages
+// out from under the server's mappings.
+namespace transport {
+
+    constexpr uint32_t kMagic = 0x31435341; // "ASC1"
+
+    enum RequestFlags : uint32_t {
+        kInputFd = 1u << 0,
+        kOutputFd = 1u << 1,
+        kRawPixels = 1u << 2,
+    };
+
+    struct Request {
+        uint32_t magic;
+        uint32_t flags;
+        uint64_t size;      // inline payload bytes; ignored with kInputFd
+        int32_t cols;       // terminal columns to render for
+        int32_t width;      // kRawPixels only
+        int32_t height;
+        int32_t channels;
+    };
+
+    struct Response {
+        uint32_t magic;
+        int32_t status;     // 0 on success, otherwise an errno-style code
+        uint64_t size;      // rendered bytes; follows inline unless kOutputFd
+    };
+
+}
+
+struct ClientOptions {
+    std::string socketPath;
+    std::string imagePath;
+    int cols = 100;
+    bool memfd = false;     // pass input and output through memfds
+    bool raw = false;       // decode locally and send raw pixels
+    int iterations = 10;    // --bench-transport only
+};
+
+// Serves connections on socketPath with a pool of worker threads
+// (0 = one per hardware thread). With traceAlloc, every decode reports its
+// stb_image allocations on stderr. Never returns on success.
+int runServer(const std::string& socketPath, int workers, bool traceAlloc);
+
+// Renders opts.imagePath through a running server and writes it to stdout.
+int runClient(const ClientOptions& opts);
+
+// Times inline vs memfd round trips for opts.imagePath and reports on stderr.
+int runTransportBenchmark(const ClientOptions& opts);
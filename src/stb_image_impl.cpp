@@ -0,0 +1,1416 @@
+#include "alloc_trace.h"
+
+#define STBI_MALLOC(sz) alloc_trace::stbMalloc(sz)
+#define STBI_REALLOC(p, newsz) alloc_trace::stbRealloc(p, newsz)
+#define STBI_FREE(p) alloc_trace::stbFree(p)
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include "decode.h"
+#include "jpeg_luma.h"
+#include "jpeg_preview.h"
+#include "jpeg_simd.h"
+
+namespace {
+
+    // The AVX2 IDCT transforms blocks in pairs, while stb_image hands the
+    // kernel one block at a time: each odd block waits (copied, since stb
+    // reuses its coefficient buffer) until the next one arrives. Nothing
+    // reads the planes before the scans are done, so one flushIdct after
+    // stbi__decode_jpeg_image completes them.
+    struct PendingBlock {
+        alignas(32) short data[64];
+        stbi_uc* out = nullptr;
+        int stride = 0;
+    };
+    thread_local PendingBlock tPending;
+    thread_local const jpeg_simd::Kernels* tKernels = nullptr;
+
+    void pairedIdct(stbi_uc* out, int out_stride, short data[64]) {
+        if (tPending.out == nullptr) {
+            memcpy(tPending.data, data, sizeof(tPending.data));
+            tPending.out = out;
+            tPending.stride = out_stride;
+            return;
+        }
+        tKernels->idct2(tPending.out, tPending.stride, tPending.data, out, out_stride, data);
+        tPending.out = nullptr;
+    }
+
+    void flushIdct() {
+        if (tPending.out == nullptr) return;
+        tKernels->idct2(tPending.out, tPending.stride, tPending.data, tPending.out, tPending.stride, tPending.data);
+        tPending.out = nullptr;
+    }
+
+    stbi_uc* upsampleHv2(stbi_uc* out, stbi_uc* in_near, stbi_uc* in_far, int w, int hs) {
+        return tKernels->upsampleHv2(out, in_near, in_far, w, hs);
+    }
+
+    void ycbcrToRgb(stbi_uc* out, const stbi_uc* y, const stbi_uc* pcb, const stbi_uc* pcr, int count, int step) {
+        tKernels->ycbcrToRgb(out, y, pcb, pcr, count, step);
+    }
+
+    // stbi__setup_jpeg, then the AVX2 kernels where the CPU has them.
+    void setupJpeg(stbi__jpeg* j) {
+        stbi__setup_jpeg(j);
+        tPending.out = nullptr;
+        tKernels = jpeg_simd::avx2();
+        if (tKernels == nullptr) return;
+        j->idct_block_kernel = pairedIdct;
+        j->resample_row_hv_2_kernel = upsampleHv2;
+        j->YCbCr_to_RGB_kernel = ycbcrToRgb;
+    }
+
+}
+
+namespace jpeg_luma {
+
+    namespace {
+
+        // stb_image calls the IDCT kernel without saying which component a
+        // block belongs to, so the wrapper tells them apart by destination:
+        // only blocks landing in the Y plane are transformed.
+        thread_local stbi__jpeg* tJpeg = nullptr;
+        thread_local void (*tIdct)(stbi_uc* out, int out_stride, short data[64]) = nullptr;
+
+        void lumaOnlyIdct(stbi_uc* out, int out_stride, short data[64]) {
+            const auto& y = tJpeg->img_comp[0];
+            if (out >= y.data && out < y.data + static_cast<size_t>(y.w2) * y.h2) tIdct(out, out_stride, data);
+        }
+
+        // Baseline YCbCr with Y at the full MCU resolution; RGB and CMYK
+        // JPEGs and odd subsampling go through the normal decoder.
+        bool lumaOnly(const stbi__jpeg* j) {
+            const bool rgb = j->rgb == 3 || (j->app14_color_transform == 0 && !j->jfif);
+            return j->s->img_n == 3 && !rgb && j->img_comp[0].h == j->img_h_max &&
+                   j->img_comp[0].v == j->img_v_max;
+        }
+
+        // stbi__decode_jpeg_image with the IDCT restricted to component 0.
+        // Returns -1 when the image is not eligible, 0 on error, 1 on success.
+        int decodeLuma(stbi__jpeg* j) {
+            for (int m = 0; m < 4; ++m) {
+                j->img_comp[m].raw_data = nullptr;
+                j->img_comp[m].raw_coeff = nullptr;
+            }
+            j->restart_interval = 0;
+            if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
+            if (!lumaOnly(j)) return -1;
+
+            tJpeg = j;
+            tIdct = j->idct_block_kernel;
+            j->idct_block_kernel = lumaOnlyIdct;
+            int m = stbi__get_marker(j);
+            while (!stbi__EOI(m)) {
+                if (stbi__SOS(m)) {
+                    if (!stbi__process_scan_header(j)) return 0;
+                    if (!stbi__parse_entropy_coded_data(j)) return 0;
+                    if (j->marker == STBI__MARKER_none) j->marker = stbi__skip_jpeg_junk_at_end(j);
+                    m = stbi__get_marker(j);
+                    if (STBI__RESTART(m)) m = stbi__get_marker(j);
+                } else if (stbi__DNL(m)) {
+                    const int ld = stbi__get16be(j->s);
+                    const stbi__uint32 nl = stbi__get16be(j->s);
+                    if (ld != 4) return stbi__err("bad DNL len", "Corrupt JPEG");
+                    if (nl != j->s->img_y) return stbi__err("bad DNL height", "Corrupt JPEG");
+                    m = stbi__get_marker(j);
+                } else {
+                    if (!stbi__process_marker(j, m)) return 1;
+                    m = stbi__get_marker(j);
+                }
+            }
+            if (j->progressive) {
+                // stbi__jpeg_finish, for the Y coefficients only.
+                auto& c = j->img_comp[0];
+                const int w = (c.x + 7) >> 3, h = (c.y + 7) >> 3;
+                for (int by = 0; by < h; ++by) {
+                    for (int bx = 0; bx < w; ++bx) {
+                        short* data = c.coeff + 64 * (bx + by * c.coeff_w);
+                        stbi__jpeg_dequantize(data, j->dequant[c.tq]);
+                        tIdct(c.data + c.w2 * by * 8 + bx * 8, c.w2, data);
+                    }
+                }
+            }
+            return 1;
+        }
+
+    }
+
+    unsigned char* load(const char* path, int* width, int* height, int* channels) {
+        FILE* f = stbi__fopen(path, "rb");
+        if (f == nullptr) return stbi__errpuc("can't fopen", "Unable to open file");
+        stbi__context s;
+        stbi__start_file(&s, f);
+        const bool jpeg = stbi__jpeg_test(&s) != 0;
+
+        int status = -1;
+        stbi_uc* out = nullptr;
+        if (jpeg) {
+            stbi__jpeg* j = static_cast<stbi__jpeg*>(stbi__malloc(sizeof(stbi__jpeg)));
+            if (j == nullptr) {
+                fclose(f);
+                return stbi__errpuc("outofmem", "Out of memory");
+            }
+            memset(j, 0, sizeof(stbi__jpeg));
+            j->s = &s;
+            setupJpeg(j);
+            s.img_n = 0;    // keeps stbi__cleanup_jpeg safe on early errors
+            status = decodeLuma(j);
+            flushIdct();
+            if (status == 1) {
+                const auto& y = j->img_comp[0];
+                out = static_cast<stbi_uc*>(stbi__malloc_mad2(s.img_x, s.img_y, 0));
+                if (out != nullptr) {
+                    for (stbi__uint32 row = 0; row < s.img_y; ++row) {
+                        memcpy(out + static_cast<size_t>(row) * s.img_x, y.data + static_cast<size_t>(row) * y.w2,
+                               s.img_x);
+                    }
+                    *width = static_cast<int>(s.img_x);
+                    *height = static_cast<int>(s.img_y);
+                    *channels = 1;
+                } else {
+                    stbi__err("outofmem", "Out of memory");
+                }
+            }
+            stbi__cleanup_jpeg(j);
+            STBI_FREE(j);
+        }
+        fclose(f);
+        if (status == 1 || status == 0) return out;
+        return decode::load(path, width, height, channels, 0);
+    }
+
+}
+
+#include "indexed.h"
+#include "inflate.h"
+#include "png_filter.h"
+#include "render.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace {
+
+    struct FreeStb {
+        void operator()(void* p) const { STBI_FREE(p); }
+    };
+    using StbPtr = std::unique_ptr<stbi_uc, FreeStb>;
+
+    // sink.begin, failing the decode when it declines the image.
+    int beginRows(const decode::RowSink& sink, int width, int height, int channels) {
+        return sink.begin(width, height, channels) ? 1 : stbi__err("abandoned", "Decode abandoned by its consumer");
+    }
+
+    // Hands row y of a height-row image to sink, flipped when stb is set to
+    // flip images on load.
+    void emitRow(const decode::RowSink& sink, int y, int height, const stbi_uc* row) {
+        sink.row(stbi__vertically_flip_on_load ? height - 1 - y : y, row);
+    }
+
+    // Bytes of filtered scanlines (filter bytes included) that a PNG header
+    // implies, summed over the interlace passes.
+    size_t pngRawSize(const stbi__context* s, int depth, bool interlaced) {
+        auto pass = [&](long long x, long long y) -> size_t {
+            return static_cast<size_t>((((s->img_n * x * depth) + 7) >> 3) + 1) * static_cast<size_t>(y);
+        };
+        if (!interlaced) return pass(s->img_x, s->img_y);
+        static const int xorig[] = {0, 4, 0, 2, 0, 1, 0}, yorig[] = {0, 0, 4, 0, 2, 0, 1};
+        static const int xspc[] = {8, 8, 4, 4, 2, 2, 1}, yspc[] = {8, 8, 8, 4, 4, 2, 2};
+        size_t total = 0;
+        for (int p = 0; p < 7; ++p) {
+            const long long x = (static_cast<long long>(s->img_x) - xorig[p] + xspc[p] - 1) / xspc[p];
+            const long long y = (static_cast<long long>(s->img_y) - yorig[p] + yspc[p] - 1) / yspc[p];
+            if (x > 0 && y > 0) total += pass(x, y);
+        }
+        return total;
+    }
+
+    // The IDAT stream inflated straight into a buffer of the size the
+    // header implies. A stream the in-tree decoder rejects, or one that
+    // does not come out at exactly that size, goes through stb's zlib.
+    stbi_uc* inflatePng(const std::vector<stbi_uc>& idata, size_t rawSize, bool zlibHeader, stbi__uint32* rawLength) {
+        stbi_uc* raw = static_cast<stbi_uc*>(stbi__malloc(rawSize));
+        if (raw != nullptr &&
+            inflate::decode(idata.data(), idata.size(), raw, rawSize, zlibHeader) == static_cast<long long>(rawSize)) {
+            *rawLength = static_cast<stbi__uint32>(rawSize);
+            return raw;
+        }
+        STBI_FREE(raw);
+        int length = 0;
+        raw = reinterpret_cast<stbi_uc*>(stbi_zlib_decode_malloc_guesssize_headerflag(
+            reinterpret_cast<const char*>(idata.data()), static_cast<int>(idata.size()), static_cast<int>(rawSize),
+            &length, zlibHeader));
+        *rawLength = static_cast<stbi__uint32>(length);
+        return raw;
+    }
+
+    // stbi__create_png_image_raw for 8-bit samples, with the scanlines
+    // reconstructed by png_filter. When no alpha channel is added, rows are
+    // unfiltered straight into a->out against the row above, skipping the
+    // copy out of a scratch row. With `sink` (and outN == img_n), every row
+    // goes to sink from the scratch row while still in cache instead, and
+    // a->out stays null.
+    int createPngImage8(stbi__png* a, stbi_uc* raw, stbi__uint32 rawLength, int outN, stbi__uint32 x,
+                        stbi__uint32 y, const decode::RowSink* sink) {
+        const int imgN = a->s->img_n;
+        STBI_ASSERT(outN == imgN || outN == imgN + 1);
+        STBI_ASSERT(sink == nullptr || outN == imgN);
+        if (sink == nullptr) {
+            a->out = static_cast<stbi_uc*>(stbi__malloc_mad3(static_cast<int>(x), static_cast<int>(y), outN, 0));
+            if (!a->out) return stbi__err("outofmem", "Out of memory");
+        }
+        if (!stbi__mad3sizes_valid(imgN, static_cast<int>(x), 8, 7)) return stbi__err("too large", "Corrupt PNG");
+        const stbi__uint32 rowBytes = x * static_cast<stbi__uint32>(imgN);
+        if (!stbi__mad2sizes_valid(static_cast<int>(rowBytes), static_cast<int>(y), static_cast<int>(rowBytes))) {
+            return stbi__err("too large", "Corrupt PNG");
+        }
+        if (rawLength < (rowBytes + 1) * y) return stbi__err("not enough pixels", "Corrupt PNG");
+        if (sink != nullptr && !beginRows(*sink, static_cast<int>(x), static_cast<int>(y), imgN)) return 0;
+
+        // Two scratch rows, the second zeroed to serve as the row above
+        // the first.
+        const bool direct = sink == nullptr && outN == imgN;
+        const StbPtr scratch(static_cast<stbi_uc*>(stbi__malloc_mad2(static_cast<int>(rowBytes), 2, 0)));
+        if (!scratch) return stbi__err("outofmem", "Out of memory");
+        memset(scratch.get() + rowBytes, 0, rowBytes);
+        const stbi_uc* prior = scratch.get() + rowBytes;
+        for (stbi__uint32 j = 0; j < y; ++j) {
+            stbi_uc* dest = sink != nullptr ? nullptr : a->out + static_cast<size_t>(j) * x * outN;
+            stbi_uc* cur = direct ? dest : scratch.get() + (j & 1) * rowBytes;
+            const int filter = *raw++;
+            if (!png_filter::unfilterRow(filter, raw, prior, cur, rowBytes, imgN)) {
+                return stbi__err("invalid filter", "Corrupt PNG");
+            }
+            raw += rowBytes;
+            if (sink != nullptr) {
+                emitRow(*sink, static_cast<int>(j), static_cast<int>(y), cur);
+            } else if (!direct) {
+                stbi__create_png_alpha_expand8(dest, cur, x, imgN);
+            }
+            prior = cur;
+        }
+        return 1;
+    }
+
+    // stbi__create_png_image, building 8-bit images with createPngImage8.
+    // `sink` applies to non-interlaced 8-bit images only.
+    int createPngImage(stbi__png* a, stbi_uc* data, stbi__uint32 length, int outN, int depth, int color,
+                       int interlaced, const decode::RowSink* sink) {
+        stbi__context* s = a->s;
+        if (depth != 8) return stbi__create_png_image(a, data, length, outN, depth, color, interlaced);
+        if (!interlaced) return createPngImage8(a, data, length, outN, s->img_x, s->img_y, sink);
+
+        StbPtr final(static_cast<stbi_uc*>(stbi__malloc_mad3(static_cast<int>(s->img_x),
+                                                                   static_cast<int>(s->img_y), outN, 0)));
+        if (!final) return stbi__err("outofmem", "Out of memory");
+        static const int xorig[] = {0, 4, 0, 2, 0, 1, 0}, yorig[] = {0, 0, 4, 0, 2, 0, 1};
+        static const int xspc[] = {8, 8, 4, 4, 2, 2, 1}, yspc[] = {8, 8, 8, 4, 4, 2, 2};
+        for (int p = 0; p < 7; ++p) {
+            const stbi__uint32 x = (s->img_x - xorig[p] + xspc[p] - 1) / xspc[p];
+            const stbi__uint32 y = (s->img_y - yorig[p] + yspc[p] - 1) / yspc[p];
+            if (x == 0 || y == 0) continue;
+            const stbi__uint32 passLength = (x * static_cast<stbi__uint32>(s->img_n) + 1) * y;
+            if (!createPngImage8(a, data, length, outN, x, y, nullptr)) return 0;
+            for (stbi__uint32 j = 0; j < y; ++j) {
+                stbi_uc* row = final.get() + (static_cast<size_t>(j) * yspc[p] + yorig[p]) * s->img_x * outN;
+                for (stbi__uint32 i = 0; i < x; ++i) {
+                    memcpy(row + (static_cast<size_t>(i) * xspc[p] + xorig[p]) * outN,
+                           a->out + (static_cast<size_t>(j) * x + i) * outN, static_cast<size_t>(outN));
+                }
+            }
+            STBI_FREE(a->out);
+            a->out = nullptr;
+            data += passLength;
+            length -= passLength;
+        }
+        a->out = final.release();
+        return 1;
+    }
+
+    // stbi__parse_png_file (STBI__SCAN_load) with the image data inflated
+    // by inflatePng. With `indices`, a palette image stops short of
+    // stbi__expand_png_palette, leaving its indices in z->out and its
+    // palette in *indices, and any other PNG returns -1 after IHDR. With
+    // `sink`, an 8-bit non-interlaced image with nothing to post-process
+    // (no palette, tRNS or CgBI) goes to sink a row at a time, leaving
+    // z->out null; any other image is decoded into z->out as usual. On
+    // failure the caller frees z->out.
+    int readPng(stbi__context* s, stbi__png* z, int req_comp, indexed::Image* indices, const decode::RowSink* sink) {
+        stbi_uc palette[1024] = {};
+        stbi_uc tc[3] = {};
+        stbi__uint16 tc16[3] = {};
+        stbi__uint32 paletteLength = 0;
+        int palImgN = 0, interlace = 0, color = 0;
+        bool first = true, hasTrans = false, iphone = false;
+        std::vector<stbi_uc> idata;
+        z->idata = z->expanded = z->out = nullptr;
+
+        if (!stbi__check_png_header(s)) return 0;
+        for (;;) {
+            const stbi__pngchunk c = stbi__get_chunk_header(s);
+            switch (c.type) {
+                case STBI__PNG_TYPE('C', 'g', 'B', 'I'):
+                    if (indices != nullptr) return -1;
+                    iphone = true;
+                    stbi__skip(s, static_cast<int>(c.length));
+                    break;
+                case STBI__PNG_TYPE('I', 'H', 'D', 'R'): {
+                    if (!first) return stbi__err("multiple IHDR", "Corrupt PNG");
+                    first = false;
+                    if (c.length != 13) return stbi__err("bad IHDR len", "Corrupt PNG");
+                    s->img_x = stbi__get32be(s);
+                    s->img_y = stbi__get32be(s);
+                    if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__err("too large", "Very large image (corrupt?)");
+                    if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__err("too large", "Very large image (corrupt?)");
+                    z->depth = stbi__get8(s);
+                    if (z->depth != 1 && z->depth != 2 && z->depth != 4 && z->depth != 8 && z->depth != 16) {
+                        return stbi__err("1/2/4/8/16-bit only", "PNG not supported: 1/2/4/8/16-bit only");
+                    }
+                    color = stbi__get8(s);
+                    if (color > 6) return stbi__err("bad ctype", "Corrupt PNG");
+                    if (color == 3 && z->depth == 16) return stbi__err("bad ctype", "Corrupt PNG");
+                    if (color == 3) palImgN = 3;
+                    else if (color & 1) return stbi__err("bad ctype", "Corrupt PNG");
+                    if (stbi__get8(s)) return stbi__err("bad comp method", "Corrupt PNG");
+                    if (stbi__get8(s)) return stbi__err("bad filter method", "Corrupt PNG");
+                    interlace = stbi__get8(s);
+                    if (interlace > 1) return stbi__err("bad interlace method", "Corrupt PNG");
+                    if (!s->img_x || !s->img_y) return stbi__err("0-pixel image", "Corrupt PNG");
+                    if (!palImgN) {
+                        s->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
+                        if ((1 << 30) / s->img_x / s->img_n < s->img_y) {
+                            return stbi__err("too large", "Image too large to decode");
+                        }
+                    } else {
+                        s->img_n = 1;
+                        if ((1 << 30) / s->img_x / 4 < s->img_y) return stbi__err("too large", "Corrupt PNG");
+                    }
+                    if (indices != nullptr && !palImgN) return -1;
+                    break;
+                }
+                case STBI__PNG_TYPE('P', 'L', 'T', 'E'): {
+                    if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+                    if (c.length > 256 * 3) return stbi__err("invalid PLTE", "Corrupt PNG");
+                    paletteLength = c.length / 3;
+                    if (paletteLength * 3 != c.length) return stbi__err("invalid PLTE", "Corrupt PNG");
+                    for (stbi__uint32 i = 0; i < paletteLength; ++i) {
+                        palette[i * 4 + 0] = stbi__get8(s);
+                        palette[i * 4 + 1] = stbi__get8(s);
+                        palette[i * 4 + 2] = stbi__get8(s);
+                        palette[i * 4 + 3] = 255;
+                    }
+                    break;
+                }
+                case STBI__PNG_TYPE('t', 'R', 'N', 'S'): {
+                    if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+                    if (!idata.empty()) return stbi__err("tRNS after IDAT", "Corrupt PNG");
+                    if (palImgN) {
+                        if (paletteLength == 0) return stbi__err("tRNS before PLTE", "Corrupt PNG");
+                        if (c.length > paletteLength) return stbi__err("bad tRNS len", "Corrupt PNG");
+                        palImgN = 4;
+                        for (stbi__uint32 i = 0; i < c.length; ++i) palette[i * 4 + 3] = stbi__get8(s);
+                    } else {
+                        if (!(s->img_n & 1)) return stbi__err("tRNS with alpha", "Corrupt PNG");
+                        if (c.length != static_cast<stbi__uint32>(s->img_n) * 2) {
+                            return stbi__err("bad tRNS len", "Corrupt PNG");
+                        }
+                        hasTrans = true;
+                        for (int k = 0; k < s->img_n && k < 3; ++k) {
+                            if (z->depth == 16) {
+                                tc16[k] = static_cast<stbi__uint16>(stbi__get16be(s));
+                            } else {
+                                tc[k] = static_cast<stbi_uc>((stbi__get16be(s) & 255) * stbi__depth_scale_table[z->depth]);
+                            }
+                        }
+                    }
+                    break;
+                }
+                case STBI__PNG_TYPE('I', 'D', 'A', 'T'): {
+                    if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+                    if (palImgN && !paletteLength) return stbi__err("no PLTE", "Corrupt PNG");
+                    if (c.length > (1u << 30)) return stbi__err("IDAT size limit", "IDAT section larger than 2^30 bytes");
+                    const size_t at = idata.size();
+                    idata.resize(at + c.length);
+                    if (!stbi__getn(s, idata.data() + at, static_cast<int>(c.length))) {
+                        return stbi__err("outofdata", "Corrupt PNG");
+                    }
+                    break;
+                }
+                case STBI__PNG_TYPE('I', 'E', 'N', 'D'): {
+                    if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+                    if (idata.empty()) return stbi__err("no IDAT", "Corrupt PNG");
+                    stbi__uint32 rawLength = 0;
+                    const StbPtr raw(inflatePng(idata, pngRawSize(s, z->depth, interlace != 0), !iphone, &rawLength));
+                    if (!raw) return 0;
+                    std::vector<stbi_uc>().swap(idata);
+                    if (indices != nullptr) {
+                        s->img_out_n = 1;
+                        if (!createPngImage(z, raw.get(), rawLength, 1, z->depth, color, interlace, nullptr)) return 0;
+                        memcpy(indices->palette, palette, sizeof(palette));
+                        indices->channels = palImgN;
+                        return 1;
+                    }
+                    if ((req_comp == s->img_n + 1 && req_comp != 3 && !palImgN) || hasTrans) {
+                        s->img_out_n = s->img_n + 1;
+                    } else {
+                        s->img_out_n = s->img_n;
+                    }
+                    const bool streamed = sink != nullptr && !palImgN && !hasTrans && !iphone && !interlace &&
+                                          z->depth == 8 && s->img_out_n == s->img_n;
+                    if (!createPngImage(z, raw.get(), rawLength, s->img_out_n, z->depth, color, interlace,
+                                        streamed ? sink : nullptr)) {
+                        return 0;
+                    }
+                    if (hasTrans) {
+                        const int ok = z->depth == 16 ? stbi__compute_transparency16(z, tc16, s->img_out_n)
+                                                      : stbi__compute_transparency(z, tc, s->img_out_n);
+                        if (!ok) return 0;
+                    }
+                    if (iphone && stbi__de_iphone_flag && s->img_out_n > 2) stbi__de_iphone(z);
+                    if (palImgN) {
+                        s->img_n = palImgN;
+                        s->img_out_n = req_comp >= 3 ? req_comp : palImgN;
+                        if (!stbi__expand_png_palette(z, palette, static_cast<int>(paletteLength), s->img_out_n)) return 0;
+                    } else if (hasTrans) {
+                        ++s->img_n;
+                    }
+                    stbi__get32be(s);
+                    return 1;
+                }
+                default:
+                    if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+                    if ((c.type & (1 << 29)) == 0) {
+                        return stbi__err("unknown chunk", "PNG not supported: unknown PNG chunk type");
+                    }
+                    stbi__skip(s, static_cast<int>(c.length));
+                    break;
+            }
+            stbi__get32be(s);   // CRC
+        }
+    }
+
+    // One row of stb's resample-and-convert stage of load_jpeg_image.
+    struct JpegRows {
+        stbi__jpeg* z;
+        stbi__resample res[4] = {};
+        stbi_uc* coutput[4] = {};
+        int n = 0, decodeN = 0;
+        bool rgb = false;
+
+        // Fills coutput with the upsampled components of the next row.
+        void resample() {
+            for (int k = 0; k < decodeN; ++k) {
+                stbi__resample* r = &res[k];
+                const bool yBot = r->ystep >= (r->vs >> 1);
+                coutput[k] = r->resample(z->img_comp[k].linebuf, yBot ? r->line1 : r->line0,
+                                         yBot ? r->line0 : r->line1, r->w_lores, r->hs);
+                if (++r->ystep >= r->vs) {
+                    r->ystep = 0;
+                    r->line0 = r->line1;
+                    if (++r->ypos < z->img_comp[k].y) r->line1 += z->img_comp[k].w2;
+                }
+            }
+        }
+
+        // Converts the current row to n channels at out.
+        void convert(stbi_uc* out) const {
+            const stbi__uint32 w = z->s->img_x;
+            const int imgN = z->s->img_n;
+            const stbi_uc* y = coutput[0];
+            if (n >= 3) {
+                if (imgN == 3 && rgb) {
+                    for (stbi__uint32 i = 0; i < w; ++i, out += n) {
+                        out[0] = y[i];
+                        out[1] = coutput[1][i];
+                        out[2] = coutput[2][i];
+                        if (n == 4) out[3] = 255;
+                    }
+                } else if (imgN == 4 && z->app14_color_transform == 0) {    // CMYK
+                    for (stbi__uint32 i = 0; i < w; ++i, out += n) {
+                        const stbi_uc m = coutput[3][i];
+                        out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                        out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                        out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                        if (n == 4) out[3] = 255;
+                    }
+                } else if (imgN >= 3) {
+                    z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], static_cast<int>(w), n);
+                    if (imgN == 4 && z->app14_color_transform == 2) {    // YCCK
+                        for (stbi__uint32 i = 0; i < w; ++i, out += n) {
+                            const stbi_uc m = coutput[3][i];
+                            out[0] = stbi__blinn_8x8(255 - out[0], m);
+                            out[1] = stbi__blinn_8x8(255 - out[1], m);
+                            out[2] = stbi__blinn_8x8(255 - out[2], m);
+                        }
+                    }
+                } else {
+                    for (stbi__uint32 i = 0; i < w; ++i, out += n) {
+                        out[0] = out[1] = out[2] = y[i];
+                        if (n == 4) out[3] = 255;
+                    }
+                }
+                return;
+            }
+            for (stbi__uint32 i = 0; i < w; ++i, out += n) {
+                if (rgb) {
+                    out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                } else if (imgN == 4 && z->app14_color_transform == 0) {
+                    const stbi_uc m = coutput[3][i];
+                    out[0] = stbi__compute_y(stbi__blinn_8x8(coutput[0][i], m), stbi__blinn_8x8(coutput[1][i], m),
+                                             stbi__blinn_8x8(coutput[2][i], m));
+                } else if (imgN == 4 && z->app14_color_transform == 2) {
+                    out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+                } else {
+                    out[0] = y[i];
+                }
+                if (n == 2) out[1] = 255;
+            }
+        }
+    };
+
+    // The resample-and-convert stage of load_jpeg_image, from the planes
+    // in z->img_comp[].data; frees the components. With `sink`, each row
+    // is converted as for req_comp 0 into a scratch row and handed to sink
+    // from there, and the result is that scratch row.
+    stbi_uc* convertJpeg(stbi__jpeg* z, int* outX, int* outY, int* comp, int req_comp, const decode::RowSink* sink) {
+        const int imgN = z->s->img_n;
+        JpegRows rows{z};
+        rows.n = req_comp && sink == nullptr ? req_comp : imgN >= 3 ? 3 : 1;
+        rows.rgb = imgN == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+        rows.decodeN = imgN == 3 && rows.n < 3 && !rows.rgb ? 1 : imgN;
+        if (rows.decodeN <= 0) {
+            stbi__cleanup_jpeg(z);
+            return nullptr;
+        }
+
+        for (int k = 0; k < rows.decodeN; ++k) {
+            stbi__resample* r = &rows.res[k];
+            // line buffer big enough for upsampling off the edges by 4
+            z->img_comp[k].linebuf = static_cast<stbi_uc*>(stbi__malloc(z->s->img_x + 3));
+            if (z->img_comp[k].linebuf == nullptr) {
+                stbi__cleanup_jpeg(z);
+                return stbi__errpuc("outofmem", "Out of memory");
+            }
+            r->hs = z->img_h_max / z->img_comp[k].h;
+            r->vs = z->img_v_max / z->img_comp[k].v;
+            r->ystep = r->vs >> 1;
+            r->w_lores = static_cast<int>((z->s->img_x + r->hs - 1) / r->hs);
+            r->ypos = 0;
+            r->line0 = r->line1 = z->img_comp[k].data;
+            if (r->hs == 1 && r->vs == 1) {
+                r->resample = resample_row_1;
+            } else if (r->hs == 1 && r->vs == 2) {
+                r->resample = stbi__resample_row_v_2;
+            } else if (r->hs == 2 && r->vs == 1) {
+                r->resample = stbi__resample_row_h_2;
+            } else if (r->hs == 2 && r->vs == 2) {
+                r->resample = z->resample_row_hv_2_kernel;
+            } else {
+                r->resample = stbi__resample_row_generic;
+            }
+        }
+
+        const int w = static_cast<int>(z->s->img_x), h = static_cast<int>(z->s->img_y);
+        // The extra byte is for stb's YCbCr kernel, which writes a fourth
+        // channel even at step 3.
+        stbi_uc* output = static_cast<stbi_uc*>(sink != nullptr ? stbi__malloc_mad2(rows.n, w, 1)
+                                                                : stbi__malloc_mad3(rows.n, w, h, 1));
+        if (output == nullptr) {
+            stbi__cleanup_jpeg(z);
+            return stbi__errpuc("outofmem", "Out of memory");
+        }
+        if (sink != nullptr && !beginRows(*sink, w, h, rows.n)) {
+            STBI_FREE(output);
+            stbi__cleanup_jpeg(z);
+            return nullptr;
+        }
+        for (int j = 0; j < h; ++j) {
+            rows.resample();
+            if (sink != nullptr) {
+                rows.convert(output);
+                emitRow(*sink, j, h, output);
+            } else {
+                rows.convert(output + static_cast<size_t>(rows.n) * w * j);
+            }
+        }
+        stbi__cleanup_jpeg(z);
+        *outX = w;
+        *outY = h;
+        if (comp) *comp = imgN >= 3 ? 3 : 1;    // original components, not output
+        return output;
+    }
+
+    // load_jpeg_image, decoding with the kernels setupJpeg picked.
+    stbi_uc* readJpeg(stbi__jpeg* z, int* outX, int* outY, int* comp, int req_comp, const decode::RowSink* sink) {
+        z->s->img_n = 0;    // make stbi__cleanup_jpeg safe
+        if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+        const int ok = stbi__decode_jpeg_image(z);
+        flushIdct();
+        if (!ok) {
+            stbi__cleanup_jpeg(z);
+            return nullptr;
+        }
+        return convertJpeg(z, outX, outY, comp, req_comp, sink);
+    }
+
+}
+
+namespace jpeg_preview {
+
+    namespace {
+
+        // The DC coefficient of every block of each component, coeff_w
+        // apart; the full coefficient buffers are never touched.
+        using DcPlanes = std::vector<short>[4];
+
+        // stbi__jpeg_decode_block_prog_dc for a first DC scan, storing
+        // only the coefficient.
+        int decodeDcValue(stbi__jpeg* j, stbi__huffman* hdc, int b, short* out) {
+            if (j->spec_end != 0) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
+            if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+            const int t = stbi__jpeg_huff_decode(j, hdc);
+            if (t < 0 || t > 15) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
+            const int diff = t ? stbi__extend_receive(j, t) : 0;
+            if (!stbi__addints_valid(j->img_comp[b].dc_pred, diff)) return stbi__err("bad delta", "Corrupt JPEG");
+            const int dc = j->img_comp[b].dc_pred + diff;
+            j->img_comp[b].dc_pred = dc;
+            if (!stbi__mul2shorts_valid(dc, 1 << j->succ_low)) {
+                return stbi__err("can't merge dc and ac", "Corrupt JPEG");
+            }
+            *out = static_cast<short>(dc * (1 << j->succ_low));
+            return 1;
+        }
+
+        // stbi__parse_entropy_coded_data for a first DC scan.
+        int parseDcScan(stbi__jpeg* z, DcPlanes& dc) {
+            stbi__jpeg_reset(z);
+            // Every MCU counts down the restart interval.
+            auto restart = [&]() {
+                if (--z->todo > 0) return 1;
+                if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+                if (!STBI__RESTART(z->marker)) return -1;
+                stbi__jpeg_reset(z);
+                return 1;
+            };
+            if (z->scan_n == 1) {
+                const int n = z->order[0];
+                const auto& c = z->img_comp[n];
+                const int w = (c.x + 7) >> 3, h = (c.y + 7) >> 3;
+                for (int j = 0; j < h; ++j) {
+                    for (int i = 0; i < w; ++i) {
+                        short* out = &dc[n][static_cast<size_t>(i) + static_cast<size_t>(j) * c.coeff_w];
+                        if (!decodeDcValue(z, &z->huff_dc[c.hd], n, out)) return 0;
+                        if (restart() < 0) return 1;
+                    }
+                }
+                return 1;
+            }
+            for (int j = 0; j < z->img_mcu_y; ++j) {
+                for (int i = 0; i < z->img_mcu_x; ++i) {
+                    for (int k = 0; k < z->scan_n; ++k) {
+                        const int n = z->order[k];
+                        const auto& c = z->img_comp[n];
+                        for (int y = 0; y < c.v; ++y) {
+                            for (int x = 0; x < c.h; ++x) {
+                                const size_t x2 = static_cast<size_t>(i) * c.h + x;
+                                const size_t y2 = static_cast<size_t>(j) * c.v + y;
+                                if (!decodeDcValue(z, &z->huff_dc[c.hd], n, &dc[n][x2 + y2 * c.coeff_w])) return 0;
+                            }
+                        }
+                    }
+                    if (restart() < 0) return 1;
+                }
+            }
+            return 1;
+        }
+
+        // Parses a progressive JPEG up to the end of the scan that
+        // completes the first DC pass of every component, leaving the DC
+        // coefficients in dc and the bits that pass left out (its
+        // successive approximation shift) in lowBits. Returns -1 for
+        // baseline images, 0 on error, 1 on success.
+        int decodeDc(stbi__jpeg* j, DcPlanes& dc, int lowBits[4]) {
+            for (int m = 0; m < 4; ++m) {
+                j->img_comp[m].raw_data = nullptr;
+                j->img_comp[m].raw_coeff = nullptr;
+            }
+            j->restart_interval = 0;
+            if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
+            if (!j->progressive) return -1;
+            for (int k = 0; k < j->s->img_n; ++k) {
+                dc[k].assign(static_cast<size_t>(j->img_comp[k].coeff_w) * j->img_comp[k].coeff_h, 0);
+            }
+
+            int pending = j->s->img_n;
+            bool seen[4] = {};
+            int m = stbi__get_marker(j);
+            while (!stbi__EOI(m)) {
+                if (stbi__SOS(m)) {
+                    if (!stbi__process_scan_header(j)) return 0;
+                    // A component's other scans can only come before its
+                    // first DC scan if another component's DC comes later.
+                    const bool first = j->spec_start == 0 && j->succ_high == 0;
+                    if (!(first ? parseDcScan(j, dc) : stbi__parse_entropy_coded_data(j))) return 0;
+                    if (first) {
+                        for (int i = 0; i < j->scan_n; ++i) {
+                            if (!seen[j->order[i]]) {
+                                seen[j->order[i]] = true;
+                                lowBits[j->order[i]] = j->succ_low;
+                                --pending;
+                            }
+                        }
+                        if (pending == 0) return 1;
+                    }
+                    if (j->marker == STBI__MARKER_none) j->marker = stbi__skip_jpeg_junk_at_end(j);
+                    m = stbi__get_marker(j);
+                    if (STBI__RESTART(m)) m = stbi__get_marker(j);
+                } else if (stbi__DNL(m)) {
+                    const int ld = stbi__get16be(j->s);
+                    const stbi__uint32 nl = stbi__get16be(j->s);
+                    if (ld != 4) return stbi__err("bad DNL len", "Corrupt JPEG");
+                    if (nl != j->s->img_y) return stbi__err("bad DNL height", "Corrupt JPEG");
+                    m = stbi__get_marker(j);
+                } else {
+                    if (!stbi__process_marker(j, m)) return 0;
+                    m = stbi__get_marker(j);
+                }
+            }
+            return stbi__err("no DC scan", "Corrupt JPEG");
+        }
+
+        // Replaces component k's plane with its 1/8-scale one: for every
+        // block, the pixel value a DC-only block inverse-transforms to,
+        // written to the start of c.data (which is far larger), with w2 and
+        // y describing it. Missing low bits are taken to be half their
+        // range.
+        void dcPlane(stbi__jpeg* j, int k, const short* dc, int lowBits) {
+            auto& c = j->img_comp[k];
+            const int q = j->dequant[c.tq][0];
+            const int half = (1 << lowBits) >> 1;
+            const int w = (c.x + 7) >> 3, h = (c.y + 7) >> 3;
+            for (int by = 0; by < h; ++by) {
+                const short* row = dc + static_cast<size_t>(by) * c.coeff_w;
+                stbi_uc* out = c.data + static_cast<size_t>(by) * w;
+                for (int bx = 0; bx < w; ++bx) out[bx] = clampU8(128 + (((row[bx] + half) * q + 4) >> 3));
+            }
+            c.w2 = w;
+            c.y = h;
+        }
+
+    }
+
+    unsigned char* load(const char* path, int* width, int* height, int* channels, int* fullWidth,
+                        int* fullHeight) {
+        FILE* f = stbi__fopen(path, "rb");
+        if (f == nullptr) return stbi__errpuc("can't fopen", "Unable to open file");
+        stbi__context s;
+        stbi__start_file(&s, f);
+        if (!stbi__jpeg_test(&s)) {
+            fclose(f);
+            return stbi__errpuc("not JPEG", "Image not of any known type, or corrupt");
+        }
+        stbi__jpeg* j = static_cast<stbi__jpeg*>(stbi__malloc(sizeof(stbi__jpeg)));
+        if (j == nullptr) {
+            fclose(f);
+            return stbi__errpuc("outofmem", "Out of memory");
+        }
+        memset(j, 0, sizeof(stbi__jpeg));
+        j->s = &s;
+        setupJpeg(j);
+        s.img_n = 0;    // keeps stbi__cleanup_jpeg safe on early errors
+        stbi_uc* out = nullptr;
+        DcPlanes dc;
+        int lowBits[4] = {};
+        if (decodeDc(j, dc, lowBits) == 1) {
+            // The DC planes then go through stb's upsampling and colour
+            // conversion as an image 1/8 the size.
+            *fullWidth = static_cast<int>(s.img_x);
+            *fullHeight = static_cast<int>(s.img_y);
+            for (int k = 0; k < s.img_n; ++k) dcPlane(j, k, dc[k].data(), lowBits[k]);
+            s.img_x = (s.img_x + 7) >> 3;
+            s.img_y = (s.img_y + 7) >> 3;
+            out = convertJpeg(j, width, height, channels, 0, nullptr);
+        } else {
+            stbi__cleanup_jpeg(j);
+        }
+        STBI_FREE(j);
+        fclose(f);
+        return out;
+    }
+
+}
+
+namespace decode {
+
+    namespace {
+
+        // The image readPng left in p->out, converted and flipped as
+        // stbi__load_and_postprocess_8bit would.
+        unsigned char* finishPng(stbi__context* s, stbi__png* p, int req_comp, int* x, int* y, int* comp) {
+            void* result = p->out;
+            const bool wide = p->depth == 16;
+            if (req_comp && req_comp != s->img_out_n) {
+                result = wide ? static_cast<void*>(stbi__convert_format16(static_cast<stbi__uint16*>(result),
+                                                                         s->img_out_n, req_comp, s->img_x, s->img_y))
+                              : static_cast<void*>(stbi__convert_format(static_cast<unsigned char*>(result),
+                                                                       s->img_out_n, req_comp, s->img_x, s->img_y));
+                if (result == nullptr) return nullptr;
+            }
+            *x = static_cast<int>(s->img_x);
+            *y = static_cast<int>(s->img_y);
+            if (comp) *comp = s->img_n;
+            const int channels = req_comp ? req_comp : s->img_n;
+            if (wide) result = stbi__convert_16_to_8(static_cast<stbi__uint16*>(result), *x, *y, channels);
+            if (result != nullptr && stbi__vertically_flip_on_load) {
+                stbi__vertical_flip(result, *x, *y, channels);
+            }
+            return static_cast<unsigned char*>(result);
+        }
+
+        stbi__jpeg* newJpeg(stbi__context* s) {
+            stbi__jpeg* j = static_cast<stbi__jpeg*>(stbi__malloc(sizeof(stbi__jpeg)));
+            if (j == nullptr) return nullptr;
+            memset(j, 0, sizeof(stbi__jpeg));
+            j->s = s;
+            setupJpeg(j);
+            return j;
+        }
+
+        // stbi__load_and_postprocess_8bit, with PNGs read by readPng and
+        // JPEGs by readJpeg.
+        unsigned char* loadContext(stbi__context* s, int* x, int* y, int* comp, int req_comp) {
+            if (stbi__jpeg_test(s)) {
+                stbi__jpeg* j = newJpeg(s);
+                if (j == nullptr) return stbi__errpuc("outofmem", "Out of memory");
+                int components = 0;
+                unsigned char* result = readJpeg(j, x, y, &components, req_comp, nullptr);
+                STBI_FREE(j);
+                if (comp) *comp = components;
+                if (result != nullptr && stbi__vertically_flip_on_load) {
+                    stbi__vertical_flip(result, *x, *y, req_comp ? req_comp : components);
+                }
+                return result;
+            }
+            if (!stbi__png_test(s)) return stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+            if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+            stbi__png p;
+            p.s = s;
+            if (readPng(s, &p, req_comp, nullptr, nullptr) != 1) {
+                STBI_FREE(p.out);
+                return nullptr;
+            }
+            return finishPng(s, &p, req_comp, x, y, comp);
+        }
+
+        // Hands a whole image to sink row by row, then frees it.
+        int emitImage(const RowSink& sink, unsigned char* pixels, int x, int y, int channels) {
+            const StbPtr image(pixels);
+            if (!beginRows(sink, x, y, channels)) return 0;
+            const size_t stride = static_cast<size_t>(x) * static_cast<size_t>(channels);
+            for (int j = 0; j < y; ++j) sink.row(j, pixels + static_cast<size_t>(j) * stride);
+            return 1;
+        }
+
+        // stbi__pnm_load for 8-bit images, read a row at a time. 16-bit
+        // images return -1 once the header has been read.
+        int readPnm(stbi__context* s, const RowSink& sink) {
+            int x = 0, y = 0, n = 0;
+            const int bits = stbi__pnm_info(s, &x, &y, &n);
+            if (bits == 0) return 0;
+            if (bits != 8) return -1;
+            if (y > STBI_MAX_DIMENSIONS) return stbi__err("too large", "Very large image (corrupt?)");
+            if (x > STBI_MAX_DIMENSIONS) return stbi__err("too large", "Very large image (corrupt?)");
+            if (!stbi__mad3sizes_valid(n, x, y, 0)) return stbi__err("too large", "PNM too large");
+            const StbPtr row(static_cast<stbi_uc*>(stbi__malloc_mad2(n, x, 0)));
+            if (!row) return stbi__err("outofmem", "Out of memory");
+            if (!beginRows(sink, x, y, n)) return 0;
+            for (int j = 0; j < y; ++j) {
+                if (!stbi__getn(s, row.get(), n * x)) return stbi__err("bad PNM", "PNM file truncated");
+                emitRow(sink, j, y, row.get());
+            }
+            return 1;
+        }
+
+        // n stbi__get8 calls into dst (zeros past the end of the input),
+        // taken from stb's buffer and then the file in one copy each.
+        void getBytes(stbi__context* s, stbi_uc* dst, int n) {
+            int got = std::min(n, static_cast<int>(s->img_buffer_end - s->img_buffer));
+            memcpy(dst, s->img_buffer, static_cast<size_t>(got));
+            s->img_buffer += got;
+            if (got < n && s->read_from_callbacks) {
+                got += std::max(0, s->io.read(s->io_user_data, reinterpret_cast<char*>(dst + got), n - got));
+            }
+            memset(dst + got, 0, static_cast<size_t>(n - got));
+        }
+
+        // stbi__bmp_load for images without alpha, unpacked a row at a time
+        // and handed over in file order. Images with alpha, whose all-zero
+        // alpha is replaced only once every row is known, and odd pixel
+        // sizes return -1 once the header has been read.
+        int readBmp(stbi__context* s, const RowSink& sink) {
+            stbi__bmp_data info;
+            info.all_a = 255;
+            if (stbi__bmp_parse_header(s, &info) == nullptr) return 0;
+            const bool bottomUp = static_cast<int>(s->img_y) > 0;
+            s->img_y = static_cast<stbi__uint32>(abs(static_cast<int>(s->img_y)));
+            if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__err("too large", "Very large image (corrupt?)");
+            if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__err("too large", "Very large image (corrupt?)");
+            if (info.ma != 0 && !(info.bpp == 24 && info.ma == 0xff000000)) return -1;
+            if (info.bpp > 8 && info.bpp != 16 && info.bpp != 24 && info.bpp != 32) return -1;
+
+            int psize = 0;
+            if (info.hsz == 12) {
+                if (info.bpp < 24) psize = (info.offset - info.extra_read - 24) / 3;
+            } else if (info.bpp < 16) {
+                psize = (info.offset - info.extra_read - info.hsz) >> 2;
+            }
+            if (psize == 0) {
+                const int readSoFar =
+                    s->callback_already_read + static_cast<int>(s->img_buffer - s->img_buffer_original);
+                if (readSoFar <= 0 || readSoFar > 1024) return stbi__err("bad header", "Corrupt BMP");
+                if (info.offset < readSoFar || info.offset - readSoFar > 256 * 4) {
+                    return stbi__err("bad offset", "Corrupt BMP");
+                }
+                stbi__skip(s, info.offset - readSoFar);
+            }
+            s->img_n = 3;
+            const int x = static_cast<int>(s->img_x), y = static_cast<int>(s->img_y);
+            if (!stbi__mad3sizes_valid(3, x, y, 0)) return stbi__err("too large", "Corrupt BMP");
+
+            stbi_uc pal[256][3] = {};
+            int width = 0;
+            unsigned int masks[3] = {info.mr, info.mg, info.mb};
+            int shift[3] = {}, count[3] = {};
+            const bool easy = info.bpp == 24;
+            if (info.bpp < 16) {
+                if (psize == 0 || psize > 256) return stbi__err("invalid", "Corrupt BMP");
+                for (int i = 0; i < psize; ++i) {
+                    pal[i][2] = stbi__get8(s);
+                    pal[i][1] = stbi__get8(s);
+                    pal[i][0] = stbi__get8(s);
+                    if (info.hsz != 12) stbi__get8(s);
+                }
+                stbi__skip(s, info.offset - info.extra_read - info.hsz - psize * (info.hsz == 12 ? 3 : 4));
+                if (info.bpp == 1) {
+                    width = (x + 7) >> 3;
+                } else if (info.bpp == 4) {
+                    width = (x + 1) >> 1;
+                } else if (info.bpp == 8) {
+                    width = x;
+                } else {
+                    return stbi__err("bad bpp", "Corrupt BMP");
+                }
+            } else {
+                stbi__skip(s, info.offset - info.extra_read - info.hsz);
+                width = info.bpp / 8 * x;
+                if (!easy) {
+                    if (!masks[0] || !masks[1] || !masks[2]) return stbi__err("bad masks", "Corrupt BMP");
+                    for (int c = 0; c < 3; ++c) {
+                        shift[c] = stbi__high_bit(masks[c]) - 7;
+                        count[c] = stbi__bitcount(masks[c]);
+                        if (count[c] > 8) return stbi__err("bad masks", "Corrupt BMP");
+                    }
+                }
+            }
+            const int rowBytes = width + ((-width) & 3);
+
+            const StbPtr raw(static_cast<stbi_uc*>(stbi__malloc_mad2(3, x, rowBytes)));
+            if (!raw) return stbi__err("outofmem", "Out of memory");
+            stbi_uc* row = raw.get() + rowBytes;
+            if (!beginRows(sink, x, y, 3)) return 0;
+            for (int j = 0; j < y; ++j) {
+                getBytes(s, raw.get(), rowBytes);
+                const stbi_uc* in = raw.get();
+                stbi_uc* out = row;
+                if (info.bpp < 16) {
+                    const int perByte = 8 / info.bpp, mask = (1 << info.bpp) - 1;
+                    for (int i = 0; i < x; ++i, out += 3) {
+                        const int shift = 8 - info.bpp * (i % perByte + 1);
+                        memcpy(out, pal[(in[i / perByte] >> shift) & mask], 3);
+                    }
+                } else if (easy) {
+                    for (int i = 0; i < x; ++i, in += 3, out += 3) {
+                        out[0] = in[2];
+                        out[1] = in[1];
+                        out[2] = in[0];
+                    }
+                } else {
+                    const int step = info.bpp / 8;
+                    for (int i = 0; i < x; ++i, in += step) {
+                        stbi__uint32 v = static_cast<stbi__uint32>(in[0] | in[1] << 8);
+                        if (step == 4) v |= static_cast<stbi__uint32>(in[2] | in[3] << 8) << 16;
+                        for (int c = 0; c < 3; ++c) {
+                            *out++ = STBI__BYTECAST(stbi__shiftsigned(v & masks[c], shift[c], count[c]));
+                        }
+                    }
+                }
+                emitRow(sink, bottomUp ? y - 1 - j : j, y, row);
+            }
+            return 1;
+        }
+
+        // decodeRows on s: 1 on success, 0 on failure, or -1, before
+        // anything reaches the sink, for an image it does not stream; the
+        // caller then decodes that from the start with wholeRows.
+        int streamRows(stbi__context* s, const RowSink& sink) {
+            if (stbi__jpeg_test(s)) {
+                stbi__jpeg* j = newJpeg(s);
+                if (j == nullptr) return stbi__err("outofmem", "Out of memory");
+                int x = 0, y = 0, components = 0;
+                const StbPtr scratch(readJpeg(j, &x, &y, &components, 0, &sink));
+                STBI_FREE(j);
+                return scratch != nullptr;
+            }
+            if (stbi__png_test(s)) {
+                stbi__png p;
+                p.s = s;
+                if (readPng(s, &p, 0, nullptr, &sink) != 1) {
+                    STBI_FREE(p.out);
+                    return 0;
+                }
+                if (p.out == nullptr) return 1;
+                int x = 0, y = 0, channels = 0;
+                unsigned char* pixels = finishPng(s, &p, 0, &x, &y, &channels);
+                return pixels != nullptr && emitImage(sink, pixels, x, y, channels);
+            }
+            if (stbi__bmp_test(s)) return readBmp(s, sink);
+            if (stbi__pnm_test(s)) return readPnm(s, sink);
+            return -1;
+        }
+
+        int wholeRows(stbi__context* s, const RowSink& sink) {
+            int x = 0, y = 0, channels = 0;
+            unsigned char* pixels = loadContext(s, &x, &y, &channels, 0);
+            return pixels != nullptr && emitImage(sink, pixels, x, y, channels);
+        }
+
+        // loadLuminance by way of decodeTo(sink).
+        template <typename Decode>
+        unsigned char* luminanceRows(int* width, int* height, Decode decodeTo) {
+            unsigned char* plane = nullptr;
+            bool began = false;
+            int channels = 0;
+            const RowSink sink{
+                [&](int w, int h, int n) {
+                    began = true;
+                    plane = static_cast<unsigned char*>(stbi__malloc_mad2(w, h, 0));
+                    *width = w;
+                    *height = h;
+                    channels = n;
+                    return plane != nullptr;
+                },
+                [&](int y, const unsigned char* pixels) {
+                    const size_t w = static_cast<size_t>(*width);
+                    luminanceGrid(pixels, channels, w, plane + static_cast<size_t>(y) * w);
+                }};
+            if (decodeTo(sink)) return plane;
+            const bool refused = began && plane == nullptr;
+            STBI_FREE(plane);
+            return refused ? stbi__errpuc("outofmem", "Out of memory") : nullptr;
+        }
+
+    }
+
+    unsigned char* load(const char* path, int* width, int* height, int* channels, int desired) {
+        FILE* f = stbi__fopen(path, "rb");
+        if (f == nullptr) return stbi__errpuc("can't fopen", "Unable to open file");
+        stbi__context s;
+        stbi__start_file(&s, f);
+        unsigned char* result = loadContext(&s, width, height, channels, desired);
+        fclose(f);
+        return result;
+    }
+
+    unsigned char* loadFromMemory(const unsigned char* data, size_t size, int* width, int* height, int* channels,
+                                  int desired) {
+        stbi__context s;
+        stbi__start_mem(&s, data, static_cast<int>(size));
+        return loadContext(&s, width, height, channels, desired);
+    }
+
+    void setFailureReason(const char* reason) { stbi__err(reason, reason); }
+
+    bool decodeRows(const char* path, const RowSink& sink) {
+        FILE* f = stbi__fopen(path, "rb");
+        if (f == nullptr) return stbi__err("can't fopen", "Unable to open file");
+        stbi__context s;
+        stbi__start_file(&s, f);
+        int result = streamRows(&s, sink);
+        if (result < 0) {
+            fseek(f, 0, SEEK_SET);
+            stbi__start_file(&s, f);
+            result = wholeRows(&s, sink);
+        }
+        fclose(f);
+        return result == 1;
+    }
+
+    bool decodeRowsFromMemory(const unsigned char* data, size_t size, const RowSink& sink) {
+        stbi__context s;
+        stbi__start_mem(&s, data, static_cast<int>(size));
+        int result = streamRows(&s, sink);
+        if (result < 0) {
+            stbi__start_mem(&s, data, static_cast<int>(size));
+            result = wholeRows(&s, sink);
+        }
+        return result == 1;
+    }
+
+    unsigned char* loadLuminance(const char* path, int* width, int* height) {
+        return luminanceRows(width, height, [&](const RowSink& sink) { return decodeRows(path, sink); });
+    }
+
+    unsigned char* loadLuminanceFromMemory(const unsigned char* data, size_t size, int* width, int* height) {
+        return luminanceRows(width, height,
+                             [&](const RowSink& sink) { return decodeRowsFromMemory(data, size, sink); });
+    }
+
+}
+
+namespace indexed {
+
+    namespace {
+
+        int loadPng(stbi__context* s, Image* img) {
+            stbi__png z;
+            z.s = s;
+            const int status = readPng(s, &z, 0, img, nullptr);
+            if (status == 1) {
+                img->width = static_cast<int>(s->img_x);
+                img->height = static_cast<int>(s->img_y);
+                img->indices = z.out;
+            } else {
+                STBI_FREE(z.out);
+            }
+            return status;
+        }
+
+        long long rasterError(const char* reason) {
+            stbi__err(reason, "Corrupt GIF");
+            return -1;
+        }
+
+        // stbi__process_gif_raster writing palette indices, one byte per
+        // pixel, instead of colours. Returns the number of pixels written, or -1
+        // on a corrupt raster.
+        long long gifRaster(stbi__context* s, stbi__gif* g, int lzwSize, stbi_uc* out) {
+            const int clear = 1 << lzwSize;
+            for (int code = 0; code < clear; ++code) {
+                g->codes[code].prefix = -1;
+                g->codes[code].first = static_cast<stbi_uc>(code);
+                g->codes[code].suffix = static_cast<stbi_uc>(code);
+            }
+            int codeSize = lzwSize + 1, codeMask = (1 << codeSize) - 1;
+            int avail = clear + 2, oldCode = -1, len = 0, validBits = 0;
+            stbi__int32 bits = 0;
+            bool first = true;
+            long long written = 0;
+            stbi_uc chain[8192];
+            for (;;) {
+                if (validBits < codeSize) {
+                    if (len == 0) {
+                        len = stbi__get8(s);
+                        if (len == 0) return written;
+                    }
+                    --len;
+                    bits |= static_cast<stbi__int32>(stbi__get8(s)) << validBits;
+                    validBits += 8;
+                    continue;
+                }
+                const int code = bits & codeMask;
+                bits >>= codeSize;
+                validBits -= codeSize;
+                if (code == clear) {
+                    codeSize = lzwSize + 1;
+                    codeMask = (1 << codeSize) - 1;
+                    avail = clear + 2;
+                    oldCode = -1;
+                    first = false;
+                } else if (code == clear + 1) {
+                    stbi__skip(s, len);
+                    while ((len = stbi__get8(s)) > 0) stbi__skip(s, len);
+                    return written;
+                } else if (code <= avail) {
+                    if (first) return rasterError("no clear code");
+                    if (oldCode >= 0) {
+                        stbi__gif_lzw* p = &g->codes[avail++];
+                        if (avail > 8192) return rasterError("too many codes");
+                        p->prefix = static_cast<stbi__int16>(oldCode);
+                        p->first = g->codes[oldCode].first;
+                        p->suffix = code == avail ? p->first : g->codes[code].first;
+                    } else if (code == avail) {
+                        return rasterError("illegal code in raster");
+                    }
+
+                    // stbi__out_gif_code without the recursion: collect the
+                    // suffixes back to the root, then emit them in order.
+                    int n = 0;
+                    for (int c = code; c >= 0; c = g->codes[c].prefix) chain[n++] = g->codes[c].suffix;
+                    while (n > 0 && g->cur_y < g->max_y) {
+                        out[g->cur_x + g->cur_y] = chain[--n];
+                        ++written;
+                        if (++g->cur_x >= g->max_x) {
+                            g->cur_x = g->start_x;
+                            g->cur_y += g->step;
+                            while (g->cur_y >= g->max_y && g->parse > 0) {
+                                g->step = (1 << g->parse) * g->line_size;
+                                g->cur_y = g->start_y + (g->step >> 1);
+                                --g->parse;
+                            }
+                        }
+                    }
+
+                    if ((avail & codeMask) == 0 && avail <= 0x0FFF) {
+                        ++codeSize;
+                        codeMask = (1 << codeSize) - 1;
+                    }
+                    oldCode = code;
+                } else {
+                    return rasterError("illegal code in raster");
+                }
+            }
+        }
+
+        // The first frame of stbi__gif_load_next, kept as indices. The
+        // palette holds what stb writes for each index: the colour, or
+        // transparent black where it skips transparent pixels. Pixels the
+        // frame does not cover get an index whose entry matches what stb
+        // leaves there; -1 when there is no such index to spare.
+        int loadGif(stbi__context* s, Image* img) {
+            std::unique_ptr<stbi__gif, FreeStb> g(static_cast<stbi__gif*>(stbi__malloc(sizeof(stbi__gif))));
+            if (!g) return stbi__err("outofmem", "Out of memory");
+            memset(g.get(), 0, sizeof(stbi__gif));
+            if (!stbi__gif_header(s, g.get(), nullptr, 0)) return 0;
+            if (!stbi__mad3sizes_valid(4, g->w, g->h, 0)) return stbi__err("too large", "GIF image is too large");
+            const size_t pixels = static_cast<size_t>(g->w) * g->h;
+            for (;;) {
+                const int tag = stbi__get8(s);
+                if (tag == 0x2C) {
+                    const int x = stbi__get16le(s), y = stbi__get16le(s);
+                    const int w = stbi__get16le(s), h = stbi__get16le(s);
+                    if (x + w > g->w || y + h > g->h) return stbi__err("bad Image Descriptor", "Corrupt GIF");
+                    g->line_size = g->w;
+                    g->start_x = x;
+                    g->start_y = y * g->line_size;
+                    g->max_x = g->start_x + w;
+                    g->max_y = g->start_y + h * g->line_size;
+                    g->cur_x = g->start_x;
+                    g->cur_y = w == 0 ? g->max_y : g->start_y;
+                    g->lflags = stbi__get8(s);
+                    g->step = (g->lflags & 0x40) ? 8 * g->line_size : g->line_size;
+                    g->parse = (g->lflags & 0x40) ? 3 : 0;
+                    if (g->lflags & 0x80) {
+                        stbi__gif_parse_colortable(s, g->lpal, 2 << (g->lflags & 7),
+                                                   g->eflags & 0x01 ? g->transparent : -1);
+                        g->color_table = &g->lpal[0][0];
+                    } else if (g->flags & 0x80) {
+                        g->color_table = &g->pal[0][0];
+                    } else {
+                        return stbi__err("missing color table", "Corrupt GIF");
+                    }
+
+                    for (int i = 0; i < 256; ++i) {
+                        const stbi_uc* c = g->color_table + i * 4;
+                        const bool drawn = c[3] > 128;
+                        img->palette[i][0] = drawn ? c[2] : 0;
+                        img->palette[i][1] = drawn ? c[1] : 0;
+                        img->palette[i][2] = drawn ? c[0] : 0;
+                        img->palette[i][3] = drawn ? c[3] : 0;
+                    }
+                    // stb fills uncovered pixels with the raw (BGR) background
+                    // entry made opaque, or leaves them transparent black.
+                    stbi_uc background[4] = {0, 0, 0, 0};
+                    if (g->bgindex > 0) {
+                        memcpy(background, g->pal[g->bgindex], 3);
+                        background[3] = 255;
+                    }
+                    // The raster never produces an index at or above its
+                    // clear code, so the first such entry is free for it.
+                    const int lzwSize = stbi__get8(s);
+                    if (lzwSize > 12) return stbi__err("bad LZW code size", "Corrupt GIF");
+                    int fill = -1;
+                    for (int i = 0; i < 256 && fill < 0; ++i) {
+                        if (memcmp(img->palette[i], background, 4) == 0) fill = i;
+                    }
+                    if (fill < 0 && (1 << lzwSize) < 256) {
+                        fill = 1 << lzwSize;
+                        memcpy(img->palette[fill], background, 4);
+                    }
+
+                    StbPtr out(static_cast<stbi_uc*>(stbi__malloc(pixels)));
+                    if (!out) return stbi__err("outofmem", "Out of memory");
+                    memset(out.get(), fill < 0 ? 0 : fill, pixels);
+                    const long long written = gifRaster(s, g.get(), lzwSize, out.get());
+                    if (written < 0) return 0;
+                    if (static_cast<size_t>(written) < pixels && fill < 0) return -1;
+                    img->width = g->w;
+                    img->height = g->h;
+                    img->channels = 4;
+                    img->indices = out.release();
+                    return 1;
+                }
+                if (tag == 0x21) {
+                    int len = 0;
+                    if (stbi__get8(s) == 0xF9) {
+                        len = stbi__get8(s);
+                        if (len != 4) {
+                            stbi__skip(s, len);
+                            continue;
+                        }
+                        g->eflags = stbi__get8(s);
+                        g->delay = 10 * stbi__get16le(s);
+                        if (g->transparent >= 0) g->pal[g->transparent][3] = 255;
+                        if (g->eflags & 0x01) {
+                            g->transparent = stbi__get8(s);
+                            g->pal[g->transparent][3] = 0;
+                        } else {
+                            stbi__skip(s, 1);
+                            g->transparent = -1;
+                        }
+                    }
+                    while ((len = stbi__get8(s)) != 0) stbi__skip(s, len);
+                    continue;
+                }
+                if (tag == 0x3B) return stbi__err("no frames", "Corrupt GIF");
+                return stbi__err("unknown code", "Corrupt GIF");
+            }
+        }
+
+        int loadContext(stbi__context* s, Image* img) {
+            *img = Image{};
+            int status = -1;
+            if (stbi__png_test(s)) {
+                status = loadPng(s, img);
+            } else if (stbi__gif_test(s)) {
+                status = loadGif(s, img);
+            }
+            if (status != 1) {
+                STBI_FREE(img->indices);
+                img->indices = nullptr;
+            }
+            return status;
+        }
+
+    }
+
+    int load(const char* path, Image* img) {
+        FILE* f = stbi__fopen(path, "rb");
+        if (f == nullptr) return stbi__err("can't fopen", "Unable to open file");
+        stbi__context s;
+        stbi__start_file(&s, f);
+        const int status = loadContext(&s, img);
+        fclose(f);
+        return status;
+    }
+
+    int loadFromMemory(const unsigned char* data, size_t size, Image* img) {
+        stbi__context s;
+        stbi__start_mem(&s, data, static_cast<int>(size));
+        return loadContext(&s, img);
+    }
+
+}
@@ -0,0 +1,126 @@
+#include "stream_output.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#else
+#include <cstdio>
+#endif
+
+namespace stream_output {
+
+    namespace {
+
+        constexpr size_t kTargetChunkBytes = 32 * 1024;
+
+        struct Slot {
+            std::string text;
+            int chunk = -1;     // chunk index held, -1 when free
+            size_t size = 0;
+        };
+
+    }
+
+    int defaultChunkRows(GridSize grid) {
+        const size_t stride = static_cast<size_t>(grid.cols) + 1;
+        return static_cast<int>(std::max<size_t>(1, kTargetChunkBytes / stride));
+    }
+
+    bool render(const ImageView& img, GridSize grid, int chunkRows, int threads, const Sink& sink, Stats* stats) {
+        using clock = std::chrono::steady_clock;
+        const auto start = clock::now();
+        chunkRows = std::max(1, std::min(chunkRows, grid.rows));
+        const int chunks = (grid.rows + chunkRows - 1) / chunkRows;
+        const size_t stride = static_cast<size_t>(grid.cols) + 1;
+
+        Slot slots[2];
+        for (Slot& s : slots) s.text.assign(stride * static_cast<size_t>(chunkRows), '\n');
+        std::mutex mu;
+        std::condition_variable cv;
+        bool abort = false;
+
+        std::thread producer([&] {
+            ThreadPool& pool = ThreadPool::shared();
+            for (int k = 0; k < chunks; ++k) {
+                Slot& slot = slots[k & 1];
+                {
+                    std::unique_lock<std::mutex> lock(mu);
+                    cv.wait(lock, [&] { return abort || slot.chunk < 0; });
+                    if (abort) return;
+                }
+                const int first = k * chunkRows;
+                const int last = std::min(grid.rows, first + chunkRows);
+                char* base = &slot.text[0];
+                pool.parallelFor(last - first, std::max(1, (last - first) / std::max(1, threads * 2)), threads,
+                                 [&](int begin, int end) {
+                    for (int r = begin; r < end; ++r) {
+                        char* line = base + static_cast<size_t>(r) * stride;
+                        renderRow(img, grid, first + r, line);
+                        line[grid.cols] = '\n';
+                    }
+                });
+                {
+                    std::lock_guard<std::mutex> lock(mu);
+                    slot.chunk = k;
+                    slot.size = static_cast<size_t>(last - first) * stride;
+                }
+                cv.notify_all();
+            }
+        });
+
+        bool ok = true;
+        for (int k = 0; k < chunks && ok; ++k) {
+            Slot& slot = slots[k & 1];
+            {
+                std::unique_lock<std::mutex> lock(mu);
+                cv.wait(lock, [&] { return slot.chunk == k; });
+            }
+            ok = sink(slot.text.data(), slot.size);
+            if (k == 0 && stats != nullptr) {
+                stats->firstByteMs = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+            }
+            {
+                std::lock_guard<std::mutex> lock(mu);
+                slot.chunk = -1;
+                if (!ok) abort = true;
+            }
+            cv.notify_all();
+        }
+        producer.join();
+
+        if (stats != nullptr) {
+            stats->chunks = chunks;
+            stats->totalMs = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        }
+        return ok;
+    }
+
+    Sink fdSink(int fd) {
+        return [fd](const char* data, size_t size) {
+#if defined(__unix__) || defined(__APPLE__)
+            while (size > 0) {
+                ssize_t w = ::write(fd, data, size);
+                if (w < 0) {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                data += w;
+                size -= static_cast<size_t>(w);
+            }
+            return true;
+#else
+            std::FILE* f = fd == 1 ? stdout : stderr;
+            return std::fwrite(data, 1, size, f) == size && std::fflush(f) == 0;
+#endif
+        };
+    }
+
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "render.h"
+
+#include <cstddef>
+#include <functional>
+
+// Streaming output for large renders: rows are produced in chunks into two
+// alternating buffers, so chunk k + 1 is rendered while chunk k is being
+// written. Output order is preserved and the first bytes leave after one
+// chunk instead of after the whole image.
+namespace stream_output {
+
+    // Receives consecutive pieces of the output; returning false aborts.
+    using Sink = std::function<bool(const char* data, size_t size)>;
+
+    struct Stats {
+        int chunks = 0;
+        double firstByteMs = 0.0;
+        double totalMs = 0.0;
+    };
+
+    // Rows per chunk aiming at about 32 KiB of text.
+    int defaultChunkRows(GridSize grid);
+
+    // Renders grid in chunks of chunkRows rows on a producer thread (using up
+    // to `threads` pool threads per chunk) and hands each to sink in order.
+    bool render(const ImageView& img, GridSize grid, int chunkRows, int threads, const Sink& sink, Stats* stats);
+
+    // Sink that write(2)s to a file descriptor, retrying short writes.
+    Sink fdSink(int fd);
+
+}
@@ -0,0 +1,77 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(int threads) {
+    for (int i = 1; i < threads; ++i) {
+        workers_.emplace_back([this, i] { workerLoop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& t : workers_) t.join();
+}
+
+ThreadPool& ThreadPool::shared() {
+    static ThreadPool pool(static_cast<int>(std::max(1u, std::thread::hardware_concurrency())));
+    return pool;
+}
+
+void ThreadPool::runChunks() {
+    for (;;) {
+        const int begin = next_.fetch_add(chunk_, std::memory_order_relaxed);
+        if (begin >= n_) return;
+        (*fn_)(begin, std::min(n_, begin + chunk_));
+    }
+}
+
+void ThreadPool::workerLoop(int index) {
+    unsigned seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+            if (stop_) return;
+            seen = generation_;
+            if (index > activeWorkers_) continue;
+        }
+        runChunks();
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (--pending_ == 0) done_.notify_one();
+        }
+    }
+}
+
+void ThreadPool::parallelFor(int n, int chunk, int threads, const std::function<void(int, int)>& fn) {
+    if (n <= 0) return;
+    chunk = std::max(1, chunk);
+    const int chunks = (n + chunk - 1) / chunk;
+    const int helpers = std::min({threads - 1, static_cast<int>(workers_.size()), chunks - 1});
+    if (helpers <= 0) {
+        for (int begin = 0; begin < n; begin += chunk) fn(begin, std::min(n, begin + chunk));
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        fn_ = &fn;
+        n_ = n;
+        chunk_ = chunk;
+        activeWorkers_ = helpers;
+        pending_ = helpers;
+        next_.store(0, std::memory_order_relaxed);
+        ++generation_;
+    }
+    wake_.notify_all();
+    runChunks();
+
+    std::unique_lock<std::mutex> lock(mu_);
+    done_.wait(lock, [this] { return pending_ == 0; });
+    fn_ = nullptr;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed pool of worker threads for data-parallel loops. The calling thread
+// takes part in every loop, so a pool of N threads has N - 1 workers.
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return static_cast<int>(workers_.size()) + 1; }
+
+    // Calls fn(begin, end) for consecutive chunks of [0, n), handing chunks
+    // out dynamically to at most `threads` threads (including the caller).
+    // Returns when every chunk is done. Not reentrant.
+    void parallelFor(int n, int chunk, int threads, const std::function<void(int, int)>& fn);
+
+    // Process-wide pool with one thread per hardware thread.
+    static ThreadPool& shared();
+
+private:
+    void workerLoop(int index);
+    void runChunks();
+
+    std::vector<std::thread> workers_;
+    std::mutex mu_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    bool stop_ = false;
+    unsigned generation_ = 0;
+
+    // Current loop; written under mu_ before generation_ is bumped.
+    const std::function<void(int, int)>* fn_ = nullptr;
+    int n_ = 0;
+    int chunk_ = 1;
+    int activeWorkers_ = 0;
+    int pending_ = 0;
+    std::atomic<int> next_{0};
+};
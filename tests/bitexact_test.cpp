@@ -0,0 +1,1925 @@
+// Differential test: every render path must reproduce, byte for byte, the
+// output of the original scalar loop from main(). The reference below is a
+// verbatim copy of that loop and must not be "optimized".
+
+#include "archive.h"
+#include "batch.h"
+#include "decode.h"
+#include "frame_stream.h"
+#include "indexed.h"
+#include "inflate.h"
+#include "jpeg_luma.h"
+#include "jpeg_preview.h"
+#include "jpeg_simd.h"
+#include "orientation.h"
+#include "palette.h"
+#include "pyramid.h"
+#include "quadrant.h"
+#include "render.h"
+#include "stream_output.h"
+#include "thread_pool.h"
+#include "stb_image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+    struct Corpus {
+        std::string name;
+        std::vector<unsigned char> pixels;
+        ImageView view;
+    };
+
+    struct Variant {
+        const char* name;
+        std::function<std::string(const ImageView&, GridSize)> render;
+    };
+
+    // luminance() as the original main() had it, kept here so a change to
+    // the shared one is measured against this rather than itself.
+    uint8_t referenceLuminance(const unsigned char* p, int channels) {
+        float r = 0.f, g = 0.f, b = 0.f, a = 1.f;
+        if (channels == 1) {
+            r = g = b = p[0] / 255.0f;
+        } else if (channels == 2) {
+            float gray = p[0] / 255.0f;
+            a = p[1] / 255.0f;
+            r = g = b = gray * a;
+        } else if (channels >= 3) {
+            r = p[0] / 255.0f;
+            g = p[1] / 255.0f;
+            b = p[2] / 255.0f;
+            if (channels >= 4) {
+                a = p[3] / 255.0f;
+                r *= a; g *= a; b *= a;
+            }
+        }
+        float Y = 0.2126f * r + 0.7152f * g + 0.0722f * b;
+        int yi = static_cast<int>(std::round(Y * 255.0f));
+        return static_cast<uint8_t>(std::min(255, std::max(0, yi)));
+    }
+
+    std::string renderReference(const ImageView& img, GridSize grid) {
+        const int width = img.width, height = img.height, channels = img.channels;
+        const int targetCols = grid.cols, targetRows = grid.rows;
+        const float charAspect = 2.0f;
+        const std::string ramp = " .:-=+*#%@";
+        const int rampN = static_cast<int>(ramp.size());
+
+        std::string out;
+        std::vector<char> line(static_cast<size_t>(targetCols) + 1, '\0');
+        for (int y = 0; y < targetRows; ++y) {
+            int sy = std::min(height - 1, std::max(0, static_cast<int>(std::round((y + 0.5f) * (height / (targetRows * charAspect)) - 0.5f))));
+            for (int x = 0; x < targetCols; ++x) {
+                int sx = std::min(width - 1, std::max(0, static_cast<int>(std::round((x + 0.5f) * (static_cast<float>(width) / targetCols) - 0.5f))));
+                const unsigned char* p = img.data + (static_cast<size_t>(sy) * width + sx) * channels;
+                uint8_t lum = referenceLuminance(p, channels);
+                int idx = (lum * (rampN - 1)) / 255;
+                line[static_cast<size_t>(x)] = ramp[idx];
+            }
+            line[static_cast<size_t>(targetCols)] = '\0';
+            out += line.data();
+            out += "\n";
+        }
+        return out;
+    }
+
+    // A private pool so the parallel paths really run threaded even on a
+    // single-core machine.
+    ThreadPool& testPool() {
+        static ThreadPool pool(4);
+        return pool;
+    }
+
+    std::vector<Variant> variants() {
+        return {
+            {"fused", [](const ImageView& img, GridSize grid) { return renderAscii(img, grid); }},
+            {"staged", [](const ImageView& img, GridSize grid) {
+                 const size_t cells = static_cast<size_t>(grid.cols) * grid.rows;
+                 std::vector<unsigned char> samples(cells * static_cast<size_t>(img.channels));
+                 std::vector<uint8_t> lum(cells);
+                 std::string text(renderedSize(grid), '\n');
+                 resampleGrid(img, grid, samples.data());
+                 luminanceGrid(samples.data(), img.channels, cells, lum.data());
+                 glyphGrid(lum.data(), grid, &text[0]);
+                 return text;
+             }},
+            {"parallel-4x1", [](const ImageView& img, GridSize grid) {
+                 std::string text(renderedSize(grid), '\n');
+                 renderAsciiParallel(img, grid, 4, 1, &text[0], testPool());
+                 return text;
+             }},
+            {"parallel-3x7", [](const ImageView& img, GridSize grid) {
+                 std::string text(renderedSize(grid), '\n');
+                 renderAsciiParallel(img, grid, 3, 7, &text[0], testPool());
+                 return text;
+             }},
+            {"options-default", [](const ImageView& img, GridSize grid) {
+                 std::string text(renderedSize(grid), '\n');
+                 renderWithOptions(img, grid, RenderOptions{}, &text[0]);
+                 return text;
+             }},
+            {"stream-3", [](const ImageView& img, GridSize grid) {
+                 std::string text;
+                 stream_output::render(img, grid, 3, 2, [&](const char* data, size_t size) {
+                     text.append(data, size);
+                     return true;
+                 }, nullptr);
+                 return text;
+             }},
+        };
+    }
+
+    bool loadFile(const std::string& name, std::vector<Corpus>* corpus) {
+        const std::string path = std::string(ASCII_TEST_DATA_DIR) + "/" + name;
+        int w = 0, h = 0, c = 0;
+        stbi_uc* data = stbi_load(path.c_str(), &w, &h, &c, 0);
+        if (data == nullptr) {
+            std::cerr << "cannot load " << path << ": " << stbi_failure_reason() << "\n";
+            return false;
+        }
+        Corpus item;
+        item.name = name;
+        item.pixels.assign(data, data + static_cast<size_t>(w) * h * c);
+        item.view = ImageView{nullptr, w, h, c};
+        stbi_image_free(data);
+        corpus->push_back(std::move(item));
+        return true;
+    }
+
+    // Random noise plus a few flat and saturated runs so every ramp entry and
+    // the alpha paths get exercised.
+    void addSynthetic(int w, int h, int c, uint32_t seed, std::vector<Corpus>* corpus) {
+        std::mt19937 rng(seed);
+        Corpus item;
+        item.name = "synthetic " + std::to_string(w) + "x" + std::to_string(h) + "x" + std::to_string(c);
+        item.pixels.resize(static_cast<size_t>(w) * h * c);
+        for (size_t i = 0; i < item.pixels.size(); ++i) {
+            const uint32_t r = rng();
+            switch (r % 8) {
+                case 0: item.pixels[i] = 0; break;
+                case 1: item.pixels[i] = 255; break;
+                default: item.pixels[i] = static_cast<unsigned char>(r >> 8); break;
+            }
+        }
+        item.view = ImageView{nullptr, w, h, c};
+        corpus->push_back(std::move(item));
+    }
+
+    // Reports the first differing cell, or returns true when identical.
+    bool compare(const std::string& expected, const std::string& actual, GridSize grid, std::string* where) {
+        if (expected == actual) return true;
+        const size_t stride = static_cast<size_t>(grid.cols) + 1;
+        const size_t n = std::min(expected.size(), actual.size());
+        size_t i = 0;
+        while (i < n && expected[i] == actual[i]) ++i;
+        if (i == n) {
+            *where = "length " + std::to_string(actual.size()) + ", expected " + std::to_string(expected.size());
+        } else {
+            *where = "row " + std::to_string(i / stride) + " col " + std::to_string(i % stride) +
+                     ": expected '" + std::string(1, expected[i]) + "' got '" + std::string(1, actual[i]) + "'";
+        }
+        return false;
+    }
+
+
+    void putU32be(std::vector<unsigned char>* out, uint32_t v) {
+        for (int shift = 24; shift >= 0; shift -= 8) out->push_back(static_cast<unsigned char>(v >> shift));
+    }
+
+    void putChunk(std::vector<unsigned char>* png, const char* type, const std::vector<unsigned char>& body) {
+        putU32be(png, static_cast<uint32_t>(body.size()));
+        png->insert(png->end(), type, type + 4);
+        png->insert(png->end(), body.begin(), body.end());
+        putU32be(png, 0);   // stb_image does not check CRCs
+    }
+
+    // LSB-first bit writer for DEFLATE streams.
+    struct BitWriter {
+        std::vector<unsigned char>* out;
+        uint32_t acc = 0;
+        int bits = 0;
+
+        void put(uint32_t value, int n) {
+            acc |= value << bits;
+            for (bits += n; bits >= 8; bits -= 8, acc >>= 8) out->push_back(static_cast<unsigned char>(acc));
+        }
+        // Huffman codes go out most significant bit first.
+        void code(uint32_t value, int n) {
+            uint32_t r = 0;
+            for (int i = 0; i < n; ++i) r = r << 1 | ((value >> i) & 1);
+            put(r, n);
+        }
+        void flush() {
+            if (bits > 0) out->push_back(static_cast<unsigned char>(acc));
+            acc = 0;
+            bits = 0;
+        }
+    };
+
+    // zlib stream of data: a fixed-Huffman block, a stored block and a final
+    // fixed-Huffman block, splitting data in thirds. Matches are found by
+    // trying each of `distances` at every position; they may reach back
+    // into earlier blocks.
+    std::vector<unsigned char> zlibFixed(const std::vector<uint8_t>& data, const std::vector<int>& distances) {
+        static const int lengthBase[] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                         31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const int distBase[] = {1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+                                       193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+        static const int lengthExtra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                          2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const int distExtra[] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                        6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        std::vector<unsigned char> z = {0x78, 0x01};
+        BitWriter bw{&z};
+        auto literal = [&](int v) {
+            if (v < 144) bw.code(static_cast<uint32_t>(0x30 + v), 8);
+            else if (v < 256) bw.code(static_cast<uint32_t>(0x190 + v - 144), 9);
+            else if (v < 280) bw.code(static_cast<uint32_t>(v - 256), 7);
+            else bw.code(static_cast<uint32_t>(0xC0 + v - 280), 8);
+        };
+        auto fixedBlock = [&](size_t begin, size_t end, bool last) {
+            bw.put(last ? 1 : 0, 1);
+            bw.put(1, 2);
+            for (size_t i = begin; i < end;) {
+                int bestLen = 0, bestDist = 0;
+                for (int d : distances) {
+                    if (static_cast<size_t>(d) > i || d > 32768) continue;
+                    int len = 0;
+                    while (len < 258 && i + len < end && data[i + len] == data[i + len - d]) ++len;
+                    if (len > bestLen) {
+                        bestLen = len;
+                        bestDist = d;
+                    }
+                }
+                if (bestLen < 3) {
+                    literal(data[i++]);
+                    continue;
+                }
+                int li = 28;
+                while (lengthBase[li] > bestLen) --li;
+                literal(257 + li);
+                bw.put(static_cast<uint32_t>(bestLen - lengthBase[li]), lengthExtra[li]);
+                int di = 29;
+                while (distBase[di] > bestDist) --di;
+                bw.code(static_cast<uint32_t>(di), 5);
+                bw.put(static_cast<uint32_t>(bestDist - distBase[di]), distExtra[di]);
+                i += static_cast<size_t>(bestLen);
+            }
+            literal(256);
+        };
+        const size_t third = data.size() / 3;
+        fixedBlock(0, third, false);
+        bw.put(0, 1);
+        bw.put(0, 2);
+        bw.flush();
+        const size_t n = std::min<size_t>(65535, third);
+        z.insert(z.end(), {static_cast<unsigned char>(n), static_cast<unsigned char>(n >> 8),
+                           static_cast<unsigned char>(~n), static_cast<unsigned char>(~n >> 8)});
+        z.insert(z.end(), data.begin() + static_cast<long>(third), data.begin() + static_cast<long>(third + n));
+        fixedBlock(third + n, data.size(), true);
+        bw.flush();
+        uint32_t a = 1, b = 0;
+        for (unsigned char c : data) {
+            a = (a + c) % 65521;
+            b = (b + a) % 65521;
+        }
+        putU32be(&z, b << 16 | a);
+        return z;
+    }
+
+    // PNG compressed by zlibFixed. samples holds one sample per byte, or
+    // big-endian pairs at depth 16; depths below 8 are packed here.
+    // Interlaced images are split into Adam7 passes. Scanlines are stored
+    // unfiltered, or with `filtered` cycle through filter types 0-4.
+    std::vector<unsigned char> pngFile(int w, int h, int depth, int color, bool interlaced,
+                                       const std::vector<uint8_t>& samples, const std::vector<uint8_t>& plte,
+                                       const std::vector<uint8_t>& trns, bool filtered = false) {
+        const int channels = color == 0 || color == 3 ? 1 : color == 2 ? 3 : color == 4 ? 2 : 4;
+        const int bytesPerSample = depth == 16 ? 2 : 1;
+        const size_t pixelBytes = static_cast<size_t>(channels) * bytesPerSample;
+        const int bpp = std::max(1, static_cast<int>(pixelBytes));
+        std::vector<uint8_t> raw;
+        auto pass = [&](int x0, int y0, int dx, int dy) {
+            std::vector<uint8_t> line, above;
+            for (int y = y0; y < h; y += dy) {
+                if (x0 >= w) return;
+                line.clear();
+                int acc = 0, bits = 0;
+                for (int x = x0; x < w; x += dx) {
+                    const size_t at = (static_cast<size_t>(y) * w + x) * pixelBytes;
+                    if (depth >= 8) {
+                        line.insert(line.end(), samples.begin() + static_cast<long>(at),
+                                    samples.begin() + static_cast<long>(at + pixelBytes));
+                        continue;
+                    }
+                    acc = acc << depth | samples[at];
+                    if ((bits += depth) == 8) {
+                        line.push_back(static_cast<uint8_t>(acc));
+                        acc = bits = 0;
+                    }
+                }
+                if (bits > 0) line.push_back(static_cast<uint8_t>(acc << (8 - bits)));
+                above.resize(line.size());
+                const int filter = filtered ? (y / dy) % 5 : 0;
+                raw.push_back(static_cast<uint8_t>(filter));
+                for (size_t k = 0; k < line.size(); ++k) {
+                    const size_t back = static_cast<size_t>(bpp);
+                    const int a = k >= back ? line[k - back] : 0, b = above[k], c = k >= back ? above[k - back] : 0;
+                    const int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+                    const int predict[] = {0, a, b, (a + b) / 2, pa <= pb && pa <= pc ? a : pb <= pc ? b : c};
+                    raw.push_back(static_cast<uint8_t>(line[k] - predict[filter]));
+                }
+                above = line;
+            }
+        };
+        if (interlaced) {
+            const int x0[] = {0, 4, 0, 2, 0, 1, 0}, y0[] = {0, 0, 4, 0, 2, 0, 1};
+            const int dx[] = {8, 8, 4, 4, 2, 2, 1}, dy[] = {8, 8, 8, 4, 4, 2, 2};
+            for (int p = 0; p < 7; ++p) pass(x0[p], y0[p], dx[p], dy[p]);
+        } else {
+            pass(0, 0, 1, 1);
+        }
+        const int stride = static_cast<int>((static_cast<size_t>(w) * channels * depth + 7) / 8) + 1;
+
+        std::vector<unsigned char> png = {137, 80, 78, 71, 13, 10, 26, 10}, ihdr;
+        putU32be(&ihdr, static_cast<uint32_t>(w));
+        putU32be(&ihdr, static_cast<uint32_t>(h));
+        ihdr.insert(ihdr.end(), {static_cast<unsigned char>(depth), static_cast<unsigned char>(color), 0, 0,
+                                 static_cast<unsigned char>(interlaced ? 1 : 0)});
+        putChunk(&png, "IHDR", ihdr);
+        if (!plte.empty()) putChunk(&png, "PLTE", plte);
+        if (!trns.empty()) putChunk(&png, "tRNS", trns);
+        putChunk(&png, "IDAT", zlibFixed(raw, {1, 2, bpp, 2 * bpp, stride, 2 * stride, 7, 300}));
+        putChunk(&png, "IEND", {});
+        return png;
+    }
+
+    // Palette PNG; the first `transparent` entries get a random tRNS alpha.
+    std::vector<unsigned char> palettePng(int w, int h, int depth, const std::vector<uint8_t>& idx,
+                                          const std::vector<uint8_t>& rgb, int transparent, uint32_t seed) {
+        std::vector<unsigned char> alpha(static_cast<size_t>(transparent));
+        std::mt19937 rng(seed);
+        for (unsigned char& v : alpha) v = static_cast<unsigned char>(rng() % 3 == 0 ? 0 : rng());
+        return pngFile(w, h, depth, 3, false, idx, rgb, alpha);
+    }
+
+    struct GifFrame {
+        int canvasW, canvasH, x, y, w, h;
+        int lzwSize;
+        bool localTable, interlaced;
+        int background, transparent;   // transparent < 0: no graphic control extension
+    };
+
+    // GIF whose raster uses only literal codes, with a clear code before the
+    // code width would grow.
+    std::vector<unsigned char> gif(const GifFrame& f, const std::vector<uint8_t>& idx, const std::vector<uint8_t>& rgb) {
+        const int tableBits = f.lzwSize < 2 ? 1 : f.lzwSize;   // table of 2 << (tableBits - 1) entries
+        std::vector<unsigned char> out = {'G', 'I', 'F', '8', '9', 'a'};
+        auto u16 = [&](int v) {
+            out.push_back(static_cast<unsigned char>(v));
+            out.push_back(static_cast<unsigned char>(v >> 8));
+        };
+        u16(f.canvasW);
+        u16(f.canvasH);
+        out.push_back(static_cast<unsigned char>(f.localTable ? 0 : 0x80 | (tableBits - 1)));
+        out.push_back(static_cast<unsigned char>(f.background));
+        out.push_back(0);
+        if (!f.localTable) out.insert(out.end(), rgb.begin(), rgb.end());
+        if (f.transparent >= 0) {
+            out.insert(out.end(), {0x21, 0xF9, 4, 1, 0, 0, static_cast<unsigned char>(f.transparent), 0});
+        }
+        out.push_back(0x2C);
+        u16(f.x);
+        u16(f.y);
+        u16(f.w);
+        u16(f.h);
+        out.push_back(static_cast<unsigned char>((f.localTable ? 0x80 | (tableBits - 1) : 0) | (f.interlaced ? 0x40 : 0)));
+        if (f.localTable) out.insert(out.end(), rgb.begin(), rgb.end());
+
+        std::vector<int> rows;
+        if (f.interlaced) {
+            const int start[] = {0, 4, 2, 1}, step[] = {8, 8, 4, 2};
+            for (int p = 0; p < 4; ++p) {
+                for (int y = start[p]; y < f.h; y += step[p]) rows.push_back(y);
+            }
+        } else {
+            for (int y = 0; y < f.h; ++y) rows.push_back(y);
+        }
+        const int clear = 1 << f.lzwSize, width = f.lzwSize + 1;
+        std::vector<unsigned char> data;
+        uint32_t acc = 0;
+        int bits = 0, run = 0;
+        auto code = [&](int c) {
+            acc |= static_cast<uint32_t>(c) << bits;
+            for (bits += width; bits >= 8; bits -= 8, acc >>= 8) data.push_back(static_cast<unsigned char>(acc));
+        };
+        code(clear);
+        for (int y : rows) {
+            for (int x = 0; x < f.w; ++x) {
+                if (run == clear - 2) {
+                    code(clear);
+                    run = 0;
+                }
+                code(idx[static_cast<size_t>(y) * f.w + x]);
+                ++run;
+            }
+        }
+        code(clear + 1);
+        if (bits > 0) data.push_back(static_cast<unsigned char>(acc));
+        out.push_back(static_cast<unsigned char>(f.lzwSize));
+        for (size_t at = 0; at < data.size(); at += 255) {
+            const size_t n = std::min<size_t>(255, data.size() - at);
+            out.push_back(static_cast<unsigned char>(n));
+            out.insert(out.end(), data.begin() + static_cast<long>(at), data.begin() + static_cast<long>(at + n));
+        }
+        out.push_back(0);
+        out.push_back(0x3B);
+        return out;
+    }
+
+    // A baseline JPEG of random quantised coefficients: the decoder neither
+    // knows nor cares that no DCT produced them, and large ones exercise
+    // the clamping in the IDCT. `sampling` holds (h << 4) | v per
+    // component; ids 'R', 'G', 'B' mark an RGB image. Every DC category
+    // has a 4-bit code and every AC run/size symbol an 8-bit one.
+    std::vector<unsigned char> jpegFile(int w, int h, const std::vector<int>& sampling, bool rgbIds, uint32_t seed) {
+        std::mt19937 rng(seed);
+        const int comps = static_cast<int>(sampling.size());
+        std::vector<unsigned char> out = {0xFF, 0xD8};
+        auto marker = [&](int m, const std::vector<unsigned char>& body) {
+            out.push_back(0xFF);
+            out.push_back(static_cast<unsigned char>(m));
+            out.push_back(static_cast<unsigned char>((body.size() + 2) >> 8));
+            out.push_back(static_cast<unsigned char>(body.size() + 2));
+            out.insert(out.end(), body.begin(), body.end());
+        };
+        std::vector<unsigned char> dqt = {0};
+        for (int k = 0; k < 64; ++k) dqt.push_back(static_cast<unsigned char>(k == 0 ? 8 : 1 + k / 4));
+        marker(0xDB, dqt);
+        std::vector<unsigned char> sof = {8, static_cast<unsigned char>(h >> 8), static_cast<unsigned char>(h),
+                                          static_cast<unsigned char>(w >> 8), static_cast<unsigned char>(w),
+                                          static_cast<unsigned char>(comps)};
+        int hMax = 1, vMax = 1;
+        for (int c = 0; c < comps; ++c) {
+            sof.push_back(static_cast<unsigned char>(rgbIds ? "RGBA"[c] : c + 1));
+            sof.push_back(static_cast<unsigned char>(sampling[static_cast<size_t>(c)]));
+            sof.push_back(0);
+            hMax = std::max(hMax, sampling[static_cast<size_t>(c)] >> 4);
+            vMax = std::max(vMax, sampling[static_cast<size_t>(c)] & 15);
+        }
+        marker(0xC0, sof);
+        std::vector<unsigned char> dht = {0x00};
+        for (int len = 1; len <= 16; ++len) dht.push_back(len == 4 ? 12 : 0);
+        for (int cat = 0; cat < 12; ++cat) dht.push_back(static_cast<unsigned char>(cat));
+        dht.push_back(0x10);
+        for (int len = 1; len <= 16; ++len) dht.push_back(len == 8 ? 162 : 0);
+        std::vector<int> acCode(256, -1);
+        int nextCode = 0;
+        auto acSymbol = [&](int sym) {
+            acCode[static_cast<size_t>(sym)] = nextCode++;
+            dht.push_back(static_cast<unsigned char>(sym));
+        };
+        acSymbol(0x00);
+        acSymbol(0xF0);
+        for (int run = 0; run < 16; ++run) {
+            for (int size = 1; size <= 10; ++size) acSymbol(run << 4 | size);
+        }
+        marker(0xC4, dht);
+        std::vector<unsigned char> sos = {static_cast<unsigned char>(comps)};
+        for (int c = 0; c < comps; ++c) {
+            sos.push_back(static_cast<unsigned char>(rgbIds ? "RGBA"[c] : c + 1));
+            sos.push_back(0x00);
+        }
+        sos.push_back(0);
+        sos.push_back(63);
+        sos.push_back(0);
+        marker(0xDA, sos);
+
+        uint32_t acc = 0;
+        int bits = 0;
+        auto put = [&](uint32_t v, int n) {
+            for (int i = n - 1; i >= 0; --i) {
+                acc = acc << 1 | ((v >> i) & 1);
+                if (++bits == 8) {
+                    out.push_back(static_cast<unsigned char>(acc));
+                    if (acc == 0xFF) out.push_back(0);
+                    acc = 0;
+                    bits = 0;
+                }
+            }
+        };
+        auto category = [](int v) {
+            int n = 0;
+            for (int a = std::abs(v); a > 0; a >>= 1) ++n;
+            return n;
+        };
+        auto value = [&](int v, int n) { put(static_cast<uint32_t>(v < 0 ? v - 1 : v) & ((1u << n) - 1), n); };
+        std::vector<int> pred(static_cast<size_t>(comps), 0);
+        auto block = [&](int c) {
+            const int dc = static_cast<int>(rng() % 241) - 120;
+            const int diff = dc - pred[static_cast<size_t>(c)];
+            pred[static_cast<size_t>(c)] = dc;
+            put(static_cast<uint32_t>(category(diff)), 4);
+            value(diff, category(diff));
+            const uint32_t density = rng() % 4;    // from DC-only to busy
+            int run = 0;
+            for (int k = 1; k < 64; ++k) {
+                const int v = rng() % 8 < density * 2 ? static_cast<int>(rng() % 81) - 40 : 0;
+                if (v == 0) {
+                    ++run;
+                    continue;
+                }
+                for (; run > 15; run -= 16) put(static_cast<uint32_t>(acCode[0xF0]), 8);
+                put(static_cast<uint32_t>(acCode[static_cast<size_t>(run << 4 | category(v))]), 8);
+                value(v, category(v));
+                run = 0;
+            }
+            if (run > 0) put(static_cast<uint32_t>(acCode[0x00]), 8);
+        };
+        if (comps == 1) {
+            for (int i = 0; i < ((w + 7) / 8) * ((h + 7) / 8); ++i) block(0);
+        } else {
+            const int mcus = ((w + 8 * hMax - 1) / (8 * hMax)) * ((h + 8 * vMax - 1) / (8 * vMax));
+            for (int m = 0; m < mcus; ++m) {
+                for (int c = 0; c < comps; ++c) {
+                    const int factors = sampling[static_cast<size_t>(c)];
+                    for (int b = 0; b < (factors >> 4) * (factors & 15); ++b) block(c);
+                }
+            }
+        }
+        if (bits > 0) put((1u << (8 - bits)) - 1, 8 - bits);
+        out.push_back(0xFF);
+        out.push_back(0xD9);
+        return out;
+    }
+
+    // Binary PGM (one channel) or PPM (three) holding pixels.
+    std::vector<unsigned char> pnmFile(int w, int h, int channels, const std::vector<uint8_t>& pixels) {
+        const std::string header = std::string(channels == 1 ? "P5" : "P6") + "\n# comment\n" +
+                                   std::to_string(w) + " " + std::to_string(h) + "\n255\n";
+        std::vector<unsigned char> out(header.begin(), header.end());
+        out.insert(out.end(), pixels.begin(), pixels.end());
+        return out;
+    }
+
+    void putLe(std::vector<unsigned char>* out, uint32_t v, int bytes) {
+        for (int i = 0; i < bytes; ++i) out->push_back(static_cast<unsigned char>(v >> (8 * i)));
+    }
+
+    // BMP with a 40-byte header. Below 16 bits per pixel `data` holds one
+    // palette index per pixel and the palette is random; at 16 and 32 bits
+    // it holds whole little-endian pixels, read through 5:6:5 or 8:8:8
+    // bitfields when `fields` is set (no alpha) and the default layout,
+    // alpha in the top byte at 32 bits, otherwise; at 24 bits it is BGR.
+    std::vector<unsigned char> bmpFile(int w, int h, int bpp, bool topDown, bool fields,
+                                       const std::vector<uint8_t>& data, uint32_t seed) {
+        std::mt19937 rng(seed);
+        const int paletteN = bpp < 16 ? 1 << bpp : 0;
+        const size_t stride = (static_cast<size_t>(w) * bpp + 31) / 32 * 4;
+        std::vector<unsigned char> pixels;
+        for (int r = 0; r < h; ++r) {
+            const int y = topDown ? r : h - 1 - r;
+            std::vector<unsigned char> row(stride, 0);
+            for (int x = 0; x < w; ++x) {
+                const size_t i = static_cast<size_t>(y) * w + x;
+                if (bpp < 8) {
+                    const size_t bit = static_cast<size_t>(x) * bpp;
+                    row[bit / 8] |= static_cast<unsigned char>(data[i] << (8 - bpp - bit % 8));
+                } else {
+                    const size_t bytes = static_cast<size_t>(bpp / 8);
+                    std::copy_n(data.begin() + static_cast<long>(i * bytes), bytes,
+                                row.begin() + static_cast<long>(x * bytes));
+                }
+            }
+            pixels.insert(pixels.end(), row.begin(), row.end());
+        }
+        const uint32_t offset = 14 + 40 + (fields ? 12 : 0) + paletteN * 4;
+        std::vector<unsigned char> out = {'B', 'M'};
+        putLe(&out, offset + static_cast<uint32_t>(pixels.size()), 4);
+        putLe(&out, 0, 4);
+        putLe(&out, offset, 4);
+        putLe(&out, 40, 4);
+        putLe(&out, static_cast<uint32_t>(w), 4);
+        putLe(&out, static_cast<uint32_t>(topDown ? -h : h), 4);
+        putLe(&out, 1, 2);
+        putLe(&out, static_cast<uint32_t>(bpp), 2);
+        putLe(&out, fields ? 3 : 0, 4);
+        putLe(&out, static_cast<uint32_t>(pixels.size()), 4);
+        putLe(&out, 2835, 4);
+        putLe(&out, 2835, 4);
+        putLe(&out, static_cast<uint32_t>(paletteN), 4);
+        putLe(&out, 0, 4);
+        if (fields) {
+            for (uint32_t mask : bpp == 16 ? std::vector<uint32_t>{0xF800, 0x07E0, 0x001F}
+                                           : std::vector<uint32_t>{0xFF0000, 0xFF00, 0xFF}) {
+                putLe(&out, mask, 4);
+            }
+        }
+        for (int i = 0; i < paletteN * 4; ++i) out.push_back(static_cast<unsigned char>(i % 4 == 3 ? 0 : rng()));
+        out.insert(out.end(), pixels.begin(), pixels.end());
+        return out;
+    }
+
+    struct ArchiveMember {
+        std::string name;
+        std::vector<unsigned char> data;
+        char type = '0';        // tar type flag
+        bool deflate = false;   // zip: compressed with zlibFixed
+        bool zip64 = false;     // zip: sizes and offset in the ZIP64 extra field
+        bool encrypted = false; // zip: flag bit 0 set
+    };
+
+    // img displayed through t, built pixel by pixel from the definitions.
+    std::vector<unsigned char> uprightCopy(const ImageView& v, orient::Transform t) {
+        const int turns = t.quarterTurns & 3;
+        const int dw = turns % 2 ? v.height : v.width, dh = turns % 2 ? v.width : v.height;
+        std::vector<unsigned char> upright(static_cast<size_t>(v.width) * v.height * v.channels);
+        for (int dy = 0; dy < dh; ++dy) {
+            for (int dx = 0; dx < dw; ++dx) {
+                const int fx = t.flip ? dw - 1 - dx : dx;
+                int sx = fx, sy = dy;
+                if (turns == 1) { sx = dy; sy = v.height - 1 - fx; }
+                if (turns == 2) { sx = v.width - 1 - fx; sy = v.height - 1 - dy; }
+                if (turns == 3) { sx = v.width - 1 - dy; sy = fx; }
+                std::copy_n(v.data + (static_cast<size_t>(sy) * v.width + sx) * v.channels, v.channels,
+                            &upright[(static_cast<size_t>(dy) * dw + dx) * v.channels]);
+            }
+        }
+        return upright;
+    }
+
+    // jpeg with an APP1 Exif block carrying orientation tag after its SOI.
+    std::vector<unsigned char> withExifOrientation(std::vector<unsigned char> jpeg, int tag) {
+        const std::vector<unsigned char> app1 = {
+            0xFF, 0xE1, 0, 34, 'E', 'x', 'i', 'f', 0, 0,
+            'I', 'I', 42, 0, 8, 0, 0, 0,                                  // TIFF header, IFD at 8
+            1, 0, 0x12, 0x01, 3, 0, 1, 0, 0, 0,                           // one SHORT entry 0x0112
+            static_cast<unsigned char>(tag), 0, 0, 0, 0, 0, 0, 0};        // value, no next IFD
+        jpeg.insert(jpeg.begin() + 2, app1.begin(), app1.end());
+        return jpeg;
+    }
+
+    void writeFile(const std::string& path, const std::vector<unsigned char>& bytes) {
+        if (std::FILE* f = std::fopen(path.c_str(), "wb")) {
+            std::fwrite(bytes.data(), 1, bytes.size(), f);
+            std::fclose(f);
+        }
+    }
+
+    // Tar of members. Names past 100 bytes are carried by a GNU long-name
+    // entry, or a pax extended header when `pax` is set; sizes are octal
+    // except an odd-sized member's, which is GNU base-256.
+    std::vector<unsigned char> tarFile(const std::vector<ArchiveMember>& members, bool pax) {
+        std::vector<unsigned char> out;
+        auto entry = [&](const std::string& name, char type, const std::vector<unsigned char>& data) {
+            unsigned char h[512] = {};
+            std::copy_n(name.begin(), std::min<size_t>(name.size(), 100), h);
+            std::snprintf(reinterpret_cast<char*>(h + 100), 8, "%07o", 0644);
+            if (data.size() % 2 == 1) {
+                h[124] = 0x80;
+                for (int i = 0; i < 8; ++i) h[135 - i] = static_cast<unsigned char>(data.size() >> (8 * i));
+            } else {
+                std::snprintf(reinterpret_cast<char*>(h + 124), 12, "%011o", static_cast<unsigned>(data.size()));
+            }
+            h[156] = static_cast<unsigned char>(type);
+            std::copy_n("ustar", 6, h + 257);
+            h[263] = h[264] = '0';
+            unsigned sum = 8 * ' ';
+            for (int i = 0; i < 512; ++i) sum += (i >= 148 && i < 156) ? 0 : h[i];
+            std::snprintf(reinterpret_cast<char*>(h + 148), 8, "%06o", sum);
+            h[155] = ' ';
+            out.insert(out.end(), h, h + 512);
+            out.insert(out.end(), data.begin(), data.end());
+            out.resize((out.size() + 511) / 512 * 512, 0);
+        };
+        for (const ArchiveMember& m : members) {
+            if (m.name.size() > 100 && pax) {
+                std::string record = " path=" + m.name + "\n";
+                std::string len = std::to_string(record.size() + 2);
+                len = std::to_string(record.size() + len.size());
+                record = len + record;
+                entry("PaxHeaders/x", 'x', std::vector<unsigned char>(record.begin(), record.end()));
+            } else if (m.name.size() > 100) {
+                std::vector<unsigned char> name(m.name.begin(), m.name.end());
+                name.push_back(0);
+                entry("././@LongLink", 'L', name);
+            }
+            entry(m.name, m.type, m.data);
+        }
+        out.resize(out.size() + 1024, 0);
+        return out;
+    }
+
+    // Zip of members with a central directory and an archive comment.
+    // CRCs are left zero; the reader does not check them.
+    std::vector<unsigned char> zipFile(const std::vector<ArchiveMember>& members) {
+        std::vector<unsigned char> out, dir;
+        for (const ArchiveMember& m : members) {
+            std::vector<unsigned char> packed = m.data;
+            if (m.deflate) {
+                // zlibFixed's stream without the zlib header and Adler-32.
+                packed = zlibFixed(m.data, {1, 2, 3, 4, 7, 16});
+                packed = std::vector<unsigned char>(packed.begin() + 2, packed.end() - 4);
+            }
+            const uint32_t offset = static_cast<uint32_t>(out.size());
+            const uint16_t flags = m.encrypted ? 1 : 0, method = m.deflate ? 8 : 0;
+            putLe(&out, 0x04034b50, 4);
+            putLe(&out, 20, 2);
+            putLe(&out, flags, 2);
+            putLe(&out, method, 2);
+            putLe(&out, 0, 8);
+            putLe(&out, static_cast<uint32_t>(packed.size()), 4);
+            putLe(&out, static_cast<uint32_t>(m.data.size()), 4);
+            putLe(&out, static_cast<uint32_t>(m.name.size()), 2);
+            putLe(&out, 3, 2);
+            out.insert(out.end(), m.name.begin(), m.name.end());
+            out.insert(out.end(), {'x', 'y', 'z'});
+            out.insert(out.end(), packed.begin(), packed.end());
+
+            putLe(&dir, 0x02014b50, 4);
+            putLe(&dir, 20, 2);
+            putLe(&dir, 20, 2);
+            putLe(&dir, flags, 2);
+            putLe(&dir, method, 2);
+            putLe(&dir, 0, 8);
+            putLe(&dir, m.zip64 ? 0xffffffffu : static_cast<uint32_t>(packed.size()), 4);
+            putLe(&dir, m.zip64 ? 0xffffffffu : static_cast<uint32_t>(m.data.size()), 4);
+            putLe(&dir, static_cast<uint32_t>(m.name.size()), 2);
+            putLe(&dir, m.zip64 ? 28 : 0, 2);
+            putLe(&dir, 0, 6);
+            putLe(&dir, 0, 4);
+            putLe(&dir, m.zip64 ? 0xffffffffu : offset, 4);
+            dir.insert(dir.end(), m.name.begin(), m.name.end());
+            if (m.zip64) {
+                putLe(&dir, 1, 2);
+                putLe(&dir, 24, 2);
+                for (uint32_t v : {static_cast<uint32_t>(m.data.size()), static_cast<uint32_t>(packed.size()), offset}) {
+                    putLe(&dir, v, 4);
+                    putLe(&dir, 0, 4);
+                }
+            }
+        }
+        const uint32_t dirOffset = static_cast<uint32_t>(out.size());
+        out.insert(out.end(), dir.begin(), dir.end());
+        const std::string comment = "comment PK\x05\x06 inside";
+        putLe(&out, 0x06054b50, 4);
+        putLe(&out, 0, 4);
+        putLe(&out, static_cast<uint32_t>(members.size()), 2);
+        putLe(&out, static_cast<uint32_t>(members.size()), 2);
+        putLe(&out, static_cast<uint32_t>(dir.size()), 4);
+        putLe(&out, dirOffset, 4);
+        putLe(&out, static_cast<uint32_t>(comment.size()), 2);
+        out.insert(out.end(), comment.begin(), comment.end());
+        return out;
+    }
+
+}
+
+int main() {
+    std::vector<Corpus> corpus;
+    bool ok = loadFile("puppy.png", &corpus);
+    ok = loadFile("goku.jpeg", &corpus) && ok;
+
+    const int sizes[][2] = {{1, 1}, {3, 7}, {17, 5}, {64, 64}, {5, 301}, {301, 3}, {641, 479}};
+    uint32_t seed = 1;
+    for (const auto& wh : sizes) {
+        for (int c = 1; c <= 4; ++c) addSynthetic(wh[0], wh[1], c, seed++, &corpus);
+    }
+    for (Corpus& item : corpus) item.view.data = item.pixels.data();
+
+    const int termCols[] = {1, 22, 80, 101, 237};
+    const std::vector<Variant> paths = variants();
+    int checks = 0, failures = 0;
+
+    for (const Corpus& item : corpus) {
+        for (int cols : termCols) {
+            const GridSize grid = computeGrid(item.view.width, item.view.height, cols);
+            const std::string expected = renderReference(item.view, grid);
+            for (const Variant& v : paths) {
+                ++checks;
+                std::string where;
+                if (!compare(expected, v.render(item.view, grid), grid, &where)) {
+                    ++failures;
+                    std::cerr << "MISMATCH " << v.name << " on " << item.name
+                              << " (" << grid.cols << "x" << grid.rows << "): " << where << "\n";
+                }
+            }
+        }
+    }
+
+    // The shared luminance() must agree with the original formula for every
+    // grey, grey+alpha and RGB pixel, and for a sample of RGBA ones.
+    {
+        int lumFailures = 0;
+        unsigned char p[4];
+        for (uint32_t v = 0; v < (1u << 24); ++v) {
+            p[0] = static_cast<unsigned char>(v);
+            p[1] = static_cast<unsigned char>(v >> 8);
+            p[2] = static_cast<unsigned char>(v >> 16);
+            for (int c = 1; c <= 3; ++c) {
+                if (v >> (8 * c) != 0) continue;
+                if (luminance(p, c) != referenceLuminance(p, c) && lumFailures++ < 10) {
+                    std::cerr << "MISMATCH luminance of " << v << " at " << c << " channels\n";
+                }
+            }
+        }
+        std::mt19937 prng(37);
+        for (int i = 0; i < (1 << 22); ++i) {
+            const uint32_t v = prng();
+            for (int k = 0; k < 4; ++k) p[k] = static_cast<unsigned char>(v >> (8 * k));
+            if (luminance(p, 4) != referenceLuminance(p, 4) && lumFailures++ < 10) {
+                std::cerr << "MISMATCH luminance of RGBA " << v << "\n";
+            }
+        }
+        ++checks;
+        if (lumFailures > 0) ++failures;
+    }
+
+    // Oriented rendering samples through tables; it must match the reference
+    // run on an upright copy built pixel by pixel from the definitions.
+    for (const Corpus& item : corpus) {
+        const ImageView& v = item.view;
+        for (int turns = 0; turns < 4; ++turns) {
+            for (int flip = 0; flip < 2; ++flip) {
+                const orient::Transform t{turns, flip != 0};
+                const int dw = turns % 2 ? v.height : v.width, dh = turns % 2 ? v.width : v.height;
+                const std::vector<unsigned char> upright = uprightCopy(v, t);
+                std::vector<unsigned char> blocked(item.pixels.size());
+                orient::apply(v.data, v.width, v.height, v.channels, t, blocked.data());
+                ++checks;
+                if (blocked != upright) {
+                    ++failures;
+                    std::cerr << "MISMATCH orient::apply " << turns * 90 << (flip ? "+flip" : "") << " on "
+                              << item.name << "\n";
+                }
+                const ImageView uv{upright.data(), dw, dh, v.channels};
+                for (int cols : termCols) {
+                    const GridSize grid = computeGrid(dw, dh, cols);
+                    std::string text(renderedSize(grid), '\n');
+                    orient::renderInto(v, t, grid, 1, &text[0]);
+                    std::string where;
+                    ++checks;
+                    if (!compare(renderReference(uv, grid), text, grid, &where)) {
+                        ++failures;
+                        std::cerr << "MISMATCH oriented " << turns * 90 << (flip ? "+flip" : "") << " on "
+                                  << item.name << " (" << grid.cols << "x" << grid.rows << "): " << where << "\n";
+                    }
+                }
+            }
+        }
+    }
+
+    // Tile-hash streaming must leave the same text as a full render of every
+    // frame, whichever tiles it decided to skip.
+    {
+        const int w = 301, h = 203, c = 3;
+        std::vector<unsigned char> frame(static_cast<size_t>(w) * h * c);
+        std::mt19937 frng(11);
+        for (unsigned char& v : frame) v = static_cast<unsigned char>(frng());
+        for (Sampling sampling : {Sampling::Nearest, Sampling::Area}) {
+            RenderOptions opts;
+            opts.sampling = sampling;
+            const GridSize grid = computeGrid(w, h, 80);
+            frame_stream::Renderer renderer(w, h, c, grid, opts);
+            for (int f = 0; f < 12; ++f) {
+                // Repaint a small random rectangle, sometimes nothing.
+                const int rx = static_cast<int>(frng() % w), ry = static_cast<int>(frng() % h);
+                const int rw = f % 4 == 3 ? 0 : 1 + static_cast<int>(frng() % 40);
+                for (int y = ry; y < std::min(h, ry + 7); ++y) {
+                    for (int x = rx; x < std::min(w, rx + rw); ++x) {
+                        frame[(static_cast<size_t>(y) * w + x) * c + frng() % c] ^= 0x5a;
+                    }
+                }
+                std::string escapes;
+                renderer.update(frame.data(), &escapes);
+                std::string expected(renderedSize(grid), '\n');
+                renderWithOptions(ImageView{frame.data(), w, h, c}, grid, opts, &expected[0]);
+                std::string where;
+                ++checks;
+                if (!compare(expected, renderer.text(), grid, &where)) {
+                    ++failures;
+                    std::cerr << "MISMATCH raw stream frame " << f << ": " << where << "\n";
+                }
+            }
+        }
+    }
+
+    // The luma-only JPEG path must produce exactly the grey image stb_image
+    // makes when asked for one channel.
+    {
+        const std::string path = std::string(ASCII_TEST_DATA_DIR) + "/goku.jpeg";
+        int w = 0, h = 0, c = 0, w1 = 0, h1 = 0, c1 = 0;
+        stbi_uc* luma = jpeg_luma::load(path.c_str(), &w, &h, &c);
+        stbi_uc* grey = stbi_load(path.c_str(), &w1, &h1, &c1, 1);
+        ++checks;
+        if (luma == nullptr || grey == nullptr || c != 1 || w != w1 || h != h1 ||
+            !std::equal(luma, luma + static_cast<size_t>(w) * h, grey)) {
+            ++failures;
+            std::cerr << "MISMATCH luma-only JPEG decode of goku.jpeg\n";
+        }
+        stbi_image_free(luma);
+        stbi_image_free(grey);
+    }
+
+    // The in-tree inflate must reproduce data built from literals and
+    // overlapping matches at every distance class, across block types, and
+    // refuse output that does not fit.
+    {
+        const std::vector<int> distances = {1, 2, 3, 5, 8, 13, 16, 17, 31, 64, 255, 1000, 4097, 24577, 32768};
+        std::vector<uint8_t> data;
+        std::mt19937 zrng(17);
+        while (data.size() < 400000) {
+            const int d = distances[zrng() % distances.size()];
+            if (zrng() % 3 == 0 || static_cast<size_t>(d) > data.size()) {
+                for (int i = static_cast<int>(zrng() % 40); i >= 0; --i) data.push_back(static_cast<uint8_t>(zrng() % 7));
+            } else {
+                const int len = 3 + static_cast<int>(zrng() % (zrng() % 4 ? 30 : 300));
+                for (int i = 0; i < len; ++i) data.push_back(data[data.size() - static_cast<size_t>(d)]);
+            }
+        }
+        const std::vector<unsigned char> z = zlibFixed(data, distances);
+        std::vector<uint8_t> out(data.size());
+        ++checks;
+        if (inflate::decode(z.data(), z.size(), out.data(), out.size(), true) != static_cast<long long>(data.size()) ||
+            out != data) {
+            ++failures;
+            std::cerr << "MISMATCH inflate of synthetic stream\n";
+        }
+        ++checks;
+        if (inflate::decode(z.data(), z.size(), out.data(), out.size() - 1, true) != -1 ||
+            inflate::decode(z.data(), z.size() / 2, out.data(), out.size(), true) != -1) {
+            ++failures;
+            std::cerr << "MISMATCH inflate accepted a short buffer or truncated stream\n";
+        }
+    }
+
+    // PNG decoding through the in-tree inflate and unfilter must match
+    // stbi_load exactly, across colour types, depths, transparency,
+    // interlacing and filter types.
+    {
+        struct Case {
+            std::string name;
+            std::vector<unsigned char> file;
+        };
+        std::vector<Case> cases;
+        std::vector<unsigned char> puppy;
+        if (std::FILE* f = std::fopen((std::string(ASCII_TEST_DATA_DIR) + "/puppy.png").c_str(), "rb")) {
+            unsigned char buf[65536];
+            for (size_t n; (n = std::fread(buf, 1, sizeof(buf), f)) > 0;) puppy.insert(puppy.end(), buf, buf + n);
+            std::fclose(f);
+        }
+        cases.push_back({"puppy.png", puppy});
+        std::mt19937 prng(23);
+        // Smooth-ish samples so the matches in zlibFixed find something.
+        auto samples = [&](size_t n, int range) {
+            std::vector<uint8_t> v(n);
+            int x = 0;
+            for (uint8_t& b : v) b = static_cast<uint8_t>((x += static_cast<int>(prng() % 3) - 1 + range) % range);
+            return v;
+        };
+        // The filtered kinds exercise every filter type on each pixel size,
+        // with rows both shorter and longer than a vector.
+        const struct { int w, h, depth, color; bool interlaced, filtered; } kinds[] = {
+            {131, 67, 8, 2, false, false}, {90, 41, 8, 6, true, false}, {37, 29, 16, 0, false, false},
+            {53, 22, 8, 4, false, false},  {77, 13, 2, 0, true, false}, {29, 31, 16, 2, true, false},
+            {9, 5, 8, 6, false, false},    {1, 1, 1, 0, true, false},   {131, 67, 8, 2, false, true},
+            {101, 40, 8, 6, false, true},  {64, 33, 8, 6, true, true},  {5, 11, 8, 2, false, true},
+            {3, 10, 8, 6, false, true},    {47, 20, 8, 0, false, true}, {33, 25, 8, 4, false, true},
+            {19, 15, 16, 6, false, true},  {61, 21, 4, 0, true, true},
+        };
+        for (const auto& k : kinds) {
+            const int channels = k.color == 0 ? 1 : k.color == 2 ? 3 : k.color == 4 ? 2 : 4;
+            const size_t n = static_cast<size_t>(k.w) * k.h * channels * (k.depth == 16 ? 2 : 1);
+            const std::string name = "png c" + std::to_string(k.color) + " d" + std::to_string(k.depth) +
+                                     (k.interlaced ? " adam7" : "") + (k.filtered ? " filtered" : "");
+            std::vector<uint8_t> trns;
+            if (k.color == 0 || k.color == 2) {
+                // Colour key of the first pixel, so some pixels really match.
+                const std::vector<uint8_t> px = samples(n, k.depth >= 8 ? 256 : 1 << k.depth);
+                for (int c = 0; c < channels; ++c) {
+                    trns.push_back(k.depth == 16 ? px[static_cast<size_t>(c) * 2] : 0);
+                    trns.push_back(k.depth == 16 ? px[static_cast<size_t>(c) * 2 + 1] : px[static_cast<size_t>(c)]);
+                }
+                cases.push_back({name, pngFile(k.w, k.h, k.depth, k.color, k.interlaced, px, {}, trns, k.filtered)});
+            }
+            if (trns.empty() || k.filtered) {
+                cases.push_back({name, pngFile(k.w, k.h, k.depth, k.color, k.interlaced,
+                                               samples(n, k.depth >= 8 ? 256 : 1 << k.depth), {}, {}, k.filtered)});
+            }
+        }
+        for (const Case& c : cases) {
+            for (int desired : {0, 1, 3, 4}) {
+                int w = 0, h = 0, n = 0, w1 = 0, h1 = 0, n1 = 0;
+                stbi_uc* a = stbi_load_from_memory(c.file.data(), static_cast<int>(c.file.size()), &w, &h, &n, desired);
+                stbi_uc* b = decode::loadFromMemory(c.file.data(), c.file.size(), &w1, &h1, &n1, desired);
+                ++checks;
+                if (a == nullptr || b == nullptr || w != w1 || h != h1 || n != n1 ||
+                    !std::equal(a, a + static_cast<size_t>(w) * h * (desired ? desired : n), b)) {
+                    ++failures;
+                    std::cerr << "MISMATCH decode of " << c.name << " (" << desired << " channels)\n";
+                }
+                stbi_image_free(a);
+                stbi_image_free(b);
+            }
+            // The luminance plane, fused into unfiltering where possible.
+            int w = 0, h = 0, n = 0, w1 = 0, h1 = 0;
+            stbi_uc* a = stbi_load_from_memory(c.file.data(), static_cast<int>(c.file.size()), &w, &h, &n, 0);
+            stbi_uc* b = decode::loadLuminanceFromMemory(c.file.data(), c.file.size(), &w1, &h1);
+            ++checks;
+            std::vector<uint8_t> plane(static_cast<size_t>(w) * h);
+            if (a != nullptr) luminancePlane(ImageView{a, w, h, n}, plane.data());
+            if (a == nullptr || b == nullptr || w != w1 || h != h1 || !std::equal(plane.begin(), plane.end(), b)) {
+                ++failures;
+                std::cerr << "MISMATCH luminance decode of " << c.name << "\n";
+            }
+            stbi_image_free(a);
+            stbi_image_free(b);
+        }
+    }
+
+    // JPEG decoding with the AVX2 kernels (where the CPU has them) and
+    // without must match stbi_load exactly, across subsampling factors, and
+    // so must the fused luminance plane.
+    {
+        struct Case {
+            std::string name;
+            std::vector<unsigned char> file;
+        };
+        std::vector<Case> cases;
+        std::vector<unsigned char> goku;
+        if (std::FILE* f = std::fopen((std::string(ASCII_TEST_DATA_DIR) + "/goku.jpeg").c_str(), "rb")) {
+            unsigned char buf[65536];
+            for (size_t n; (n = std::fread(buf, 1, sizeof(buf), f)) > 0;) goku.insert(goku.end(), buf, buf + n);
+            std::fclose(f);
+        }
+        cases.push_back({"goku.jpeg", goku});
+        const struct { const char* name; int w, h; std::vector<int> sampling; bool rgb; } kinds[] = {
+            {"grey", 75, 41, {0x11}, false},
+            {"4:4:4", 67, 35, {0x11, 0x11, 0x11}, false},
+            {"4:2:2", 97, 23, {0x21, 0x11, 0x11}, false},
+            {"4:2:0", 131, 67, {0x22, 0x11, 0x11}, false},
+            {"4:2:0 narrow", 3, 19, {0x22, 0x11, 0x11}, false},
+            {"4:4:0", 45, 50, {0x12, 0x11, 0x11}, false},
+            {"rgb", 33, 17, {0x11, 0x11, 0x11}, true},
+            {"four", 29, 21, {0x22, 0x11, 0x11, 0x22}, false},
+        };
+        uint32_t jseed = 31;
+        for (const auto& k : kinds) cases.push_back({k.name, jpegFile(k.w, k.h, k.sampling, k.rgb, jseed++)});
+        for (bool simd : {true, false}) {
+            jpeg_simd::setEnabled(simd);
+            const std::string how = simd ? "" : " without AVX2";
+            for (const Case& c : cases) {
+                for (int desired : {0, 1, 2, 3, 4}) {
+                    int w = 0, h = 0, n = 0, w1 = 0, h1 = 0, n1 = 0;
+                    stbi_uc* a =
+                        stbi_load_from_memory(c.file.data(), static_cast<int>(c.file.size()), &w, &h, &n, desired);
+                    stbi_uc* b = decode::loadFromMemory(c.file.data(), c.file.size(), &w1, &h1, &n1, desired);
+                    ++checks;
+                    if (a == nullptr || b == nullptr || w != w1 || h != h1 || n != n1 ||
+                        !std::equal(a, a + static_cast<size_t>(w) * h * (desired ? desired : n), b)) {
+                        ++failures;
+                        std::cerr << "MISMATCH decode of JPEG " << c.name << how << " (" << desired << " channels)\n";
+                    }
+                    stbi_image_free(a);
+                    stbi_image_free(b);
+                }
+                int w = 0, h = 0, n = 0, w1 = 0, h1 = 0;
+                stbi_uc* a = stbi_load_from_memory(c.file.data(), static_cast<int>(c.file.size()), &w, &h, &n, 0);
+                stbi_uc* b = decode::loadLuminanceFromMemory(c.file.data(), c.file.size(), &w1, &h1);
+                ++checks;
+                std::vector<uint8_t> plane(static_cast<size_t>(w) * h);
+                if (a != nullptr) luminancePlane(ImageView{a, w, h, n}, plane.data());
+                if (a == nullptr || b == nullptr || w != w1 || h != h1 || !std::equal(plane.begin(), plane.end(), b)) {
+                    ++failures;
+                    std::cerr << "MISMATCH luminance decode of JPEG " << c.name << how << "\n";
+                }
+                stbi_image_free(a);
+                stbi_image_free(b);
+            }
+        }
+        jpeg_simd::setEnabled(true);
+    }
+
+    // The DC preview of a progressive JPEG is its 8x8 block means: the
+    // luma of every preview pixel must be close to the mean of its block
+    // in the full decode. Chroma is only 1/16 scale there, so colour is
+    // not compared. Anything but a progressive JPEG has no preview.
+    {
+        const std::string path = std::string(ASCII_TEST_DATA_DIR) + "/goku.jpeg";
+        int w = 0, h = 0, c = 0, fw = 0, fh = 0, w1 = 0, h1 = 0, c1 = 0;
+        stbi_uc* preview = jpeg_preview::load(path.c_str(), &w, &h, &c, &fw, &fh);
+        stbi_uc* grey = stbi_load(path.c_str(), &w1, &h1, &c1, 1);
+        double error = 0.0;
+        if (preview != nullptr && grey != nullptr && c == 3 && w == (w1 + 7) / 8 && h == (h1 + 7) / 8) {
+            for (int y = 0; y < h; ++y) {
+                for (int x = 0; x < w; ++x) {
+                    double sum = 0.0;
+                    int n = 0;
+                    for (int yy = y * 8; yy < std::min(h1, y * 8 + 8); ++yy) {
+                        for (int xx = x * 8; xx < std::min(w1, x * 8 + 8); ++xx, ++n) {
+                            sum += grey[static_cast<size_t>(yy) * w1 + xx];
+                        }
+                    }
+                    const stbi_uc* p = preview + (static_cast<size_t>(y) * w + x) * 3;
+                    error += std::abs(sum / n - (0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2]));
+                }
+            }
+            error /= static_cast<double>(w) * h;
+        }
+        ++checks;
+        if (preview == nullptr || grey == nullptr || c != 3 || fw != w1 || fh != h1 || w != (w1 + 7) / 8 ||
+            h != (h1 + 7) / 8 || error > 2.0) {
+            ++failures;
+            std::cerr << "MISMATCH DC preview of goku.jpeg (mean luma error " << error << ")\n";
+        }
+        stbi_image_free(preview);
+        stbi_image_free(grey);
+        const std::string png = std::string(ASCII_TEST_DATA_DIR) + "/puppy.png";
+        ++checks;
+        if (jpeg_preview::load(png.c_str(), &w, &h, &c, &fw, &fh) != nullptr) {
+            ++failures;
+            std::cerr << "MISMATCH DC preview of a PNG\n";
+        }
+    }
+
+    // Palette images rendered from their indices must match rendering what
+    // stbi_load expands them to, transparency and GIF backgrounds included.
+    {
+        struct Case {
+            std::string name;
+            std::vector<unsigned char> file;
+        };
+        std::vector<Case> cases;
+        std::mt19937 prng(13);
+        auto randomBytes = [&](size_t n, int range) {
+            std::vector<uint8_t> v(n);
+            for (uint8_t& b : v) b = static_cast<uint8_t>(prng() % static_cast<uint32_t>(range));
+            return v;
+        };
+        const int pngs[][4] = {{173, 91, 8, 100}, {97, 61, 4, 0}, {33, 17, 1, 2}, {640, 3, 2, 4}};
+        for (const auto& p : pngs) {
+            const int entries = 1 << p[2];
+            cases.push_back({"png" + std::to_string(p[2]),
+                             palettePng(p[0], p[1], p[2], randomBytes(static_cast<size_t>(p[0]) * p[1], entries),
+                                        randomBytes(static_cast<size_t>(entries) * 3, 256), p[3], 5)});
+        }
+        const GifFrame gifs[] = {
+            {121, 77, 0, 0, 121, 77, 8, false, false, 0, -1},
+            {90, 70, 7, 5, 61, 43, 4, false, true, 3, 5},
+            {64, 48, 10, 0, 30, 48, 2, true, false, 0, 1},
+            {64, 48, 3, 3, 50, 40, 8, false, false, 0, 200},
+        };
+        for (const GifFrame& f : gifs) {
+            const int entries = 1 << f.lzwSize;
+            cases.push_back({"gif" + std::to_string(f.lzwSize),
+                             gif(f, randomBytes(static_cast<size_t>(f.w) * f.h, entries),
+                                 randomBytes(static_cast<size_t>(entries) * 3, 256))});
+        }
+
+        RenderOptions area;
+        area.sampling = Sampling::Area;
+        for (const Case& c : cases) {
+            int w = 0, h = 0, n = 0;
+            stbi_uc* pixels = stbi_load_from_memory(c.file.data(), static_cast<int>(c.file.size()), &w, &h, &n, 0);
+            indexed::Image img;
+            const int status = indexed::loadFromMemory(c.file.data(), c.file.size(), &img);
+            ++checks;
+            if (pixels == nullptr || status != 1 || img.width != w || img.height != h || img.channels != n) {
+                ++failures;
+                std::cerr << "MISMATCH indexed decode of " << c.name << "\n";
+                stbi_image_free(pixels);
+                stbi_image_free(img.indices);
+                continue;
+            }
+            const ImageView view{pixels, w, h, n};
+            for (int cols : termCols) {
+                const GridSize grid = computeGrid(w, h, cols);
+                std::string text(renderedSize(grid), '\n'), expected(renderedSize(grid), '\n');
+                std::string where;
+                indexed::renderInto(img, grid, 2, &text[0]);
+                ++checks;
+                if (!compare(renderReference(view, grid), text, grid, &where)) {
+                    ++failures;
+                    std::cerr << "MISMATCH indexed " << c.name << " (" << grid.cols << "x" << grid.rows << "): "
+                              << where << "\n";
+                }
+                renderWithOptions(view, grid, area, &expected[0]);
+                indexed::renderWithOptions(img, grid, area, &text[0]);
+                ++checks;
+                if (!compare(expected, text, grid, &where)) {
+                    ++failures;
+                    std::cerr << "MISMATCH indexed area " << c.name << " (" << grid.cols << "x" << grid.rows
+                              << "): " << where << "\n";
+                }
+            }
+            stbi_image_free(pixels);
+            stbi_image_free(img.indices);
+        }
+        indexed::Image img;
+        ++checks;
+        if (indexed::load((std::string(ASCII_TEST_DATA_DIR) + "/puppy.png").c_str(), &img) != -1) {
+            ++failures;
+            std::cerr << "MISMATCH indexed loader accepted a truecolour PNG\n";
+        }
+    }
+
+    // decode::decodeRows must hand over exactly the rows stbi_load makes,
+    // each once, whether streamed (PNG, JPEG, PNM, BMP without alpha) or
+    // replayed from a whole decode (BMP with alpha, GIF, interlaced PNG).
+    // A BoxAccumulator fed those rows in the order they arrive, bottom-up
+    // BMPs included, must match boxResample of the whole plane.
+    {
+        struct Case {
+            std::string name;
+            std::vector<unsigned char> file;
+        };
+        std::vector<Case> cases;
+        std::mt19937 prng(17);
+        auto randomBytes = [&](size_t n, int range) {
+            std::vector<uint8_t> v(n);
+            for (uint8_t& b : v) b = static_cast<uint8_t>(prng() % static_cast<uint32_t>(range));
+            return v;
+        };
+        cases.push_back({"pgm", pnmFile(131, 67, 1, randomBytes(131 * 67, 256))});
+        cases.push_back({"ppm", pnmFile(97, 41, 3, randomBytes(97 * 41 * 3, 256))});
+        const struct { int w, h, bpp; bool topDown, fields; } bmps[] = {
+            {77, 45, 1, false, false}, {63, 30, 4, true, false}, {101, 53, 8, false, false},
+            {59, 37, 16, false, true}, {61, 29, 16, true, false}, {73, 41, 24, false, false},
+            {3, 90, 24, true, false}, {45, 33, 32, false, true}, {47, 35, 32, false, false},
+        };
+        uint32_t bseed = 41;
+        for (const auto& b : bmps) {
+            const size_t n = static_cast<size_t>(b.w) * b.h;
+            const std::vector<uint8_t> data = b.bpp < 16 ? randomBytes(n, 1 << b.bpp) : randomBytes(n * b.bpp / 8, 256);
+            const std::string name =
+                "bmp" + std::to_string(b.bpp) + (b.topDown ? " top-down" : "") + (b.fields ? " fields" : "");
+            cases.push_back({name, bmpFile(b.w, b.h, b.bpp, b.topDown, b.fields, data, bseed++)});
+        }
+        cases.push_back({"png", pngFile(83, 47, 8, 2, false, randomBytes(83 * 47 * 3, 256), {}, {}, true)});
+        cases.push_back({"png interlaced", pngFile(83, 47, 8, 6, true, randomBytes(83 * 47 * 4, 256), {}, {}, true)});
+        cases.push_back({"jpeg", jpegFile(131, 67, {0x22, 0x11, 0x11}, false, 77)});
+        cases.push_back({"gif", gif({40, 30, 0, 0, 40, 30, 8, false, false, 0, -1}, randomBytes(40 * 30, 256),
+                                    randomBytes(256 * 3, 256))});
+
+        for (const Case& c : cases) {
+            int w = 0, h = 0, n = 0;
+            stbi_uc* expected = stbi_load_from_memory(c.file.data(), static_cast<int>(c.file.size()), &w, &h, &n, 0);
+            int rw = 0, rh = 0, rn = 0;
+            std::vector<uint8_t> image, plane, lumRow;
+            std::vector<int> seen;
+            std::unique_ptr<BoxAccumulator> cells;
+            const GridSize grid{17, 9};
+            const decode::RowSink sink{
+                [&](int width, int height, int channels) {
+                    rw = width;
+                    rh = height;
+                    rn = channels;
+                    image.assign(static_cast<size_t>(width) * height * channels, 0);
+                    plane.assign(static_cast<size_t>(width) * height, 0);
+                    lumRow.resize(static_cast<size_t>(width));
+                    seen.assign(static_cast<size_t>(height), 0);
+                    const ImageView view{nullptr, width, height, channels};
+                    cells = std::make_unique<BoxAccumulator>(width, height, cellWidth(view, grid) * grid.cols,
+                                                             cellHeight(view, grid) * grid.rows, grid.cols, grid.rows);
+                    return true;
+                },
+                [&](int y, const unsigned char* pixels) {
+                    const size_t rowBytes = static_cast<size_t>(rw) * rn;
+                    std::copy(pixels, pixels + rowBytes, image.begin() + static_cast<long>(y * rowBytes));
+                    luminanceGrid(pixels, rn, lumRow.size(), lumRow.data());
+                    std::copy(lumRow.begin(), lumRow.end(), plane.begin() + static_cast<long>(y) * rw);
+                    cells->addRow(y, lumRow.data());
+                    ++seen[static_cast<size_t>(y)];
+                }};
+            const bool decoded = decode::decodeRowsFromMemory(c.file.data(), c.file.size(), sink);
+            ++checks;
+            if (expected == nullptr || !decoded || rw != w || rh != h || rn != n ||
+                std::count(seen.begin(), seen.end(), 1) != h || !std::equal(image.begin(), image.end(), expected)) {
+                ++failures;
+                std::cerr << "MISMATCH decodeRows of " << c.name << "\n";
+            } else {
+                const ImageView view{expected, w, h, n};
+                std::vector<uint8_t> whole(static_cast<size_t>(grid.cols) * grid.rows), fed(whole.size());
+                boxResample(plane.data(), w, h, cellWidth(view, grid) * grid.cols, cellHeight(view, grid) * grid.rows,
+                            grid.cols, grid.rows, whole.data());
+                cells->finish(fed.data());
+                ++checks;
+                if (whole != fed) {
+                    ++failures;
+                    std::cerr << "MISMATCH box filter fed by decodeRows of " << c.name << "\n";
+                }
+            }
+            stbi_image_free(expected);
+        }
+        ++checks;
+        if (decode::decodeRowsFromMemory(cases[0].file.data(), 20, decode::RowSink{
+                [](int, int, int) { return true; }, [](int, const unsigned char*) {}})) {
+            ++failures;
+            std::cerr << "MISMATCH decodeRows accepted a truncated PGM\n";
+        }
+    }
+
+    // Archive members read in place must be the bytes that went in, found
+    // by name through the index, and decode as they would from a file.
+    // Directories, links and encrypted zip members are not indexed.
+    {
+        std::mt19937 prng(23);
+        auto randomBytes = [&](size_t n) {
+            std::vector<uint8_t> v(n);
+            for (uint8_t& b : v) b = static_cast<uint8_t>(prng() % 16);
+            return v;
+        };
+        const std::string longName = std::string(120, 'd') + "/" + std::string(30, 'n') + ".pgm";
+        std::vector<ArchiveMember> members = {
+            {"a.pgm", pnmFile(31, 17, 1, randomBytes(31 * 17))},
+            {"sub/", {}, '5'},
+            {"link.pgm", {}, '2'},
+            {"b.ppm", pnmFile(20, 11, 3, randomBytes(20 * 11 * 3))},
+            {"notes.txt", {'h', 'i', '\n'}},
+            {longName, pnmFile(9, 40, 1, randomBytes(9 * 40))},
+            {"empty.pgm", {}},
+        };
+        members[1].deflate = true;
+        members[3].deflate = members[3].zip64 = true;
+        members[5].zip64 = true;
+        const std::vector<std::string> indexed = {"a.pgm", "b.ppm", "notes.txt", longName, "empty.pgm"};
+
+        const std::string dir = std::filesystem::temp_directory_path().string() + "/";
+        std::vector<std::pair<std::string, std::vector<unsigned char>>> archives = {
+            {dir + "bitexact_gnu.tar", tarFile(members, false)},
+            {dir + "bitexact_pax.tar", tarFile(members, true)},
+        };
+        std::vector<ArchiveMember> zipped;
+        for (const ArchiveMember& m : members) {
+            if (m.type == '5') zipped.push_back(m);
+            if (m.type != '0') continue;
+            zipped.push_back(m);
+            if (m.name == "notes.txt") {
+                ArchiveMember locked = m;
+                locked.name = "locked.pgm";
+                locked.encrypted = true;
+                zipped.push_back(locked);
+            }
+        }
+        archives.push_back({dir + "bitexact.zip", zipFile(zipped)});
+
+        for (const auto& a : archives) {
+            writeFile(a.first, a.second);
+            archive::Reader reader;
+            std::string error;
+            ++checks;
+            if (!reader.open(a.first, &error)) {
+                ++failures;
+                std::cerr << "MISMATCH archive " << a.first << " not opened: " << error << "\n";
+                continue;
+            }
+            std::vector<std::string> names;
+            for (const archive::Member& m : reader.members()) names.push_back(m.name);
+            ++checks;
+            if (names != indexed) {
+                ++failures;
+                std::cerr << "MISMATCH archive " << a.first << " member list\n";
+            }
+            std::vector<unsigned char> scratch;
+            for (const ArchiveMember& m : members) {
+                if (m.type != '0') continue;
+                const long i = reader.find(m.name);
+                const unsigned char* data = nullptr;
+                size_t size = 0;
+                ++checks;
+                if (i < 0 || reader.members()[static_cast<size_t>(i)].name != m.name ||
+                    !reader.read(static_cast<size_t>(i), &scratch, &data, &size) || size != m.data.size() ||
+                    !std::equal(m.data.begin(), m.data.end(), data)) {
+                    ++failures;
+                    std::cerr << "MISMATCH archive " << a.first << " member " << m.name << "\n";
+                }
+            }
+            ++checks;
+            if (reader.find("locked.pgm") >= 0 || reader.find("sub/") >= 0 || reader.find("missing") >= 0) {
+                ++failures;
+                std::cerr << "MISMATCH archive " << a.first << " indexed a member it should not have\n";
+            }
+
+            // Expanded, the archive contributes its images in archive order,
+            // and ARCHIVE:MEMBER picks one out.
+            const std::vector<archive::Input> inputs = archive::expandInputs({a.first, a.first + ":b.ppm"});
+            const std::vector<std::string> expected = {"a.pgm", "b.ppm", longName, "empty.pgm", "b.ppm"};
+            ++checks;
+            bool same = inputs.size() == expected.size();
+            for (size_t k = 0; same && k < inputs.size(); ++k) {
+                same = inputs[k].label == a.first + ":" + expected[k] && inputs[k].archive &&
+                       inputs[k].archive->members()[inputs[k].member].name == expected[k] &&
+                       inputs[k].archive == inputs[0].archive;
+            }
+            if (!same) {
+                ++failures;
+                std::cerr << "MISMATCH archive " << a.first << " expanded inputs\n";
+            }
+            for (size_t k = 0; same && k < 3; ++k) {
+                const std::vector<unsigned char>& file = members[k == 0 ? 0 : k == 1 ? 3 : 5].data;
+                int w = 0, h = 0, n = 0, ew = 0, eh = 0, en = 0;
+                stbi_uc* got = archive::load(inputs[k], &w, &h, &n, 0, nullptr);
+                stbi_uc* want = stbi_load_from_memory(file.data(), static_cast<int>(file.size()), &ew, &eh, &en, 0);
+                ++checks;
+                if (got == nullptr || want == nullptr || w != ew || h != eh || n != en ||
+                    !std::equal(got, got + static_cast<size_t>(w) * h * n, want)) {
+                    ++failures;
+                    std::cerr << "MISMATCH archive " << a.first << " decode of " << expected[k] << "\n";
+                }
+                stbi_image_free(got);
+                stbi_image_free(want);
+            }
+            ++checks;
+            int w = 0, h = 0, n = 0;
+            if (same && archive::load(inputs[3], &w, &h, &n, 0, nullptr) != nullptr) {
+                ++failures;
+                std::cerr << "MISMATCH archive " << a.first << " decoded an empty member\n";
+            }
+
+            // Cut short, the archive must be refused rather than read past
+            // its end.
+            writeFile(a.first, std::vector<unsigned char>(a.second.begin(), a.second.begin() + 600));
+            archive::Reader cut;
+            ++checks;
+            if (cut.open(a.first, &error)) {
+                ++failures;
+                std::cerr << "MISMATCH archive " << a.first << " opened when truncated\n";
+            }
+            std::remove(a.first.c_str());
+        }
+
+        // A zip member claiming more than its deflate data can produce, or
+        // more than a decoder could take, must be refused with a reason
+        // before any buffer is sized for it.
+        for (const bool zip64 : {false, true}) {
+            ArchiveMember bomb = members[0];
+            bomb.deflate = true;
+            bomb.zip64 = zip64;
+            std::vector<unsigned char> bytes = zipFile({bomb});
+            size_t at = 0;
+            while (at + 4 <= bytes.size() && !(bytes[at] == 'P' && bytes[at + 1] == 'K' && bytes[at + 2] == 1)) ++at;
+            // The central directory's size field, or its ZIP64 extra value.
+            const size_t field = zip64 ? at + 46 + bomb.name.size() + 4 : at + 24;
+            const uint64_t claimed = zip64 ? uint64_t(1) << 62 : 100u << 20;
+            const char* reason = zip64 ? "archive member too large" : "zip member larger than its data can inflate to";
+            for (int k = 0; k < (zip64 ? 8 : 4); ++k) bytes[field + k] = static_cast<unsigned char>(claimed >> (8 * k));
+            const std::string path = dir + "bitexact_bomb.zip";
+            writeFile(path, bytes);
+            archive::Reader reader;
+            std::string error;
+            std::vector<unsigned char> scratch;
+            const unsigned char* data = nullptr;
+            size_t size = 0;
+            ++checks;
+            if (!reader.open(path, &error) || reader.members().size() != 1 || reader.members()[0].size != claimed ||
+                reader.read(0, &scratch, &data, &size) || scratch.size() != 0 ||
+                std::strcmp(stbi_failure_reason(), reason) != 0) {
+                ++failures;
+                std::cerr << "MISMATCH archive zip bomb" << (zip64 ? " (zip64)" : "") << " not refused\n";
+            }
+            std::remove(path.c_str());
+        }
+
+        // archive::load reports the EXIF orientation of a plain file and of
+        // an archive member alike.
+        {
+            const std::vector<unsigned char> jpeg = withExifOrientation(jpegFile(40, 24, {0x11}, false, 5), 6);
+            const std::string plain = dir + "bitexact_turned.jpg", tar = dir + "bitexact_turned.tar";
+            writeFile(plain, jpeg);
+            writeFile(tar, tarFile({{"turned.jpg", jpeg}}, false));
+            const std::vector<archive::Input> inputs = archive::expandInputs({plain, tar});
+            bool same = inputs.size() == 2;
+            for (size_t k = 0; same && k < inputs.size(); ++k) {
+                int w = 0, h = 0, n = 0, exif = 0;
+                stbi_uc* img = archive::load(inputs[k], &w, &h, &n, 0, &exif);
+                same = img != nullptr && w == 40 && h == 24 && exif == 6;
+                stbi_image_free(img);
+            }
+            ++checks;
+            if (!same) {
+                ++failures;
+                std::cerr << "MISMATCH archive::load orientation\n";
+            }
+            std::remove(plain.c_str());
+            std::remove(tar.c_str());
+        }
+    }
+
+    // TarWriter's entries must read back byte for byte, whichever way
+    // their names are stored, with a buffer small enough that entries
+    // straddle flushes and some bypass it. A batch written through it must
+    // hold each input's render, in input order, at the indexed offsets.
+    {
+        const std::string dir = std::filesystem::temp_directory_path().string() + "/";
+        const std::string tarPath = dir + "bitexact_written.tar";
+        std::mt19937 prng(29);
+        const std::vector<std::string> names = {
+            "short.txt",
+            std::string(120, 'p') + "/" + std::string(90, 'n') + ".txt",   // ustar prefix
+            std::string(20, 'p') + "/" + std::string(110, 'n') + ".txt",   // GNU long name
+            "empty.txt",
+            "big.txt",
+        };
+        std::vector<std::string> contents;
+        for (const std::string& name : names) {
+            const size_t n = name == "empty.txt" ? 0 : name == "big.txt" ? 5000 : 300 + prng() % 900;
+            std::string text(n, ' ');
+            for (char& ch : text) ch = kRamp[prng() % kRampN];
+            contents.push_back(text);
+        }
+        archive::TarWriter writer(1024);
+        std::string error;
+        std::vector<uint64_t> offsets(names.size());
+        bool ok = writer.open(tarPath, &error);
+        for (size_t i = 0; ok && i < names.size(); ++i) {
+            ok = writer.add(names[i], contents[i].data(), contents[i].size(), &offsets[i]);
+        }
+        ok = writer.close() && ok;
+        archive::Reader reader;
+        ++checks;
+        if (!ok || !reader.open(tarPath, &error) || reader.members().size() != names.size()) {
+            ++failures;
+            std::cerr << "MISMATCH TarWriter archive not written or not read back\n";
+        } else {
+            std::vector<unsigned char> scratch;
+            for (size_t i = 0; i < names.size(); ++i) {
+                const unsigned char* data = nullptr;
+                size_t size = 0;
+                ++checks;
+                if (reader.members()[i].name != names[i] || reader.members()[i].offset != offsets[i] ||
+                    !reader.read(i, &scratch, &data, &size) || size != contents[i].size() ||
+                    !std::equal(contents[i].begin(), contents[i].end(), data)) {
+                    ++failures;
+                    std::cerr << "MISMATCH TarWriter entry " << i << "\n";
+                }
+            }
+        }
+
+        ++checks;
+        if (batch::entryName("/data/./x/../a.png") != "data/x/a.png.txt" || batch::entryName("a.zip/b.png") !=
+                                                                                "a.zip/b.png.txt") {
+            ++failures;
+            std::cerr << "MISMATCH batch entry names\n";
+        }
+
+        // A batch over an archive of PGMs and a PGM file.
+        std::vector<ArchiveMember> members;
+        std::vector<std::vector<unsigned char>> images;
+        for (int i = 0; i < 12; ++i) {
+            const int w = 20 + i * 7, h = 9 + i * 3;
+            std::vector<uint8_t> pixels(static_cast<size_t>(w) * h);
+            for (uint8_t& b : pixels) b = static_cast<uint8_t>(prng());
+            images.push_back(pnmFile(w, h, 1, pixels));
+            members.push_back({"img" + std::to_string(i) + ".pgm", images.back()});
+        }
+        const std::string inputTar = dir + "bitexact_batch_in.tar", inputPgm = dir + "bitexact_batch.pgm";
+        const std::string indexPath = dir + "bitexact_batch.idx";
+        writeFile(inputTar, tarFile(members, false));
+        writeFile(inputPgm, images[3]);
+        batch::Options opts;
+        opts.output = tarPath;
+        opts.index = indexPath;
+        opts.termCols = 37;
+        opts.threads = 3;
+        const int status = batch::run({inputTar, inputPgm}, opts);
+        archive::Reader out;
+        std::string indexText;
+        if (std::FILE* f = std::fopen(indexPath.c_str(), "rb")) {
+            char buf[4096];
+            size_t n = 0;
+            while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0) indexText.append(buf, n);
+            std::fclose(f);
+        }
+        ++checks;
+        if (status != 0 || !out.open(tarPath, &error) || out.members().size() != images.size() + 1) {
+            ++failures;
+            std::cerr << "MISMATCH batch archive not written\n";
+        } else {
+            std::string expectedIndex;
+            std::vector<unsigned char> scratch;
+            for (size_t i = 0; i <= images.size(); ++i) {
+                const std::vector<unsigned char>& file = i < images.size() ? images[i] : images[3];
+                const std::string name = batch::entryName(i < images.size() ? inputTar + "/" + members[i].name
+                                                                            : inputPgm);
+                int w = 0, h = 0, n = 0;
+                stbi_uc* img = stbi_load_from_memory(file.data(), static_cast<int>(file.size()), &w, &h, &n, 0);
+                const ImageView view{img, w, h, n};
+                const std::string want = renderReference(view, computeGrid(w, h, opts.termCols));
+                stbi_image_free(img);
+                expectedIndex += std::to_string(out.members()[i].offset) + " " + std::to_string(want.size()) + " " +
+                                 name + "\n";
+                const unsigned char* data = nullptr;
+                size_t size = 0;
+                ++checks;
+                if (out.members()[i].name != name || !out.read(i, &scratch, &data, &size) || size != want.size() ||
+                    !std::equal(want.begin(), want.end(), data)) {
+                    ++failures;
+                    std::cerr << "MISMATCH batch entry " << i << "\n";
+                }
+            }
+            ++checks;
+            if (indexText != expectedIndex) {
+                ++failures;
+                std::cerr << "MISMATCH batch offset index\n";
+            }
+        }
+        for (const std::string& path : {tarPath, inputTar, inputPgm, indexPath}) std::remove(path.c_str());
+    }
+
+    // A pyramid must hold the decoded image in level 0 and 2x2 means in
+    // each level after it. Sampled at level 0 over the whole image it must
+    // render exactly as the decoded image does, and over a region as that
+    // region cut out of it does.
+    {
+        const std::string dir = std::filesystem::temp_directory_path().string() + "/";
+        const std::string imagePath = dir + "bitexact_pyramid.png", pyrPath = dir + "bitexact.pyr";
+        const orient::Transform none{};
+        std::mt19937 prng(31);
+        struct Case {
+            int w, h, color;
+        };
+        for (const Case& pc : {Case{613, 300, 0}, Case{300, 517, 6}, Case{40, 30, 2}}) {
+            const int n = pc.color == 0 ? 1 : pc.color == 2 ? 3 : 4;
+            std::vector<uint8_t> samples(static_cast<size_t>(pc.w) * pc.h * n);
+            for (size_t i = 0; i < samples.size(); ++i) {
+                samples[i] = static_cast<uint8_t>((i / n % pc.w + i / n / pc.w) * 3 + prng() % 24);
+            }
+            const std::vector<unsigned char> png = pngFile(pc.w, pc.h, 8, pc.color, false, samples, {}, {}, true);
+            writeFile(imagePath, png);
+            const std::string label = "pyramid " + std::to_string(pc.w) + "x" + std::to_string(pc.h);
+
+            std::string error;
+            pyramid::File file;
+            ++checks;
+            if (!pyramid::build(imagePath, pyrPath, &error) || !pyramid::isPyramid(pyrPath) ||
+                pyramid::isPyramid(imagePath) || !file.open(pyrPath, &error) || file.width() != pc.w ||
+                file.height() != pc.h || file.channels() != n) {
+                ++failures;
+                std::cerr << "MISMATCH " << label << " not built: " << error << "\n";
+                continue;
+            }
+
+            // Levels halve, rounding up, down to one tile.
+            std::vector<std::vector<uint8_t>> levels(1, samples);
+            int lw = pc.w, lh = pc.h;
+            while (lw > pyramid::kTileSize || lh > pyramid::kTileSize) {
+                const int nw = (lw + 1) / 2, nh = (lh + 1) / 2;
+                const std::vector<uint8_t>& from = levels.back();
+                std::vector<uint8_t> to(static_cast<size_t>(nw) * nh * n);
+                for (int y = 0; y < nh; ++y) {
+                    for (int x = 0; x < nw; ++x) {
+                        const int x1 = std::min(2 * x + 1, lw - 1), y1 = std::min(2 * y + 1, lh - 1);
+                        for (int c = 0; c < n; ++c) {
+                            auto at = [&](int sx, int sy) { return from[(static_cast<size_t>(sy) * lw + sx) * n + c]; };
+                            const int sum = at(2 * x, 2 * y) + at(x1, 2 * y) + at(2 * x, y1) + at(x1, y1);
+                            to[(static_cast<size_t>(y) * nw + x) * n + c] = static_cast<uint8_t>((sum + 2) >> 2);
+                        }
+                    }
+                }
+                levels.push_back(std::move(to));
+                lw = nw;
+                lh = nh;
+            }
+            ++checks;
+            if (file.levelCount() != static_cast<int>(levels.size())) {
+                ++failures;
+                std::cerr << "MISMATCH " << label << " level count\n";
+                continue;
+            }
+            for (int k = 0; k < file.levelCount(); ++k) {
+                const pyramid::Level& l = file.level(k);
+                bool same = l.offset % pyramid::kPageSize == 0;
+                for (int y = 0; same && y < l.height; ++y) {
+                    for (int x = 0; same && x < l.width; ++x) {
+                        same = std::equal(file.pixel(k, x, y), file.pixel(k, x, y) + n,
+                                          levels[static_cast<size_t>(k)].begin() +
+                                              static_cast<long>((static_cast<size_t>(y) * l.width + x) * n));
+                    }
+                }
+                ++checks;
+                if (!same) {
+                    ++failures;
+                    std::cerr << "MISMATCH " << label << " level " << k << "\n";
+                }
+            }
+
+            const ImageView view{samples.data(), pc.w, pc.h, n};
+            for (int cols : {17, 80, 333}) {
+                const GridSize grid = computeGrid(pc.w, pc.h, cols);
+                std::vector<uint8_t> lum(static_cast<size_t>(grid.cols) * grid.rows);
+                const pyramid::Region whole = pyramid::clampRegion(file, none, pyramid::Region{});
+                pyramid::sampleLuminance(file, none, whole, grid, 0, lum.data());
+                std::string text(renderedSize(grid), '\n');
+                glyphGrid(lum.data(), grid, &text[0]);
+                ++checks;
+                if (text != renderReference(view, grid)) {
+                    ++failures;
+                    std::cerr << "MISMATCH " << label << " render at " << cols << " columns\n";
+                }
+            }
+
+            const pyramid::Region region =
+                pyramid::clampRegion(file, none, pyramid::Region{pc.w / 3, pc.h / 4, pc.w / 2, 1000});
+            std::vector<uint8_t> crop;
+            for (int y = region.y; y < region.y + region.height; ++y) {
+                const uint8_t* row = samples.data() + (static_cast<size_t>(y) * pc.w + region.x) * n;
+                crop.insert(crop.end(), row, row + static_cast<size_t>(region.width) * n);
+            }
+            const GridSize grid = computeGrid(region.width, region.height, 60);
+            std::vector<uint8_t> lum(static_cast<size_t>(grid.cols) * grid.rows);
+            pyramid::sampleLuminance(file, none, region, grid, 0, lum.data());
+            std::string text(renderedSize(grid), '\n');
+            glyphGrid(lum.data(), grid, &text[0]);
+            ++checks;
+            if (region.height != pc.h - pc.h / 4 ||
+                text != renderReference(ImageView{crop.data(), region.width, region.height, n}, grid)) {
+                ++failures;
+                std::cerr << "MISMATCH " << label << " region render\n";
+            }
+            ++checks;
+            if (pyramid::levelFor(file, pyramid::clampRegion(file, none, pyramid::Region{}), GridSize{4, 2}) !=
+                file.levelCount() - 1) {
+                ++failures;
+                std::cerr << "MISMATCH " << label << " level for a small grid\n";
+            }
+        }
+
+        // The EXIF orientation of the source is kept in the header, and a
+        // render through it and --rotate / --flip samples the level as the
+        // upright image: whole, and over a region in displayed pixels.
+        const std::string jpegPath = dir + "bitexact_pyramid.jpg";
+        for (int tag = 1; tag <= 8; ++tag) {
+            const uint32_t seed = 90 + static_cast<uint32_t>(tag);
+            const std::vector<unsigned char> jpeg =
+                withExifOrientation(jpegFile(291, 133, {0x22, 0x11, 0x11}, false, seed), tag);
+            writeFile(jpegPath, jpeg);
+            int w = 0, h = 0, n = 0;
+            stbi_uc* pixels = stbi_load_from_memory(jpeg.data(), static_cast<int>(jpeg.size()), &w, &h, &n, 0);
+            std::string error;
+            pyramid::File file;
+            ++checks;
+            if (pixels == nullptr || !pyramid::build(jpegPath, pyrPath, &error) || !file.open(pyrPath, &error) ||
+                file.orientation() != tag) {
+                ++failures;
+                std::cerr << "MISMATCH pyramid orientation " << tag << " not kept: " << error << "\n";
+                stbi_image_free(pixels);
+                continue;
+            }
+            const ImageView view{pixels, w, h, n};
+            for (const orient::Transform& extra : {none, orient::Transform{1, false}, orient::Transform{2, true}}) {
+                const orient::Transform t = orient::compose(orient::fromExif(tag), extra);
+                const std::vector<unsigned char> upright = uprightCopy(view, t);
+                const int dw = t.swapsAxes() ? h : w, dh = t.swapsAxes() ? w : h;
+                const std::string label = "pyramid orientation " + std::to_string(tag) + " then " +
+                                          std::to_string(extra.quarterTurns * 90) + (extra.flip ? "+flip" : "");
+
+                const pyramid::Region whole = pyramid::clampRegion(file, t, pyramid::Region{});
+                const GridSize grid = computeGrid(whole.width, whole.height, 80);
+                std::vector<uint8_t> lum(static_cast<size_t>(grid.cols) * grid.rows);
+                pyramid::sampleLuminance(file, t, whole, grid, 0, lum.data());
+                std::string text(renderedSize(grid), '\n');
+                glyphGrid(lum.data(), grid, &text[0]);
+                ++checks;
+                if (whole.width != dw || whole.height != dh ||
+                    text != renderReference(ImageView{upright.data(), dw, dh, n}, grid)) {
+                    ++failures;
+                    std::cerr << "MISMATCH " << label << " render\n";
+                }
+
+                const pyramid::Region region =
+                    pyramid::clampRegion(file, t, pyramid::Region{dw / 5, dh / 3, dw / 2, dh / 2});
+                std::vector<uint8_t> crop;
+                for (int y = region.y; y < region.y + region.height; ++y) {
+                    const unsigned char* row = upright.data() + (static_cast<size_t>(y) * dw + region.x) * n;
+                    crop.insert(crop.end(), row, row + static_cast<size_t>(region.width) * n);
+                }
+                const GridSize regionGrid = computeGrid(region.width, region.height, 50);
+                lum.assign(static_cast<size_t>(regionGrid.cols) * regionGrid.rows, 0);
+                pyramid::sampleLuminance(file, t, region, regionGrid, 0, lum.data());
+                text.assign(renderedSize(regionGrid), '\n');
+                glyphGrid(lum.data(), regionGrid, &text[0]);
+                ++checks;
+                if (text != renderReference(ImageView{crop.data(), region.width, region.height, n}, regionGrid)) {
+                    ++failures;
+                    std::cerr << "MISMATCH " << label << " region render\n";
+                }
+            }
+            stbi_image_free(pixels);
+        }
+        std::remove(jpegPath.c_str());
+
+        // A failed rebuild must leave the old pyramid readable and no
+        // temporary file behind, and a build over its own input must be
+        // refused without touching it.
+        {
+            // A PGM is decoded row by row, so the build is well under way
+            // when the rows run out.
+            const std::vector<unsigned char> pgm = pnmFile(300, 300, 1, std::vector<uint8_t>(300 * 300, 7));
+            writeFile(imagePath, std::vector<unsigned char>(pgm.begin(), pgm.begin() + pgm.size() / 2));
+            std::string error;
+            const bool built = pyramid::build(imagePath, pyrPath, &error);
+            size_t leftovers = 0;
+            for (const auto& e : std::filesystem::directory_iterator(dir)) {
+                leftovers += e.path().filename().string().rfind("bitexact.pyr.", 0) == 0;
+            }
+            pyramid::File old;
+            ++checks;
+            if (built || !old.open(pyrPath, &error) || leftovers != 0) {
+                ++failures;
+                std::cerr << "MISMATCH pyramid failed rebuild clobbered the old one: " << error << "\n";
+            }
+            writeFile(imagePath, pgm);
+            ++checks;
+            if (pyramid::build(imagePath, imagePath, &error) || pyramid::isPyramid(imagePath) ||
+                std::filesystem::file_size(imagePath) != pgm.size()) {
+                ++failures;
+                std::cerr << "MISMATCH pyramid built over its own input\n";
+            }
+        }
+
+        // A pyramid cut short must be refused.
+        std::vector<unsigned char> bytes;
+        if (std::FILE* f = std::fopen(pyrPath.c_str(), "rb")) {
+            char buf[4096];
+            size_t n = 0;
+            while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0) bytes.insert(bytes.end(), buf, buf + n);
+            std::fclose(f);
+        }
+        bytes.resize(bytes.size() - pyramid::kPageSize);
+        writeFile(pyrPath, bytes);
+        pyramid::File cut;
+        std::string error;
+        ++checks;
+        if (cut.open(pyrPath, &error)) {
+            ++failures;
+            std::cerr << "MISMATCH pyramid opened when truncated\n";
+        }
+        std::remove(imagePath.c_str());
+        std::remove(pyrPath.c_str());
+    }
+
+    // The SIMD quadrant partition search must agree with the scalar loop,
+    // ties included; low-contrast cells make ties common.
+    std::mt19937 rng(7);
+    for (int i = 0; i < 200000; ++i) {
+        quadrant::Cell cell;
+        const int spread = i % 2 ? 256 : 4;
+        const int base = static_cast<int>(rng() % (257 - spread));
+        for (auto& px : cell.rgb) {
+            for (uint8_t& v : px) v = static_cast<uint8_t>(base + rng() % spread);
+        }
+        const quadrant::Choice a = quadrant::bestPartition(cell), b = quadrant::bestPartitionScalar(cell);
+        ++checks;
+        if (a.mask != b.mask || !std::equal(a.fg, a.fg + 3, b.fg) || !std::equal(a.bg, a.bg + 3, b.bg)) {
+            ++failures;
+            if (failures < 10) std::cerr << "MISMATCH quadrant partition at sample " << i << "\n";
+        }
+    }
+
+    // The SIMD palette search must agree with the scalar loop for every
+    // palette size, 1 to 16, so the padded tail of the last group of four
+    // is exercised. Every third palette repeats entries and every third
+    // colour sits midway between two entries, so ties are common and must
+    // go to the lowest index.
+    for (int i = 0; i < 100000; ++i) {
+        palette::Palette pal;
+        pal.size = 1 + i % palette::kMaxColours;
+        for (int j = 0; j < pal.size; ++j) {
+            for (uint8_t& v : pal.rgb[j]) v = static_cast<uint8_t>(rng());
+        }
+        if (i % 3 == 0) {
+            for (int j = 1; j < pal.size; j += 2) std::copy(pal.rgb[j / 2], pal.rgb[j / 2] + 3, pal.rgb[j]);
+        }
+        uint8_t rgb[3];
+        for (uint8_t& v : rgb) v = static_cast<uint8_t>(rng());
+        if (i % 3 == 1 && pal.size > 1) {
+            const int a = static_cast<int>(rng() % pal.size), b = static_cast<int>(rng() % pal.size);
+            const int c = static_cast<int>(rng() % 3);
+            for (int k = 0; k < 3; ++k) pal.rgb[b][k] = pal.rgb[a][k];
+            pal.rgb[a][c] = static_cast<uint8_t>(rgb[c] > 127 ? rgb[c] - 8 : rgb[c] + 8);
+            pal.rgb[b][c] = static_cast<uint8_t>(2 * rgb[c] - pal.rgb[a][c]);
+        }
+        const int a = palette::nearest(pal, rgb), b = palette::nearestScalar(pal, rgb);
+        ++checks;
+        if (a != b) {
+            ++failures;
+            if (failures < 10) std::cerr << "MISMATCH palette nearest at sample " << i << "\n";
+        }
+    }
+
+    std::cout << checks << " comparisons, " << failures << " mismatches\n";
+    return (ok && failures == 0) ? 0 : 1;
+}